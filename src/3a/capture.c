@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "capture.h"
+
+/* Each of the two buffers; one fills while the other is written */
+#define CAPTURE_BUF_SIZE (1 << 20)
+/* Hand a buffer to the writer once it holds this much... */
+#define CAPTURE_BATCH (64 << 10)
+/* ...or when it has waited this long */
+#define CAPTURE_LINGER_MS 100
+#define CAPTURE_SNAPLEN 65535
+/* Sockets whose addresses are remembered */
+#define CAPTURE_FDS 1024
+
+int capture;
+
+static int capture_fd = -1;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static struct {
+	char *data;
+	size_t len;
+} bufs[2];
+static int active;		/* the buffer capture_packet fills */
+static int stopping;
+static uint64_t captured, dropped;
+static uint16_t ip_id;
+
+static struct {
+	char known;
+	struct sockaddr_in local, peer;
+} sockets[CAPTURE_FDS];
+
+static void
+put16 (char **p, uint16_t v)
+{
+	memcpy (*p, &v, 2);
+	*p += 2;
+}
+
+static void
+put32 (char **p, uint32_t v)
+{
+	memcpy (*p, &v, 4);
+	*p += 4;
+}
+
+static uint16_t
+ip_cksum (const uint8_t *h, int len)
+{
+	uint32_t sum = 0;
+	for (; len > 1; h += 2, len -= 2)
+		sum += h[0] << 8 | h[1];
+	while (sum > 0xffff)
+		sum = (sum >> 16) + (sum & 0xffff);
+	return htons (~sum);
+}
+
+/* The writer: write out the buffer capture_packet handed over, or take
+ * the active one when it has lingered or at exit, with the lock dropped */
+static void *
+capture_writer (void *arg)
+{
+	pthread_mutex_lock (&lock);
+	for (;;) {
+		int full = !active;
+		if (!bufs[full].len) {
+			if (stopping) {
+				if (!bufs[active].len)
+					break;
+			}
+			else {
+				struct timespec ts;
+				clock_gettime (CLOCK_REALTIME, &ts);
+				ts.tv_nsec += CAPTURE_LINGER_MS * 1000000L;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+				if (pthread_cond_timedwait (&wakeup, &lock, &ts) != ETIMEDOUT)
+					continue;
+			}
+			if (!bufs[full].len) {
+				if (!bufs[active].len)
+					continue;
+				active = full;
+				full = !active;
+			}
+		}
+		char *data = bufs[full].data;
+		size_t len = bufs[full].len, off = 0;
+		pthread_mutex_unlock (&lock);
+		while (off < len) {
+			ssize_t n = write (capture_fd, data + off, len - off);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				perror ("capture");
+				break;
+			}
+			off += n;
+		}
+		pthread_mutex_lock (&lock);
+		bufs[full].len = 0;
+	}
+	pthread_mutex_unlock (&lock);
+	return NULL;
+}
+
+static void
+capture_close (void)
+{
+	if (!capture)
+		return;
+	pthread_mutex_lock (&lock);
+	stopping = 1;
+	pthread_cond_signal (&wakeup);
+	pthread_mutex_unlock (&lock);
+	pthread_join (writer, NULL);
+	close (capture_fd);
+	capture = 0;
+	fprintf (stderr, "Capture: %llu packets, %llu dropped\n",
+			(unsigned long long) captured, (unsigned long long) dropped);
+}
+
+int
+capture_open (const char *path)
+{
+	char head[64], *p = head;
+
+	capture_fd = open (path, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+	if (capture_fd < 0) {
+		perror (path);
+		return -1;
+	}
+
+	/* Section header, then the one interface, with nanosecond stamps */
+	put32 (&p, PCAPNG_SHB);
+	put32 (&p, 28);
+	put32 (&p, PCAPNG_BYTE_ORDER);
+	put16 (&p, 1);
+	put16 (&p, 0);
+	put32 (&p, 0xffffffff);		/* section length unknown */
+	put32 (&p, 0xffffffff);
+	put32 (&p, 28);
+	put32 (&p, PCAPNG_IDB);
+	put32 (&p, 32);
+	put16 (&p, PCAPNG_LINKTYPE_RAW);
+	put16 (&p, 0);
+	put32 (&p, CAPTURE_SNAPLEN);
+	put16 (&p, PCAPNG_OPT_TSRESOL);
+	put16 (&p, 1);
+	put32 (&p, 9);			/* 10^-9, then padding */
+	put32 (&p, PCAPNG_OPT_END);
+	put32 (&p, 32);
+	if (write (capture_fd, head, p - head) != p - head) {
+		perror (path);
+		close (capture_fd);
+		return -1;
+	}
+
+	bufs[0].data = malloc (CAPTURE_BUF_SIZE);
+	bufs[1].data = malloc (CAPTURE_BUF_SIZE);
+	if (!bufs[0].data || !bufs[1].data
+			|| pthread_create (&writer, NULL, capture_writer, NULL)) {
+		fprintf (stderr, "%s: cannot start the capture writer\n", path);
+		close (capture_fd);
+		return -1;
+	}
+	capture = 1;
+	atexit (capture_close);
+	return 0;
+}
+
+static void
+capture_addresses (int fd, const struct sockaddr_storage *peer,
+		struct sockaddr_in *local, struct sockaddr_in *remote)
+{
+	memset (local, 0, sizeof (*local));
+	memset (remote, 0, sizeof (*remote));
+	if (fd >= 0 && fd < CAPTURE_FDS) {
+		if (!sockets[fd].known) {
+			socklen_t len = sizeof (sockets[fd].local);
+			getsockname (fd, (struct sockaddr *) &sockets[fd].local, &len);
+			len = sizeof (sockets[fd].peer);
+			getpeername (fd, (struct sockaddr *) &sockets[fd].peer, &len);
+			sockets[fd].known = 1;
+		}
+		if (sockets[fd].local.sin_family == AF_INET)
+			*local = sockets[fd].local;
+		if (sockets[fd].peer.sin_family == AF_INET)
+			*remote = sockets[fd].peer;
+	}
+	if (peer && peer->ss_family == AF_INET)
+		memcpy (remote, peer, sizeof (*remote));
+}
+
+void
+capture_packet (int fd, const struct sockaddr_storage *peer, int dir,
+		const void *buf, size_t len)
+{
+	struct sockaddr_in local, remote;
+	const struct sockaddr_in *src, *dst;
+	struct timespec ts;
+	uint64_t ns;
+	size_t caplen, padded, block;
+	char *p;
+
+	if (!capture)
+		return;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	capture_addresses (fd, peer, &local, &remote);
+	src = dir == CAPTURE_OUT ? &local : &remote;
+	dst = dir == CAPTURE_OUT ? &remote : &local;
+
+	caplen = 28 + len;
+	if (caplen > CAPTURE_SNAPLEN)
+		caplen = CAPTURE_SNAPLEN;
+	padded = (caplen + 3) & ~3;
+	block = 28 + padded + 16;
+
+	pthread_mutex_lock (&lock);
+	if (bufs[active].len + block > CAPTURE_BUF_SIZE) {
+		if (bufs[!active].len) {
+			dropped++;
+			pthread_mutex_unlock (&lock);
+			return;
+		}
+		active = !active;
+		pthread_cond_signal (&wakeup);
+	}
+	p = bufs[active].data + bufs[active].len;
+
+	put32 (&p, PCAPNG_EPB);
+	put32 (&p, block);
+	put32 (&p, 0);			/* interface */
+	put32 (&p, ns >> 32);
+	put32 (&p, ns);
+	put32 (&p, caplen);
+	put32 (&p, 28 + len);
+
+	/* IPv4 and UDP headers, in network order */
+	uint8_t *ip = (uint8_t *) p;
+	memset (p, 0, padded);
+	ip[0] = 0x45;
+	*(uint16_t *) (ip + 2) = htons (28 + len);
+	*(uint16_t *) (ip + 4) = htons (ip_id++);
+	ip[8] = 64;
+	ip[9] = IPPROTO_UDP;
+	memcpy (ip + 12, &src->sin_addr, 4);
+	memcpy (ip + 16, &dst->sin_addr, 4);
+	*(uint16_t *) (ip + 10) = ip_cksum (ip, 20);
+	memcpy (ip + 20, &src->sin_port, 2);
+	memcpy (ip + 22, &dst->sin_port, 2);
+	*(uint16_t *) (ip + 24) = htons (8 + len);
+	memcpy (ip + 28, buf, caplen - 28);
+	p += padded;
+
+	put16 (&p, PCAPNG_OPT_FLAGS);
+	put16 (&p, 4);
+	put32 (&p, dir);
+	put32 (&p, PCAPNG_OPT_END);
+	put32 (&p, block);
+
+	bufs[active].len += block;
+	captured++;
+	if (bufs[active].len >= CAPTURE_BATCH && !bufs[!active].len) {
+		active = !active;
+		pthread_cond_signal (&wakeup);
+	}
+	pthread_mutex_unlock (&lock);
+}
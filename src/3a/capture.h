@@ -0,0 +1,50 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* -----------------------------------------------------------------------
+
+   Packet capture.
+
+   With -p file, every datagram reliable sends or receives is written to
+   file in pcapng format, which wireshark and tcpdump read and replay
+   (see replay.c) feeds back into the protocol.  Each packet is an
+   Enhanced Packet Block with a nanosecond CLOCK_REALTIME timestamp, a
+   direction flag and made up IPv4 and UDP headers carrying the real
+   addresses and ports, so the link type is raw IP.
+
+   capture_packet only formats the block into one of two buffers; a
+   writer thread writes the other one out.  If the writer falls so far
+   behind that both are full, packets are dropped and counted rather
+   than slowing the protocol down.
+
+   ----------------------------------------------------------------------- */
+
+#define CAPTURE_IN 1		/* pcapng epb_flags directions */
+#define CAPTURE_OUT 2
+
+/* Non-zero once capture_open has succeeded */
+extern int capture;
+
+/* Create the capture file and start the writer; returns -1 on failure.
+ * The rest is written out and the file closed at exit. */
+int capture_open (const char *path);
+/* Record a datagram of len bytes sent or received on socket fd.  peer
+ * is the other end, or NULL for a connected socket. */
+void capture_packet (int fd, const struct sockaddr_storage *peer, int dir,
+		const void *buf, size_t len);
+
+/* For readers: the block types and the one option used */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+#define PCAPNG_LINKTYPE_RAW 101
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_TSRESOL 9	/* in the IDB */
+#define PCAPNG_OPT_FLAGS 2	/* in an EPB: direction in the low 2 bits */
+
+#endif /* CAPTURE_H */
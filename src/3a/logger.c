@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "logger.h"
+
+/* The longest line a logger_format_fn may make */
+#define LOGGER_LINE 512
+
+/* What a record in the ring starts with; fd -1 marks padding up to the
+ * end of the ring */
+struct record {
+	int32_t fd;
+	uint32_t len;
+	logger_format_fn fn;		/* NULL for bytes to write as they are */
+};
+
+#define RECORD_SIZE(n) (sizeof (struct record) + (((n) + 15) & ~(size_t) 15))
+
+static char *ring;
+static uint64_t head;		/* bytes ever put in; only the producer writes it */
+static uint64_t tail;		/* bytes ever taken out; only the logger writes it */
+static int sleeping;		/* the logger waits on this, as a futex */
+static int stopping;
+static int running;
+static pthread_t thread;
+static uint64_t records, dropped;
+
+/* The logger's output, gathered for one fd at a time */
+static char out[LOGGER_BATCH];
+static size_t out_len;
+static int out_fd = -1;
+
+static void
+futex (int *word, int op, int val, const struct timespec *timeout)
+{
+	syscall (SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+static void
+write_all (int fd, const char *buf, size_t len)
+{
+	size_t off = 0;
+
+	while (off < len) {
+		ssize_t n = write (fd, buf + off, len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;			/* logs never stop the program */
+		}
+		off += n;
+	}
+}
+
+static void
+flush (void)
+{
+	write_all (out_fd, out, out_len);
+	out_len = 0;
+}
+
+/* Make room in out for n more bytes for fd */
+static void
+out_room (int fd, size_t n)
+{
+	if (fd != out_fd || out_len + n > sizeof (out)) {
+		flush ();
+		out_fd = fd;
+	}
+}
+
+static void
+take (const struct record *r)
+{
+	const char *payload = (const char *) (r + 1);
+	int n;
+
+	if (r->fn) {
+		out_room (r->fd, LOGGER_LINE);
+		n = r->fn (out + out_len, LOGGER_LINE, payload);
+		if (n > LOGGER_LINE - 1)
+			n = LOGGER_LINE - 1;
+		if (n > 0)
+			out_len += n;
+	}
+	else if (r->len > sizeof (out)) {
+		flush ();
+		write_all (r->fd, payload, r->len);
+	}
+	else {
+		out_room (r->fd, r->len);
+		memcpy (out + out_len, payload, r->len);
+		out_len += r->len;
+	}
+}
+
+static void *
+logger_thread (void *arg)
+{
+	struct timespec linger = { 0, LOGGER_LINGER_MS * 1000000L };
+	uint64_t t = tail;
+
+	for (;;) {
+		uint64_t h = __atomic_load_n (&head, __ATOMIC_ACQUIRE);
+		while (t != h) {
+			const struct record *r =
+				(const struct record *) (ring + (t & (LOGGER_RING - 1)));
+			if (r->fd >= 0)
+				take (r);
+			t += RECORD_SIZE (r->len);
+			__atomic_store_n (&tail, t, __ATOMIC_RELEASE);
+		}
+		flush ();
+
+		__atomic_store_n (&sleeping, 1, __ATOMIC_SEQ_CST);
+		h = __atomic_load_n (&head, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&stopping, __ATOMIC_SEQ_CST) && h == t)
+			break;
+		if (h - t < LOGGER_BATCH && !__atomic_load_n (&stopping, __ATOMIC_SEQ_CST))
+			futex (&sleeping, FUTEX_WAIT_PRIVATE, 1, &linger);
+		__atomic_store_n (&sleeping, 0, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void
+logger_stop (void)
+{
+	if (!running)
+		return;
+	__atomic_store_n (&stopping, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n (&sleeping, 0, __ATOMIC_SEQ_CST);
+	futex (&sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+	pthread_join (thread, NULL);
+	running = 0;
+	fprintf (stderr, "Log: %llu records, %llu dropped\n",
+			(unsigned long long) records, (unsigned long long) dropped);
+}
+
+int
+logger_start (void)
+{
+	if (running)
+		return 0;
+	ring = malloc (LOGGER_RING);
+	if (!ring || pthread_create (&thread, NULL, logger_thread, NULL)) {
+		fprintf (stderr, "cannot start the logger; logging synchronously\n");
+		free (ring);
+		ring = NULL;
+		return -1;
+	}
+	running = 1;
+	atexit (logger_stop);
+	return 0;
+}
+
+/* Room for a record of n bytes, or NULL if the logger is behind */
+static struct record *
+reserve (size_t n)
+{
+	size_t need = RECORD_SIZE (n);
+	size_t pos = head & (LOGGER_RING - 1);
+	size_t pad = LOGGER_RING - pos < need ? LOGGER_RING - pos : 0;
+	uint64_t t = __atomic_load_n (&tail, __ATOMIC_ACQUIRE);
+
+	if (need > LOGGER_RING / 2 || head + pad + need - t > LOGGER_RING) {
+		dropped++;
+		return NULL;
+	}
+	if (pad) {
+		struct record *r = (struct record *) (ring + pos);
+		r->fd = -1;
+		r->len = pad - sizeof (*r);
+		/* the logger reads head as it runs, so this publishes the padding */
+		__atomic_store_n (&head, head + pad, __ATOMIC_RELEASE);
+	}
+	return (struct record *) (ring + (head & (LOGGER_RING - 1)));
+}
+
+/* Hand the record reserve returned to the logger */
+static void
+publish (struct record *r)
+{
+	uint64_t h = head + RECORD_SIZE (r->len);
+
+	records++;
+	__atomic_store_n (&head, h, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&sleeping, __ATOMIC_SEQ_CST)
+			&& h - __atomic_load_n (&tail, __ATOMIC_RELAXED) >= LOGGER_BATCH) {
+		__atomic_store_n (&sleeping, 0, __ATOMIC_RELAXED);
+		futex (&sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+	}
+}
+
+void
+logger_write (int fd, const void *buf, size_t n)
+{
+	struct record *r;
+
+	if (!running) {
+		write (fd, buf, n);
+		return;
+	}
+	if (!(r = reserve (n)))
+		return;
+	r->fd = fd;
+	r->len = n;
+	r->fn = NULL;
+	memcpy (r + 1, buf, n);
+	publish (r);
+}
+
+void
+logger_format (int fd, logger_format_fn fn, const void *arg, size_t n)
+{
+	struct record *r;
+
+	if (!running) {
+		char line[LOGGER_LINE];
+		int len = fn (line, sizeof (line), arg);
+		if (len > (int) sizeof (line) - 1)
+			len = sizeof (line) - 1;
+		if (len > 0)
+			write (fd, line, len);
+		return;
+	}
+	if (!(r = reserve (n)))
+		return;
+	r->fd = fd;
+	r->len = n;
+	r->fn = fn;
+	memcpy (r + 1, arg, n);
+	publish (r);
+}
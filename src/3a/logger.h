@@ -0,0 +1,48 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Asynchronous logging.
+
+   The -l payload logs and the -d packet lines go through here.  Once
+   logger_start has run, logger_write and logger_format only copy their
+   record into a ring of LOGGER_RING bytes that a logger thread empties:
+   the ring has one producer, the protocol's thread, and one consumer,
+   so neither side takes a lock.  The logger sleeps until a batch has
+   built up or LOGGER_LINGER_MS has passed, then formats what it found,
+   joins neighbouring records for the same fd and writes each run with
+   one system call.
+
+   Memory is bounded by the ring.  When the logger falls so far behind
+   that a record does not fit, the record is dropped and counted; the
+   counts are printed at exit, after what is in the ring has been
+   written.  A process killed by a signal loses what the logger had not
+   written yet, at most LOGGER_LINGER_MS worth.  Before logger_start,
+   both calls write straight away.
+
+   Lines logged here can come out after stderr lines printed directly
+   at about the same time.
+
+   ----------------------------------------------------------------------- */
+
+#define LOGGER_RING (4 << 20)		/* a power of 2 */
+#define LOGGER_BATCH (64 << 10)		/* wake the logger at this much... */
+#define LOGGER_LINGER_MS 10		/* ...or after this long */
+
+/* Formats arg, of the size given to logger_format, into out, returning
+ * the length like snprintf.  It runs on the logger thread. */
+typedef int (*logger_format_fn) (char *out, size_t size, const void *arg);
+
+/* Start the logger thread; returns -1 on failure, when logging stays
+ * synchronous.  The rest is written out at exit. */
+int logger_start (void);
+/* Write n bytes of buf to fd */
+void logger_write (int fd, const void *buf, size_t n);
+/* Write to fd what fn makes of the n bytes of arg, which are copied */
+void logger_format (int fd, logger_format_fn fn, const void *arg, size_t n);
+
+#endif /* LOGGER_H */
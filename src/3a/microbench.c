@@ -0,0 +1,463 @@
+/*
+ * microbench: time the hot paths of reliable in isolation.
+ *
+ *   microbench [-c]
+ *
+ * Covers the packet list (insert in order at several reorder distances,
+ * removing the head, the size query), cksum across packet sizes and
+ * buffer alignments, rel_recvpkt on in-order, out-of-order and duplicate
+ * data packets, and the sender's ACK processing with windows of 10 to
+ * 100000 packets in flight.  Prints ns/op and cycles/op (the time stamp
+ * counter, on x86) for each, or CSV with -c.
+ *
+ * The library is compiled in, but the calls that would reach the network
+ * or the output file only count, so the numbers are the protocol's own.
+ * Build it like reliable (make microbench) so they describe what ships.
+ */
+
+#define NO_DEBUG
+
+#define main rlib_main
+#define conn_sendpkt rlib_conn_sendpkt
+#define conn_output rlib_conn_output
+#define conn_input rlib_conn_input
+#include "rlib.c"
+#undef main
+#undef conn_sendpkt
+#undef conn_output
+#undef conn_input
+
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+static uint64_t packets_sent, bytes_output;
+
+int conn_sendpkt(conn_t *c, const packet_t *pkt, size_t len) {
+	packets_sent++;
+	return len;
+}
+
+int conn_output(conn_t *c, const void *buf, size_t n) {
+	bytes_output += n;
+	return n;
+}
+
+/* There is always more to send */
+int conn_input(conn_t *c, void *buf, size_t n) {
+	return n;
+}
+
+#include "reliable.c"
+
+static int csv;
+
+/* ---- timing ---- */
+
+struct timer {
+	uint64_t ns, cycles;
+	struct timespec ts;
+	uint64_t tsc;
+};
+
+/* What a start and stop with nothing between costs */
+static double overhead_ns, overhead_cycles;
+
+static uint64_t read_tsc() {
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void timer_start(struct timer* t) {
+	clock_gettime(CLOCK_MONOTONIC, &t->ts);
+	t->tsc = read_tsc();
+}
+
+static void timer_stop(struct timer* t) {
+	struct timespec now;
+	uint64_t tsc = read_tsc();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t->ns += (now.tv_sec - t->ts.tv_sec) * 1000000000LL
+		+ now.tv_nsec - t->ts.tv_nsec;
+	t->cycles += tsc - t->tsc;
+}
+
+static void calibrate() {
+	struct timer t = { 0, 0 };
+	int i, n = 100000;
+	for (i = 0; i < n; i++) {
+		timer_start(&t);
+		timer_stop(&t);
+	}
+	overhead_ns = (double) t.ns / n;
+	overhead_cycles = (double) t.cycles / n;
+}
+
+/* Print the cost of ops operations timed in spans start/stop pairs */
+static void report(const char* name, struct timer* t, uint64_t ops, uint64_t spans) {
+	double ns = ((double) t->ns - spans * overhead_ns) / ops;
+	double cycles = ((double) t->cycles - spans * overhead_cycles) / ops;
+	if (ns < 0) {
+		ns = 0;
+	}
+	if (cycles < 0) {
+		cycles = 0;
+	}
+	if (csv) {
+		printf("\"%s\",%.1f,", name, ns);
+#ifdef HAVE_TSC
+		printf("%.1f\n", cycles);
+#else
+		printf("\n");
+#endif
+	}
+	else {
+		printf("%-48s %10.1f ns/op", name, ns);
+#ifdef HAVE_TSC
+		printf(" %10.1f cycles/op", cycles);
+#endif
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/* ---- packets ---- */
+
+static packet_list* data_node(uint32_t seqno) {
+	packet_list* node = new_packet();
+	memset(node->packet, 0, MAX_PACKET_SIZE);
+	node->packet->len = htons(MAX_PACKET_SIZE);
+	node->packet->ackno = htonl(1);
+	node->packet->seqno = htonl(seqno);
+	return node;
+}
+
+/* A full data packet as the peer would send it */
+static void make_data(packet_t* pkt, uint32_t seqno, uint32_t ackno) {
+	memset(pkt, 0, MAX_PACKET_SIZE);
+	pkt->len = htons(MAX_PACKET_SIZE);
+	pkt->ackno = htonl(ackno);
+	pkt->seqno = htonl(seqno);
+	memset(pkt->data, 'x', MAX_PACKET_DATA_SIZE);
+	pkt->cksum = cksum(pkt, MAX_PACKET_SIZE);
+}
+
+static void make_ack(struct ack_packet* ack, uint32_t ackno) {
+	memset(ack, 0, sizeof(*ack));
+	ack->len = htons(sizeof(*ack));
+	ack->ackno = htonl(ackno);
+	ack->cksum = cksum(ack, sizeof(*ack));
+}
+
+static void free_list(packet_list** list) {
+	while (*list) {
+		remove_head_packet(list);
+	}
+}
+
+/* ---- packet list ---- */
+
+/* Inserts timed together at least, so the clock is not what is timed */
+#define INSERT_BATCH 256
+
+/* Packets arrive in reversed runs of distance + 1, so each lands up to
+ * distance places from the end; the in-order prefix is consumed, as the
+ * receiver does, which empties the list after every run.  A span times
+ * one run into each of enough lists to make INSERT_BATCH inserts. */
+static void bench_insert(int distance) {
+	struct timer t = { 0, 0 };
+	int i, j, run = distance + 1;
+	int nlists = run < INSERT_BATCH ? INSERT_BATCH / run : 1;
+	packet_list* lists[nlists];
+	packet_list* nodes[nlists][run];
+	uint32_t base, next;
+	uint64_t ops = 0, spans = 0;
+	char name[64];
+
+	memset(lists, 0, sizeof(lists));
+	for (base = 1; ops < 200000; base += run) {
+		for (j = 0; j < nlists; j++) {
+			for (i = 0; i < run; i++) {
+				nodes[j][i] = data_node(base + run - 1 - i);
+			}
+		}
+		timer_start(&t);
+		for (j = 0; j < nlists; j++) {
+			for (i = 0; i < run; i++) {
+				insert_packet_in_order(&lists[j], nodes[j][i]);
+			}
+		}
+		timer_stop(&t);
+		spans++;
+		ops += (uint64_t) nlists * run;
+		for (j = 0; j < nlists; j++) {
+			for (next = base; lists[j] && ntohl(lists[j]->packet->seqno) == next; next++) {
+				remove_head_packet(&lists[j]);
+			}
+		}
+	}
+	for (j = 0; j < nlists; j++) {
+		free_list(&lists[j]);
+	}
+	snprintf(name, sizeof(name), "insert_packet_in_order, distance %d", distance);
+	report(name, &t, ops, spans);
+}
+
+static void bench_remove_head() {
+	struct timer t = { 0, 0 };
+	packet_list* list = NULL;
+	packet_list* tail = NULL;
+	int i, n = 100000;
+
+	for (i = 0; i < n; i++) {
+		packet_list* node = data_node(i + 1);
+		insert_packet_after(&tail, node);
+		tail = node;
+		if (!list) {
+			list = node;
+		}
+	}
+	timer_start(&t);
+	while (list) {
+		remove_head_packet(&list);
+	}
+	timer_stop(&t);
+	report("remove_head_packet", &t, n, 1);
+}
+
+static void bench_size(int n) {
+	struct timer t = { 0, 0 };
+	packet_list* list = NULL;
+	packet_list* tail = NULL;
+	volatile int sink;
+	int i, calls = 10000000 / n;
+	char name[64];
+
+	for (i = 0; i < n; i++) {
+		packet_list* node = data_node(i + 1);
+		insert_packet_after(&tail, node);
+		tail = node;
+		if (!list) {
+			list = node;
+		}
+	}
+	timer_start(&t);
+	for (i = 0; i < calls; i++) {
+		sink = packet_list_size(list);
+	}
+	timer_stop(&t);
+	(void) sink;
+	free_list(&list);
+	snprintf(name, sizeof(name), "packet_list_size, %d packets", n);
+	report(name, &t, calls, 1);
+}
+
+/* ---- checksum ---- */
+
+static void bench_cksum(int size, int align) {
+	struct timer t = { 0, 0 };
+	static uint64_t space[MAX_PACKET_SIZE / 8 + 2];
+	char* buf = (char*) space + align;
+	volatile uint16_t sink;
+	int i, calls = 20000000 / (size + 16);
+	char name[64];
+
+	for (i = 0; i < size; i++) {
+		buf[i] = i * 7;
+	}
+	timer_start(&t);
+	for (i = 0; i < calls; i++) {
+		sink = cksum(buf, size);
+	}
+	timer_stop(&t);
+	(void) sink;
+	snprintf(name, sizeof(name), "cksum, %d bytes, offset %d", size, align);
+	report(name, &t, calls, 1);
+}
+
+/* ---- rel_recvpkt ---- */
+
+#define BATCH 1024
+
+static struct config_common config;
+
+static rel_t* bench_rel(int window) {
+	config.window = window;
+	config.timer = 10;
+	config.timeout = 40;
+	return rel_create(conn_alloc(), NULL, &config);
+}
+
+static void reset_receiver(rel_t* r, uint64_t expected) {
+	free_list(&r->receive_buffer);
+	r->receive_buffer_data_offset = 0;
+	r->next_seqno_expected = expected;
+}
+
+static void bench_recv_in_order() {
+	struct timer t = { 0, 0 };
+	static packet_t pkts[BATCH];
+	rel_t* r = bench_rel(32);
+	uint32_t seqno = 1;
+	uint64_t ops = 0, spans = 0;
+	int i;
+
+	while (ops < 200000) {
+		for (i = 0; i < BATCH; i++) {
+			make_data(&pkts[i], seqno + i, 1);
+		}
+		timer_start(&t);
+		for (i = 0; i < BATCH; i++) {
+			rel_recvpkt(r, &pkts[i], MAX_PACKET_SIZE);
+		}
+		timer_stop(&t);
+		seqno += BATCH;
+		ops += BATCH;
+		spans++;
+	}
+	reset_receiver(r, 1);
+	report("rel_recvpkt, in order", &t, ops, spans);
+}
+
+/* Each run of run packets arrives backwards, into a fresh receiver */
+static void bench_recv_reordered(int run) {
+	struct timer t = { 0, 0 };
+	packet_t pkts[run];
+	rel_t* r = bench_rel(32);
+	uint32_t base = 1;
+	uint64_t ops = 0, spans = 0;
+	int i;
+	char name[64];
+
+	while (ops < 200000) {
+		reset_receiver(r, base);
+		for (i = 0; i < run; i++) {
+			make_data(&pkts[i], base + run - 1 - i, 1);
+		}
+		timer_start(&t);
+		for (i = 0; i < run; i++) {
+			rel_recvpkt(r, &pkts[i], MAX_PACKET_SIZE);
+		}
+		timer_stop(&t);
+		base += run;
+		ops += run;
+		spans++;
+	}
+	reset_receiver(r, 1);
+	snprintf(name, sizeof(name), "rel_recvpkt, out of order by %d", run - 1);
+	report(name, &t, ops, spans);
+}
+
+static void bench_recv_duplicate() {
+	struct timer t = { 0, 0 };
+	static packet_t pkts[BATCH];
+	rel_t* r = bench_rel(32);
+	uint64_t ops = 0, spans = 0;
+	int i;
+
+	reset_receiver(r, BATCH + 1);
+	while (ops < 200000) {
+		for (i = 0; i < BATCH; i++) {
+			make_data(&pkts[i], i + 1, 1);
+		}
+		timer_start(&t);
+		for (i = 0; i < BATCH; i++) {
+			rel_recvpkt(r, &pkts[i], MAX_PACKET_SIZE);
+		}
+		timer_stop(&t);
+		ops += BATCH;
+		spans++;
+	}
+	report("rel_recvpkt, duplicate", &t, ops, spans);
+}
+
+/* ---- ACK processing ---- */
+
+/* A sender with window packets in flight gets ACKs one packet apart;
+ * each frees a packet and lets rel_read send the next */
+static void bench_ack(int window) {
+	struct timer t = { 0, 0 };
+	rel_t* r = bench_rel(window);
+	packet_list* tail = NULL;
+	int i, n = 1000000 / window;
+	struct ack_packet* acks;
+	char name[64];
+
+	if (n < 20) {
+		n = 20;
+	}
+	for (i = 0; i < window; i++) {
+		packet_list* node = data_node(i + 1);
+		insert_packet_after(&tail, node);
+		tail = node;
+		if (!r->send_buffer) {
+			r->send_buffer = node;
+		}
+	}
+	r->next_seqno_to_send = window + 1;
+	acks = malloc(n * sizeof(*acks));
+	for (i = 0; i < n; i++) {
+		make_ack(&acks[i], i + 2);
+	}
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		rel_recvpkt(r, (packet_t*) &acks[i], sizeof(acks[i]));
+	}
+	timer_stop(&t);
+	free(acks);
+	free_list(&r->send_buffer);
+	snprintf(name, sizeof(name), "ACK processing, window %d", window);
+	report(name, &t, n, 1);
+}
+
+int main(int argc, char **argv) {
+	static const int distances[] = { 0, 1, 4, 16, 64, 256 };
+	static const int sizes[] = { 10, 100, 1000, 10000 };
+	static const int lengths[] = { 8, 12, 64, 256, MAX_PACKET_SIZE };
+	static const int windows[] = { 10, 100, 1000, 10000, 100000 };
+	unsigned i;
+	int align, opt;
+
+	progname = argv[0];
+	while ((opt = getopt(argc, argv, "c")) != -1) {
+		switch (opt) {
+		case 'c':
+			csv = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c]\n", progname);
+			exit(1);
+		}
+	}
+	if (csv) {
+		printf("benchmark,ns_per_op,cycles_per_op\n");
+	}
+	calibrate();
+
+	for (i = 0; i < sizeof(distances) / sizeof(*distances); i++) {
+		bench_insert(distances[i]);
+	}
+	bench_remove_head();
+	for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		bench_size(sizes[i]);
+	}
+	for (i = 0; i < sizeof(lengths) / sizeof(*lengths); i++) {
+		for (align = 0; align < 4; align++) {
+			bench_cksum(lengths[i], align);
+		}
+	}
+	bench_recv_in_order();
+	bench_recv_reordered(2);
+	bench_recv_reordered(8);
+	bench_recv_reordered(64);
+	bench_recv_duplicate();
+	for (i = 0; i < sizeof(windows) / sizeof(*windows); i++) {
+		bench_ack(windows[i]);
+	}
+	return 0;
+}
@@ -21,6 +21,49 @@ typedef struct packet_list {
 	packet_t *packet;
 } packet_list;
 
+/**
+ * Serial number arithmetic on 32 bit seqnos (RFC 1982): a is before b if
+ * it is less than 2^31 behind it, so the order survives the counter
+ * wrapping around
+ */
+int seqno_lt(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) < 0;
+}
+
+int seqno_le(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) <= 0;
+}
+
+/**
+ * A 64 bit seqno that no packet has
+ */
+#define SEQNO_NONE UINT64_MAX
+
+/**
+ * Connections count seqnos in 64 bits and put the low 32 bits on the
+ * wire.  Wire seqno 0 is never used for data, so the count skips every
+ * value whose low 32 bits are 0.
+ */
+uint64_t seqno_next(uint64_t seqno) {
+	seqno++;
+	if (!(uint32_t) seqno) {
+		seqno++;
+	}
+	return seqno;
+}
+
+/**
+ * The 64 bit seqno nearest to reference that has these low 32 bits, or
+ * 0 if that would be below the start of the sequence space
+ */
+uint64_t seqno_extend(uint64_t reference, uint32_t seqno) {
+	int32_t delta = (int32_t) (seqno - (uint32_t) reference);
+	if (delta < 0 && (uint64_t) -(int64_t) delta > reference) {
+		return 0;
+	}
+	return reference + delta;
+}
+
 /**
  * Create a new, unlinked packet node
  */
@@ -131,7 +174,7 @@ int insert_packet_in_order(packet_list** list, packet_list* packet) {
 		if (!iter->packet) {
 			return -1;
 		}
-		if (ntohl(packet->packet->seqno) < ntohl(iter->packet->seqno)) {
+		if (seqno_lt(ntohl(packet->packet->seqno), ntohl(iter->packet->seqno))) {
 			break;
 		}
 		if (!iter->next) {
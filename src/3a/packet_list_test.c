@@ -96,6 +96,41 @@ void test_insert_packet_in_order() {
 	assert(last_consecutive_sequence_number(list) == 11);
 }
 
+void test_seqno_wrap() {
+	// serial number order holds across the wrap
+	assert(seqno_lt(0xfffffffe, 0xffffffff));
+	assert(seqno_lt(0xffffffff, 1));
+	assert(!seqno_lt(1, 0xffffffff));
+	assert(seqno_le(5, 5));
+
+	// the 64 bit count skips wire seqno 0
+	assert(seqno_next(0xfffffffeULL) == 0xffffffffULL);
+	assert(seqno_next(0xffffffffULL) == 0x100000001ULL);
+
+	// wire seqnos are extended to the nearest 64 bit seqno
+	assert(seqno_extend(0x100000001ULL, 0xffffffff) == 0xffffffffULL);
+	assert(seqno_extend(0xfffffff0ULL, 2) == 0x100000002ULL);
+	assert(seqno_extend(1, 3) == 3);
+	assert(seqno_extend(1, 0xfffffff0) == 0);
+
+	// packets are ordered across the wrap
+	packet_list* packet_a = new_packet();
+	packet_a->packet->seqno = htonl(0xfffffffe);
+	packet_list* packet_b = new_packet();
+	packet_b->packet->seqno = htonl(0xffffffff);
+	packet_list* packet_c = new_packet();
+	packet_c->packet->seqno = htonl(1);
+
+	packet_list* list = NULL;
+	insert_packet_in_order(&list, packet_c);
+	insert_packet_in_order(&list, packet_a);
+	insert_packet_in_order(&list, packet_b);
+	assert(packet_list_size(list) == 3);
+	assert(list->packet->seqno == htonl(0xfffffffe));
+	assert(list->next->packet->seqno == htonl(0xffffffff));
+	assert(list->next->next->packet->seqno == htonl(1));
+}
+
 int main() {
 	packet_list* packet_a = new_packet();
 	packet_a->packet->seqno = htonl(1);
@@ -164,4 +199,5 @@ int main() {
 	test_serialize();
 	test_get_by_seqno();
 	test_insert_packet_in_order();
+	test_seqno_wrap();
 }
@@ -17,7 +17,10 @@
 #include "packet_list.c"
 #include "constants.h"
 
+/* Trace every step on stderr, unless built with -DNO_DEBUG (microbench) */
+#ifndef NO_DEBUG
 #define DEBUG
+#endif
 
 // TODO:
 // - multiple connections
@@ -40,10 +43,14 @@ struct reliable_state {
 	 */
 	packet_list* send_buffer;
 	/**
-	 * The next sequence number to send with a packet
+	 * The next sequence number to send with a packet.  Seqnos are counted
+	 * in 64 bits; packets carry the low 32 bits (see seqno_extend).
+	 */
+	uint64_t next_seqno_to_send;
+	/**
+	 * The seqno of our EOF packet, SEQNO_NONE until we have sent it
 	 */
-	unsigned int next_seqno_to_send;
-	unsigned int final_seqno;
+	uint64_t final_seqno;
 
 	/**
 	 * This consists of the data that has not been read by the application yet.
@@ -60,7 +67,7 @@ struct reliable_state {
 	 * The sequence number of the lowest packet that could be received next in
 	 * the receive buffer
 	 */
-	unsigned int next_seqno_expected;
+	uint64_t next_seqno_expected;
 	size_t receive_buffer_data_offset;
 
 	/**
@@ -89,11 +96,14 @@ void print_rel_state(rel_t* rel, int indent_level) {
 		indents[0] = 0;
 	}
 	fprintf(stderr, "%sPID: %d\n", indents, getpid());
-	fprintf(stderr, "%sNext seqno to send: %d\n", indents, rel->next_seqno_to_send);
-	fprintf(stderr, "%sFinal seqno: %d\n", indents, rel->final_seqno);
+	fprintf(stderr, "%sNext seqno to send: %llu\n", indents,
+			(unsigned long long) rel->next_seqno_to_send);
+	fprintf(stderr, "%sFinal seqno: %llu\n", indents,
+			(unsigned long long) rel->final_seqno);
 	fprintf(stderr, "%sSend buffer:\n", indents);
 	print_packet_list(rel->send_buffer, 2);
-	fprintf(stderr, "%sNext seqno expected: %d\n", indents, rel->next_seqno_expected);
+	fprintf(stderr, "%sNext seqno expected: %llu\n", indents,
+			(unsigned long long) rel->next_seqno_expected);
 	fprintf(stderr, "%sReceive buffer:\n", indents);
 	print_packet_list(rel->receive_buffer, 2);
 	fprintf(stderr, "%sEOF flags: %d, %d, %d, %d\n", indents,
@@ -148,7 +158,7 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss, const struct config_co
 	/* Do any other initialization you need here */
 	r->send_buffer = NULL;
 	r->next_seqno_to_send = 1;
-	r->final_seqno = -1;
+	r->final_seqno = SEQNO_NONE;
 	r->receive_buffer = NULL;
 	r->next_seqno_expected = 1;
 	r->receive_buffer_data_offset = 0;
@@ -163,9 +173,11 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss, const struct config_co
 void
 rel_destroy (rel_t *r)
 {
-    if (r->next)
-	r->next->prev = r->prev;
-	*r->prev = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	// the first connection has no prev
+	if (r->prev)
+		*r->prev = r->next;
 	conn_destroy (r->c);
 	/* Free any other allocated memory here */
 	while (r->send_buffer) {
@@ -209,14 +221,15 @@ int handle_ack(rel_t* rel, struct ack_packet* ack_packet) {
 #ifdef DEBUG
 	fprintf(stderr, "RECEIVE ACK %d\n", ntohl(ack_packet->ackno));
 #endif
-	if (ntohl(ack_packet->ackno) > rel->final_seqno) {
+	uint64_t ackno = seqno_extend(rel->next_seqno_to_send, ntohl(ack_packet->ackno));
+	if (ackno > rel->final_seqno) {
 		rel->eof_all_acked = 1;
 #ifdef DEBUG
 	fprintf(stderr, "All sent are acked\n");
 #endif
 	}
 	while (rel->send_buffer
-			&& ntohl(rel->send_buffer->packet->seqno) < ntohl(ack_packet->ackno)) {
+			&& seqno_lt(ntohl(rel->send_buffer->packet->seqno), (uint32_t) ackno)) {
 		remove_head_packet(&rel->send_buffer);
 	}
 	//assert(ntohl(rel->send_buffer->packet->seqno) >= ntohl(ack_packet->ackno));
@@ -267,9 +280,8 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 	fprintf(stderr, "\n");
 #endif
     int possible_ackno = ntohl(pkt->ackno); //valid if not corrupt
-    int possible_seqno = ntohl(pkt->seqno);
 #ifdef DEBUG
-    fprintf(stderr, "ackno: %d seqno: %d \n", possible_ackno, possible_seqno);
+    fprintf(stderr, "ackno: %d seqno: %d \n", possible_ackno, ntohl(pkt->seqno));
 #endif
 	if (((int) n) != ntohs(pkt->len)) {
 		fprintf(stderr, "%d:ackno:%d Packet advertised size is not equal to real size\n", getpid(), possible_ackno);
@@ -281,7 +293,8 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 		return;
 	}
 	if (ntohl(pkt->ackno) < 1
-			|| ntohl(pkt->ackno) > r->next_seqno_to_send) {
+			|| seqno_extend(r->next_seqno_to_send, ntohl(pkt->ackno))
+					> r->next_seqno_to_send) {
 		fprintf(stderr, "%d: Ackno %d doesn't make sense\n", getpid(), ntohl(pkt->ackno));
 		return;
 	}
@@ -312,7 +325,8 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
     else {
         if (packet_length >= 12
             && packet_length <= MAX_PACKET_SIZE
-            && ntohl(pkt->seqno) >= r->next_seqno_expected){
+            && seqno_extend(r->next_seqno_expected, ntohl(pkt->seqno))
+                    >= r->next_seqno_expected){
             //if (ntohs(pkt->len)-12 != check_pkt_data_len(pkt->data))	return;
 #ifdef DEBUG
             fprintf(stderr, "INSERTING %d\n", ntohl(pkt->seqno));
@@ -326,8 +340,8 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
             
             insert_packet_in_order(&(r->receive_buffer), to_insert);
             
-            if (ntohl(pkt->seqno) == r->next_seqno_expected) {
-                r->next_seqno_expected++;
+            if (ntohl(pkt->seqno) == (uint32_t) r->next_seqno_expected) {
+                r->next_seqno_expected = seqno_next(r->next_seqno_expected);
             }
             
             send_ack(r, r->next_seqno_expected);
@@ -391,7 +405,7 @@ rel_read (rel_t *s)
 		packet_node->packet->seqno = htonl(s->next_seqno_to_send);
 		uint16_t checksum = cksum(packet_node->packet, packet_length);
 		packet_node->packet->cksum = checksum;
-		s->next_seqno_to_send++;
+		s->next_seqno_to_send = seqno_next(s->next_seqno_to_send);
 
 		conn_sendpkt(s->c, packet_node->packet, packet_length);
 		append_packet(&(s->send_buffer), packet_node);
@@ -454,7 +468,7 @@ void rel_output (rel_t *r) {
 			&& r->receive_buffer->packet
 			&& !(handle_eof_packet(r))
 			&& r->receive_buffer->packet->data
-			&& ntohl(r->receive_buffer->packet->seqno) < r->next_seqno_expected) {
+			&& seqno_lt(ntohl(r->receive_buffer->packet->seqno), r->next_seqno_expected)) {
 		int to_write = ntohs(r->receive_buffer->packet->len)
 				- DATA_PACKET_METADATA_LENGTH
 				- r->receive_buffer_data_offset;
@@ -0,0 +1,354 @@
+/*
+ * replay: feed the packets a capture says reliable received back into
+ * rel_recvpkt, on the capture's clock.
+ *
+ *   replay [-d] [-w window] [-t timeout] [-i input] [-o output] [-n runs]
+ *          capture.pcapng
+ *
+ * The capture comes from reliable -p.  Its received packets go to a
+ * fresh connection in the order and at the times they arrived, and
+ * rel_timer fires every timeout/5 ms of capture time in between, as it
+ * did live; nothing waits on the real clock, so a long capture replays
+ * as fast as the protocol can take it.  Give -w and -t as the recorded
+ * run had them.  With -i, the connection reads its input from the file
+ * (the pid.in.log of reliable -l, say); without it there is none.  With
+ * -o, what the connection outputs goes to the file.  -d prints the
+ * packets the connection sends.
+ *
+ * With -n runs, the capture is replayed that many times and the time
+ * per received packet is the mean, for profiling.  Build it like
+ * reliable (make replay) so the protocol is the one that ships.
+ */
+
+#define NO_DEBUG
+
+#define main rlib_main
+#define conn_sendpkt rlib_conn_sendpkt
+#define conn_output rlib_conn_output
+#define conn_input rlib_conn_input
+#include "rlib.c"
+#undef main
+#undef conn_sendpkt
+#undef conn_output
+#undef conn_input
+
+#include <time.h>
+#include <sys/stat.h>
+
+#define MAX_INTERFACES 16
+
+struct replay_packet {
+	uint64_t ns;
+	int len;
+	char* data;
+};
+
+static struct replay_packet* packets;
+static int npackets;
+
+static int input_fd = -1, output_fd = -1;
+static uint64_t packets_sent, bytes_output, timer_ticks;
+static int output_eof;
+
+int conn_sendpkt(conn_t *c, const packet_t *pkt, size_t len) {
+	packets_sent++;
+	if (opt_debug) {
+		print_pkt(pkt, "send", len);
+	}
+	return len;
+}
+
+int conn_output(conn_t *c, const void *buf, size_t n) {
+	if (n == 0) {
+		c->write_eof = 1;
+		output_eof = 1;
+		return 0;
+	}
+	bytes_output += n;
+	if (output_fd >= 0 && write(output_fd, buf, n) != (ssize_t) n) {
+		perror("output");
+		close(output_fd);
+		output_fd = -1;
+	}
+	return n;
+}
+
+int conn_input(conn_t *c, void *buf, size_t n) {
+	int r;
+	if (c->read_eof || input_fd < 0) {
+		return c->read_eof ? -1 : 0;
+	}
+	r = read(input_fd, buf, n);
+	if (r <= 0) {
+		c->read_eof = 1;
+		return -1;
+	}
+	c->xoff = 0;
+	return r;
+}
+
+#include "reliable.c"
+
+/* ---- reading the capture ---- */
+
+static uint32_t get32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static uint16_t get16(const uint8_t* p) {
+	uint16_t v;
+	memcpy(&v, p, 2);
+	return v;
+}
+
+/* The UDP payload of a raw IPv4 packet, or NULL */
+static const uint8_t* udp_payload(const uint8_t* ip, int caplen, int* len) {
+	int ihl;
+	if (caplen < 20 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_UDP) {
+		return NULL;
+	}
+	ihl = (ip[0] & 0xf) * 4;
+	if (caplen < ihl + 8) {
+		return NULL;
+	}
+	*len = caplen - ihl - 8;
+	return ip + ihl + 8;
+}
+
+static void load_capture(const char* path) {
+	struct stat st;
+	uint8_t* file;
+	size_t off = 0;
+	int fd = open(path, O_RDONLY);
+	int linktype[MAX_INTERFACES];
+	uint64_t per_second[MAX_INTERFACES];
+	int ninterfaces = 0, skipped = 0, size = 0;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		exit(1);
+	}
+	file = xmalloc(st.st_size + 1);
+	if (read(fd, file, st.st_size) != st.st_size) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+
+	while (off + 12 <= (size_t) st.st_size) {
+		uint8_t* b = file + off;
+		uint32_t type = get32(b), length = get32(b + 4);
+		if (length < 12 || length % 4 || off + length > (size_t) st.st_size) {
+			fprintf(stderr, "%s: truncated block at offset %zu\n", path, off);
+			break;
+		}
+		off += length;
+		if (type == PCAPNG_SHB) {
+			if (get32(b + 8) != PCAPNG_BYTE_ORDER) {
+				fprintf(stderr, "%s: written with the other byte order\n", path);
+				exit(1);
+			}
+			ninterfaces = 0;
+		}
+		else if (type == PCAPNG_IDB && ninterfaces < MAX_INTERFACES) {
+			uint8_t* opt = b + 16;
+			linktype[ninterfaces] = get16(b + 8);
+			per_second[ninterfaces] = 1000000;
+			while (opt + 4 <= b + length - 4 && get16(opt) != PCAPNG_OPT_END) {
+				int optlen = get16(opt + 2);
+				if (get16(opt) == PCAPNG_OPT_TSRESOL && optlen == 1) {
+					uint64_t units = 1;
+					int i;
+					for (i = 0; i < (opt[4] & 0x7f); i++) {
+						units *= opt[4] & 0x80 ? 2 : 10;
+					}
+					per_second[ninterfaces] = units;
+				}
+				opt += 4 + ((optlen + 3) & ~3);
+			}
+			ninterfaces++;
+		}
+		else if (type == PCAPNG_EPB) {
+			uint32_t iface = get32(b + 8), caplen = get32(b + 20);
+			uint8_t* opt = b + 28 + ((caplen + 3) & ~3);
+			uint32_t dir = 0;
+			const uint8_t* payload;
+			int len;
+
+			if (iface >= (uint32_t) ninterfaces || 28 + caplen > length) {
+				skipped++;
+				continue;
+			}
+			while (opt + 4 <= b + length - 4 && get16(opt) != PCAPNG_OPT_END) {
+				int optlen = get16(opt + 2);
+				if (get16(opt) == PCAPNG_OPT_FLAGS && optlen == 4) {
+					dir = get32(opt + 4) & 3;
+				}
+				opt += 4 + ((optlen + 3) & ~3);
+			}
+			if (dir != CAPTURE_IN) {
+				continue;
+			}
+			payload = linktype[iface] == PCAPNG_LINKTYPE_RAW
+					? udp_payload(b + 28, caplen, &len) : NULL;
+			if (!payload) {
+				skipped++;
+				continue;
+			}
+			if (npackets == size) {
+				size = size ? 2 * size : 1024;
+				packets = realloc(packets, size * sizeof(*packets));
+				if (!packets) {
+					perror("replay");
+					exit(1);
+				}
+			}
+			/* recv would have cut it to the buffer */
+			if (len > (int) sizeof(packet_t)) {
+				len = sizeof(packet_t);
+			}
+			uint64_t ts = (uint64_t) get32(b + 12) << 32 | get32(b + 16);
+			packets[npackets].ns = per_second[iface] == 1000000000
+					? ts : (uint64_t) (ts * (1e9 / per_second[iface]));
+			packets[npackets].len = len;
+			packets[npackets].data = (char*) payload;
+			npackets++;
+		}
+	}
+	if (skipped) {
+		fprintf(stderr, "%s: skipped %d packets that are not UDP over raw IPv4\n",
+				path, skipped);
+	}
+}
+
+/* ---- replaying it ---- */
+
+static struct config_common config;
+
+/* The input is a file, which is always ready: read as the poll loop
+ * would, until the protocol stops asking */
+static void poll_input(conn_t* c) {
+	while (input_fd >= 0 && !c->read_eof && !c->xoff && !c->delete_me) {
+		c->xoff = 1;
+		rel_read(c->rel);
+	}
+}
+
+static void replay(void) {
+	static packet_t pkt;
+	conn_t* c = conn_alloc();
+	uint64_t timer_ns = (uint64_t) config.timer * 1000000;
+	uint64_t tick = packets[0].ns + timer_ns;
+	int i;
+
+	c->rfd = c->wfd = c->nfd = -1;
+	c->rel = rel_create(c, NULL, &config);
+	poll_input(c);
+	for (i = 0; i < npackets && !c->delete_me; i++) {
+		while (tick <= packets[i].ns && !c->delete_me) {
+			rel_timer();
+			timer_ticks++;
+			tick += timer_ns;
+			poll_input(c);
+		}
+		if (c->delete_me) {
+			break;
+		}
+		/* rel_recvpkt may write to the packet */
+		memcpy(&pkt, packets[i].data, packets[i].len);
+		rel_recvpkt(c->rel, &pkt, packets[i].len);
+		poll_input(c);
+	}
+	if (!c->delete_me) {
+		rel_destroy(c->rel);
+	}
+	conn_free(c);
+}
+
+static void replay_usage(void) {
+	fprintf(stderr, "usage: %s [-d] [-w window] [-t timeout] [-i input] [-o output]\n"
+			"       [-n runs] capture.pcapng\n", progname);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char* input = NULL;
+	struct timespec start, end;
+	int opt, runs = 1, run;
+	double ns;
+
+	progname = argv[0];
+	config.window = 1;
+	config.timeout = 2000;
+	while ((opt = getopt(argc, argv, "di:n:o:t:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			opt_debug = 1;
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'o':
+			output_fd = open(optarg, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+			if (output_fd < 0) {
+				perror(optarg);
+				exit(1);
+			}
+			break;
+		case 't':
+			config.timeout = atoi(optarg);
+			break;
+		case 'w':
+			config.window = atoi(optarg);
+			break;
+		default:
+			replay_usage();
+		}
+	}
+	if (optind + 1 != argc || runs < 1 || config.window < 1 || config.timeout < 10) {
+		replay_usage();
+	}
+	config.timer = config.timeout / 5;
+	config.single_connection = 1;
+
+	load_capture(argv[optind]);
+	if (!npackets) {
+		fprintf(stderr, "%s: no received packets in %s\n", progname, argv[optind]);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (run = 0; run < runs; run++) {
+		if (input && (input_fd = open(input, O_RDONLY)) < 0) {
+			perror(input);
+			exit(1);
+		}
+		replay();
+		if (input_fd >= 0) {
+			close(input_fd);
+		}
+		if (run == 0) {
+			printf("Replayed: \t%d packets received over %.3f s\n", npackets,
+					(packets[npackets - 1].ns - packets[0].ns) / 1e9);
+			printf("Sent: \t\t%llu packets, %llu timer ticks\n",
+					(unsigned long long) packets_sent,
+					(unsigned long long) timer_ticks);
+			printf("Output: \t%llu bytes%s\n", (unsigned long long) bytes_output,
+					output_eof ? ", then EOF" : "");
+			if (output_fd >= 0) {
+				close(output_fd);
+				output_fd = -1;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec;
+	printf("Time: \t\t%.1f ns per packet over %d run%s\n",
+			ns / runs / npackets, runs, runs == 1 ? "" : "s");
+	return 0;
+}
@@ -18,6 +18,8 @@
 #include <signal.h>
 
 #include "rlib.h"
+#include "capture.h"
+#include "logger.h"
 
 #define LIBDEBUG
 
@@ -124,27 +126,61 @@ clock_gettime (int id, struct timespec *tp)
 }
 #endif /* NEED_CLOCK_GETTIME */
 
+/* What print_pkt hands the logger; the line is made on its thread */
+struct pkt_line {
+	int pid;
+	int n;
+	int err;
+	const char *op;
+	uint16_t cksum;
+	uint16_t len;
+	uint32_t ackno;
+	uint32_t seqno;
+};
+
+static int
+format_pkt (char *out, size_t size, const void *arg)
+{
+	const struct pkt_line *l = arg;
+	if (l->n < 0)
+		return snprintf (out, size, "%5d %s(%3d): %s\n", l->pid, l->op, l->n,
+				strerror (l->err));
+	else if (l->n == 8)
+		return snprintf (out, size,
+				"%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x\n",
+				l->pid, l->op, l->n, l->cksum, ntohs (l->len), ntohl (l->ackno));
+	else if (l->n >= 12)
+		return snprintf (out, size,
+				"%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x\n",
+				l->pid, l->op, l->n, l->cksum, ntohs (l->len), ntohl (l->ackno),
+				ntohl (l->seqno));
+	else
+		return snprintf (out, size, "%5d %s(%3d):\n", l->pid, l->op, l->n);
+}
+
 void
 print_pkt (const packet_t *buf, const char *op, int n)
 {
 	static int pid = -1;
+	struct pkt_line l;
 	int saved_errno = errno;
 	if (pid == -1)
 		pid = getpid ();
-	if (n < 0) {
-		if (errno != EAGAIN)
-			fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
+	if (n < 0 && errno == EAGAIN)
+		return;
+	memset (&l, 0, sizeof (l));
+	l.pid = pid;
+	l.n = n;
+	l.err = errno;
+	l.op = op;
+	if (n >= 8) {
+		l.cksum = buf->cksum;
+		l.len = buf->len;
+		l.ackno = buf->ackno;
 	}
-	else if (n == 8)
-		fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x\n",
-				pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno));
-	else if (n >= 12)
-		fprintf (stderr,
-				"%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x\n",
-				pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
-				ntohl (buf->seqno));
-	else
-		fprintf (stderr, "%5d %s(%3d):\n", pid, op, n);
+	if (n >= 12)
+		l.seqno = buf->seqno;
+	logger_format (2, format_pkt, &l, sizeof (l));
 	errno = saved_errno;
 }
 
@@ -158,6 +194,8 @@ conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 				(const struct sockaddr *) &c->peer, addrsize (&c->peer));
 	else
 		n = send (c->nfd, pkt, len, 0);
+	if (capture && n >= 0)
+		capture_packet (c->nfd, &c->peer, CAPTURE_OUT, pkt, n);
 	if (opt_debug)
 		print_pkt (pkt, "send", n);
 	return n;
@@ -213,7 +251,7 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 		return 0;
 
 	if (log_out >= 0)
-		write (log_out, buf, n);
+		logger_write (log_out, buf, n);
 
 	if (!c->outq) {
 		int r = write (c->wfd, buf, n);
@@ -265,7 +303,7 @@ conn_input (conn_t *c, void *buf, size_t n)
 		r = 0;
 
 	if (r > 0 && log_in >= 0)
-		write (log_in, buf, r);
+		logger_write (log_in, buf, r);
 
 	c->xoff = 0;
 	cevents[c->rpoll].events |= POLLIN;
@@ -857,6 +895,8 @@ debug_recv (int s, packet_t *buf, size_t len, int flags,
 		n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
 	else
 		n = recv (s, buf, len, flags);
+	if (capture && n >= 0)
+		capture_packet (s, from, CAPTURE_IN, buf, n);
 	if (opt_debug)
 		print_pkt (buf, "recv", n);
 	return n;
@@ -921,6 +961,10 @@ usage (void)
 			"usage: %s udp-port [host:]udp-port\n"
 			"       %s -c {-u unix-socket | tcp-port} [host:]udp-port\n"
 			"       %s -s [-u] udp-port {unix-socket | [host:]tcp-port}\n"
+			"       -d: print every packet sent and received\n"
+			"       -l: log the data read and written to pid.in.log, pid.out.log\n"
+			"       -p: capture every packet sent and received to a pcapng file\n"
+			"           (see replay)\n"
 			, progname, progname, progname);
 	exit (1);
 }
@@ -934,6 +978,7 @@ main (int argc, char **argv)
 			{ "server", no_argument, NULL, 's' },
 			{ "window", required_argument, NULL, 'w' },
 			{ "client", no_argument, NULL, 'c' },
+			{ "pcap", required_argument, NULL, 'p' },
 			{ NULL, 0, NULL, 0 }
 	};
 	int opt;
@@ -961,7 +1006,7 @@ main (int argc, char **argv)
 	else
 		progname = argv[0];
 
-	while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
+	while ((opt = getopt_long (argc, argv, "cdp:ust:w:l", o, NULL)) != -1)
 		switch (opt) {
 		case 'c':
 			opt_client = 1;
@@ -982,6 +1027,10 @@ main (int argc, char **argv)
 				perror (name);
 		}
 		break;
+		case 'p':
+			if (capture_open (optarg) < 0)
+				exit (1);
+			break;
 		case 'u':
 			opt_unix = 1;
 			break;
@@ -1004,6 +1053,8 @@ main (int argc, char **argv)
 			|| (!(opt_server || opt_client) && opt_unix))
 		usage ();
 	c.timer = c.timeout / 5;
+	if (opt_debug || log_in >= 0 || log_out >= 0)
+		logger_start ();
 	local = argv[optind];
 	remote = argv[optind+1];
 
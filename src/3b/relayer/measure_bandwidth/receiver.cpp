@@ -1,105 +1,392 @@
 /*************************************
-*this receiver is used for lab 4. You can use it to get a 
-*more accurate bandwidth of the relayer. This receiver grabs
-*all the packets relayed by the relayer in 30s, and calculate
-*(number of bits received / 30s). This is a more accurate estimation
-*of the relayer's bandwidth.
+*this receiver is used for lab 4 with the sender to measure the link of
+*the relayer (or relay). It receives the sender's flows and prints, for
+*every flow and in total, the throughput, the loss, the reordering and
+*the one-way delay, from the sequence numbers and send times the sender
+*puts in every packet.
 *
-*You may need to change the udpport according to the relayer's config.xml
-*use "g++ -o receiver receiver.cpp" to compile
-*To run: 
+*use "g++ -O2 -o receiver receiver.cpp" to compile
+*To run:
 *(1)start the relayer first
 *./relayer config.xml
-*(2)run the sender
-*./sender
-*(3)run the receiver
-*./receiver
-*after 30s, you'll get the relayer's bandwidth
+*(2)run the receiver on the port the relayer relays to
+*./receiver 20000
+*(3)run the sender
+*./sender -r 5000 -t 30 localhost:50001
+*
+*usage: receiver [-n ports] [-t seconds] [-i seconds] [-T trace.txt] port
+* -n: listen on ports port to port + n - 1 (default 1), for a sender -k
+* -t: stop this long after the first packet (default 30)
+* -i: stop when nothing arrived for this long (default never)
+* -T: record the link as a packet delivery trace for relay: every line
+*     is the time in ms, since the first packet, at which another
+*     TRACE_MTU bytes got through (Mahimahi's format)
+*
+*Loss counts the seqnos that never arrived, up to the highest one that
+*did. Rates are over the time from the first packet to the last. A
+*packet is reordered if a higher seqno of its flow arrived
+*before it; its distance is by how many. Delays are from the sender's
+*clock to ours, so the two must agree.
 *************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
-#include <sys/time.h>
 #include <unistd.h>
 using namespace std;
 
-#define PKT_SIZE 1016
-/*****************************************/
-//this is the receiver's listening port, you may need to change it before running
-unsigned short int udpport = 20000;
-/*****************************************/
+#define MAX_PKT 1500
+#define MAX_FLOWS 256
+#define MAX_PORTS 256
+#define BATCH 64
+#define TRACE_MTU 1500
+#define LOAD_MAGIC 0x4c4f4144 /* "LOAD" */
+#define HIST 32 /* log2 buckets, for reorder distances */
+#define SUB 8 /* delay buckets per power of two, for 12.5% precision */
+#define DELAY_HIST (SUB + SUB * 40)
+#define WINDOW 65536 /* seqnos remembered for duplicates */
+
+struct load_header
+{
+  uint32_t magic;
+  uint32_t flow;
+  uint64_t seqno;
+  uint64_t sent_ns;
+};
+
+struct flow
+{
+  int seen;
+  uint64_t packets, bytes, duplicates, reordered, top; /* top: highest seqno + 1 */
+  uint64_t delay_hist[DELAY_HIST], reorder_hist[HIST];
+  int64_t delay_min, delay_max;
+  double delay_sum;
+  uint8_t arrived[WINDOW / 8]; /* seqnos in [top - WINDOW, top) */
+};
+
+static struct flow flows[MAX_FLOWS];
+
+static uint64_t now_ns(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int log2_bucket(uint64_t v)
+{
+  int b = 0;
+  while (v > 1 && b < HIST - 1)
+  {
+    v >>= 1;
+    b++;
+  }
+  return b;
+}
+
+/* Delays in us: exact below SUB, then SUB buckets per power of two */
+static int delay_bucket(uint64_t v)
+{
+  int e = 0;
+  if (v < SUB)
+    return v;
+  while (v >> e >= 2 * SUB)
+    e++;
+  return SUB + e * SUB + (v >> e) - SUB;
+}
+
+static uint64_t delay_bucket_low(int b)
+{
+  if (b < SUB)
+    return b;
+  return (uint64_t) (SUB + b % SUB) << (b / SUB - 1);
+}
+
+static int test_and_set(struct flow* f, uint64_t seqno)
+{
+  int i = seqno % WINDOW, was = f->arrived[i / 8] >> (i % 8) & 1;
+  f->arrived[i / 8] |= 1 << (i % 8);
+  return was;
+}
+
+static void clear(struct flow* f, uint64_t seqno)
+{
+  int i = seqno % WINDOW;
+  f->arrived[i / 8] &= ~(1 << (i % 8));
+}
+
+static void account(struct flow* f, const struct load_header* h, int len,
+    uint64_t now_real)
+{
+  uint64_t seqno = be64toh(h->seqno);
+  int64_t delay = (int64_t) (now_real - be64toh(h->sent_ns));
+
+  if (f->top > WINDOW && seqno < f->top - WINDOW)
+    return; /* too old to tell; rare enough to ignore */
+  if (seqno < f->top)
+  {
+    if (test_and_set(f, seqno))
+    {
+      f->duplicates++;
+      return;
+    }
+    f->reordered++;
+    f->reorder_hist[log2_bucket(f->top - seqno)]++;
+  }
+  else
+  {
+    /* Forget what falls out of the window, mark the new top */
+    uint64_t s;
+    for (s = f->top; s < seqno + 1 && s < f->top + WINDOW; s++)
+      clear(f, s);
+    f->top = seqno + 1;
+    test_and_set(f, seqno);
+  }
+  f->packets++;
+  f->bytes += len;
+  if (!f->seen || delay < f->delay_min)
+    f->delay_min = delay;
+  if (!f->seen || delay > f->delay_max)
+    f->delay_max = delay;
+  f->seen = 1;
+  f->delay_sum += delay;
+  f->delay_hist[delay_bucket(delay > 0 ? delay / 1000 : 0)]++;
+}
+
+/* The upper end, in us, of the delay bucket holding fraction q */
+static uint64_t quantile(const uint64_t* hist, double q)
+{
+  uint64_t total = 0, seen = 0;
+  int b;
+  for (b = 0; b < DELAY_HIST; b++)
+    total += hist[b];
+  for (b = 0; b < DELAY_HIST - 1; b++)
+  {
+    seen += hist[b];
+    if (seen >= q * total)
+      break;
+  }
+  return delay_bucket_low(b + 1) - 1;
+}
+
+/* The non-empty buckets of a histogram */
+static void print_hist(const char* title, const uint64_t* hist, int n,
+    uint64_t (*low)(int), const char* unit)
+{
+  int b;
+  printf("  %s:\n", title);
+  for (b = 0; b < n; b++)
+    if (hist[b])
+      printf("    %8llu-%-8llu %s %10llu\n", (unsigned long long) low(b),
+          (unsigned long long) low(b + 1) - 1, unit,
+          (unsigned long long) hist[b]);
+}
+
+static uint64_t log2_bucket_low(int b)
+{
+  return b ? 1ULL << b : 0;
+}
 
-int udpsock;
-int listen_init(unsigned short int port)
+static void report(const char* name, struct flow* f, double seconds)
 {
-    int length;
-    struct sockaddr_in server;   	
-    
-    /* Create a socket for receiving feedback */
-    udpsock=socket(AF_INET,SOCK_DGRAM,0);
-    if (udpsock<0)
+  uint64_t lost = f->top - (f->packets < f->top ? f->packets : f->top);
+  printf("%s: %llu packets, %.1f kb/s, lost %llu (%.2f%%), reordered %llu, "
+      "duplicated %llu\n", name, (unsigned long long) f->packets,
+      f->bytes * 8 / seconds / 1000, (unsigned long long) lost,
+      f->top ? 100.0 * lost / f->top : 0, (unsigned long long) f->reordered,
+      (unsigned long long) f->duplicates);
+  if (!f->packets)
+    return;
+  printf("  one-way delay: min %.3f ms, mean %.3f ms, max %.3f ms, "
+      "p50 %.3f ms, p99 %.3f ms, p999 %.3f ms\n", f->delay_min / 1e6,
+      f->delay_sum / f->packets / 1e6, f->delay_max / 1e6,
+      quantile(f->delay_hist, 0.5) / 1e3, quantile(f->delay_hist, 0.99) / 1e3,
+      quantile(f->delay_hist, 0.999) / 1e3);
+  print_hist("one-way delay", f->delay_hist, DELAY_HIST, delay_bucket_low, "us");
+  if (f->reordered)
+    print_hist("reorder distance", f->reorder_hist, HIST, log2_bucket_low,
+        "  ");
+}
+
+int main(int argc, char** argv)
+{
+  static char bufs[BATCH][MAX_PKT];
+  struct pollfd fds[MAX_PORTS];
+  double seconds = 30, idle = 0;
+  int nports = 1, opt, i;
+  FILE* trace = NULL;
+  long trace_bytes = 0;
+
+  while ((opt = getopt(argc, argv, "n:t:i:T:")) != -1)
+  {
+    switch (opt)
     {
- 	 printf("ERROR: opening stream socket!\n");
-   	exit(1);
+    case 'n': nports = atoi(optarg); break;
+    case 't': seconds = atof(optarg); break;
+    case 'i': idle = atof(optarg); break;
+    case 'T':
+      trace = fopen(optarg, "w");
+      if (!trace)
+      {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n ports] [-t seconds] [-i seconds] "
+          "[-T trace.txt] port\n", argv[0]);
+      return 1;
     }
+  }
+  if (optind + 1 != argc || nports < 1 || nports > MAX_PORTS || seconds <= 0)
+  {
+    fprintf(stderr, "usage: %s [-n ports] [-t seconds] [-i seconds] "
+        "[-T trace.txt] port\n", argv[0]);
+    return 1;
+  }
+  int port = atoi(argv[optind]);
 
-    server.sin_family=AF_INET;
-    server.sin_addr.s_addr=INADDR_ANY;
-    server.sin_port=htons(port);
-    
-    /*Bind the socket to the listening port */
-    if (bind(udpsock,(struct sockaddr *)&server,sizeof server)<0)
+  for (i = 0; i < nports; i++)
+  {
+    struct sockaddr_in server;
+    int size = 4 << 20;
+    fds[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+    fds[i].events = POLLIN;
+    if (fds[i].fd < 0)
     {
-    	printf("UDP Binding error, maybe port number occupied by others. Change another port");
-   	exit(1);
-    };
-    length=sizeof server;
-    if (getsockname(udpsock,(struct sockaddr *)&server,(socklen_t *)&length)<0)
+      perror("socket");
+      return 1;
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port + i);
+    if (bind(fds[i].fd, (struct sockaddr*) &server, sizeof(server)) < 0)
     {
-	 printf("ERROR: getting socket name\n");
-   	exit(1);
+      perror("bind");
+      return 1;
     }
-    printf("UDP Socket port # %d\n",ntohs(server.sin_port)); 
-    return 0;
-};
+    setsockopt(fds[i].fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  printf("UDP Socket port # %d", port);
+  if (nports > 1)
+    printf(" to %d", port + nports - 1);
+  printf("\n");
+  fflush(stdout);
 
+  uint64_t first = 0, last = 0, foreign = 0;
+  for (;;)
+  {
+    uint64_t now = now_ns(CLOCK_MONOTONIC);
+    int timeout = 1000;
+    if (first && now - first >= seconds * 1e9)
+      break;
+    if (idle > 0 && last && now - last >= idle * 1e9)
+      break;
+    if (first)
+      timeout = (first + (uint64_t) (seconds * 1e9) - now) / 1000000 + 1;
+    if (idle > 0 && last && (last + (uint64_t) (idle * 1e9) - now) / 1000000 + 1
+        < (uint64_t) timeout)
+      timeout = (last + (uint64_t) (idle * 1e9) - now) / 1000000 + 1;
+    if (poll(fds, nports, timeout > 1000 ? 1000 : timeout) <= 0)
+      continue;
 
-int main()
-{
-  if (listen_init(udpport)!=0) { printf("UDP Socket establish failure!\n"); return 1;};
-  double num = 0.0;
-  struct timeval start;
-  struct timeval current;
-  gettimeofday (&start, NULL);
-
-  char buf[PKT_SIZE];
-  fd_set setForSelect;
-  while (1)
-  { 
-    FD_ZERO(&setForSelect);
-    FD_SET(udpsock,&setForSelect);   	 
-    select(udpsock+1,&setForSelect,0,0,NULL);
-    if (FD_ISSET(udpsock,&setForSelect))
+    for (i = 0; i < nports; i++)
     {
-      struct sockaddr incoming_addr;
-      memset(buf,0,PKT_SIZE);   
-      socklen_t incoming_len = sizeof(incoming_addr);
-      int rval = recvfrom(udpsock,buf,PKT_SIZE,0,&incoming_addr, &incoming_len);   
-      if(rval == PKT_SIZE)
+      struct mmsghdr msgs[BATCH];
+      struct iovec iov[BATCH];
+      int j, n;
+
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      for (j = 0; j < BATCH; j++)
+      {
+        iov[j].iov_base = bufs[j];
+        iov[j].iov_len = MAX_PKT;
+        memset(&msgs[j].msg_hdr, 0, sizeof(msgs[j].msg_hdr));
+        msgs[j].msg_hdr.msg_iov = &iov[j];
+        msgs[j].msg_hdr.msg_iovlen = 1;
+      }
+      n = recvmmsg(fds[i].fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+      if (n <= 0)
+        continue;
+      uint64_t mono = now_ns(CLOCK_MONOTONIC), real = now_ns(CLOCK_REALTIME);
+      if (!first)
+        first = mono;
+      last = mono;
+      for (j = 0; j < n; j++)
       {
-          num = num + 1.0;
-          printf("%f\n", num);
+        const struct load_header* h = (const struct load_header*) bufs[j];
+        int len = msgs[j].msg_len;
+        if (len < (int) sizeof(*h) || ntohl(h->magic) != LOAD_MAGIC
+            || ntohl(h->flow) >= MAX_FLOWS)
+        {
+          foreign++;
+          continue;
+        }
+        account(&flows[ntohl(h->flow)], h, len, real);
+        if (trace)
+        {
+          long ms = (mono - first) / 1000000;
+          for (trace_bytes += len; trace_bytes >= TRACE_MTU; trace_bytes -= TRACE_MTU)
+            fprintf(trace, "%ld\n", ms);
+        }
       }
     }
-    gettimeofday (&current, NULL);
-    if(current.tv_sec - start.tv_sec >= 30)
-      break;
   }
-  printf("!!! relayer's bandwidth is %f kb/s\n", (((8.0 * PKT_SIZE) / (current.tv_sec - start.tv_sec)) * num) / 1000.0);
+  if (trace)
+    fclose(trace);
+
+  /* Rates are over the time packets were arriving */
+  double elapsed = (last - first) / 1e9;
+  if (elapsed <= 0)
+  {
+    printf("no packets\n");
+    return 1;
+  }
+
+  struct flow* total = (struct flow*) calloc(1, sizeof(*total));
+  int nflows = 0;
+  for (i = 0; i < MAX_FLOWS; i++)
+  {
+    struct flow* f = &flows[i];
+    char name[32];
+    if (!f->seen && !f->top)
+      continue;
+    snprintf(name, sizeof(name), "flow %d", i);
+    report(name, f, elapsed);
+    nflows++;
+    total->packets += f->packets;
+    total->bytes += f->bytes;
+    total->top += f->top;
+    total->duplicates += f->duplicates;
+    total->reordered += f->reordered;
+    total->delay_sum += f->delay_sum;
+    if (!total->seen || f->delay_min < total->delay_min)
+      total->delay_min = f->delay_min;
+    if (!total->seen || f->delay_max > total->delay_max)
+      total->delay_max = f->delay_max;
+    total->seen = 1;
+    for (int b = 0; b < DELAY_HIST; b++)
+      total->delay_hist[b] += f->delay_hist[b];
+    for (int b = 0; b < HIST; b++)
+      total->reorder_hist[b] += f->reorder_hist[b];
+  }
+  if (nflows > 1)
+    report("all flows", total, elapsed);
+  if (foreign)
+    printf("%llu packets were not the sender's\n", (unsigned long long) foreign);
+  printf("!!! relayer's bandwidth is %f kb/s\n", total->bytes * 8 / elapsed / 1000);
+  return 0;
 }
@@ -1,83 +1,275 @@
 /*************************************
-*this sender is used for lab 4. You can use it to get a 
-*more accurate bandwidth of the relayer. This sender keeps on sending
-*2016-byte packets to the relayer, The relayer may drop some of them,
-*and relay the rest of them. The receiver on the other end will grabs
-*all the packets relayed by the relayer in 30s and calculates
-*(number of received bits / 30s). This is a more accurate estimation
-*of the relayer's bandwidth.
+*this sender is used for lab 4 to load the relayer (or relay) and measure
+*its link together with the receiver. It sends N flows of UDP packets,
+*each paced at a target rate, with packet sizes drawn from a
+*distribution, for a given time. Every packet carries its flow, a
+*sequence number and the time it was sent, from which the receiver
+*measures loss, reordering and one-way delay.
 *
-*You may need to change some of the values bellow according to the relayer's config.xml
-*use "g++ -o sender sender.cpp" to compile
-*To run: 
+*use "g++ -O2 -o sender sender.cpp" to compile
+*To run:
 *(1)start the relayer first
 *./relayer config.xml
-*(2)run the sender
-*./sender
-*(3)run the receiver
-*./receiver
-*after 30s, you'll get the relayer's bandwidth
+*(2)run the receiver
+*./receiver 20000
+*(3)run the sender towards the relayer's listening port
+*./sender -r 5000 -t 30 localhost:50001
+*
+*usage: sender [-r kb/s] [-s sizes] [-n flows] [-t seconds] [-b batch]
+*              [-p port] [-k] host:port
+* -r: rate of each flow in kb/s, 0 (default) for as fast as it can
+* -s: packet sizes in bytes: a size (default 1016), a range "min-max"
+*     drawn uniformly, or "imix" (64, 576 and 1500 bytes, 7:4:1)
+* -n: number of flows (default 1)
+* -t: seconds to send (default 30)
+* -b: packets to hand to the kernel at once, with sendmmsg (default 16)
+* -p: local port of flow 0; flow i uses port + i (default any)
+* -k: flow i sends to port + i instead of to port, one relayer pair each
+*
+*The clocks of the two ends must agree for the one-way delays to mean
+*anything; on one machine they do.
 *************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 using namespace std;
 
-#define PKT_SIZE 1016
+#define MAX_PKT 1500
+#define MAX_FLOWS 256
+#define MAX_BATCH 64
+#define LOAD_MAGIC 0x4c4f4144 /* "LOAD" */
+
+/* The start of every packet; the rest is padding */
+struct load_header
+{
+  uint32_t magic;
+  uint32_t flow;
+  uint64_t seqno;
+  uint64_t sent_ns; /* CLOCK_REALTIME */
+};
+
+struct flow
+{
+  int sock;
+  struct sockaddr_in to;
+  uint64_t seqno;
+  uint64_t next_ns; /* when the next packet is due */
+  uint64_t bytes, errors;
+};
 
-/***************************************/
-//you may need to change these configurations according to relayer's config.xml
-char* host_name = (char*)"linux25";//relayer's host name
-short int sender_port = 10000;     //this sender's sending port
-short int relayer_port = 50001;    //relayer's listening port
-/***************************************/
+static int min_size = 1016, max_size = 1016, imix = 0;
+static uint64_t rng = 88172645463325252ULL;
 
-int main()
+static uint64_t now_ns(clockid_t id)
 {
-  int udpsock = socket(AF_INET,SOCK_DGRAM,0);
-  if (udpsock<0)
-  {
-     printf("ERROR: opening UDP socket\n");
-    return 0;
-  }
-  struct sockaddr_in l_s_i;
-  l_s_i.sin_family=AF_INET;
-  l_s_i.sin_addr.s_addr=INADDR_ANY;
-  l_s_i.sin_port=htons(sender_port);
-  if (bind(udpsock, (struct sockaddr *)&(l_s_i), sizeof(struct sockaddr_in))<0)
-  {
-    printf("ERROR: UDP Binding error\n");
-    return 0;
-  }
-  
-  struct sockaddr_in r_s_i;
-  r_s_i.sin_family=AF_INET;
-  struct hostent *address = gethostbyname(host_name);
-  if(address)
-  {
-    memcpy(&r_s_i.sin_addr , address->h_addr, address->h_length);
-    r_s_i.sin_port=htons(relayer_port);
-  }
-  else
-  {
-    printf("ERROR: UDP INIT error\n");
-    return 0;
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t xorshift()
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+static int next_size()
+{
+  if (imix)
+  {
+    int r = xorshift() % 12;
+    return r < 7 ? 64 : r < 11 ? 576 : 1500;
   }
+  return min_size + xorshift() % (max_size - min_size + 1);
+}
+
+static void usage(const char* progname)
+{
+  fprintf(stderr, "usage: %s [-r kb/s] [-s sizes] [-n flows] [-t seconds] [-b batch]\n"
+      "       [-p port] [-k] host:port\n", progname);
+  exit(1);
+}
 
-  char sendbuf[PKT_SIZE];
-  while(1)
+static int parse_sizes(const char* arg)
+{
+  if (!strcmp(arg, "imix"))
   {
-    if(sendto(udpsock, sendbuf, PKT_SIZE, 0, (struct sockaddr *)&r_s_i, sizeof(struct sockaddr_in))<0)
-    {
-      printf("Error in loop \n");
-      continue;
+    imix = 1;
+    return 0;
+  }
+  if (sscanf(arg, "%d-%d", &min_size, &max_size) != 2)
+    max_size = min_size = atoi(arg);
+  return min_size < (int) sizeof(struct load_header) || max_size > MAX_PKT
+    || min_size > max_size ? -1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+  static struct flow flows[MAX_FLOWS];
+  static char bufs[MAX_BATCH][MAX_PKT];
+  double rate_kbps = 0, seconds = 30;
+  int nflows = 1, batch = 16, local_port = 0, spread = 0;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "r:s:n:t:b:p:k")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r': rate_kbps = atof(optarg); break;
+    case 's':
+      if (parse_sizes(optarg) < 0)
+      {
+        fprintf(stderr, "sizes must be from %d to %d bytes\n",
+            (int) sizeof(struct load_header), MAX_PKT);
+        return 1;
+      }
+      break;
+    case 'n': nflows = atoi(optarg); break;
+    case 't': seconds = atof(optarg); break;
+    case 'b': batch = atoi(optarg); break;
+    case 'p': local_port = atoi(optarg); break;
+    case 'k': spread = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind + 1 != argc || nflows < 1 || nflows > MAX_FLOWS || batch < 1
+      || batch > MAX_BATCH || rate_kbps < 0 || seconds <= 0)
+    usage(argv[0]);
+
+  char host[256];
+  snprintf(host, sizeof(host), "%s", argv[optind]);
+  char* colon = strrchr(host, ':');
+  if (!colon)
+    usage(argv[0]);
+  *colon = '\0';
+  int port = atoi(colon + 1);
+  struct addrinfo hints, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int err = getaddrinfo(host, NULL, &hints, &ai);
+  if (err)
+  {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+    return 1;
+  }
+
+  uint64_t start = now_ns(CLOCK_MONOTONIC);
+  for (i = 0; i < nflows; i++)
+  {
+    struct flow* f = &flows[i];
+    int size = 4 << 20;
+    f->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (f->sock < 0)
+    {
+      perror("socket");
+      return 1;
     }
+    setsockopt(f->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (local_port)
+    {
+      struct sockaddr_in l;
+      memset(&l, 0, sizeof(l));
+      l.sin_family = AF_INET;
+      l.sin_addr.s_addr = INADDR_ANY;
+      l.sin_port = htons(local_port + i);
+      if (bind(f->sock, (struct sockaddr*) &l, sizeof(l)) < 0)
+      {
+        perror("bind");
+        return 1;
+      }
+    }
+    memcpy(&f->to, ai->ai_addr, sizeof(f->to));
+    f->to.sin_port = htons(port + (spread ? i : 0));
+    /* Spread the flows' first packets over the first gap */
+    f->next_ns = start + (uint64_t) i * 1000000 / nflows;
+  }
+  freeaddrinfo(ai);
+
+  uint64_t end = start + (uint64_t) (seconds * 1e9);
+  for (;;)
+  {
+    uint64_t now = now_ns(CLOCK_MONOTONIC), next = end;
+    if (now >= end)
+      break;
+    for (i = 0; i < nflows; i++)
+    {
+      struct flow* f = &flows[i];
+      struct mmsghdr msgs[MAX_BATCH];
+      struct iovec iov[MAX_BATCH];
+      int n = 0;
+
+      /* Everything due by now, up to a batch */
+      while (n < batch && (rate_kbps == 0 || f->next_ns <= now))
+      {
+        struct load_header* h = (struct load_header*) bufs[n];
+        int size = next_size();
+        h->magic = htonl(LOAD_MAGIC);
+        h->flow = htonl(i);
+        h->seqno = htobe64(f->seqno + n);
+        h->sent_ns = htobe64(now_ns(CLOCK_REALTIME));
+        iov[n].iov_base = bufs[n];
+        iov[n].iov_len = size;
+        memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+        msgs[n].msg_hdr.msg_name = &f->to;
+        msgs[n].msg_hdr.msg_namelen = sizeof(f->to);
+        msgs[n].msg_hdr.msg_iov = &iov[n];
+        msgs[n].msg_hdr.msg_iovlen = 1;
+        if (rate_kbps > 0)
+          f->next_ns += (uint64_t) (size * 8e6 / rate_kbps);
+        n++;
+      }
+      if (n)
+      {
+        /* Packets the kernel refuses are lost, and the receiver sees
+         * the gap in the seqnos */
+        int sent = sendmmsg(f->sock, msgs, n, 0);
+        if (sent < 0)
+          sent = 0;
+        f->errors += n - sent;
+        for (int j = 0; j < sent; j++)
+          f->bytes += iov[j].iov_len;
+        f->seqno += n;
+      }
+      if (rate_kbps > 0 && f->next_ns < next)
+        next = f->next_ns;
+    }
+    if (rate_kbps > 0 && next > now)
+    {
+      struct timespec ts;
+      ts.tv_sec = next / 1000000000;
+      ts.tv_nsec = next % 1000000000;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+  }
+
+  double elapsed = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+  uint64_t total = 0;
+  for (i = 0; i < nflows; i++)
+  {
+    struct flow* f = &flows[i];
+    printf("flow %d: %llu packets, %.1f kb/s", i, (unsigned long long) f->seqno,
+        f->bytes * 8 / elapsed / 1000);
+    if (f->errors)
+      printf(", %llu send errors", (unsigned long long) f->errors);
+    printf("\n");
+    total += f->bytes;
   }
+  printf("sent %.1f kb/s in %.1f s\n", total * 8 / elapsed / 1000, elapsed);
+  return 0;
 }
@@ -0,0 +1,1058 @@
+/*
+ * relay: link emulator for reliable, built from source.
+ *
+ *   relay [-s] [-o stats.csv [-i ms]] [config.xml]
+ *
+ * relay reads the relayer's config.xml and forwards the UDP traffic of
+ * every sender/receiver pair through an emulated link, one per
+ * direction: a bottleneck of <bandwidth> kb/s with a queue of
+ * <buffer_size> packets, then <propagation_delay> ms of wire.  Packets
+ * sent to a pair's sender dst are relayed to the receiver src, and
+ * packets sent to its receiver dst to the sender src, from the socket
+ * the other side sends to.
+ *
+ * On top of the relayer's settings, config.xml may choose the queue
+ * discipline and its parameters:
+ *
+ *   <queue>droptail</queue>		or red or codel
+ *   <red_min_threshold>, <red_max_threshold>	packets, by default a
+ *					quarter and three quarters of the buffer
+ *   <red_max_probability>		default 0.1
+ *   <codel_target>, <codel_interval>	ms, default 5 and 100
+ *
+ * Instead of a constant bandwidth, a direction may follow a packet
+ * delivery trace in the format of Mahimahi: one line per opportunity to
+ * deliver TRACE_MTU bytes, giving its time in ms; the trace repeats when
+ * it runs out.  Its delay and loss may follow a schedule: lines of
+ * "time_ms delay_ms loss", each in effect from its time on.  Uplink is
+ * from the senders to the receivers:
+ *
+ *   <uplink_trace>, <downlink_trace>		trace files
+ *   <uplink_schedule>, <downlink_schedule>	schedule files
+ *
+ * measure_bandwidth's receiver records traces in this format.
+ *
+ * With <shared_bottleneck>1</shared_bottleneck> the pairs compete: the
+ * uplinks of all pairs share one bottleneck and its queue, and so do
+ * the downlinks, and only the wire is each pair's own.  A pair may have
+ * its own <propagation_delay>, which gives competing flows different
+ * RTTs.
+ *
+ * <CPU_frequency> is not needed and ignored.  With <enable_log> (or -s)
+ * relay prints the rates, queue lengths and drops of every link once a
+ * second, instead of a line per packet.  -o writes them as CSV every
+ * -i ms (default 100) instead, for scripts: one line per link with the
+ * CLOCK_MONOTONIC time in seconds, the pair, the direction, the bytes
+ * delivered, the queue length at the end of the interval and its
+ * maximum during it, and the drops.  With a shared bottleneck the queue
+ * is the shared one.
+ *
+ * Sockets are read and written in batches with recvmmsg and sendmmsg,
+ * and relay sleeps in ppoll with nanosecond timeouts, spinning for the
+ * last few microseconds before a packet is due.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define MAX_PACKET 2048
+#define BATCH 64
+#define SPIN_NS 50000		/* spin instead of sleeping this close */
+
+#define QUEUE_DROPTAIL 0
+#define QUEUE_RED 1
+#define QUEUE_CODEL 2
+
+#define RED_WEIGHT 0.002
+
+#define TRACE_MTU 1500
+
+/* A packet delivery trace, ms since its start, repeating every period */
+struct trace {
+	uint32_t *ms;
+	int n;
+	uint64_t period_ns;
+};
+
+struct schedule_step {
+	uint64_t at_ns;
+	uint64_t delay_ns;
+	double loss;
+};
+
+struct schedule {
+	struct schedule_step *steps;
+	int n;
+};
+
+struct packet {
+	struct packet *next;
+	struct link *link;		/* whose wire it goes on */
+	uint64_t arrival_ns;
+	uint64_t due_ns;		/* end of serialization, then of the wire */
+	int len;
+	char data[MAX_PACKET];
+};
+
+/* A FIFO of packets */
+struct fifo {
+	struct packet *head, *tail;
+	int len;
+};
+
+/* One direction of a pair */
+struct link {
+	int rfd, wfd;			/* socket we read from and write to */
+	struct sockaddr_storage to;
+	socklen_t tolen;
+	const char *name;
+	uint64_t delay_ns;		/* of the wire, unless scheduled */
+
+	/* Where packets wait for the bottleneck: the link itself, or the
+	 * bottleneck it shares with the other pairs */
+	struct link *bottleneck;
+	struct fifo queue;		/* waiting for or in serialization */
+	struct fifo wire;		/* propagating */
+	uint64_t link_free_ns;		/* when the packet in service is done */
+
+	/* Trace driven capacity: the start of the current round of the
+	 * trace and the next opportunity in it */
+	const struct trace *trace;
+	uint64_t trace_round_ns;
+	int trace_next;
+
+	/* Delay and loss over time; the step in effect */
+	const struct schedule *schedule;
+	int step;
+
+	/* RED */
+	double avg;
+	int count;
+
+	/* CoDel (RFC 8289) */
+	uint64_t first_above_ns;
+	uint64_t drop_next_ns;
+	uint32_t drop_count;
+	uint32_t last_count;
+	int dropping;
+
+	/* For the log */
+	uint64_t bytes_out, packets_in, drops;
+	int queue_max;
+};
+
+struct config {
+	uint64_t bandwidth_kbps;
+	uint64_t delay_ns;
+	int buffer;
+	int log;
+	int queue;
+	int shared;
+	double red_min, red_max, red_maxp;
+	uint64_t codel_target_ns, codel_interval_ns;
+};
+
+static struct config cfg;
+static struct trace *uplink_trace, *downlink_trace;
+static struct schedule *uplink_schedule, *downlink_schedule;
+static uint64_t start_ns;
+static struct link *links;
+static int nlinks;
+static struct link shared_up, shared_down;
+static FILE *stats;
+static uint64_t stats_ns = 100000000;
+static struct packet *free_packets;
+static char *progname;
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+xmalloc (size_t n)
+{
+	void *p = malloc (n);
+	if (!p) {
+		perror ("malloc");
+		exit (1);
+	}
+	return p;
+}
+
+static struct packet *
+packet_get (void)
+{
+	struct packet *p = free_packets;
+	if (p)
+		free_packets = p->next;
+	else
+		p = xmalloc (sizeof (*p));
+	p->next = NULL;
+	return p;
+}
+
+static void
+packet_put (struct packet *p)
+{
+	p->next = free_packets;
+	free_packets = p;
+}
+
+static void
+fifo_push (struct fifo *f, struct packet *p)
+{
+	p->next = NULL;
+	if (f->tail)
+		f->tail->next = p;
+	else
+		f->head = p;
+	f->tail = p;
+	f->len++;
+}
+
+static struct packet *
+fifo_pop (struct fifo *f)
+{
+	struct packet *p = f->head;
+	f->head = p->next;
+	if (!f->head)
+		f->tail = NULL;
+	f->len--;
+	return p;
+}
+
+/* ---- config.xml ---- */
+
+/* The text between <tag> and </tag> in [s, end), or NULL */
+static const char *
+xml_find (const char *s, const char *end, const char *tag, const char **tag_end)
+{
+	char open[64], close[64];
+	const char *a, *b;
+
+	snprintf (open, sizeof (open), "<%s>", tag);
+	snprintf (close, sizeof (close), "</%s>", tag);
+	a = memmem (s, end - s, open, strlen (open));
+	if (!a)
+		return NULL;
+	a += strlen (open);
+	b = memmem (a, end - a, close, strlen (close));
+	if (!b)
+		return NULL;
+	*tag_end = b;
+	return a;
+}
+
+static int
+xml_string (const char *s, const char *end, const char *tag, char *buf,
+		size_t size)
+{
+	const char *tag_end, *a = xml_find (s, end, tag, &tag_end);
+	size_t n;
+
+	if (!a)
+		return 0;
+	while (a < tag_end && (*a == ' ' || *a == '\t' || *a == '\n' || *a == '\r'))
+		a++;
+	while (tag_end > a && (tag_end[-1] == ' ' || tag_end[-1] == '\t'
+					|| tag_end[-1] == '\n' || tag_end[-1] == '\r'))
+		tag_end--;
+	n = tag_end - a < (long) size - 1 ? (size_t) (tag_end - a) : size - 1;
+	memcpy (buf, a, n);
+	buf[n] = '\0';
+	return 1;
+}
+
+static double
+xml_number (const char *s, const char *end, const char *tag, double def)
+{
+	char buf[64];
+	if (!xml_string (s, end, tag, buf, sizeof (buf)))
+		return def;
+	return atof (buf);
+}
+
+/* Blank out <!-- comments -->, which may hide whole pairs */
+static void
+xml_strip_comments (char *s)
+{
+	char *a, *b;
+	while ((a = strstr (s, "<!--"))) {
+		b = strstr (a, "-->");
+		if (!b) {
+			*a = '\0';
+			return;
+		}
+		memset (a, ' ', b + 3 - a);
+		s = b + 3;
+	}
+}
+
+static int
+resolve (const char *hostport, struct sockaddr_storage *ss, socklen_t *len)
+{
+	char host[256], *port;
+	struct addrinfo hints, *ai;
+	int err;
+
+	snprintf (host, sizeof (host), "%s", hostport);
+	port = strrchr (host, ':');
+	if (!port) {
+		fprintf (stderr, "%s: expected host:port, not %s\n", progname, hostport);
+		return -1;
+	}
+	*port++ = '\0';
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	err = getaddrinfo (host, port, &hints, &ai);
+	if (err) {
+		fprintf (stderr, "%s: %s: %s\n", progname, hostport, gai_strerror (err));
+		return -1;
+	}
+	memcpy (ss, ai->ai_addr, ai->ai_addrlen);
+	*len = ai->ai_addrlen;
+	freeaddrinfo (ai);
+	return 0;
+}
+
+/* A nonblocking socket on the port of hostport, on every address: the
+ * host in the config is this machine as the peers know it */
+static int
+listen_on (const char *hostport)
+{
+	const char *port = strrchr (hostport, ':');
+	struct sockaddr_in sin;
+	int fd, size = 4 << 20;
+
+	if (!port) {
+		fprintf (stderr, "%s: expected host:port, not %s\n", progname, hostport);
+		return -1;
+	}
+	fd = socket (AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror ("socket");
+		return -1;
+	}
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons (atoi (port + 1));
+	sin.sin_addr.s_addr = htonl (INADDR_ANY);
+	if (bind (fd, (struct sockaddr *) &sin, sizeof (sin)) < 0) {
+		perror (hostport);
+		close (fd);
+		return -1;
+	}
+	setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+	setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static struct trace *
+read_trace (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	struct trace *t;
+	unsigned long ms;
+	int size = 1024;
+
+	if (!f) {
+		perror (path);
+		return NULL;
+	}
+	t = xmalloc (sizeof (*t));
+	t->ms = xmalloc (size * sizeof (*t->ms));
+	t->n = 0;
+	while (fscanf (f, "%lu", &ms) == 1) {
+		if (t->n && ms < t->ms[t->n - 1]) {
+			fprintf (stderr, "%s: %s: times go backwards at line %d\n",
+					progname, path, t->n + 1);
+			fclose (f);
+			return NULL;
+		}
+		if (t->n == size) {
+			size *= 2;
+			t->ms = realloc (t->ms, size * sizeof (*t->ms));
+			if (!t->ms) {
+				perror ("realloc");
+				exit (1);
+			}
+		}
+		t->ms[t->n++] = ms;
+	}
+	fclose (f);
+	if (!t->n || !t->ms[t->n - 1]) {
+		fprintf (stderr, "%s: %s: empty trace\n", progname, path);
+		return NULL;
+	}
+	t->period_ns = (uint64_t) t->ms[t->n - 1] * 1000000;
+	return t;
+}
+
+static struct schedule *
+read_schedule (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	struct schedule *sc;
+	double at, delay, loss;
+	int size = 64;
+
+	if (!f) {
+		perror (path);
+		return NULL;
+	}
+	sc = xmalloc (sizeof (*sc));
+	sc->steps = xmalloc (size * sizeof (*sc->steps));
+	sc->n = 0;
+	while (fscanf (f, "%lf %lf %lf", &at, &delay, &loss) == 3) {
+		if (delay < 0 || loss < 0 || loss > 1
+				|| (sc->n && at * 1e6 < sc->steps[sc->n - 1].at_ns)) {
+			fprintf (stderr, "%s: %s: bad step at line %d\n", progname, path,
+					sc->n + 1);
+			fclose (f);
+			return NULL;
+		}
+		if (sc->n == size) {
+			size *= 2;
+			sc->steps = realloc (sc->steps, size * sizeof (*sc->steps));
+			if (!sc->steps) {
+				perror ("realloc");
+				exit (1);
+			}
+		}
+		sc->steps[sc->n].at_ns = at * 1e6;
+		sc->steps[sc->n].delay_ns = delay * 1e6;
+		sc->steps[sc->n].loss = loss;
+		sc->n++;
+	}
+	fclose (f);
+	if (!sc->n) {
+		fprintf (stderr, "%s: %s: empty schedule\n", progname, path);
+		return NULL;
+	}
+	return sc;
+}
+
+static int
+read_config (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	char *text, *end;
+	const char *p, *pair, *pair_end, *head_end;
+	char queue[32], s_src[256], s_dst[256], r_src[256], r_dst[256];
+	char file[1024];
+	long size;
+	int npairs = 0;
+
+	if (!f) {
+		perror (path);
+		return -1;
+	}
+	fseek (f, 0, SEEK_END);
+	size = ftell (f);
+	rewind (f);
+	text = xmalloc (size + 1);
+	if (fread (text, 1, size, f) != (size_t) size) {
+		perror (path);
+		fclose (f);
+		return -1;
+	}
+	fclose (f);
+	text[size] = '\0';
+	xml_strip_comments (text);
+	end = text + strlen (text);
+	/* The settings of the whole relay come before the pairs, which may
+	 * have some of their own */
+	head_end = strstr (text, "<pairs>");
+	if (!head_end)
+		head_end = end;
+
+	cfg.bandwidth_kbps = xml_number (text, head_end, "bandwidth", 10000);
+	cfg.delay_ns = xml_number (text, head_end, "propagation_delay", 0) * 1e6;
+	cfg.buffer = xml_number (text, head_end, "buffer_size", 25);
+	cfg.log |= xml_number (text, head_end, "enable_log", 0) != 0;
+	cfg.shared = xml_number (text, head_end, "shared_bottleneck", 0) != 0;
+	cfg.queue = QUEUE_DROPTAIL;
+	if (xml_string (text, head_end, "queue", queue, sizeof (queue))) {
+		if (!strcmp (queue, "red"))
+			cfg.queue = QUEUE_RED;
+		else if (!strcmp (queue, "codel"))
+			cfg.queue = QUEUE_CODEL;
+		else if (strcmp (queue, "droptail")) {
+			fprintf (stderr, "%s: unknown queue %s\n", progname, queue);
+			return -1;
+		}
+	}
+	cfg.red_min = xml_number (text, head_end, "red_min_threshold", cfg.buffer / 4.0);
+	cfg.red_max = xml_number (text, head_end, "red_max_threshold",
+			3 * cfg.buffer / 4.0);
+	cfg.red_maxp = xml_number (text, head_end, "red_max_probability", 0.1);
+	cfg.codel_target_ns = xml_number (text, head_end, "codel_target", 5) * 1e6;
+	cfg.codel_interval_ns = xml_number (text, head_end, "codel_interval", 100) * 1e6;
+	if (xml_string (text, head_end, "uplink_trace", file, sizeof (file))
+			&& !(uplink_trace = read_trace (file)))
+		return -1;
+	if (xml_string (text, head_end, "downlink_trace", file, sizeof (file))
+			&& !(downlink_trace = read_trace (file)))
+		return -1;
+	if (xml_string (text, head_end, "uplink_schedule", file, sizeof (file))
+			&& !(uplink_schedule = read_schedule (file)))
+		return -1;
+	if (xml_string (text, head_end, "downlink_schedule", file, sizeof (file))
+			&& !(downlink_schedule = read_schedule (file)))
+		return -1;
+	if (cfg.bandwidth_kbps < 1 || cfg.buffer < 1 || cfg.red_max <= cfg.red_min) {
+		fprintf (stderr, "%s: bad bandwidth, buffer_size or RED thresholds\n",
+				progname);
+		return -1;
+	}
+
+	for (p = text; (pair = xml_find (p, end, "pair", &pair_end)); p = pair_end)
+		npairs++;
+	if (!npairs) {
+		fprintf (stderr, "%s: no pairs in %s\n", progname, path);
+		return -1;
+	}
+	links = xmalloc (2 * npairs * sizeof (*links));
+	memset (links, 0, 2 * npairs * sizeof (*links));
+	shared_up.name = "uplink";
+	shared_up.trace = uplink_trace;
+	shared_down.name = "downlink";
+	shared_down.trace = downlink_trace;
+	for (p = text; (pair = xml_find (p, end, "pair", &pair_end)); p = pair_end) {
+		const char *s, *s_end, *r, *r_end;
+		struct link *up = &links[nlinks++], *down = &links[nlinks++];
+		char name[600];
+		int sfd, rfd;
+
+		if (!(s = xml_find (pair, pair_end, "sender", &s_end))
+				|| !(r = xml_find (pair, pair_end, "receiver", &r_end))
+				|| !xml_string (s, s_end, "src", s_src, sizeof (s_src))
+				|| !xml_string (s, s_end, "dst", s_dst, sizeof (s_dst))
+				|| !xml_string (r, r_end, "src", r_src, sizeof (r_src))
+				|| !xml_string (r, r_end, "dst", r_dst, sizeof (r_dst))) {
+			fprintf (stderr, "%s: incomplete pair in %s\n", progname, path);
+			return -1;
+		}
+		if ((sfd = listen_on (s_dst)) < 0 || (rfd = listen_on (r_dst)) < 0)
+			return -1;
+		up->rfd = sfd;
+		up->wfd = rfd;
+		if (resolve (r_src, &up->to, &up->tolen) < 0)
+			return -1;
+		snprintf (name, sizeof (name), "%s->%s", s_src, r_src);
+		up->name = strdup (name);
+		up->delay_ns = xml_number (pair, pair_end, "propagation_delay",
+				cfg.delay_ns / 1e6) * 1e6;
+		up->bottleneck = cfg.shared ? &shared_up : up;
+		up->trace = uplink_trace;
+		up->schedule = uplink_schedule;
+		down->rfd = rfd;
+		down->wfd = sfd;
+		if (resolve (s_src, &down->to, &down->tolen) < 0)
+			return -1;
+		snprintf (name, sizeof (name), "%s->%s", r_src, s_src);
+		down->name = strdup (name);
+		down->delay_ns = up->delay_ns;
+		down->bottleneck = cfg.shared ? &shared_down : down;
+		down->trace = downlink_trace;
+		down->schedule = downlink_schedule;
+	}
+	free (text);
+	return 0;
+}
+
+/* ---- queue disciplines ---- */
+
+/* Whether an arriving packet gets in */
+static int
+admit (struct link *l)
+{
+	if (l->queue.len >= cfg.buffer)
+		return 0;
+	if (cfg.queue != QUEUE_RED)
+		return 1;
+
+	l->avg = (1 - RED_WEIGHT) * l->avg + RED_WEIGHT * l->queue.len;
+	if (l->avg < cfg.red_min) {
+		l->count = -1;
+		return 1;
+	}
+	if (l->avg >= cfg.red_max) {
+		l->count = 0;
+		return 0;
+	}
+	l->count++;
+	{
+		double pb = cfg.red_maxp * (l->avg - cfg.red_min)
+			/ (cfg.red_max - cfg.red_min);
+		double pa = l->count * pb < 1 ? pb / (1 - l->count * pb) : 1;
+		if (drand48 () < pa) {
+			l->count = 0;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static uint64_t
+codel_control_law (uint64_t t, uint32_t count)
+{
+	return t + cfg.codel_interval_ns / sqrt (count);
+}
+
+/* CoDel's verdict on the packet leaving the queue at now: drop it? */
+static int
+codel_drop (struct link *l, struct packet *p, uint64_t now)
+{
+	uint64_t sojourn = now - p->arrival_ns;
+	int ok_to_drop = 0;
+
+	if (sojourn < cfg.codel_target_ns || l->queue.len <= 1)
+		l->first_above_ns = 0;
+	else if (!l->first_above_ns)
+		l->first_above_ns = now + cfg.codel_interval_ns;
+	else if (now >= l->first_above_ns)
+		ok_to_drop = 1;
+
+	if (l->dropping) {
+		if (!ok_to_drop) {
+			l->dropping = 0;
+			return 0;
+		}
+		if (now >= l->drop_next_ns) {
+			l->drop_count++;
+			l->drop_next_ns = codel_control_law (l->drop_next_ns, l->drop_count);
+			return 1;
+		}
+		return 0;
+	}
+	if (ok_to_drop) {
+		uint32_t delta = l->drop_count - l->last_count;
+		l->dropping = 1;
+		l->drop_count = delta > 1 && now - l->drop_next_ns
+			< 16 * cfg.codel_interval_ns ? delta : 1;
+		l->drop_next_ns = codel_control_law (now, l->drop_count);
+		l->last_count = l->drop_count;
+		return 1;
+	}
+	return 0;
+}
+
+/* ---- forwarding ---- */
+
+/* The schedule step in effect at now, or NULL */
+static const struct schedule_step *
+schedule_step (struct link *l, uint64_t now)
+{
+	const struct schedule *sc = l->schedule;
+
+	if (!sc || now - start_ns < sc->steps[0].at_ns)
+		return NULL;
+	while (l->step + 1 < sc->n && sc->steps[l->step + 1].at_ns <= now - start_ns)
+		l->step++;
+	return &sc->steps[l->step];
+}
+
+static uint64_t
+propagation_ns (struct link *l, uint64_t now)
+{
+	const struct schedule_step *st = schedule_step (l, now);
+	return st ? st->delay_ns : l->delay_ns;
+}
+
+/* Put a packet that made it through the bottleneck at time t on the
+ * wire.  A shorter delay must not let it overtake the packets ahead. */
+static void
+to_wire (struct link *l, struct packet *p, uint64_t t)
+{
+	p->due_ns = t + propagation_ns (l, t);
+	if (l->wire.len && p->due_ns < l->wire.tail->due_ns)
+		p->due_ns = l->wire.tail->due_ns;
+	fifo_push (&l->wire, p);
+}
+
+static uint64_t
+trace_opportunity (struct link *l)
+{
+	return l->trace_round_ns
+		+ (uint64_t) l->trace->ms[l->trace_next] * 1000000;
+}
+
+static void
+trace_advance (struct link *l)
+{
+	if (++l->trace_next == l->trace->n) {
+		l->trace_next = 0;
+		l->trace_round_ns += l->trace->period_ns;
+	}
+}
+
+/* Skip the opportunities before now, which an empty queue wasted */
+static void
+trace_seek (struct link *l, uint64_t now)
+{
+	const struct trace *t = l->trace;
+	uint64_t offset = now - start_ns;
+	uint64_t in_round = offset % t->period_ns;
+	int lo = 0, hi = t->n;
+
+	l->trace_round_ns = now - in_round;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if ((uint64_t) t->ms[mid] * 1000000 < in_round)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	l->trace_next = lo;
+	if (lo == t->n) {
+		l->trace_next = 0;
+		l->trace_round_ns += t->period_ns;
+	}
+}
+
+static uint64_t
+serialization_ns (int len)
+{
+	return (uint64_t) len * 8 * 1000000 / cfg.bandwidth_kbps;
+}
+
+/* Read one batch; the link gets served before the next */
+static void
+receive (struct link *l, uint64_t now)
+{
+	struct link *b = l->bottleneck;
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+	struct packet *pkts[BATCH];
+	int i, n;
+
+	for (i = 0; i < BATCH; i++) {
+		pkts[i] = packet_get ();
+		iov[i].iov_base = pkts[i]->data;
+		iov[i].iov_len = MAX_PACKET;
+		memset (&msgs[i].msg_hdr, 0, sizeof (msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	n = recvmmsg (l->rfd, msgs, BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0 && errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED)
+		perror ("recvmmsg");
+	for (i = 0; i < n; i++) {
+		struct packet *p = pkts[i];
+		const struct schedule_step *st = schedule_step (l, now);
+		p->link = l;
+		p->len = msgs[i].msg_len;
+		p->arrival_ns = now;
+		l->packets_in++;
+		if ((st && st->loss > 0 && drand48 () < st->loss) || !admit (b)) {
+			l->drops++;
+			if (b != l)
+				b->drops++;
+			packet_put (p);
+			continue;
+		}
+		/* An idle link starts on it right away */
+		if (!b->queue.len && b->trace)
+			trace_seek (b, now);
+		else if (!b->queue.len) {
+			if (b->link_free_ns < now)
+				b->link_free_ns = now;
+			b->link_free_ns += serialization_ns (p->len);
+			p->due_ns = b->link_free_ns;
+		}
+		fifo_push (&b->queue, p);
+		if (b->queue.len > b->queue_max)
+			b->queue_max = b->queue.len;
+	}
+	for (i = n < 0 ? 0 : n; i < BATCH; i++)
+		packet_put (pkts[i]);
+}
+
+/* Move packets through a trace driven bottleneck onto the wires.  Each
+ * opportunity takes as many packets as fit in TRACE_MTU bytes, or one
+ * larger packet. */
+static void
+serve_trace (struct link *l, uint64_t now)
+{
+	uint64_t t;
+
+	while (l->queue.len && (t = trace_opportunity (l)) <= now) {
+		int budget = TRACE_MTU;
+		while (l->queue.len && l->queue.head->arrival_ns <= t
+				&& (l->queue.head->len <= budget || budget == TRACE_MTU)) {
+			struct packet *p = fifo_pop (&l->queue);
+			budget -= p->len;
+			if (cfg.queue == QUEUE_CODEL && codel_drop (l, p, t)) {
+				l->drops++;
+				if (p->link != l)
+					p->link->drops++;
+				packet_put (p);
+			}
+			else
+				to_wire (p->link, p, t);
+		}
+		trace_advance (l);
+	}
+}
+
+/* Move packets through the bottleneck l onto the wires of their links */
+static void
+serve (struct link *l, uint64_t now)
+{
+	if (l->trace) {
+		serve_trace (l, now);
+		return;
+	}
+	while (l->queue.len && l->queue.head->due_ns <= now) {
+		struct packet *p = fifo_pop (&l->queue);
+		uint64_t done = p->due_ns;
+
+		if (cfg.queue == QUEUE_CODEL && codel_drop (l, p, done)) {
+			l->drops++;
+			if (p->link != l)
+				p->link->drops++;
+			packet_put (p);
+		}
+		else
+			to_wire (p->link, p, done);
+		/* The next packet goes on the link when this one is done */
+		if (l->queue.len) {
+			struct packet *n = l->queue.head;
+			uint64_t start = done > n->arrival_ns ? done : n->arrival_ns;
+			n->due_ns = start + serialization_ns (n->len);
+			l->link_free_ns = n->due_ns;
+		}
+	}
+}
+
+static void
+transmit (struct link *l, uint64_t now)
+{
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+	struct packet *p;
+	int i, n, sent;
+
+	while (l->wire.len && l->wire.head->due_ns <= now) {
+		for (n = 0, p = l->wire.head; p && n < BATCH && p->due_ns <= now;
+				p = p->next, n++) {
+			iov[n].iov_base = p->data;
+			iov[n].iov_len = p->len;
+			memset (&msgs[n].msg_hdr, 0, sizeof (msgs[n].msg_hdr));
+			msgs[n].msg_hdr.msg_name = &l->to;
+			msgs[n].msg_hdr.msg_namelen = l->tolen;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+		sent = sendmmsg (l->wfd, msgs, n, MSG_DONTWAIT);
+		if (sent < 0) {
+			if (errno == EAGAIN)
+				return;
+			/* The peer is not up (yet); its packets are lost */
+			sent = 1;
+		}
+		for (i = 0; i < sent; i++) {
+			p = fifo_pop (&l->wire);
+			l->bytes_out += p->len;
+			packet_put (p);
+		}
+	}
+}
+
+static uint64_t
+queue_due (struct link *l, uint64_t next)
+{
+	if (l->queue.len) {
+		uint64_t due = l->trace ? trace_opportunity (l) : l->queue.head->due_ns;
+		if (due < next)
+			next = due;
+	}
+	return next;
+}
+
+static uint64_t
+next_event (uint64_t now)
+{
+	uint64_t next = now + 1000000000;
+	int i;
+
+	if (cfg.shared)
+		next = queue_due (&shared_down, queue_due (&shared_up, next));
+	for (i = 0; i < nlinks; i++) {
+		struct link *l = &links[i];
+		next = queue_due (l, next);
+		if (l->wire.len && l->wire.head->due_ns < next)
+			next = l->wire.head->due_ns;
+	}
+	return next;
+}
+
+static void
+print_log (uint64_t elapsed_ns)
+{
+	int i;
+
+	for (i = 0; i < nlinks; i++) {
+		struct link *l = &links[i];
+		fprintf (stderr, "%s: %.3f Mb/s, %llu packets in, queue %d, wire %d, "
+				"%llu dropped\n", l->name,
+				l->bytes_out * 8e3 / elapsed_ns,
+				(unsigned long long) l->packets_in, l->bottleneck->queue.len,
+				l->wire.len, (unsigned long long) l->drops);
+		l->bytes_out = l->packets_in = l->drops = 0;
+	}
+	if (cfg.shared)
+		for (i = 0; i < 2; i++) {
+			struct link *b = i ? &shared_down : &shared_up;
+			fprintf (stderr, "shared %s: queue %d, %llu dropped\n", b->name,
+					b->queue.len, (unsigned long long) b->drops);
+			b->drops = 0;
+		}
+}
+
+static void
+write_stats (uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < nlinks; i++) {
+		struct link *l = &links[i], *b = l->bottleneck;
+		fprintf (stats, "%.6f,%d,%s,%llu,%d,%d,%llu\n", now / 1e9, i / 2,
+				i % 2 ? "down" : "up", (unsigned long long) l->bytes_out,
+				b->queue.len, b->queue_max, (unsigned long long) l->drops);
+		l->bytes_out = l->drops = 0;
+	}
+	for (i = 0; i < nlinks; i++)
+		links[i].queue_max = links[i].queue.len;
+	shared_up.queue_max = shared_up.queue.len;
+	shared_down.queue_max = shared_down.queue.len;
+	fflush (stats);
+}
+
+static void
+usage (void)
+{
+	fprintf (stderr, "usage: %s [-s] [-o stats.csv [-i ms]] [config.xml]\n"
+			"       -s: print link statistics every second\n"
+			"       -o: write link statistics as CSV every -i ms\n", progname);
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct pollfd *fds;
+	const char *path = "config.xml";
+	uint64_t last_log, last_stats;
+	int i, opt;
+
+	progname = strrchr (argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+	while ((opt = getopt (argc, argv, "i:o:s")) != -1)
+		switch (opt) {
+		case 'i':
+			stats_ns = atof (optarg) * 1e6;
+			if (stats_ns < 1000000)
+				usage ();
+			break;
+		case 'o':
+			stats = fopen (optarg, "w");
+			if (!stats) {
+				perror (optarg);
+				exit (1);
+			}
+			fprintf (stats, "time,pair,dir,bytes,queue,queue_max,dropped\n");
+			break;
+		case 's':
+			cfg.log = 1;
+			break;
+		default:
+			usage ();
+		}
+	if (optind + 1 < argc)
+		usage ();
+	if (optind < argc)
+		path = argv[optind];
+	if (read_config (path) < 0)
+		exit (1);
+	/* Both reset the counters; the CSV wins */
+	if (stats)
+		cfg.log = 0;
+	signal (SIGPIPE, SIG_IGN);
+	srand48 (1);
+
+	fds = xmalloc (nlinks * sizeof (*fds));
+	for (i = 0; i < nlinks; i++) {
+		fds[i].fd = links[i].rfd;
+		fds[i].events = POLLIN;
+	}
+	fprintf (stderr, "%s: %d pairs, %llu kb/s, %.1f ms, %d packets %s%s\n",
+			progname, nlinks / 2, (unsigned long long) cfg.bandwidth_kbps,
+			cfg.delay_ns / 1e6, cfg.buffer,
+			cfg.queue == QUEUE_RED ? "RED"
+			: cfg.queue == QUEUE_CODEL ? "CoDel" : "drop-tail",
+			cfg.shared ? ", shared" : "");
+	if (uplink_trace || downlink_trace || uplink_schedule || downlink_schedule)
+		fprintf (stderr, "%s: uplink %s%s, downlink %s%s\n", progname,
+				uplink_trace ? "traced" : "constant",
+				uplink_schedule ? " with schedule" : "",
+				downlink_trace ? "traced" : "constant",
+				downlink_schedule ? " with schedule" : "");
+
+	start_ns = last_log = last_stats = now_ns ();
+	for (;;) {
+		uint64_t now = now_ns (), next = next_event (now);
+
+		if (stats && last_stats + stats_ns < next)
+			next = last_stats + stats_ns;
+		if (next > now + SPIN_NS) {
+			struct timespec ts;
+			uint64_t wait = next - now - SPIN_NS;
+			ts.tv_sec = wait / 1000000000;
+			ts.tv_nsec = wait % 1000000000;
+			if (ppoll (fds, nlinks, &ts, NULL) < 0 && errno != EINTR) {
+				perror ("ppoll");
+				exit (1);
+			}
+			now = now_ns ();
+		}
+		for (i = 0; i < nlinks; i++)
+			receive (&links[i], now);
+		if (cfg.shared) {
+			serve (&shared_up, now);
+			serve (&shared_down, now);
+		}
+		for (i = 0; i < nlinks; i++) {
+			serve (&links[i], now);
+			transmit (&links[i], now);
+		}
+		if (stats && now - last_stats >= stats_ns) {
+			write_stats (now);
+			last_stats += stats_ns;
+		}
+		if (cfg.log && now - last_log >= 1000000000) {
+			print_log (now - last_log);
+			last_log = now;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,299 @@
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#include "constants.h"
+
+/**
+ * Authenticated encryption of data packets.
+ *
+ * With -K keyfile on both ends, every data packet, EOF included, goes
+ * out sealed with AES-256-GCM: the payload is encrypted in place and
+ * followed by a AEAD_TAG_LENGTH byte tag, and the header after the
+ * checksum is associated data, so the tag covers the length, ackno,
+ * rwnd and seqno as well.  The checksum is taken over the sealed
+ * packet.  FEC works on sealed packets and carries their ackno and rwnd
+ * in its symbols, so what it rebuilds is opened like anything else.
+ *
+ * ACKs are sealed too, with the key of the direction they go in, as
+ * control packets of type AEAD_ACK: the header carries the ackno and
+ * rwnd, the payload a count of the ACKs sealed before, and all of it is
+ * associated data for a tag over an empty message.  Their nonces have
+ * the top bit set, so they never meet those of data packets.  Plain
+ * ACKs are dropped, and so is a sealed ACK whose count is not above
+ * that of the last one taken, so old ACKs cannot be replayed either.
+ * Hellos, replies and FEC control packets are not authenticated: forged
+ * ones can stop the handshake or waste parity, but neither changes what
+ * gets written out nor what the sender takes as delivered.
+ *
+ * The key file holds a secret both ends share; each connection derives
+ * its own keys from it at the handshake.  The hello and the reply each
+ * carry AEAD_SALT_LENGTH random bytes, and HKDF-SHA256 of the secret
+ * with both salts gives one key for each direction.  The sender sends
+ * no data until the reply has come, one round trip at the start, and
+ * gives up if no reply that grants encryption comes within
+ * HANDSHAKE_TIMEOUT_MS.  A receiver with a key drops every data packet
+ * that does not open, and refuses a sender without one.
+ *
+ * The nonce of a packet is its 64 bit seqno, which no two packets with
+ * different contents share.  A retransmission sends the same bytes
+ * again.
+ *
+ * The sender seals a burst of packets in one go before sending any of
+ * them.  OpenSSL has no call that seals several messages with different
+ * nonces, so the batch is a tight loop over one context whose key
+ * schedule and GHASH tables were set up once per connection.  OpenSSL
+ * picks AES-NI, VAES and carry-less multiply where the CPU has them.
+ */
+
+#define AEAD_TAG_LENGTH 16
+#define AEAD_SALT_LENGTH 16
+#define AEAD_KEY_LENGTH 32
+#define AEAD_BATCH 16
+#define AEAD_ACK 5
+
+/* The header after the checksum: len, ackno, rwnd, seqno */
+#define AEAD_AAD_OFFSET 2
+#define AEAD_AAD_LENGTH (DATA_PACKET_METADATA_LENGTH - AEAD_AAD_OFFSET)
+
+/**
+ * Payload of a sealed ACK, followed by the tag
+ */
+struct aead_ack {
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t count_high;	/* ACKs sealed before this one, in its direction */
+	uint32_t count_low;
+};
+
+typedef struct aead_state {
+	EVP_CIPHER_CTX* seal;		/* our direction */
+	EVP_CIPHER_CTX* open;		/* the peer's */
+	/**
+	 * Packets sealed and opened, and packets that did not open, for the
+	 * stats at the end
+	 */
+	uint64_t sealed;
+	uint64_t opened;
+	uint64_t rejected;
+	/**
+	 * ACKs sealed, which counts the ACK nonces, and the lowest count a
+	 * sealed ACK from the peer may have, which refuses replays
+	 */
+	uint64_t acks_sealed;
+	uint64_t next_ack_count;
+} aead_state;
+
+/**
+ * Derive the key for one direction; returns false on failure
+ */
+static bool aead_derive(const char* secret, int secret_length,
+		const uint8_t* salt, const char* label, uint8_t* key) {
+	size_t length = AEAD_KEY_LENGTH;
+	EVP_PKEY_CTX* kdf = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	bool ok = kdf
+			&& EVP_PKEY_derive_init(kdf) > 0
+			&& EVP_PKEY_CTX_set_hkdf_md(kdf, EVP_sha256()) > 0
+			&& EVP_PKEY_CTX_set1_hkdf_salt(kdf, salt, 2 * AEAD_SALT_LENGTH) > 0
+			&& EVP_PKEY_CTX_set1_hkdf_key(kdf, (const unsigned char*) secret,
+					secret_length) > 0
+			&& EVP_PKEY_CTX_add1_hkdf_info(kdf, (const unsigned char*) label,
+					strlen(label)) > 0
+			&& EVP_PKEY_derive(kdf, key, &length) > 0;
+	EVP_PKEY_CTX_free(kdf);
+	return ok;
+}
+
+static EVP_CIPHER_CTX* aead_context(const uint8_t* key, bool seal) {
+	EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+	if (ctx && (seal ? EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, NULL)
+			: EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, NULL)) > 0) {
+		return ctx;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	return NULL;
+}
+
+/**
+ * Fill a salt with random bytes
+ */
+void aead_salt(uint8_t* salt) {
+	if (RAND_bytes(salt, AEAD_SALT_LENGTH) != 1) {
+		fprintf(stderr, "%d: No random bytes for the salt\n", getpid());
+		abort();
+	}
+}
+
+void aead_destroy(aead_state* a) {
+	if (!a) {
+		return;
+	}
+	EVP_CIPHER_CTX_free(a->seal);
+	EVP_CIPHER_CTX_free(a->open);
+	free(a);
+}
+
+/**
+ * Set up the keys of a connection from the secret and the salts of the
+ * hello and the reply; returns NULL on failure
+ */
+aead_state* aead_create(const char* secret, int secret_length,
+		const uint8_t* sender_salt, const uint8_t* receiver_salt, bool sender) {
+	uint8_t salt[2 * AEAD_SALT_LENGTH];
+	uint8_t to_receiver[AEAD_KEY_LENGTH], to_sender[AEAD_KEY_LENGTH];
+	aead_state* a = (aead_state*) malloc(sizeof(aead_state));
+	memset(a, 0, sizeof(aead_state));
+	memcpy(salt, sender_salt, AEAD_SALT_LENGTH);
+	memcpy(salt + AEAD_SALT_LENGTH, receiver_salt, AEAD_SALT_LENGTH);
+	if (aead_derive(secret, secret_length, salt, "reliable to receiver", to_receiver)
+			&& aead_derive(secret, secret_length, salt, "reliable to sender", to_sender)) {
+		a->seal = aead_context(sender ? to_receiver : to_sender, true);
+		a->open = aead_context(sender ? to_sender : to_receiver, false);
+	}
+	OPENSSL_cleanse(to_receiver, sizeof(to_receiver));
+	OPENSSL_cleanse(to_sender, sizeof(to_sender));
+	if (!a->seal || !a->open) {
+		fprintf(stderr, "%d: Cannot set up the encryption keys\n", getpid());
+		aead_destroy(a);
+		return NULL;
+	}
+	return a;
+}
+
+static void aead_nonce(uint64_t seqno, uint8_t* nonce) {
+	int i;
+	memset(nonce, 0, 4);
+	for (i = 0; i < 8; i++) {
+		nonce[4 + i] = seqno >> (56 - 8 * i);
+	}
+}
+
+/**
+ * ACK nonces: the count, with the bit above the seqnos set
+ */
+static void aead_ack_nonce(uint64_t count, uint8_t* nonce) {
+	aead_nonce(count, nonce);
+	nonce[0] = 0x80;
+}
+
+/**
+ * Seal n packets, whose headers are filled in for their plaintext;
+ * seqnos holds their 64 bit seqnos.  Each gets AEAD_TAG_LENGTH longer.
+ */
+void aead_seal_batch(aead_state* a, packet_list** packets, const uint64_t* seqnos,
+		int n) {
+	PMU_SCOPE(PMU_AEAD);
+	int i, out;
+	for (i = 0; i < n; i++) {
+		packet_t* packet = packets[i]->packet;
+		int length = ntohs(packet->len) - DATA_PACKET_METADATA_LENGTH;
+		uint8_t nonce[12];
+		packet->len = htons(ntohs(packet->len) + AEAD_TAG_LENGTH);
+		aead_nonce(seqnos[i], nonce);
+		if (EVP_EncryptInit_ex(a->seal, NULL, NULL, NULL, nonce) <= 0
+				|| EVP_EncryptUpdate(a->seal, NULL, &out,
+						(uint8_t*) packet + AEAD_AAD_OFFSET, AEAD_AAD_LENGTH) <= 0
+				|| (length && EVP_EncryptUpdate(a->seal, (uint8_t*) packet->data, &out,
+						(uint8_t*) packet->data, length) <= 0)
+				|| EVP_EncryptFinal_ex(a->seal, (uint8_t*) packet->data + length, &out) <= 0
+				|| EVP_CIPHER_CTX_ctrl(a->seal, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LENGTH,
+						packet->data + length) <= 0) {
+			// sending it in the clear is not an option
+			fprintf(stderr, "%d: Cannot seal packet %d\n", getpid(), ntohl(packet->seqno));
+			abort();
+		}
+	}
+	a->sealed += n;
+}
+
+/**
+ * Open a sealed packet of len bytes in place; returns its length
+ * without the tag, or -1 if it is not authentic
+ */
+int aead_open(aead_state* a, packet_t* packet, int len, uint64_t seqno) {
+	PMU_SCOPE(PMU_AEAD);
+	int length = len - DATA_PACKET_METADATA_LENGTH - AEAD_TAG_LENGTH;
+	uint8_t nonce[12];
+	int out;
+	if (length < 0) {
+		a->rejected++;
+		return -1;
+	}
+	aead_nonce(seqno, nonce);
+	if (EVP_DecryptInit_ex(a->open, NULL, NULL, NULL, nonce) <= 0
+			|| EVP_DecryptUpdate(a->open, NULL, &out,
+					(uint8_t*) packet + AEAD_AAD_OFFSET, AEAD_AAD_LENGTH) <= 0
+			|| (length && EVP_DecryptUpdate(a->open, (uint8_t*) packet->data, &out,
+					(uint8_t*) packet->data, length) <= 0)
+			|| EVP_CIPHER_CTX_ctrl(a->open, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LENGTH,
+					packet->data + length) <= 0
+			|| EVP_DecryptFinal_ex(a->open, (uint8_t*) packet->data + length, &out) <= 0) {
+		a->rejected++;
+		return -1;
+	}
+	a->opened++;
+	packet->len = htons(len - AEAD_TAG_LENGTH);
+	return len - AEAD_TAG_LENGTH;
+}
+
+/**
+ * Fill in a sealed ACK; returns its length.  The checksum is left to
+ * the caller.
+ */
+int aead_seal_ack(aead_state* a, packet_t* packet, uint32_t ackno, uint32_t rwnd) {
+	struct aead_ack* ack = (struct aead_ack*) packet->data;
+	int length = DATA_PACKET_METADATA_LENGTH + sizeof(*ack) + AEAD_TAG_LENGTH;
+	uint8_t nonce[12];
+	uint8_t empty;
+	int out;
+	memset(packet, 0, length);
+	packet->len = htons(length);
+	packet->ackno = htonl(ackno);
+	packet->rwnd = htonl(rwnd);
+	ack->type = AEAD_ACK;
+	ack->count_high = htonl(a->acks_sealed >> 32);
+	ack->count_low = htonl(a->acks_sealed);
+	aead_ack_nonce(a->acks_sealed, nonce);
+	if (EVP_EncryptInit_ex(a->seal, NULL, NULL, NULL, nonce) <= 0
+			|| EVP_EncryptUpdate(a->seal, NULL, &out, (uint8_t*) packet + AEAD_AAD_OFFSET,
+					length - AEAD_TAG_LENGTH - AEAD_AAD_OFFSET) <= 0
+			|| EVP_EncryptFinal_ex(a->seal, &empty, &out) <= 0
+			|| EVP_CIPHER_CTX_ctrl(a->seal, EVP_CTRL_GCM_GET_TAG, AEAD_TAG_LENGTH,
+					packet->data + sizeof(*ack)) <= 0) {
+		fprintf(stderr, "%d: Cannot seal ACK %u\n", getpid(), ackno);
+		abort();
+	}
+	a->acks_sealed++;
+	return length;
+}
+
+/**
+ * Whether a control packet of type AEAD_ACK is an authentic ACK that
+ * came after the last one taken
+ */
+bool aead_open_ack(aead_state* a, packet_t* packet, int len) {
+	struct aead_ack* ack = (struct aead_ack*) packet->data;
+	uint8_t nonce[12];
+	uint8_t empty;
+	int out;
+	if (len != DATA_PACKET_METADATA_LENGTH + (int) sizeof(*ack) + AEAD_TAG_LENGTH) {
+		a->rejected++;
+		return false;
+	}
+	uint64_t count = (uint64_t) ntohl(ack->count_high) << 32 | ntohl(ack->count_low);
+	aead_ack_nonce(count, nonce);
+	if (count < a->next_ack_count
+			|| EVP_DecryptInit_ex(a->open, NULL, NULL, NULL, nonce) <= 0
+			|| EVP_DecryptUpdate(a->open, NULL, &out, (uint8_t*) packet + AEAD_AAD_OFFSET,
+					len - AEAD_TAG_LENGTH - AEAD_AAD_OFFSET) <= 0
+			|| EVP_CIPHER_CTX_ctrl(a->open, EVP_CTRL_GCM_SET_TAG, AEAD_TAG_LENGTH,
+					packet->data + sizeof(*ack)) <= 0
+			|| EVP_DecryptFinal_ex(a->open, &empty, &out) <= 0) {
+		a->rejected++;
+		return false;
+	}
+	a->next_ack_count = count + 1;
+	return true;
+}
@@ -0,0 +1,493 @@
+/*
+ * bench: goodput and latency of reliable over an emulated link.
+ *
+ *   bench [-n runs] [-s sizes] [-w windows] [-l losses] [-d delays]
+ *         [-b bandwidths] [-q queue] [-t timeout] [-o runs.csv]
+ *         [-p path/to/reliable] [-g]
+ *
+ * Every option but -n, -q, -t, -o and -p takes a comma separated list,
+ * and bench runs each combination -n times (default 5): sizes in bytes
+ * (k and m suffixes work), windows for -w, loss probabilities, one-way
+ * delays in ms and bandwidths in kb/s (0 for no limit).  The link is
+ * reliable's own emulator (-N), on both ends, so runs need no relayer
+ * and the same seeds give the same losses.  The queue is -q packets.
+ *
+ * For each run bench checks that the file arrived intact and measures
+ * the completion time, the goodput, the share of data packets the
+ * sender retransmitted, the CPU time of both ends and the sender's
+ * percentiles of the time from sending a packet to its ACK (reliable
+ * -L).  -o writes those as CSV, which benchcmp compares against a
+ * baseline.  On stdout goes one CSV line per combination with the mean of
+ * each measure and the half width of its 95% confidence interval.
+ *
+ * A run fails only when the data did not arrive intact.  The sender's
+ * exit status is reported on its own (sender_ok, sender_failed): the
+ * receiver closes once it has written the EOF, so when its last ACK is
+ * lost the sender retransmits into a closed port and exits 1 with
+ * everything delivered.
+ *
+ * With -g there are no files: the sender makes its data up and the
+ * receiver checks it as it arrives (reliable's synth: inputs and
+ * outputs), so the disk stays out of the numbers.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#define MAX_VALUES 32
+
+struct list {
+	double v[MAX_VALUES];
+	int n;
+};
+
+struct result {
+	int ok;
+	int sender_ok;
+	double completion_ms;
+	double goodput_mbps;
+	double retransmit_ratio;
+	double cpu_ms;
+	double ack_p50_us;
+	double ack_p99_us;
+};
+
+static char *progname;
+static char tmpdir[] = "/tmp/benchXXXXXX";
+static const char *reliable = "./reliable";
+static int timeout_s = 120;
+static int queue = 0;
+static int synthetic;
+
+static void
+usage (void)
+{
+	fprintf (stderr,
+			"usage: %s [-n runs] [-s sizes] [-w windows] [-l losses] [-d delays]\n"
+			"       [-b bandwidths] [-q queue] [-t timeout] [-o runs.csv]\n"
+			"       [-p path/to/reliable] [-g]\n", progname);
+	exit (1);
+}
+
+static void
+parse_list (const char *arg, struct list *l)
+{
+	char *copy = strdup (arg), *save = NULL, *item, *end;
+
+	l->n = 0;
+	for (item = strtok_r (copy, ",", &save); item;
+			item = strtok_r (NULL, ",", &save)) {
+		double v = strtod (item, &end);
+		if (*end == 'k' || *end == 'K')
+			v *= 1024, end++;
+		else if (*end == 'm' || *end == 'M')
+			v *= 1024 * 1024, end++;
+		if (*end || end == item || v < 0 || l->n == MAX_VALUES) {
+			fprintf (stderr, "%s: bad list \"%s\"\n", progname, arg);
+			exit (1);
+		}
+		l->v[l->n++] = v;
+	}
+	free (copy);
+}
+
+/* Student's t for a two sided 95% interval with df degrees of freedom */
+static double
+t95 (int df)
+{
+	static const double t[] = { 0, 12.706, 4.303, 3.182, 2.776, 2.571,
+		2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145,
+		2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069,
+		2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	if (df < 1)
+		return 0;
+	return df < (int) (sizeof (t) / sizeof (*t)) ? t[df] : 1.960;
+}
+
+/* Mean of x[0..n) and the half width of its 95% confidence interval */
+static void
+interval (const double *x, int n, double *mean, double *half)
+{
+	double sum = 0, ss = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += x[i];
+	*mean = n ? sum / n : 0;
+	for (i = 0; i < n; i++)
+		ss += (x[i] - *mean) * (x[i] - *mean);
+	*half = n > 1 ? t95 (n - 1) * sqrt (ss / (n - 1)) / sqrt (n) : 0;
+}
+
+static double
+now_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* The input file of a given size, made once */
+static const char *
+input_file (long size)
+{
+	static char path[256];
+	struct stat sb;
+	char buf[8192];
+	uint64_t x = 0x9e3779b97f4a7c15ULL ^ size;
+	long left;
+	FILE *f;
+
+	snprintf (path, sizeof (path), "%s/in.%ld", tmpdir, size);
+	if (!stat (path, &sb) && sb.st_size == size)
+		return path;
+	f = fopen (path, "w");
+	if (!f) {
+		perror (path);
+		exit (1);
+	}
+	for (left = size; left > 0; left -= sizeof (buf)) {
+		size_t i, n = left < (long) sizeof (buf) ? (size_t) left : sizeof (buf);
+		for (i = 0; i < n; i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = x;
+		}
+		fwrite (buf, 1, n, f);
+	}
+	fclose (f);
+	return path;
+}
+
+static int
+same_files (const char *a, const char *b)
+{
+	FILE *fa = fopen (a, "r"), *fb = fopen (b, "r");
+	char ba[8192], bb[8192];
+	size_t na, nb;
+	int same = fa && fb;
+
+	while (same) {
+		na = fread (ba, 1, sizeof (ba), fa);
+		nb = fread (bb, 1, sizeof (bb), fb);
+		if (na != nb || memcmp (ba, bb, na))
+			same = 0;
+		if (!na)
+			break;
+	}
+	if (fa)
+		fclose (fa);
+	if (fb)
+		fclose (fb);
+	return same;
+}
+
+static pid_t
+spawn (char *const argv[], int in, const char *err)
+{
+	pid_t pid = fork ();
+
+	if (pid < 0) {
+		perror ("fork");
+		exit (1);
+	}
+	if (!pid) {
+		int fd = open (err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0)
+			dup2 (fd, 2);
+		if (in >= 0)
+			dup2 (in, 0);
+		fd = open ("/dev/null", O_WRONLY);
+		dup2 (fd, 1);
+		execv (argv[0], argv);
+		perror (argv[0]);
+		_exit (127);
+	}
+	return pid;
+}
+
+/* Wait for pid, for at most until the deadline; adds its CPU time */
+static int
+reap (pid_t pid, double deadline, double *cpu_ms)
+{
+	struct rusage ru;
+	int status;
+
+	for (;;) {
+		pid_t r = wait4 (pid, &status, WNOHANG, &ru);
+		if (r == pid)
+			break;
+		if (r < 0) {
+			perror ("wait4");
+			return -1;
+		}
+		if (now_ms () > deadline) {
+			kill (pid, SIGKILL);
+			wait4 (pid, &status, 0, &ru);
+			status = -1;
+			break;
+		}
+		usleep (1000);
+	}
+	*cpu_ms += ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3
+		+ ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+	return status;
+}
+
+static unsigned long long
+sender_retransmits (const char *log, unsigned long long *sent)
+{
+	FILE *f = fopen (log, "r");
+	char line[256];
+	unsigned long long retransmitted = 0;
+
+	*sent = 0;
+	if (!f)
+		return 0;
+	while (fgets (line, sizeof (line), f))
+		sscanf (line, "Packets: %llu sent, %llu retransmitted", sent,
+				&retransmitted);
+	fclose (f);
+	return retransmitted;
+}
+
+/* The sender's ACK latency percentiles from its -L file */
+static void
+sender_latency (const char *csv, struct result *res)
+{
+	FILE *f = fopen (csv, "r");
+	char line[256];
+	double p50, p99;
+
+	res->ack_p50_us = res->ack_p99_us = 0;
+	if (!f)
+		return;
+	while (fgets (line, sizeof (line), f))
+		if (sscanf (line, "%*d,sender,ack,%*u,%*f,%lf,%lf", &p50, &p99) == 2) {
+			res->ack_p50_us = p50;
+			res->ack_p99_us = p99;
+		}
+	fclose (f);
+}
+
+static void
+run (long size, int window, double loss, double delay, double bandwidth,
+		int seed, struct result *res)
+{
+	static int port_base;
+	char win[16], local[16], remote[32], spec_s[256], spec_r[256];
+	char in[256], out[256], slog[256], rlog[256], lat[256];
+	unsigned long long sent, retransmitted;
+	int pipefd[2], sstatus, rstatus;
+	double start, deadline;
+	pid_t sender, receiver;
+
+	if (!port_base)
+		port_base = 20000 + getpid () % 2000 * 10;
+	port_base = port_base + 2 < 60000 ? port_base + 2 : 20000;
+	snprintf (win, sizeof (win), "%d", window);
+	if (synthetic) {
+		snprintf (in, sizeof (in), "synth:size=%ld,seed=%d", size, seed);
+		snprintf (out, sizeof (out), "synth:size=%ld,seed=%d", size, seed);
+	}
+	else {
+		snprintf (in, sizeof (in), "%s", input_file (size));
+		snprintf (out, sizeof (out), "%s/out", tmpdir);
+	}
+	snprintf (slog, sizeof (slog), "%s/sender.log", tmpdir);
+	snprintf (rlog, sizeof (rlog), "%s/receiver.log", tmpdir);
+	snprintf (lat, sizeof (lat), "%s/latency.csv", tmpdir);
+	/* Each end emulates its own direction of the link */
+	snprintf (spec_s, sizeof (spec_s), "seed=%d,loss=%g,delay=%g,rate=%.0f,queue=%d",
+			2 * seed, loss, delay, bandwidth, queue);
+	snprintf (spec_r, sizeof (spec_r), "seed=%d,loss=%g,delay=%g,rate=%.0f,queue=%d",
+			2 * seed + 1, loss, delay, bandwidth, queue);
+	if (!synthetic)
+		unlink (out);
+	unlink (lat);
+
+	/* The receiver reads what it sends back from stdin; keep it open */
+	if (pipe (pipefd) < 0) {
+		perror ("pipe");
+		exit (1);
+	}
+	snprintf (local, sizeof (local), "%d", port_base + 1);
+	snprintf (remote, sizeof (remote), "localhost:%d", port_base);
+	{
+		char *argv[] = { (char *) reliable, "-w", win, "-N", spec_r,
+			"-r", out, local, remote, NULL };
+		receiver = spawn (argv, pipefd[0], rlog);
+	}
+	close (pipefd[0]);
+	usleep (100000);
+
+	snprintf (local, sizeof (local), "%d", port_base);
+	snprintf (remote, sizeof (remote), "localhost:%d", port_base + 1);
+	start = now_ms ();
+	deadline = start + timeout_s * 1e3;
+	res->cpu_ms = 0;
+	{
+		char *argv[] = { (char *) reliable, "-w", win, "-N", spec_s,
+			"-L", lat, "-s", in, local, remote, NULL };
+		sender = spawn (argv, -1, slog);
+	}
+	sstatus = reap (sender, deadline, &res->cpu_ms);
+	res->completion_ms = now_ms () - start;
+	close (pipefd[1]);
+	rstatus = reap (receiver, deadline + 5000, &res->cpu_ms);
+
+	retransmitted = sender_retransmits (slog, &sent);
+	sender_latency (lat, res);
+	/* A synth: receiver exits with 1 if the data was wrong */
+	res->ok = synthetic ? rstatus == 0 : same_files (in, out);
+	res->sender_ok = sstatus == 0;
+	res->goodput_mbps = size * 8 / (res->completion_ms * 1e3);
+	res->retransmit_ratio = sent ? (double) retransmitted / sent : 0;
+}
+
+int
+main (int argc, char **argv)
+{
+	struct list sizes, windows, losses, delays, bandwidths;
+	FILE *raw = NULL;
+	int runs = 5, opt;
+	int si, wi, li, di, bi, i;
+
+	progname = strrchr (argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+	parse_list ("1m", &sizes);
+	parse_list ("32", &windows);
+	parse_list ("0", &losses);
+	parse_list ("10", &delays);
+	parse_list ("0", &bandwidths);
+
+	while ((opt = getopt (argc, argv, "n:s:w:l:d:b:q:t:o:p:g")) != -1)
+		switch (opt) {
+		case 'n':
+			runs = atoi (optarg);
+			break;
+		case 's':
+			parse_list (optarg, &sizes);
+			break;
+		case 'w':
+			parse_list (optarg, &windows);
+			break;
+		case 'l':
+			parse_list (optarg, &losses);
+			break;
+		case 'd':
+			parse_list (optarg, &delays);
+			break;
+		case 'b':
+			parse_list (optarg, &bandwidths);
+			break;
+		case 'q':
+			queue = atoi (optarg);
+			break;
+		case 't':
+			timeout_s = atoi (optarg);
+			break;
+		case 'o':
+			raw = fopen (optarg, "w");
+			if (!raw) {
+				perror (optarg);
+				exit (1);
+			}
+			break;
+		case 'p':
+			reliable = optarg;
+			break;
+		case 'g':
+			synthetic = 1;
+			break;
+		default:
+			usage ();
+		}
+	if (optind != argc || runs < 1 || timeout_s < 1)
+		usage ();
+	if (access (reliable, X_OK) < 0) {
+		perror (reliable);
+		exit (1);
+	}
+	if (!mkdtemp (tmpdir)) {
+		perror ("mkdtemp");
+		exit (1);
+	}
+
+	if (raw)
+		fprintf (raw, "size,window,loss,delay_ms,bandwidth_kbps,run,ok,sender_ok,"
+				"completion_ms,goodput_mbps,retransmit_ratio,cpu_ms,"
+				"cpu_ns_per_byte,ack_p50_us,ack_p99_us\n");
+	printf ("size,window,loss,delay_ms,bandwidth_kbps,runs,failed,sender_failed,"
+			"completion_ms,completion_ci95,goodput_mbps,goodput_ci95,"
+			"retransmit_ratio,retransmit_ci95,cpu_ms,cpu_ci95\n");
+	fflush (stdout);
+
+	for (si = 0; si < sizes.n; si++)
+	for (wi = 0; wi < windows.n; wi++)
+	for (li = 0; li < losses.n; li++)
+	for (di = 0; di < delays.n; di++)
+	for (bi = 0; bi < bandwidths.n; bi++) {
+		double completion[runs], goodput[runs], ratio[runs], cpu[runs];
+		double m[4], h[4];
+		int good = 0, sender_failed = 0;
+
+		for (i = 0; i < runs; i++) {
+			struct result r;
+			run (sizes.v[si], windows.v[wi], losses.v[li], delays.v[di],
+					bandwidths.v[bi], i + 1, &r);
+			if (raw) {
+				fprintf (raw, "%.0f,%.0f,%g,%g,%.0f,%d,%d,%d,%.1f,%.3f,%.4f,%.1f,"
+						"%.2f,%.0f,%.0f\n",
+						sizes.v[si], windows.v[wi], losses.v[li], delays.v[di],
+						bandwidths.v[bi], i + 1, r.ok, r.sender_ok, r.completion_ms,
+						r.goodput_mbps, r.retransmit_ratio, r.cpu_ms,
+						r.cpu_ms * 1e6 / sizes.v[si], r.ack_p50_us, r.ack_p99_us);
+				fflush (raw);
+			}
+			if (!r.sender_ok)
+				sender_failed++;
+			/* A failed run has no meaningful timing */
+			if (!r.ok)
+				continue;
+			completion[good] = r.completion_ms;
+			goodput[good] = r.goodput_mbps;
+			ratio[good] = r.retransmit_ratio;
+			cpu[good] = r.cpu_ms;
+			good++;
+		}
+		interval (completion, good, &m[0], &h[0]);
+		interval (goodput, good, &m[1], &h[1]);
+		interval (ratio, good, &m[2], &h[2]);
+		interval (cpu, good, &m[3], &h[3]);
+		printf ("%.0f,%.0f,%g,%g,%.0f,%d,%d,%d,%.1f,%.1f,%.3f,%.3f,%.4f,%.4f,"
+				"%.1f,%.1f\n", sizes.v[si], windows.v[wi], losses.v[li],
+				delays.v[di], bandwidths.v[bi], runs, runs - good, sender_failed,
+				m[0], h[0],
+				m[1], h[1], m[2], h[2], m[3], h[3]);
+		fflush (stdout);
+	}
+
+	{
+		char cmd[300];
+		snprintf (cmd, sizeof (cmd), "rm -rf %s", tmpdir);
+		if (system (cmd))
+			fprintf (stderr, "%s: could not remove %s\n", progname, tmpdir);
+	}
+	if (raw)
+		fclose (raw);
+	return 0;
+}
@@ -0,0 +1,455 @@
+/*
+ * benchcmp: compare benchmark results against a baseline.
+ *
+ *   benchcmp -m metric:dir[,...] [-k key[,...]] [-t percent]
+ *            baseline.csv current.csv
+ *
+ * Both files are CSV with a header line, such as bench -o or microbench
+ * -c writes; lines starting with # are comments, which the baselines
+ * use to say what built them.  Rows with the same values in the -k
+ * columns are one configuration, and each such row is one sample of it;
+ * without -k, the key is the columns before run, as bench writes them,
+ * or with no run column, every column that is not a metric.
+ * A row whose ok column is 0 is a failed run and only counted.
+ *
+ * For every configuration in both files and every -m metric, benchcmp
+ * prints the mean and 95% confidence interval of each file, the change,
+ * and a verdict.  The direction says which way is better: + for higher
+ * (goodput), - for lower (times, CPU, latency).  A change is flagged
+ * when Welch's t test finds it significant at 95% and it is at least -t
+ * percent of the baseline (default 5); with a single sample on either
+ * side there is no test, and the threshold alone decides.  A baseline
+ * mean of zero, or one whose interval reaches zero, gives no percentage
+ * to go by, so there any significant change counts, however small.
+ * More failed runs than the baseline is a regression too, when Fisher's
+ * exact test finds the difference significant at 95%; a run or two
+ * failing out of five now and then is noise.
+ *
+ * Exits 1 if anything regressed, 0 if not, 2 on bad input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define MAX_COLUMNS 64
+#define MAX_METRICS 16
+#define MAX_LINE 4096
+
+struct table {
+	const char *path;
+	char *names[MAX_COLUMNS];
+	int ncolumns;
+	char **cells;			/* nrows * ncolumns */
+	int nrows;
+};
+
+struct metric {
+	char name[64];
+	int better;			/* +1 higher, -1 lower */
+};
+
+static char *progname;
+static struct metric metrics[MAX_METRICS];
+static int nmetrics;
+static char *keys[MAX_COLUMNS];
+static int nkeys;
+static double threshold = 5;
+
+static void
+usage (void)
+{
+	fprintf (stderr, "usage: %s -m metric:dir[,...] [-k key[,...]] [-t percent]\n"
+			"       baseline.csv current.csv\n", progname);
+	exit (2);
+}
+
+/* Split a CSV line in place, honouring double quotes; returns the
+ * number of fields */
+static int
+split (char *line, char **fields, int max)
+{
+	int n = 0;
+	char *p = line, *out;
+
+	line[strcspn (line, "\r\n")] = 0;
+	while (n < max) {
+		fields[n++] = out = p;
+		if (*p == '"') {
+			fields[n - 1] = out = ++p;
+			while (*p && !(*p == '"' && p[1] != '"')) {
+				if (*p == '"')
+					p++;
+				*out++ = *p++;
+			}
+			if (*p == '"')
+				p++;
+		}
+		else
+			while (*p && *p != ',')
+				*out++ = *p++;
+		if (*p != ',') {
+			*out = 0;
+			break;
+		}
+		*out = 0;
+		p++;
+	}
+	return n;
+}
+
+static void
+load (const char *path, struct table *t)
+{
+	FILE *f = fopen (path, "r");
+	char line[MAX_LINE];
+	int size = 0;
+
+	memset (t, 0, sizeof (*t));
+	t->path = path;
+	if (!f) {
+		perror (path);
+		exit (2);
+	}
+	while (fgets (line, sizeof (line), f)) {
+		char *fields[MAX_COLUMNS];
+		int n, i;
+
+		if (line[0] == '#') {
+			printf ("%s: %s", path, line);
+			continue;
+		}
+		if (line[strspn (line, " \t\r\n")] == 0)
+			continue;
+		n = split (line, fields, MAX_COLUMNS);
+		if (!t->ncolumns) {
+			for (i = 0; i < n; i++)
+				t->names[i] = strdup (fields[i]);
+			t->ncolumns = n;
+			continue;
+		}
+		if (n != t->ncolumns) {
+			fprintf (stderr, "%s: a row of %d fields under %d columns\n",
+					path, n, t->ncolumns);
+			exit (2);
+		}
+		if (t->nrows == size) {
+			size = size ? 2 * size : 64;
+			t->cells = realloc (t->cells, size * t->ncolumns * sizeof (char *));
+			if (!t->cells) {
+				perror (progname);
+				exit (2);
+			}
+		}
+		for (i = 0; i < n; i++)
+			t->cells[t->nrows * t->ncolumns + i] = strdup (fields[i]);
+		t->nrows++;
+	}
+	fclose (f);
+	if (!t->ncolumns) {
+		fprintf (stderr, "%s: no header\n", path);
+		exit (2);
+	}
+}
+
+static int
+column (const struct table *t, const char *name)
+{
+	int i;
+
+	for (i = 0; i < t->ncolumns; i++)
+		if (!strcmp (t->names[i], name))
+			return i;
+	return -1;
+}
+
+static const char *
+cell (const struct table *t, int row, int col)
+{
+	return t->cells[row * t->ncolumns + col];
+}
+
+static int
+is_metric (const char *name)
+{
+	int i;
+
+	for (i = 0; i < nmetrics; i++)
+		if (!strcmp (metrics[i].name, name))
+			return 1;
+	return 0;
+}
+
+/* Whether row a of ta has the same key as row b of tb */
+static int
+same_key (const struct table *ta, int a, const struct table *tb, int b)
+{
+	int i;
+
+	for (i = 0; i < nkeys; i++)
+		if (strcmp (cell (ta, a, column (ta, keys[i])),
+					cell (tb, b, column (tb, keys[i]))))
+			return 0;
+	return 1;
+}
+
+static int
+failed (const struct table *t, int row)
+{
+	int ok = column (t, "ok");
+	return ok >= 0 && atoi (cell (t, row, ok)) == 0;
+}
+
+/* Student's t for a two sided 95% interval with df degrees of freedom */
+static double
+t95 (double df)
+{
+	static const double t[] = { 0, 12.706, 4.303, 3.182, 2.776, 2.571,
+		2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145,
+		2.131, 2.120, 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069,
+		2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	int d = (int) df;
+	if (d < 1)
+		return 0;
+	return d < (int) (sizeof (t) / sizeof (*t)) ? t[d] : 1.960;
+}
+
+struct sample {
+	int n;
+	double mean;
+	double var;
+};
+
+/* The successful samples of metric col over the rows of t with the key
+ * of row r of tk, and how many of those rows failed */
+static struct sample
+collect (const struct table *t, int col, const struct table *tk, int r,
+		int *nfailed)
+{
+	struct sample s = { 0, 0, 0 };
+	double sum = 0, ss = 0;
+	int i;
+
+	*nfailed = 0;
+	for (i = 0; i < t->nrows; i++) {
+		double v;
+		if (!same_key (t, i, tk, r))
+			continue;
+		if (failed (t, i)) {
+			(*nfailed)++;
+			continue;
+		}
+		v = atof (cell (t, i, col));
+		s.n++;
+		sum += v;
+		ss += v * v;
+	}
+	if (s.n) {
+		s.mean = sum / s.n;
+		s.var = s.n > 1 ? (ss - sum * sum / s.n) / (s.n - 1) : 0;
+		if (s.var < 0)
+			s.var = 0;
+	}
+	return s;
+}
+
+static double
+half_width (const struct sample *s)
+{
+	return s->n > 1 ? t95 (s->n - 1) * sqrt (s->var / s->n) : 0;
+}
+
+/* Whether a baseline is too close to zero for a change in percent */
+static int
+near_zero (const struct sample *s)
+{
+	return fabs (s->mean) <= half_width (s) || fabs (s->mean) < 1e-12;
+}
+
+/* The one sided p value of Fisher's exact test that b failed out of nb
+ * runs is more than a out of na: the chance of b or more of the failures
+ * landing in the second group if both fail alike */
+static double
+fisher (int a, int na, int b, int nb)
+{
+	int failures = a + b, n = na + nb, k;
+	double p = 0;
+
+	for (k = b; k <= failures && k <= nb; k++)
+		p += exp (lgamma (failures + 1) - lgamma (k + 1) - lgamma (failures - k + 1)
+				+ lgamma (n - failures + 1) - lgamma (nb - k + 1)
+				- lgamma (n - failures - nb + k + 1)
+				- lgamma (n + 1) + lgamma (nb + 1) + lgamma (n - nb + 1));
+	return p;
+}
+
+/* 1 for a significant regression, -1 for a significant improvement */
+static int
+compare (const struct metric *m, const struct sample *a,
+		const struct sample *b, const char **verdict)
+{
+	double change = near_zero (a) ? b->mean - a->mean
+		: (b->mean - a->mean) / fabs (a->mean) * 100;
+	int significant;
+
+	if ((!near_zero (a) && fabs (change) < threshold) || a->mean == b->mean) {
+		*verdict = "same";
+		return 0;
+	}
+	if (a->n > 1 && b->n > 1) {
+		double va = a->var / a->n, vb = b->var / b->n;
+		double se = sqrt (va + vb);
+		double df = se > 0 ? (va + vb) * (va + vb)
+			/ (va * va / (a->n - 1) + vb * vb / (b->n - 1)) : 1e9;
+		significant = se == 0 || fabs (b->mean - a->mean) / se > t95 (df);
+	}
+	else
+		significant = 1;
+	if (!significant) {
+		*verdict = "noise";
+		return 0;
+	}
+	if ((change > 0) == (m->better > 0)) {
+		*verdict = "BETTER";
+		return -1;
+	}
+	*verdict = "WORSE";
+	return 1;
+}
+
+static void
+parse_metrics (char *arg)
+{
+	char *save = NULL, *item;
+
+	for (item = strtok_r (arg, ",", &save); item;
+			item = strtok_r (NULL, ",", &save)) {
+		char *colon = strrchr (item, ':');
+		if (!colon || (strcmp (colon + 1, "+") && strcmp (colon + 1, "-"))
+				|| nmetrics == MAX_METRICS
+				|| colon - item >= (int) sizeof (metrics[0].name))
+			usage ();
+		*colon = 0;
+		strcpy (metrics[nmetrics].name, item);
+		metrics[nmetrics].better = colon[1] == '+' ? 1 : -1;
+		nmetrics++;
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	struct table base, cur;
+	int opt, i, j, k, regressions = 0, improvements = 0, compared = 0;
+	char *key_arg = NULL;
+
+	progname = strrchr (argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+	while ((opt = getopt (argc, argv, "m:k:t:")) != -1)
+		switch (opt) {
+		case 'm':
+			parse_metrics (optarg);
+			break;
+		case 'k':
+			key_arg = optarg;
+			break;
+		case 't':
+			threshold = atof (optarg);
+			break;
+		default:
+			usage ();
+		}
+	if (optind + 2 != argc || !nmetrics || threshold < 0)
+		usage ();
+
+	load (argv[optind], &base);
+	load (argv[optind + 1], &cur);
+
+	if (key_arg) {
+		char *save = NULL, *item;
+		for (item = strtok_r (key_arg, ",", &save); item && nkeys < MAX_COLUMNS;
+				item = strtok_r (NULL, ",", &save))
+			keys[nkeys++] = item;
+	}
+	else if (column (&base, "run") >= 0)
+		for (i = 0; i < column (&base, "run"); i++)
+			keys[nkeys++] = base.names[i];
+	else
+		for (i = 0; i < base.ncolumns; i++)
+			if (!is_metric (base.names[i]))
+				keys[nkeys++] = base.names[i];
+	for (i = 0; i < nkeys; i++)
+		if (column (&base, keys[i]) < 0 || column (&cur, keys[i]) < 0) {
+			fprintf (stderr, "%s: no key column %s in both files\n",
+					progname, keys[i]);
+			exit (2);
+		}
+
+	/* Each configuration of the baseline, at its first row */
+	for (i = 0; i < base.nrows; i++) {
+		int first = 1, bfailed, cfailed;
+
+		for (j = 0; j < i && !same_key (&base, j, &base, i); j++)
+			;
+		if (j < i)
+			continue;
+		for (j = 0; j < cur.nrows && !same_key (&cur, j, &base, i); j++)
+			;
+		if (j == cur.nrows)
+			continue;
+
+		for (k = 0; k < nmetrics; k++) {
+			int bc = column (&base, metrics[k].name);
+			int cc = column (&cur, metrics[k].name);
+			struct sample a, b;
+			const char *verdict;
+			int r;
+
+			if (bc < 0 || cc < 0)
+				continue;
+			a = collect (&base, bc, &base, i, &bfailed);
+			b = collect (&cur, cc, &base, i, &cfailed);
+			if (first) {
+				for (j = 0; j < nkeys; j++)
+					printf ("%s%s=%s", j ? " " : "", keys[j],
+							cell (&base, i, column (&base, keys[j])));
+				printf ("\n");
+				if (cfailed * (a.n + bfailed) > bfailed * (b.n + cfailed)) {
+					int worse = fisher (bfailed, a.n + bfailed, cfailed,
+							b.n + cfailed) < 0.05;
+					printf ("  %-20s %d of %d failed, baseline %d of %d  %s\n",
+							"runs", cfailed, b.n + cfailed, bfailed,
+							a.n + bfailed, worse ? "WORSE" : "noise");
+					regressions += worse;
+				}
+				first = 0;
+			}
+			if (!a.n || !b.n)
+				continue;
+			r = compare (&metrics[k], &a, &b, &verdict);
+			printf ("  %-20s %12.6g +- %-10.4g -> %12.6g +- %-10.4g ",
+					metrics[k].name, a.mean, half_width (&a), b.mean,
+					half_width (&b));
+			if (near_zero (&a))
+				printf ("%8s  %s\n", "from ~0", verdict);
+			else
+				printf ("%+7.1f%%  %s\n",
+						(b.mean - a.mean) / fabs (a.mean) * 100, verdict);
+			compared++;
+			if (r > 0)
+				regressions++;
+			else if (r < 0)
+				improvements++;
+		}
+	}
+	if (!compared && !regressions) {
+		fprintf (stderr, "%s: nothing in %s to compare with %s\n", progname,
+				cur.path, base.path);
+		exit (2);
+	}
+	printf ("%d compared, %d worse, %d better\n", compared, regressions,
+			improvements);
+	return regressions ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "constants.h"
+
+/**
+ * Packet checksums.
+ *
+ * The cksum field of every packet holds the Internet checksum of rlib's
+ * cksum() unless the peers agree on another algorithm in the handshake:
+ * the sender asks for one with -c and the receiver grants it.
+ *
+ *   sum     the Internet checksum
+ *   crc32c  CRC32C (Castagnoli) with its two halves xored together to
+ *           fit the field.  It catches the swapped and reordered words
+ *           and the errors that cancel out which a sum misses.  It runs
+ *           on the CRC32 instructions of SSE4.2 or ARMv8 where the CPU
+ *           has them, and on a table otherwise.
+ *   none    no checksum: the field is 0, as in UDP.  CRC32C is never 0
+ *           but the Internet sum can be.  This is for paths that keep
+ *           data intact anyway, such as loopback or AF_UNIX, so the
+ *           receiver only grants it if it was given -c none as well.
+ *
+ * The algorithm switches with the other features at the settings
+ * packet: the sender's packets after it and the receiver's once it has
+ * written it out carry the agreed checksum, and so do FEC control
+ * packets and retransmissions from then on.  Hellos, replies and
+ * whatever went before carry the Internet sum.  Once the handshake
+ * agrees on another algorithm, an end accepts both until the first
+ * packet under the agreed one comes, and only that one after, since
+ * the peer never goes back.  A packet of the sum still on its way then
+ * is dropped and sent again under the agreed one.
+ */
+
+#define CRC32C_POLY 0x82f63b78
+
+typedef uint32_t crc32c_fn(uint32_t crc, const uint8_t* data, int len);
+
+static crc32c_fn* crc32c_update;
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t* data, int len) {
+	while (len-- > 0) {
+		crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hard(uint32_t crc, const uint8_t* data, int len) {
+	uint64_t crc64 = crc;
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = crc64;
+	while (len-- > 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return crc;
+}
+#define crc32c_have_hard() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hard(uint32_t crc, const uint8_t* data, int len) {
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc = __crc32cd(crc, word);
+	}
+	while (len-- > 0) {
+		crc = __crc32cb(crc, *data++);
+	}
+	return crc;
+}
+#define crc32c_have_hard() (getauxval(AT_HWCAP) & HWCAP_CRC32)
+#endif
+
+/**
+ * Pick the fastest CRC32C this CPU can run
+ */
+static void crc32c_select() {
+	uint32_t i, j;
+#ifdef crc32c_have_hard
+	if (crc32c_have_hard()) {
+		crc32c_update = crc32c_hard;
+		return;
+	}
+#endif
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+	crc32c_update = crc32c_soft;
+}
+
+uint32_t crc32c(const void* data, int len) {
+	if (!crc32c_update) {
+		crc32c_select();
+	}
+	return ~crc32c_update(~0u, (const uint8_t*) data, len);
+}
+
+/**
+ * The algorithm the agreed capabilities name
+ */
+int checksum_agreed(uint32_t capabilities) {
+	if (capabilities & CAPABILITY_NO_CHECKSUM) {
+		return CHECKSUM_NONE;
+	}
+	if (capabilities & CAPABILITY_CRC32C) {
+		return CHECKSUM_CRC32C;
+	}
+	return CHECKSUM_SUM;
+}
+
+/**
+ * The cksum field for a packet under an algorithm; the field must be 0
+ */
+uint16_t packet_checksum(int algorithm, packet_t* packet, int len) {
+	if (algorithm == CHECKSUM_NONE) {
+		return 0;
+	}
+	if (algorithm == CHECKSUM_CRC32C) {
+		PMU_SCOPE(PMU_CKSUM);
+		uint32_t crc = crc32c(packet, len);
+		uint16_t folded = crc ^ (crc >> 16);
+		return folded ? folded : 0xffff;
+	}
+	return cksum(packet, len);
+}
+
+/**
+ * Whether stored is a right cksum field for a packet under the
+ * algorithm accepted, or under the Internet sum unless *switched says
+ * the peer has moved on from it; sets *switched at the first packet
+ * under accepted.  The field must be 0.
+ */
+bool packet_checksum_ok(int accepted, bool* switched, uint16_t stored,
+		packet_t* packet, int len) {
+	if (accepted == CHECKSUM_SUM) {
+		return stored == cksum(packet, len);
+	}
+	if (stored == packet_checksum(accepted, packet, len)) {
+		*switched = true;
+		return true;
+	}
+	return !*switched && stored == cksum(packet, len);
+}
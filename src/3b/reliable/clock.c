@@ -0,0 +1,37 @@
+#include <time.h>
+
+#include "clock.h"
+
+static int virtual;
+static uint64_t virtual_now_us;
+
+uint64_t
+clock_now_us (void)
+{
+	struct timespec ts;
+
+	if (virtual)
+		return virtual_now_us;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+clock_set_virtual (uint64_t now_us)
+{
+	virtual = 1;
+	virtual_now_us = now_us;
+}
+
+void
+clock_advance (uint64_t now_us)
+{
+	if (now_us > virtual_now_us)
+		virtual_now_us = now_us;
+}
+
+int
+clock_is_virtual (void)
+{
+	return virtual;
+}
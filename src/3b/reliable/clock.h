@@ -0,0 +1,27 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   The clock every protocol timer reads.
+
+   Normally it is CLOCK_MONOTONIC.  With -S, reliable simulates a whole
+   transfer in one process and switches the clock to virtual time, which
+   only moves when the simulation advances it from one event to the
+   next.  Nothing in a simulated run then depends on how fast the
+   machine is, so the same inputs and seed give the same run.
+
+   ----------------------------------------------------------------------- */
+
+/* Microseconds since an arbitrary start */
+uint64_t clock_now_us (void);
+
+/* Switch to virtual time, starting at now_us */
+void clock_set_virtual (uint64_t now_us);
+/* Move virtual time forward to now_us; it never goes back */
+void clock_advance (uint64_t now_us);
+int clock_is_virtual (void);
+
+#endif /* CLOCK_H */
@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+
+/**
+ * Payload compression.
+ *
+ * The sender collects up to COMPRESS_STAGING bytes of input and packs
+ * as much of it as fits into each data packet.  Every packet is
+ * compressed on its own, so the receiver can expand it whatever became
+ * of the packets before it.  The first payload byte says how the rest
+ * is coded: COMPRESS_RAW for input bytes as they are, COMPRESS_LZ for
+ * an LZ77 block.
+ *
+ * An LZ block is a list of sequences.  A sequence starts with a token
+ * byte, literal count in the high nibble and match length - 4 in the
+ * low nibble; a nibble of 15 is continued by extra bytes that are added
+ * on until one is less than 255.  Then come the literals, and then a
+ * two byte little endian match offset.  The last sequence of a block
+ * ends after its literals.
+ *
+ * Data that does not compress (already compressed files, say) is sent
+ * raw, and the sender stops trying for a while so it does not spend CPU
+ * on it.  Each failure doubles the number of packets skipped.
+ */
+
+#define COMPRESS_RAW 0
+#define COMPRESS_LZ 1
+
+#define COMPRESS_STAGING (8 * MAX_PACKET_DATA_SIZE)
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_SKIP 256
+
+typedef struct compress_state {
+	/**
+	 * Sender: input read from the connection but not yet sent
+	 */
+	char staging[COMPRESS_STAGING];
+	int staged;
+	int input_eof;
+	/**
+	 * Sender: packets still to send raw before trying again, and how many
+	 * to skip after the next failure
+	 */
+	int skip;
+	int backoff;
+	int32_t hash[1 << COMPRESS_HASH_BITS];
+
+	/**
+	 * Receiver: the expanded payload of the packet being written out
+	 */
+	char expanded[COMPRESS_STAGING];
+	int expanded_length;
+	uint32_t expanded_seqno;
+
+	/**
+	 * Bytes in and out of the compressor, for the stats at the end
+	 */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} compress_state;
+
+compress_state* compress_create() {
+	compress_state* z = (compress_state*) malloc(sizeof(compress_state));
+	memset(z, 0, sizeof(compress_state));
+	z->backoff = 1;
+	return z;
+}
+
+void compress_destroy(compress_state* z) {
+	free(z);
+}
+
+static uint32_t compress_read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int compress_hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/**
+ * Bytes it takes to continue a length of n past its nibble
+ */
+static int compress_extra(int n) {
+	return n < 15 ? 0 : (n - 15) / 255 + 1;
+}
+
+static uint8_t* compress_put_length(uint8_t* op, int n) {
+	if (n < 15) {
+		return op;
+	}
+	n -= 15;
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+static uint8_t* compress_put_literals(uint8_t* op, const uint8_t* lit,
+		int count, int match) {
+	*op++ = ((count < 15 ? count : 15) << 4) | (match < 15 ? match : 15);
+	op = compress_put_length(op, count);
+	memcpy(op, lit, count);
+	return op + count;
+}
+
+/**
+ * LZ code a prefix of in[0, in_length) into at most out_capacity bytes.
+ * Sets *consumed to the length of the prefix and returns the length of
+ * the block.
+ */
+int compress_block(compress_state* z, const uint8_t* in, int in_length,
+		uint8_t* out, int out_capacity, int* consumed) {
+	uint8_t* op = out;
+	uint8_t* end = out + out_capacity;
+	int ip = 0, anchor = 0;
+	memset(z->hash, 0xff, sizeof(z->hash));
+	while (ip + COMPRESS_MIN_MATCH <= in_length) {
+		uint32_t v = compress_read32(in + ip);
+		int h = compress_hash(v);
+		int ref = z->hash[h];
+		z->hash[h] = ip;
+		if (ref < 0 || compress_read32(in + ref) != v) {
+			ip++;
+			continue;
+		}
+		int length = COMPRESS_MIN_MATCH;
+		while (ip + length < in_length && in[ref + length] == in[ip + length]) {
+			length++;
+		}
+		int literals = ip - anchor;
+		int match = length - COMPRESS_MIN_MATCH;
+		int cost = 1 + compress_extra(literals) + literals + 2 + compress_extra(match);
+		if (op + cost > end) {
+			break;
+		}
+		op = compress_put_literals(op, in + anchor, literals, match);
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		op = compress_put_length(op, match);
+		ip += length;
+		anchor = ip;
+	}
+	// the rest goes as literals, as many as fit
+	int literals = in_length - anchor;
+	int room = end - op;
+	while (literals > 0 && 1 + compress_extra(literals) + literals > room) {
+		literals--;
+	}
+	if (room > 0) {
+		op = compress_put_literals(op, in + anchor, literals, 0);
+	}
+	*consumed = anchor + literals;
+	return op - out;
+}
+
+static int compress_get_length(const uint8_t** ip, const uint8_t* end, int n) {
+	if (n < 15) {
+		return n;
+	}
+	while (*ip < end) {
+		uint8_t b = *(*ip)++;
+		n += b;
+		if (b < 255) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Expand an LZ block into out.  Returns the expanded length, or -1 if
+ * the block is malformed or expands to more than out_capacity bytes.
+ */
+int decompress_block(const uint8_t* in, int in_length, uint8_t* out,
+		int out_capacity) {
+	const uint8_t* ip = in;
+	const uint8_t* end = in + in_length;
+	int op = 0;
+	while (ip < end) {
+		uint8_t token = *ip++;
+		int literals = compress_get_length(&ip, end, token >> 4);
+		if (literals < 0 || literals > end - ip || op + literals > out_capacity) {
+			return -1;
+		}
+		memcpy(out + op, ip, literals);
+		ip += literals;
+		op += literals;
+		if (ip == end) {
+			break;
+		}
+		if (end - ip < 2) {
+			return -1;
+		}
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int length = compress_get_length(&ip, end, token & 0xf);
+		if (length < 0 || offset == 0 || offset > op) {
+			return -1;
+		}
+		length += COMPRESS_MIN_MATCH;
+		if (op + length > out_capacity) {
+			return -1;
+		}
+		// byte by byte: the match may overlap what it is copying
+		int i;
+		for (i = 0; i < length; i++, op++) {
+			out[op] = out[op - offset];
+		}
+	}
+	return op;
+}
+
+/**
+ * Fill a data packet payload from the connection's input.  Returns the
+ * payload length, 0 if there is no input right now, or -1 once the
+ * input has ended and everything read has been sent.
+ */
+int compress_input(compress_state* z, conn_t* c, char* payload, int capacity) {
+	while (!z->input_eof && z->staged < COMPRESS_STAGING) {
+		int n = conn_input(c, z->staging + z->staged, COMPRESS_STAGING - z->staged);
+		if (n < 0) {
+			z->input_eof = 1;
+		}
+		if (n <= 0) {
+			break;
+		}
+		z->staged += n;
+	}
+	if (!z->staged) {
+		return z->input_eof ? -1 : 0;
+	}
+
+	int consumed = 0, length = 0;
+	if (z->skip > 0) {
+		z->skip--;
+	}
+	else {
+		length = compress_block(z, (uint8_t*) z->staging, z->staged,
+				(uint8_t*) payload + 1, capacity - 1, &consumed);
+		// not worth it unless it saves an eighth
+		if (length + length / 8 < consumed) {
+			z->backoff = 1;
+		}
+		else {
+			z->skip = z->backoff;
+			if (z->backoff < COMPRESS_MAX_SKIP) {
+				z->backoff *= 2;
+			}
+			consumed = 0;
+		}
+	}
+	if (consumed) {
+		payload[0] = COMPRESS_LZ;
+	}
+	else {
+		payload[0] = COMPRESS_RAW;
+		consumed = z->staged < capacity - 1 ? z->staged : capacity - 1;
+		memcpy(payload + 1, z->staging, consumed);
+		length = consumed;
+	}
+	z->staged -= consumed;
+	memmove(z->staging, z->staging + consumed, z->staged);
+	z->bytes_in += consumed;
+	z->bytes_out += length + 1;
+	return length + 1;
+}
+
+/**
+ * Expand the payload of a data packet into z->expanded, unless it is
+ * already there.  Returns the expanded length, or -1 if the payload
+ * cannot be expanded.
+ */
+int decompress_packet(compress_state* z, packet_t* packet) {
+	uint32_t seqno = ntohl(packet->seqno);
+	if (z->expanded_seqno == seqno) {
+		return z->expanded_length;
+	}
+	int length = ntohs(packet->len) - DATA_PACKET_METADATA_LENGTH - 1;
+	const uint8_t* data = (uint8_t*) packet->data + 1;
+	if (length < 0) {
+		return -1;
+	}
+	if (packet->data[0] == COMPRESS_RAW) {
+		memcpy(z->expanded, data, length);
+	}
+	else if (packet->data[0] == COMPRESS_LZ) {
+		length = decompress_block(data, length, (uint8_t*) z->expanded,
+				COMPRESS_STAGING);
+	}
+	else {
+		length = -1;
+	}
+	if (length < 0) {
+		return -1;
+	}
+	z->expanded_seqno = seqno;
+	z->expanded_length = length;
+	z->bytes_in += length;
+	z->bytes_out += ntohs(packet->len) - DATA_PACKET_METADATA_LENGTH;
+	return length;
+}
@@ -0,0 +1,472 @@
+/*
+ * fairness: several flows of reliable competing for one bottleneck.
+ *
+ *   fairness [-f flows] [-g gap] [-t time] [-d delays] [-b bandwidth]
+ *            [-q buffer] [-Q queue] [-w window] [-x reference]
+ *            [-i interval] [-W window] [-j threshold] [-o series.csv]
+ *            [-p path/to/reliable] [-R path/to/relay]
+ *
+ * fairness starts the relayer's relay with a shared bottleneck of -b
+ * kb/s (default 10000) and a -Q queue (droptail, red or codel) of -q
+ * packets (default 50), and runs -f bulk flows through it (default 4),
+ * each sending /dev/zero.  Flow i starts i * -g seconds after the first
+ * (default 5), and all of them stop -t seconds after the last one
+ * started (default 20).  -d gives the one-way delays of the flows in ms,
+ * comma separated and used in turn (default 20), for flows of mixed
+ * RTTs.  -x runs flow 0 with another build of reliable, as a reference
+ * to compare against: its share shows whether the others starve it or
+ * it starves them.
+ *
+ * relay reports the bytes each flow got through and the queue every -i
+ * ms (default 100).  From these, over the time when all flows run:
+ *
+ *   the rate of each flow and its share of the fair rate,
+ *   Jain's fairness index of the rates, (sum x)^2 / (n sum x^2),
+ *   the utilization of the bottleneck,
+ *   the mean and maximum queue and the drops,
+ *   the convergence time: how long after the last flow started the
+ *   index over every -W second window (default 1) stays at least -j
+ *   (default 0.9).
+ *
+ * -o writes the rates, the index and the queue of every interval as CSV.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define MAX_FLOWS 64
+#define MAX_DELAYS 16
+
+/* One interval of relay's statistics */
+struct sample {
+	double time;
+	uint64_t bytes[MAX_FLOWS];
+	int queue, queue_max;
+	uint64_t dropped;
+};
+
+static char *progname;
+static char tmpdir[] = "/tmp/fairnessXXXXXX";
+static const char *reliable = "./reliable";
+static const char *relay = "../relayer/relay";
+static const char *reference;
+static int nflows = 4;
+static double gap_s = 5, time_s = 20;
+static double delays[MAX_DELAYS] = { 20 };
+static int ndelays = 1;
+static long bandwidth = 10000;
+static int buffer = 50;
+static const char *queue = "droptail";
+static int window = 32;
+static double interval_ms = 100;
+static double fair_window_s = 1, threshold = 0.9;
+
+static struct sample *samples;
+static int nsamples;
+
+static void
+usage (void)
+{
+	fprintf (stderr,
+			"usage: %s [-f flows] [-g gap] [-t time] [-d delays] [-b bandwidth]\n"
+			"       [-q buffer] [-Q queue] [-w window] [-x reference]\n"
+			"       [-i interval] [-W window] [-j threshold] [-o series.csv]\n"
+			"       [-p path/to/reliable] [-R path/to/relay]\n", progname);
+	exit (1);
+}
+
+static double
+now_s (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleep_until (double t)
+{
+	double left;
+	while ((left = t - now_s ()) > 0)
+		usleep (left > 1 ? 1000000 : left * 1e6);
+}
+
+static pid_t
+spawn (char *const argv[], int in, const char *err)
+{
+	pid_t pid = fork ();
+
+	if (pid < 0) {
+		perror ("fork");
+		exit (1);
+	}
+	if (!pid) {
+		int fd = open (err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd >= 0)
+			dup2 (fd, 2);
+		if (in >= 0)
+			dup2 (in, 0);
+		fd = open ("/dev/null", O_WRONLY);
+		dup2 (fd, 1);
+		execv (argv[0], argv);
+		perror (argv[0]);
+		_exit (127);
+	}
+	return pid;
+}
+
+static double
+delay_of (int flow)
+{
+	return delays[flow % ndelays];
+}
+
+static int
+port (int base, int flow, int which)
+{
+	return base + 4 * flow + which;
+}
+
+/* Ports of flow i: the sender on base + 4i and the relay's end for it
+ * on base + 4i + 1, the receiver on base + 4i + 2 and the relay's end
+ * for it on base + 4i + 3 */
+static void
+write_config (const char *path, int base)
+{
+	FILE *f = fopen (path, "w");
+	int i;
+
+	if (!f) {
+		perror (path);
+		exit (1);
+	}
+	fprintf (f, "<config>\n"
+			"<enable_log>0</enable_log>\n"
+			"<number_of_pairs>%d</number_of_pairs>\n"
+			"<propagation_delay>%g</propagation_delay>\n"
+			"<bandwidth>%ld</bandwidth>\n"
+			"<buffer_size>%d</buffer_size>\n"
+			"<queue>%s</queue>\n"
+			"<shared_bottleneck>1</shared_bottleneck>\n"
+			"<pairs>\n", nflows, delays[0], bandwidth, buffer, queue);
+	for (i = 0; i < nflows; i++)
+		fprintf (f, "  <pair>\n"
+				"   <propagation_delay>%g</propagation_delay>\n"
+				"   <sender><src>localhost:%d</src><dst>localhost:%d</dst></sender>\n"
+				"   <receiver><src>localhost:%d</src><dst>localhost:%d</dst></receiver>\n"
+				"  </pair>\n", delay_of (i), port (base, i, 0), port (base, i, 1),
+				port (base, i, 2), port (base, i, 3));
+	fprintf (f, "</pairs>\n</config>\n");
+	fclose (f);
+}
+
+/* Read relay's CSV into samples, the uplink rows only */
+static void
+read_stats (const char *path)
+{
+	FILE *f = fopen (path, "r");
+	char line[256], dir[8];
+	double t, last = -1;
+	unsigned long long bytes, dropped;
+	int pair, q, qmax, size = 0;
+
+	if (!f) {
+		perror (path);
+		exit (1);
+	}
+	while (fgets (line, sizeof (line), f)) {
+		struct sample *s;
+
+		if (sscanf (line, "%lf,%d,%7[a-z],%llu,%d,%d,%llu", &t, &pair, dir,
+					&bytes, &q, &qmax, &dropped) != 7
+				|| strcmp (dir, "up") || pair < 0 || pair >= nflows)
+			continue;
+		if (t != last) {
+			if (nsamples == size) {
+				size = size ? 2 * size : 256;
+				samples = realloc (samples, size * sizeof (*samples));
+				if (!samples) {
+					perror ("realloc");
+					exit (1);
+				}
+			}
+			s = &samples[nsamples++];
+			memset (s, 0, sizeof (*s));
+			s->time = last = t;
+			s->queue = q;
+			s->queue_max = qmax;
+		}
+		s = &samples[nsamples - 1];
+		s->bytes[pair] = bytes;
+		s->dropped += dropped;
+	}
+	fclose (f);
+}
+
+static double
+jain (const double *x, int n)
+{
+	double sum = 0, squares = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		sum += x[i];
+		squares += x[i] * x[i];
+	}
+	return squares > 0 ? sum * sum / (n * squares) : 1;
+}
+
+/* The flows running during the interval that ends at t */
+static int
+running (const double *start, double t, double step, double *x,
+		const struct sample *s)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nflows; i++)
+		if (t - step >= start[i])
+			x[n++] = s->bytes[i] * 8 / (step * 1e6);
+	return n;
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *series = NULL;
+	char path[256], stats_path[256], config[256], win[16], local[16],
+		remote[32], iv[32];
+	double start[MAX_FLOWS], t0, t_last, t_end, step;
+	pid_t senders[MAX_FLOWS], receivers[MAX_FLOWS], relay_pid;
+	int pipes[MAX_FLOWS][2];
+	int base, opt, i, k;
+
+	progname = strrchr (argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+
+	while ((opt = getopt (argc, argv, "f:g:t:d:b:q:Q:w:x:i:W:j:o:p:R:")) != -1)
+		switch (opt) {
+		case 'f':
+			nflows = atoi (optarg);
+			break;
+		case 'g':
+			gap_s = atof (optarg);
+			break;
+		case 't':
+			time_s = atof (optarg);
+			break;
+		case 'd': {
+			char *copy = strdup (optarg), *save = NULL, *item;
+			ndelays = 0;
+			for (item = strtok_r (copy, ",", &save); item && ndelays < MAX_DELAYS;
+					item = strtok_r (NULL, ",", &save))
+				delays[ndelays++] = atof (item);
+			free (copy);
+			break;
+		}
+		case 'b':
+			bandwidth = atol (optarg);
+			break;
+		case 'q':
+			buffer = atoi (optarg);
+			break;
+		case 'Q':
+			queue = optarg;
+			break;
+		case 'w':
+			window = atoi (optarg);
+			break;
+		case 'x':
+			reference = optarg;
+			break;
+		case 'i':
+			interval_ms = atof (optarg);
+			break;
+		case 'W':
+			fair_window_s = atof (optarg);
+			break;
+		case 'j':
+			threshold = atof (optarg);
+			break;
+		case 'o':
+			series = optarg;
+			break;
+		case 'p':
+			reliable = optarg;
+			break;
+		case 'R':
+			relay = optarg;
+			break;
+		default:
+			usage ();
+		}
+	if (optind != argc || nflows < 1 || nflows > MAX_FLOWS || ndelays < 1
+			|| gap_s < 0 || time_s <= 0 || bandwidth < 1 || buffer < 1
+			|| interval_ms < 1 || fair_window_s * 1e3 < interval_ms)
+		usage ();
+	for (i = 0; i < 3; i++) {
+		const char *bin = i == 0 ? reliable : i == 1 ? relay : reference;
+		if (bin && access (bin, X_OK) < 0) {
+			perror (bin);
+			exit (1);
+		}
+	}
+	if (!mkdtemp (tmpdir)) {
+		perror ("mkdtemp");
+		exit (1);
+	}
+	signal (SIGPIPE, SIG_IGN);
+
+	base = 20000 + getpid () % 1000 * 4 * MAX_FLOWS % 30000;
+	snprintf (config, sizeof (config), "%s/config.xml", tmpdir);
+	snprintf (stats_path, sizeof (stats_path), "%s/stats.csv", tmpdir);
+	write_config (config, base);
+	snprintf (win, sizeof (win), "%d", window);
+	snprintf (iv, sizeof (iv), "%g", interval_ms);
+	{
+		char *args[] = { (char *) relay, "-o", stats_path, "-i", iv, config,
+			NULL };
+		snprintf (path, sizeof (path), "%s/relay.log", tmpdir);
+		relay_pid = spawn (args, -1, path);
+	}
+	usleep (300000);
+
+	/* The receivers read what they send back from stdin; keep it open */
+	for (i = 0; i < nflows; i++) {
+		const char *bin = i == 0 && reference ? reference : reliable;
+		char *args[] = { (char *) bin, "-w", win, "-r", "/dev/null", local,
+			remote, NULL };
+		if (pipe (pipes[i]) < 0) {
+			perror ("pipe");
+			exit (1);
+		}
+		snprintf (local, sizeof (local), "%d", port (base, i, 2));
+		snprintf (remote, sizeof (remote), "localhost:%d", port (base, i, 3));
+		snprintf (path, sizeof (path), "%s/receiver%d.log", tmpdir, i);
+		receivers[i] = spawn (args, pipes[i][0], path);
+		close (pipes[i][0]);
+	}
+	usleep (100000);
+
+	t0 = now_s ();
+	for (i = 0; i < nflows; i++) {
+		const char *bin = i == 0 && reference ? reference : reliable;
+		char *args[] = { (char *) bin, "-w", win, "-s", "/dev/zero", local,
+			remote, NULL };
+		sleep_until (t0 + i * gap_s);
+		snprintf (local, sizeof (local), "%d", port (base, i, 0));
+		snprintf (remote, sizeof (remote), "localhost:%d", port (base, i, 1));
+		snprintf (path, sizeof (path), "%s/sender%d.log", tmpdir, i);
+		start[i] = now_s ();
+		senders[i] = spawn (args, -1, path);
+	}
+	t_last = start[nflows - 1];
+	t_end = t_last + time_s;
+	sleep_until (t_end);
+
+	for (i = 0; i < nflows; i++) {
+		kill (senders[i], SIGTERM);
+		kill (receivers[i], SIGTERM);
+		close (pipes[i][1]);
+	}
+	usleep (2 * interval_ms * 1e3);
+	kill (relay_pid, SIGTERM);
+	while (wait (NULL) > 0)
+		;
+
+	read_stats (stats_path);
+	step = interval_ms / 1e3;
+
+	{
+		FILE *out = NULL;
+		double total[MAX_FLOWS] = { 0 }, rate[MAX_FLOWS], x[MAX_FLOWS];
+		double all = 0, duration = 0, queue_sum = 0, converged = -1;
+		uint64_t dropped = 0;
+		int queue_max = 0, nqueue = 0, w = fair_window_s / step + 0.5;
+
+		if (series) {
+			out = fopen (series, "w");
+			if (!out) {
+				perror (series);
+				exit (1);
+			}
+			fprintf (out, "time");
+			for (i = 0; i < nflows; i++)
+				fprintf (out, ",flow%d_mbps", i);
+			fprintf (out, ",jain,queue,queue_max,dropped\n");
+		}
+		for (k = 0; k < nsamples; k++) {
+			struct sample *s = &samples[k];
+			int n = running (start, s->time, step, x, s);
+
+			if (out) {
+				fprintf (out, "%.3f", s->time - t0);
+				for (i = 0; i < nflows; i++)
+					fprintf (out, ",%.3f", s->bytes[i] * 8 / (step * 1e6));
+				fprintf (out, ",%.4f,%d,%d,%llu\n", n ? jain (x, n) : 1,
+						s->queue, s->queue_max, (unsigned long long) s->dropped);
+			}
+			if (s->time - step < t_last || s->time > t_end)
+				continue;
+			for (i = 0; i < nflows; i++)
+				total[i] += s->bytes[i];
+			duration += step;
+			queue_sum += s->queue;
+			nqueue++;
+			if (s->queue_max > queue_max)
+				queue_max = s->queue_max;
+			dropped += s->dropped;
+
+			/* The index over the window ending here */
+			if (k + 1 >= w && samples[k + 1 - w].time - step >= t_last) {
+				int j;
+				for (i = 0; i < nflows; i++) {
+					rate[i] = 0;
+					for (j = k + 1 - w; j <= k; j++)
+						rate[i] += samples[j].bytes[i];
+				}
+				if (jain (rate, nflows) < threshold)
+					converged = -1;
+				else if (converged < 0)
+					converged = s->time - t_last;
+			}
+		}
+		if (out)
+			fclose (out);
+		if (duration <= 0) {
+			fprintf (stderr, "%s: no statistics from relay; see %s\n",
+					progname, tmpdir);
+			exit (1);
+		}
+
+		for (i = 0; i < nflows; i++) {
+			rate[i] = total[i] * 8 / (duration * 1e6);
+			all += rate[i];
+		}
+		printf ("flow  delay_ms  start_s    Mb/s  share\n");
+		for (i = 0; i < nflows; i++)
+			printf ("%4d  %8g  %7.1f  %6.3f  %5.2f%s\n", i, delay_of (i),
+					start[i] - t0, rate[i], all > 0 ? rate[i] * nflows / all : 0,
+					i == 0 && reference ? "  reference" : "");
+		printf ("Jain's index %.3f, utilization %.1f%%, ", jain (rate, nflows),
+				all * 1e3 / bandwidth * 100);
+		if (converged >= 0)
+			printf ("converged %.1f s after the last start\n", converged);
+		else
+			printf ("did not converge to %g\n", threshold);
+		printf ("queue: mean %.1f, max %d of %d packets, %llu dropped\n",
+				nqueue ? queue_sum / nqueue : 0, queue_max, buffer,
+				(unsigned long long) dropped);
+	}
+
+	snprintf (path, sizeof (path), "rm -rf %s", tmpdir);
+	if (system (path))
+		fprintf (stderr, "%s: could not remove %s\n", progname, tmpdir);
+	return 0;
+}
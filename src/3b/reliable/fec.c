@@ -0,0 +1,500 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+
+/**
+ * Forward error correction.
+ *
+ * The sender closes every group of up to `group` new data packets with
+ * `parity` parity packets.  The receiver keeps a short history of the
+ * data packets it got, and when a parity packet arrives it rebuilds the
+ * data packets of the group that are still missing, as long as no more
+ * are missing than it has parity packets for.  Rebuilt packets go
+ * through rel_recvpkt like any other, so they are never reported as a
+ * hole.
+ *
+ * Parity packet j of a group is sum_i C[j][i] * d_i over GF(2^8), where
+ * d_i is the symbol of data packet i of the group.  C is a Cauchy matrix
+ * with its columns scaled so that row 0 is all ones: a single parity
+ * packet is then a plain XOR, and any m lost packets can still be
+ * rebuilt from any m parity packets.
+ *
+ * The receiver reports how many packets went missing on the way, and
+ * the sender picks group and parity sizes from that loss rate.
+ */
+
+#define FEC_PARITY 1
+#define FEC_REPORT 2
+
+#define FEC_MAX_GROUP 32
+#define FEC_MIN_GROUP 4
+#define FEC_MAX_PARITY 8
+#define FEC_HISTORY 1024
+#define FEC_PENDING 32
+#define FEC_REPORT_INTERVAL 64
+
+/**
+ * A Data packet with seqno 0 is a control packet; the first byte of its
+ * payload says which kind.  Parity packets start with this header,
+ * followed by the parity symbol.
+ */
+struct fec_header {
+	uint8_t type;
+	uint8_t index;		/* which parity packet of the group */
+	uint8_t count;		/* data packets in the group */
+	uint8_t parity;		/* parity packets in the group */
+	uint32_t base;		/* seqno of the first data packet of the group */
+};
+
+/**
+ * Sent by the receiver every FEC_REPORT_INTERVAL sequence numbers
+ */
+struct fec_report {
+	uint8_t type;
+	uint8_t pad[3];
+	uint32_t seen;		/* sequence numbers passed since the last report */
+	uint32_t missing;	/* of which did not arrive in order */
+};
+
+/**
+ * The part of a data packet FEC protects: the header from the length
+ * to the rwnd, and the payload.  The seqno follows from the packet's
+ * place in the group.  A rebuilt packet has the ackno and rwnd it was
+ * sent with, which encryption authenticates.  A parity packet has to
+ * fit a whole symbol, so with FEC on data packets carry FEC_OVERHEAD
+ * bytes less payload.
+ */
+#define FEC_SYMBOL_HEADER 10	/* len, ackno and rwnd */
+#define FEC_SYMBOL_LENGTH(len) ((len) - DATA_PACKET_METADATA_LENGTH + FEC_SYMBOL_HEADER)
+#define FEC_MAX_SYMBOL (MAX_PACKET_DATA_SIZE - (int) sizeof(struct fec_header))
+#define FEC_OVERHEAD (MAX_PACKET_DATA_SIZE - FEC_MAX_SYMBOL + FEC_SYMBOL_HEADER)
+
+typedef struct fec_symbol {
+	uint32_t seqno;
+	int length;
+	uint8_t data[FEC_MAX_SYMBOL];
+} fec_symbol;
+
+typedef struct fec_state {
+	/**
+	 * Sender: group and parity sizes for the next group, and the upper
+	 * limit on the group size given by the user
+	 */
+	int group;
+	int parity;
+	int max_group;
+	double loss_rate;
+	/**
+	 * Sender: the open group.  Parity is accumulated as the data packets
+	 * are sent, so the data packets themselves need not be kept.
+	 */
+	uint32_t base;
+	int count;
+	int group_size;
+	int group_parity;
+	int symbol_length;
+	uint8_t accumulators[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+
+	/**
+	 * Receiver: recent data packets, indexed by seqno % FEC_HISTORY
+	 */
+	fec_symbol* history;
+	/**
+	 * Receiver: parity packets of groups that cannot be rebuilt yet
+	 */
+	packet_t pending[FEC_PENDING];
+	int next_pending;
+	/**
+	 * Receiver: packets rebuilt by the last fec_recover
+	 */
+	packet_t recovered[FEC_MAX_PARITY];
+	/**
+	 * Receiver: loss statistics for the next report
+	 */
+	uint32_t highest_seen;
+	uint32_t seen;
+	uint32_t missing;
+	/**
+	 * The checksum on parity packets and reports, as on data packets
+	 */
+	int checksum;
+} fec_state;
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t fec_coefficients[FEC_MAX_PARITY][FEC_MAX_GROUP];
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+	if (!a || !b) {
+		return 0;
+	}
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) {
+	return gf_exp[255 - gf_log[a]];
+}
+
+/**
+ * dst += c * src, over len bytes
+ */
+void gf_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, int len) {
+	int i;
+	if (!c) {
+		return;
+	}
+	if (c == 1) {
+		for (i = 0; i < len; i++) {
+			dst[i] ^= src[i];
+		}
+		return;
+	}
+	int log_c = gf_log[c];
+	for (i = 0; i < len; i++) {
+		if (src[i]) {
+			dst[i] ^= gf_exp[gf_log[src[i]] + log_c];
+		}
+	}
+}
+
+void fec_init_tables() {
+	int i, j, x = 1;
+	if (gf_exp[0]) {
+		return;
+	}
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = x;
+		gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= 0x11d;
+		}
+	}
+	// C[j][i] = 1 / (x_j + y_i), scaled by (x_0 + y_i), with x_j = j and
+	// y_i = FEC_MAX_PARITY + i
+	for (j = 0; j < FEC_MAX_PARITY; j++) {
+		for (i = 0; i < FEC_MAX_GROUP; i++) {
+			uint8_t y = FEC_MAX_PARITY + i;
+			fec_coefficients[j][i] = gf_mul(y, gf_inv(j ^ y));
+		}
+	}
+}
+
+fec_state* fec_create(int max_group) {
+	fec_init_tables();
+	fec_state* fec = (fec_state*) malloc(sizeof(fec_state));
+	memset(fec, 0, sizeof(fec_state));
+	if (max_group > FEC_MAX_GROUP) {
+		max_group = FEC_MAX_GROUP;
+	}
+	if (max_group < FEC_MIN_GROUP) {
+		max_group = FEC_MIN_GROUP;
+	}
+	fec->max_group = max_group;
+	fec->group = max_group;
+	fec->parity = 1;
+	fec->history = (fec_symbol*) malloc(FEC_HISTORY * sizeof(fec_symbol));
+	memset(fec->history, 0, FEC_HISTORY * sizeof(fec_symbol));
+	return fec;
+}
+
+void fec_destroy(fec_state* fec) {
+	if (fec) {
+		free(fec->history);
+		free(fec);
+	}
+}
+
+/**
+ * Pick group and parity sizes for the measured loss rate: enough parity
+ * for the expected losses in a group and then some, shrinking the group
+ * when that would take more than FEC_MAX_PARITY parity packets
+ */
+void fec_adapt(fec_state* fec) {
+	int group = fec->max_group;
+	int parity;
+	while (1) {
+		parity = 1 + (int) (2 * fec->loss_rate * group);
+		if (parity <= FEC_MAX_PARITY || group <= FEC_MIN_GROUP) {
+			break;
+		}
+		group /= 2;
+	}
+	if (group < FEC_MIN_GROUP) {
+		group = FEC_MIN_GROUP;
+	}
+	fec->group = group;
+	fec->parity = parity > FEC_MAX_PARITY ? FEC_MAX_PARITY : parity;
+}
+
+/**
+ * Sender: add a new data packet to the open group, opening one if needed.
+ * Returns non-zero when the group is complete and fec_flush is due.
+ */
+int fec_add(fec_state* fec, packet_t* packet) {
+	int j;
+	if (!fec->count) {
+		fec->base = ntohl(packet->seqno);
+		fec->group_size = fec->group;
+		fec->group_parity = fec->parity;
+		fec->symbol_length = 0;
+		memset(fec->accumulators, 0, sizeof(fec->accumulators));
+	}
+	int length = FEC_SYMBOL_LENGTH(ntohs(packet->len));
+	for (j = 0; j < fec->group_parity; j++) {
+		uint8_t c = fec_coefficients[j][fec->count];
+		gf_mul_add(fec->accumulators[j], (uint8_t*) &packet->len, c, FEC_SYMBOL_HEADER);
+		gf_mul_add(fec->accumulators[j] + FEC_SYMBOL_HEADER, (uint8_t*) packet->data, c,
+				length - FEC_SYMBOL_HEADER);
+	}
+	if (length > fec->symbol_length) {
+		fec->symbol_length = length;
+	}
+	fec->count++;
+	// a group must not run across the wrap, where wire seqno 0 is skipped
+	return fec->count >= fec->group_size || ntohl(packet->seqno) == UINT32_MAX;
+}
+
+/**
+ * Sender: fill in parity packet j of the open group; returns its length
+ */
+int fec_parity(fec_state* fec, int j, packet_t* parity, uint32_t ackno, uint32_t rwnd) {
+	struct fec_header* header = (struct fec_header*) parity->data;
+	int packet_length = DATA_PACKET_METADATA_LENGTH + sizeof(*header)
+			+ fec->symbol_length;
+	parity->cksum = 0;
+	parity->len = htons(packet_length);
+	parity->ackno = htonl(ackno);
+	parity->rwnd = htonl(rwnd);
+	parity->seqno = 0;
+	header->type = FEC_PARITY;
+	header->index = j;
+	header->count = fec->count;
+	header->parity = fec->group_parity;
+	header->base = htonl(fec->base);
+	memcpy(parity->data + sizeof(*header), fec->accumulators[j], fec->symbol_length);
+	parity->cksum = packet_checksum(fec->checksum, parity, packet_length);
+	return packet_length;
+}
+
+/**
+ * Sender: close the open group, if any, by sending its parity packets
+ */
+void fec_flush(fec_state* fec, conn_t* c, uint32_t ackno, uint32_t rwnd) {
+	int j;
+	packet_t parity;
+	if (!fec->count) {
+		return;
+	}
+	for (j = 0; j < fec->group_parity; j++) {
+		conn_sendpkt(c, &parity, fec_parity(fec, j, &parity, ackno, rwnd));
+	}
+	fec->count = 0;
+}
+
+/**
+ * Sender: take in a loss report from the receiver
+ */
+void fec_report(fec_state* fec, packet_t* packet, int len) {
+	struct fec_report* report = (struct fec_report*) packet->data;
+	if (len < DATA_PACKET_METADATA_LENGTH + (int) sizeof(*report)) {
+		return;
+	}
+	uint32_t seen = ntohl(report->seen);
+	uint32_t missing = ntohl(report->missing);
+	if (!seen || missing > seen) {
+		return;
+	}
+	fec->loss_rate = 0.75 * fec->loss_rate + 0.25 * missing / seen;
+	fec_adapt(fec);
+}
+
+/**
+ * Receiver: keep the symbol of a data packet for rebuilding its group
+ * later, and count the sequence numbers that were skipped.  Returns
+ * non-zero when a loss report is due.
+ */
+int fec_remember(fec_state* fec, packet_t* packet, int len) {
+	uint32_t seqno = ntohl(packet->seqno);
+	fec_symbol* symbol = &fec->history[seqno % FEC_HISTORY];
+	int length = FEC_SYMBOL_LENGTH(len);
+	if (length <= FEC_MAX_SYMBOL && symbol->seqno != seqno) {
+		symbol->seqno = seqno;
+		symbol->length = length;
+		memcpy(symbol->data, &packet->len, FEC_SYMBOL_HEADER);
+		memcpy(symbol->data + FEC_SYMBOL_HEADER, packet->data, length - FEC_SYMBOL_HEADER);
+	}
+	if (seqno_lt(fec->highest_seen, seqno)) {
+		fec->seen += seqno - fec->highest_seen;
+		fec->missing += seqno - fec->highest_seen - 1;
+		fec->highest_seen = seqno;
+	}
+	return fec->seen >= FEC_REPORT_INTERVAL;
+}
+
+/**
+ * Receiver: send the loss report
+ */
+void fec_send_report(fec_state* fec, conn_t* c, uint32_t ackno, uint32_t rwnd) {
+	packet_t packet;
+	struct fec_report* report = (struct fec_report*) packet.data;
+	int packet_length = DATA_PACKET_METADATA_LENGTH + sizeof(*report);
+	memset(&packet, 0, packet_length);
+	packet.len = htons(packet_length);
+	packet.ackno = htonl(ackno);
+	packet.rwnd = htonl(rwnd);
+	report->type = FEC_REPORT;
+	report->seen = htonl(fec->seen);
+	report->missing = htonl(fec->missing);
+	packet.cksum = packet_checksum(fec->checksum, &packet, packet_length);
+	conn_sendpkt(c, &packet, packet_length);
+	fec->seen = 0;
+	fec->missing = 0;
+}
+
+/**
+ * Invert an n x n matrix over GF(2^8) in place; returns -1 if singular
+ */
+int gf_invert(uint8_t m[FEC_MAX_PARITY][FEC_MAX_PARITY], int n) {
+	uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	int row, col, k;
+	memset(inverse, 0, sizeof(inverse));
+	for (row = 0; row < n; row++) {
+		inverse[row][row] = 1;
+	}
+	for (col = 0; col < n; col++) {
+		for (row = col; row < n && !m[row][col]; row++)
+			;
+		if (row == n) {
+			return -1;
+		}
+		for (k = 0; k < n; k++) {
+			uint8_t t = m[row][k]; m[row][k] = m[col][k]; m[col][k] = t;
+			t = inverse[row][k]; inverse[row][k] = inverse[col][k]; inverse[col][k] = t;
+		}
+		uint8_t scale = gf_inv(m[col][col]);
+		for (k = 0; k < n; k++) {
+			m[col][k] = gf_mul(m[col][k], scale);
+			inverse[col][k] = gf_mul(inverse[col][k], scale);
+		}
+		for (row = 0; row < n; row++) {
+			uint8_t factor = m[row][col];
+			if (row == col || !factor) {
+				continue;
+			}
+			for (k = 0; k < n; k++) {
+				m[row][k] ^= gf_mul(factor, m[col][k]);
+				inverse[row][k] ^= gf_mul(factor, inverse[col][k]);
+			}
+		}
+	}
+	memcpy(m, inverse, sizeof(inverse));
+	return 0;
+}
+
+/**
+ * Receiver: take in a parity packet and rebuild what can be rebuilt of
+ * its group.  Data packets below next_seqno_expected are not needed any
+ * more.  Returns the number of packets rebuilt into fec->recovered, each
+ * a complete data packet with a valid checksum.
+ */
+int fec_recover(fec_state* fec, packet_t* parity, int len, uint32_t next_seqno_expected) {
+	struct fec_header* header = (struct fec_header*) parity->data;
+	int symbol_length = len - DATA_PACKET_METADATA_LENGTH - sizeof(*header);
+	uint32_t base = ntohl(header->base);
+	int count = header->count;
+	int i, j, k;
+
+	if (symbol_length < FEC_SYMBOL_HEADER || symbol_length > FEC_MAX_SYMBOL
+			|| count < 1 || count > FEC_MAX_GROUP
+			|| header->index >= FEC_MAX_PARITY
+			|| base < 1 || seqno_le(base + count, next_seqno_expected)) {
+		return 0;
+	}
+
+	int missing[FEC_MAX_PARITY];
+	int nmissing = 0;
+	for (i = 0; i < count; i++) {
+		if (fec->history[(base + i) % FEC_HISTORY].seqno != base + i) {
+			if (seqno_lt(base + i, next_seqno_expected) || nmissing == FEC_MAX_PARITY) {
+				// delivered and forgotten, or beyond repair
+				return 0;
+			}
+			missing[nmissing++] = i;
+		}
+	}
+	if (!nmissing) {
+		return 0;
+	}
+
+	// the parity packets of this group: this one and any held back
+	packet_t* parities[FEC_MAX_PARITY];
+	int nparities = 0;
+	parities[nparities++] = parity;
+	for (k = 0; k < FEC_PENDING && nparities < nmissing; k++) {
+		struct fec_header* held = (struct fec_header*) fec->pending[k].data;
+		if (fec->pending[k].len && ntohl(held->base) == base
+				&& held->index != header->index
+				&& ntohs(fec->pending[k].len) == len) {
+			parities[nparities++] = &fec->pending[k];
+		}
+	}
+	if (nparities < nmissing) {
+		memcpy(&fec->pending[fec->next_pending], parity, len);
+		fec->next_pending = (fec->next_pending + 1) % FEC_PENDING;
+		return 0;
+	}
+
+	// syndromes: each parity symbol minus the contribution of the data
+	// packets we have
+	uint8_t syndromes[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+	uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	for (j = 0; j < nmissing; j++) {
+		struct fec_header* h = (struct fec_header*) parities[j]->data;
+		memcpy(syndromes[j], parities[j]->data + sizeof(*h), symbol_length);
+		for (i = 0, k = 0; i < count; i++) {
+			if (k < nmissing && missing[k] == i) {
+				matrix[j][k++] = fec_coefficients[h->index][i];
+				continue;
+			}
+			fec_symbol* symbol = &fec->history[(base + i) % FEC_HISTORY];
+			gf_mul_add(syndromes[j], symbol->data, fec_coefficients[h->index][i],
+					symbol->length < symbol_length ? symbol->length : symbol_length);
+		}
+	}
+	if (gf_invert(matrix, nmissing) < 0) {
+		return 0;
+	}
+
+	int nrecovered = 0;
+	for (k = 0; k < nmissing; k++) {
+		uint8_t symbol[FEC_MAX_SYMBOL];
+		memset(symbol, 0, symbol_length);
+		for (j = 0; j < nmissing; j++) {
+			gf_mul_add(symbol, syndromes[j], matrix[k][j], symbol_length);
+		}
+		packet_t* packet = &fec->recovered[nrecovered];
+		memcpy(&packet->len, symbol, FEC_SYMBOL_HEADER);
+		int packet_length = ntohs(packet->len);
+		if (packet_length < DATA_PACKET_METADATA_LENGTH
+				|| FEC_SYMBOL_LENGTH(packet_length) > symbol_length) {
+			continue;
+		}
+		packet->cksum = 0;
+		packet->seqno = htonl(base + missing[k]);
+		memcpy(packet->data, symbol + FEC_SYMBOL_HEADER,
+				packet_length - DATA_PACKET_METADATA_LENGTH);
+		packet->cksum = cksum(packet, packet_length);
+		nrecovered++;
+	}
+	// the group is done with
+	for (k = 0; k < FEC_PENDING; k++) {
+		struct fec_header* held = (struct fec_header*) fec->pending[k].data;
+		if (fec->pending[k].len && ntohl(held->base) == base) {
+			fec->pending[k].len = 0;
+		}
+	}
+	return nrecovered;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <assert.h>
+
+#include "reliable.c"
+
+static const char secret[] = "fec test secret, thirty-two bytes";
+static const uint8_t sender_salt[AEAD_SALT_LENGTH] = { 1, 2, 3 };
+static const uint8_t receiver_salt[AEAD_SALT_LENGTH] = { 4, 5, 6 };
+
+/**
+ * Send a group of count sealed packets whose ackno and rwnd all differ,
+ * lose the ones in lost, and check that the parity packets, with yet
+ * another ackno and rwnd, rebuild them into the packets that were sent
+ */
+void check_recovery(int count, int parity, const int* lost, int nlost) {
+	aead_state* tx = aead_create(secret, sizeof(secret) - 1, sender_salt,
+			receiver_salt, true);
+	aead_state* rx = aead_create(secret, sizeof(secret) - 1, sender_salt,
+			receiver_salt, false);
+	fec_state* tx_fec = fec_create(count);
+	fec_state* rx_fec = fec_create(count);
+	assert(tx && rx);
+	tx_fec->group = count;
+	tx_fec->parity = parity;
+
+	int i, j;
+	for (i = 0; i < count; i++) {
+		packet_list* packet = new_packet();
+		uint64_t seqno = 1 + i;
+		int length = 100 + 10 * i;
+		memset(packet->packet, 0, MAX_PACKET_SIZE);
+		memset(packet->packet->data, 'a' + i, length);
+		packet->packet->len = htons(DATA_PACKET_METADATA_LENGTH + length);
+		packet->packet->ackno = htonl(1 + i);
+		packet->packet->rwnd = htonl(32 - i);
+		packet->packet->seqno = htonl(seqno);
+		aead_seal_batch(tx, &packet, &seqno, 1);
+		int packet_length = ntohs(packet->packet->len);
+		packet->packet->cksum = packet_checksum(CHECKSUM_SUM, packet->packet,
+				packet_length);
+		fec_add(tx_fec, packet->packet);
+		for (j = 0; j < nlost && lost[j] != i; j++) {
+		}
+		if (j == nlost) {
+			fec_remember(rx_fec, packet->packet, packet_length);
+		}
+		remove_head_packet(&packet);
+	}
+
+	int recovered = 0;
+	for (j = 0; j < parity; j++) {
+		packet_t packet;
+		int length = fec_parity(tx_fec, j, &packet, 1000 + j, 7);
+		recovered += fec_recover(rx_fec, &packet, length, 1);
+	}
+	assert(recovered == nlost);
+
+	for (j = 0; j < nlost; j++) {
+		packet_t* packet = &rx_fec->recovered[j];
+		uint32_t seqno = ntohl(packet->seqno);
+		int length = 100 + 10 * (seqno - 1);
+		assert(ntohl(packet->ackno) == seqno);
+		assert(ntohl(packet->rwnd) == 32 - (seqno - 1));
+		assert(aead_open(rx, packet, ntohs(packet->len), seqno)
+				== DATA_PACKET_METADATA_LENGTH + length);
+		for (i = 0; i < length; i++) {
+			assert(packet->data[i] == 'a' + (int) seqno - 1);
+		}
+	}
+
+	fec_destroy(tx_fec);
+	fec_destroy(rx_fec);
+	aead_destroy(tx);
+	aead_destroy(rx);
+}
+
+void test_recover_one() {
+	int lost[] = { 2 };
+	check_recovery(4, 1, lost, 1);
+}
+
+void test_recover_two() {
+	int lost[] = { 0, 5 };
+	check_recovery(8, 2, lost, 2);
+}
+
+/**
+ * Every field of the header after the checksum is authenticated
+ */
+void test_header_tampering() {
+	aead_state* tx = aead_create(secret, sizeof(secret) - 1, sender_salt,
+			receiver_salt, true);
+	aead_state* rx = aead_create(secret, sizeof(secret) - 1, sender_salt,
+			receiver_salt, false);
+	packet_list* packet = new_packet();
+	packet_t copy;
+	uint64_t seqno = 1;
+	memset(packet->packet, 0, MAX_PACKET_SIZE);
+	memset(packet->packet->data, 'x', 50);
+	packet->packet->len = htons(DATA_PACKET_METADATA_LENGTH + 50);
+	packet->packet->seqno = htonl(seqno);
+	aead_seal_batch(tx, &packet, &seqno, 1);
+	int length = ntohs(packet->packet->len);
+
+	memcpy(&copy, packet->packet, length);
+	copy.seqno = htonl(2);
+	assert(aead_open(rx, &copy, length, 2) < 0);
+
+	memcpy(&copy, packet->packet, length);
+	copy.len = htons(length - 1);
+	assert(aead_open(rx, &copy, length - 1, 1) < 0);
+
+	memcpy(&copy, packet->packet, length);
+	copy.ackno = htonl(99);
+	assert(aead_open(rx, &copy, length, 1) < 0);
+
+	memcpy(&copy, packet->packet, length);
+	copy.rwnd = htonl(99);
+	assert(aead_open(rx, &copy, length, 1) < 0);
+
+	memcpy(&copy, packet->packet, length);
+	assert(aead_open(rx, &copy, length, 1) == length - AEAD_TAG_LENGTH);
+
+	remove_head_packet(&packet);
+	aead_destroy(tx);
+	aead_destroy(rx);
+}
+
+/**
+ * ACKs open with the key of their direction, only once, and only in
+ * order
+ */
+void test_ack() {
+	aead_state* tx = aead_create(secret, sizeof(secret) - 1, sender_salt,
+			receiver_salt, true);
+	aead_state* rx = aead_create(secret, sizeof(secret) - 1, sender_salt,
+			receiver_salt, false);
+	packet_t first, second, copy;
+	int length = aead_seal_ack(rx, &first, 5, 30);
+	assert(aead_seal_ack(rx, &second, 9, 20) == length);
+	assert(first.seqno == 0 && first.data[0] == AEAD_ACK);
+
+	// not with the key of the other direction
+	memcpy(&copy, &first, length);
+	assert(!aead_open_ack(rx, &copy, length));
+
+	memcpy(&copy, &first, length);
+	copy.ackno = htonl(6);
+	assert(!aead_open_ack(tx, &copy, length));
+	memcpy(&copy, &first, length);
+	copy.rwnd = htonl(31);
+	assert(!aead_open_ack(tx, &copy, length));
+
+	assert(aead_open_ack(tx, &second, length));
+	// an older one is refused, as is the same one again
+	assert(!aead_open_ack(tx, &first, length));
+	assert(!aead_open_ack(tx, &second, length));
+
+	// and the sender's ACKs open at the receiver
+	length = aead_seal_ack(tx, &first, 2, 32);
+	assert(aead_open_ack(rx, &first, length));
+
+	aead_destroy(tx);
+	aead_destroy(rx);
+}
+
+int main() {
+	test_recover_one();
+	test_recover_two();
+	test_header_tampering();
+	test_ack();
+	printf("All tests passed\n");
+	return 0;
+}
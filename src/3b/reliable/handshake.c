@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+
+/**
+ * Connection handshake.
+ *
+ * The sender sends a hello with the features it wants and its
+ * parameters together with its first flight of data, so the handshake
+ * costs no round trip.  A receiver that knows the handshake answers
+ * with the features it supports and its own parameters.  Old peers
+ * treat the hello as a data packet out of the window and just ACK it.
+ *
+ * The first flight, seqnos below HANDSHAKE_SEQNO, always goes without
+ * any feature.  If a reply came back by the time the sender gets to
+ * HANDSHAKE_SEQNO, the data packet with that seqno is a settings packet
+ * naming the features in use from then on; the receiver acts on it when
+ * it writes it out, so it switches over at exactly that point in the
+ * byte stream.
+ *
+ * The hello goes out ahead of the first flight and the reply ahead of
+ * the first ACK, so each end falls back to the old protocol as soon as
+ * it sees data first: a receiver that gets a data packet before any
+ * hello ignores later ones, and a sender that has data ACKed before a
+ * reply sends no settings.  If the first flight was ACKed but neither
+ * came, the sender also gives up after HANDSHAKE_RETRIES more hellos.
+ * Packets keep the old sizes meanwhile.  Only when a reply is lost or
+ * overtaken by an ACK does a receiver that replied get no settings
+ * packet, and then only a data packet of exactly the settings length
+ * that starts with HANDSHAKE_MAGIC is misread.
+ *
+ * Encryption and streams change every data packet from the first, so a
+ * sender that wants either sends no data until the reply has come, and
+ * gives up if no reply that grants it comes within HANDSHAKE_TIMEOUT_MS.
+ * A receiver frames streams only once it has granted them in a reply.
+ *
+ * Hellos and replies are control packets, data packets with seqno 0.
+ * Both carry a random salt, from which and the -K secret each end
+ * derives the keys of the connection (see aead.c); peers from before
+ * the salt send shorter ones, and are taken to have none.
+ */
+
+#define HANDSHAKE_HELLO 3
+#define HANDSHAKE_REPLY 4
+
+#define HANDSHAKE_VERSION 1
+#define HANDSHAKE_SEQNO (INITIAL_SEND_WINDOW + 1)
+#define HANDSHAKE_RETRIES 3
+#define HANDSHAKE_MAGIC "RELSET01"
+#define HANDSHAKE_TIMEOUT_MS 3000
+
+/**
+ * Capability bits
+ */
+#define CAPABILITY_FEC 0x1
+#define CAPABILITY_COMPRESS 0x2
+#define CAPABILITY_CRC32C 0x4
+#define CAPABILITY_NO_CHECKSUM 0x8	/* granted only with -c none */
+#define CAPABILITY_AEAD 0x10		/* granted only with -K */
+#define CAPABILITY_STREAMS 0x20		/* granted only with -m */
+#define CAPABILITIES_SUPPORTED (CAPABILITY_FEC | CAPABILITY_COMPRESS \
+		| CAPABILITY_CRC32C)
+
+/**
+ * Handshake progress, sender side
+ */
+#define HANDSHAKE_PENDING 0
+#define HANDSHAKE_REPLIED 1
+#define HANDSHAKE_DONE 2
+
+struct handshake_hello {
+	uint8_t type;
+	uint8_t version;
+	uint16_t max_payload;		/* largest payload the peer may send */
+	uint32_t capabilities;		/* hello: wanted, reply: supported */
+	uint32_t window;		/* receive window, in packets */
+	uint32_t initial_window;	/* hello: proposed, reply: allowed */
+	uint8_t salt[AEAD_SALT_LENGTH];
+};
+
+/**
+ * Payload of the data packet with seqno HANDSHAKE_SEQNO, when the
+ * peers agreed on anything
+ */
+struct handshake_settings {
+	char magic[8];
+	uint32_t capabilities;
+};
+
+typedef struct handshake_state {
+	int progress;
+	int retries;
+	/**
+	 * Sender: features asked for by the user.  Receiver: features the
+	 * sender asked for in its hello.
+	 */
+	uint32_t wanted;
+	/**
+	 * What the peer told us; the sender keeps its own values until a
+	 * reply comes
+	 */
+	uint32_t capabilities;
+	int max_payload;
+	int window;
+	int initial_window;
+	/**
+	 * Our salt, and the peer's once a hello or reply brought one
+	 */
+	uint8_t salt[AEAD_SALT_LENGTH];
+	uint8_t peer_salt[AEAD_SALT_LENGTH];
+	bool have_peer_salt;
+	/**
+	 * Whether the first hello went out, and when
+	 */
+	bool started;
+	uint64_t started_us;
+} handshake_state;
+
+handshake_state* handshake_create(uint32_t wanted, int max_payload,
+		int window, int initial_window) {
+	handshake_state* h = (handshake_state*) malloc(sizeof(handshake_state));
+	memset(h, 0, sizeof(handshake_state));
+	h->wanted = wanted;
+	h->max_payload = max_payload;
+	h->window = window;
+	h->initial_window = initial_window;
+	aead_salt(h->salt);
+	return h;
+}
+
+void handshake_destroy(handshake_state* h) {
+	free(h);
+}
+
+void handshake_send(conn_t* c, int type, uint32_t capabilities,
+		int max_payload, int window, int initial_window, const uint8_t* salt,
+		uint32_t ackno, uint32_t rwnd) {
+	packet_t packet;
+	struct handshake_hello* hello = (struct handshake_hello*) packet.data;
+	int packet_length = DATA_PACKET_METADATA_LENGTH + sizeof(*hello);
+	memset(&packet, 0, packet_length);
+	packet.len = htons(packet_length);
+	packet.ackno = htonl(ackno);
+	packet.rwnd = htonl(rwnd);
+	hello->type = type;
+	hello->version = HANDSHAKE_VERSION;
+	hello->max_payload = htons(max_payload);
+	hello->capabilities = htonl(capabilities);
+	hello->window = htonl(window);
+	hello->initial_window = htonl(initial_window);
+	memcpy(hello->salt, salt, sizeof(hello->salt));
+	packet.cksum = cksum(&packet, packet_length);
+	conn_sendpkt(c, &packet, packet_length);
+}
+
+/**
+ * Take in a hello or reply; returns false if it is malformed
+ */
+bool handshake_receive(handshake_state* h, packet_t* packet, int len) {
+	struct handshake_hello* hello = (struct handshake_hello*) packet->data;
+	if (len < DATA_PACKET_METADATA_LENGTH + (int) offsetof(struct handshake_hello, salt)
+			|| hello->version != HANDSHAKE_VERSION) {
+		return false;
+	}
+	if (len >= DATA_PACKET_METADATA_LENGTH + (int) sizeof(*hello)) {
+		memcpy(h->peer_salt, hello->salt, sizeof(h->peer_salt));
+		h->have_peer_salt = true;
+	}
+	int max_payload = ntohs(hello->max_payload);
+	int window = ntohl(hello->window);
+	int initial_window = ntohl(hello->initial_window);
+	if (hello->type == HANDSHAKE_HELLO) {
+		h->wanted = ntohl(hello->capabilities);
+	}
+	else {
+		h->capabilities = ntohl(hello->capabilities);
+	}
+	if (max_payload > 0 && max_payload < h->max_payload) {
+		h->max_payload = max_payload;
+	}
+	if (window > 0 && window < h->window) {
+		h->window = window;
+	}
+	if (initial_window > 0 && initial_window < h->initial_window) {
+		h->initial_window = initial_window;
+	}
+	return true;
+}
+
+int handshake_settings_length() {
+	return sizeof(struct handshake_settings);
+}
+
+void handshake_write_settings(char* payload, uint32_t capabilities) {
+	struct handshake_settings* settings = (struct handshake_settings*) payload;
+	memcpy(settings->magic, HANDSHAKE_MAGIC, sizeof(settings->magic));
+	settings->capabilities = htonl(capabilities);
+}
+
+/**
+ * Whether a data packet is a settings packet; sets *capabilities if so
+ */
+bool handshake_read_settings(packet_t* packet, uint32_t* capabilities) {
+	struct handshake_settings* settings = (struct handshake_settings*) packet->data;
+	if (ntohl(packet->seqno) != HANDSHAKE_SEQNO
+			|| ntohs(packet->len) != DATA_PACKET_METADATA_LENGTH + sizeof(*settings)
+			|| memcmp(settings->magic, HANDSHAKE_MAGIC, sizeof(settings->magic))) {
+		return false;
+	}
+	*capabilities = ntohl(settings->capabilities);
+	return true;
+}
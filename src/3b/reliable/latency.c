@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "latency.h"
+
+static FILE *latency_file;
+
+/* The largest value that falls in bucket i */
+static uint64_t
+bucket_top (int i)
+{
+	int shift;
+
+	if (i < 2 * HISTOGRAM_SUB)
+		return i;
+	shift = i / HISTOGRAM_SUB - 1;
+	return ((uint64_t) (i - HISTOGRAM_SUB * shift + 1) << shift) - 1;
+}
+
+uint64_t
+histogram_percentile (const struct histogram *h, double q)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+	rank = (uint64_t) (q * h->count + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	return i < HISTOGRAM_BUCKETS && bucket_top (i) < h->max
+		? bucket_top (i) : h->max;
+}
+
+int
+latency_open (const char *path)
+{
+	latency_file = fopen (path, "a");
+	if (!latency_file) {
+		perror (path);
+		return -1;
+	}
+	if (ftell (latency_file) == 0)
+		fprintf (latency_file, "pid,role,histogram,count,mean_us,"
+				"p50_us,p99_us,p999_us,max_us\n");
+	return 0;
+}
+
+struct latency *
+latency_attach (void)
+{
+	struct latency *l;
+
+	if (!latency_file)
+		return NULL;
+	l = calloc (1, sizeof (*l));
+	if (!l)
+		perror ("latency");
+	return l;
+}
+
+static void
+report (const char *name, const struct histogram *h, int sender_receiver)
+{
+	unsigned long long p50, p99, p999;
+
+	if (!h->count)
+		return;
+	p50 = histogram_percentile (h, 0.5);
+	p99 = histogram_percentile (h, 0.99);
+	p999 = histogram_percentile (h, 0.999);
+	fprintf (stderr, "Latency %s: \t%llu samples, p50 %llu us, p99 %llu us, "
+			"p99.9 %llu us, max %llu us\n", name,
+			(unsigned long long) h->count, p50, p99, p999,
+			(unsigned long long) h->max);
+	if (latency_file) {
+		fprintf (latency_file, "%d,%s,%s,%llu,%.1f,%llu,%llu,%llu,%llu\n",
+				(int) getpid (),
+				sender_receiver == 1 ? "sender" : "receiver", name,
+				(unsigned long long) h->count, (double) h->sum / h->count,
+				p50, p99, p999, (unsigned long long) h->max);
+		fflush (latency_file);
+	}
+}
+
+void
+latency_detach (struct latency *l, int sender_receiver)
+{
+	if (!l)
+		return;
+	report ("ack", &l->ack, sender_receiver);
+	report ("reorder", &l->reorder, sender_receiver);
+	report ("output", &l->output, sender_receiver);
+	free (l);
+}
@@ -0,0 +1,89 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Latency histograms.
+
+   With -L, every connection keeps three, in microseconds:
+
+     ack      a data packet first sent to the cumulative ACK covering it
+     reorder  a data packet received to its payload handed to conn_output,
+              the time it waits in the receive buffer behind a hole
+     output   bytes handed to conn_output to written to the output fd,
+              the time they wait in the output queue; the streams of -m
+              past the first have no histograms of their own
+
+   The buckets are log-linear, as in HdrHistogram: values below 64 us
+   each have their own, and above that every power of two is split in
+   32, so a percentile read back is within 1/32 of the true value.
+   Values from 2^36 us (19 hours) up share the last bucket.  Recording
+   is a few instructions and never allocates.
+
+   The percentiles are printed when the connection closes and appended
+   to the -L file, as CSV, one line per histogram.  Without -L there
+   are no histograms, and nothing is timed for them.
+
+   ----------------------------------------------------------------------- */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 36
+#define HISTOGRAM_BUCKETS \
+	(HISTOGRAM_SUB * (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1))
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct latency {
+	struct histogram ack;
+	struct histogram reorder;
+	struct histogram output;
+};
+
+static inline void
+histogram_record (struct histogram *h, uint64_t v)
+{
+	uint64_t b = v;
+	int i = v;
+
+	if (b >= 2 * HISTOGRAM_SUB) {
+		int shift;
+		if (b >> HISTOGRAM_MAX_BITS)
+			b = ((uint64_t) 1 << HISTOGRAM_MAX_BITS) - 1;
+		shift = 63 - __builtin_clzll (b) - HISTOGRAM_SUB_BITS;
+		i = HISTOGRAM_SUB * shift + (int) (b >> shift);
+	}
+	h->buckets[i]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* The value at quantile q (0.5 for the median), to within a bucket */
+uint64_t histogram_percentile (const struct histogram *h, double q);
+
+/* Open the -L file; returns -1 on failure */
+int latency_open (const char *path);
+/* Histograms for a new connection; NULL without -L */
+struct latency *latency_attach (void);
+/* Print the percentiles of a closing connection to stderr and the -L
+ * file, and free its histograms; l may be NULL */
+void latency_detach (struct latency *l, int sender_receiver);
+
+/* Record v in histogram which of connection c, if it has histograms */
+#define LATENCY_RECORD(c, which, v)					\
+	do {								\
+		struct latency *l_ = (c)->latency;			\
+		if (l_)							\
+			histogram_record (&l_->which, (v));		\
+	} while (0)
+
+#endif /* LATENCY_H */
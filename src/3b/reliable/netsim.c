@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "netsim.h"
+#include "clock.h"
+
+#define NETSIM_GARBAGE_MAX 512
+/* A packet held back to be reordered goes out after the next packet, or
+ * after this long if no packet comes */
+#define NETSIM_REORDER_HOLD_US 20000
+
+struct netsim_packet {
+	uint64_t due_us;
+	uint64_t order;			/* ties go first in, first out */
+	void *arg;
+	size_t len;
+	char data[];
+};
+
+struct netsim {
+	struct netsim_config cfg;
+	const char *name;
+	netsim_deliver_fn *deliver;
+	uint64_t rng;
+
+	/* Packets on the link, a min-heap on due time */
+	struct netsim_packet **heap;
+	int npackets;
+	int heap_size;
+	uint64_t order;
+
+	/* The packet held back for reordering */
+	struct netsim_packet *held;
+	uint64_t held_until;
+
+	/* When the link finishes the packets queued for it, and when each
+	 * of them is done, oldest first */
+	uint64_t link_free_ns;
+	uint64_t *backlog;
+	int backlog_head, backlog_count;
+
+	struct {
+		uint64_t packets, delivered, lost, reordered, duplicated;
+		uint64_t badlength, garbage, corrupted, truncated, queue_drops;
+	} stats;
+};
+
+/* xorshift64* */
+static uint64_t
+netsim_random (struct netsim *ns)
+{
+	ns->rng ^= ns->rng >> 12;
+	ns->rng ^= ns->rng << 25;
+	ns->rng ^= ns->rng >> 27;
+	return ns->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double
+netsim_uniform (struct netsim *ns)
+{
+	return (netsim_random (ns) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int
+netsim_chance (struct netsim *ns, double p)
+{
+	return p > 0 && netsim_uniform (ns) < p;
+}
+
+static int
+netsim_before (const struct netsim_packet *a, const struct netsim_packet *b)
+{
+	return a->due_us < b->due_us
+		|| (a->due_us == b->due_us && a->order < b->order);
+}
+
+static void
+netsim_sift_down (struct netsim *ns, int i)
+{
+	struct netsim_packet **h = ns->heap;
+	for (;;) {
+		int l = 2 * i + 1, m = i;
+		if (l < ns->npackets && netsim_before (h[l], h[m]))
+			m = l;
+		if (l + 1 < ns->npackets && netsim_before (h[l + 1], h[m]))
+			m = l + 1;
+		if (m == i)
+			return;
+		struct netsim_packet *t = h[i];
+		h[i] = h[m];
+		h[m] = t;
+		i = m;
+	}
+}
+
+static void
+netsim_push (struct netsim *ns, struct netsim_packet *p)
+{
+	int i;
+
+	if (ns->npackets == ns->heap_size) {
+		ns->heap_size = ns->heap_size ? 2 * ns->heap_size : 64;
+		ns->heap = realloc (ns->heap, ns->heap_size * sizeof (*ns->heap));
+		if (!ns->heap) {
+			perror ("netsim");
+			exit (1);
+		}
+	}
+	p->order = ns->order++;
+	for (i = ns->npackets++; i > 0; i = (i - 1) / 2) {
+		struct netsim_packet *parent = ns->heap[(i - 1) / 2];
+		if (!netsim_before (p, parent))
+			break;
+		ns->heap[i] = parent;
+	}
+	ns->heap[i] = p;
+}
+
+static struct netsim_packet *
+netsim_pop (struct netsim *ns)
+{
+	struct netsim_packet *p = ns->heap[0];
+	ns->heap[0] = ns->heap[--ns->npackets];
+	netsim_sift_down (ns, 0);
+	return p;
+}
+
+static struct netsim_packet *
+netsim_alloc (void *arg, size_t len)
+{
+	struct netsim_packet *p = malloc (sizeof (*p) + len);
+	if (!p) {
+		perror ("netsim");
+		exit (1);
+	}
+	p->arg = arg;
+	p->len = len;
+	return p;
+}
+
+static struct netsim_packet *
+netsim_copy (void *arg, const void *buf, size_t len)
+{
+	struct netsim_packet *p = netsim_alloc (arg, len);
+	memcpy (p->data, buf, len);
+	return p;
+}
+
+/* Queue the packet for the link and send it on its way */
+static void
+netsim_link (struct netsim *ns, struct netsim_packet *p, uint64_t now)
+{
+	uint64_t done_ns = now * 1000;
+
+	if (ns->cfg.rate_kbps) {
+		uint64_t now_ns = now * 1000;
+		while (ns->backlog_count && ns->backlog[ns->backlog_head] <= now_ns) {
+			ns->backlog_head = (ns->backlog_head + 1) % ns->cfg.queue;
+			ns->backlog_count--;
+		}
+		if (ns->cfg.queue && ns->backlog_count >= ns->cfg.queue) {
+			ns->stats.queue_drops++;
+			free (p);
+			return;
+		}
+		if (ns->link_free_ns > now_ns)
+			done_ns = ns->link_free_ns;
+		done_ns += p->len * 8 * 1000000 / ns->cfg.rate_kbps;
+		ns->link_free_ns = done_ns;
+		if (ns->cfg.queue) {
+			ns->backlog[(ns->backlog_head + ns->backlog_count) % ns->cfg.queue]
+					= done_ns;
+			ns->backlog_count++;
+		}
+	}
+	p->due_us = done_ns / 1000 + (uint64_t) (ns->cfg.delay_ms * 1000);
+	if (ns->cfg.jitter_ms > 0)
+		p->due_us += (uint64_t) (netsim_uniform (ns) * ns->cfg.jitter_ms * 1000);
+	netsim_push (ns, p);
+}
+
+/* The impairments after the reorderer, for one copy of a packet */
+static void
+netsim_impair (struct netsim *ns, struct netsim_packet *p, uint64_t now)
+{
+	if (netsim_chance (ns, ns->cfg.badlength) && p->len) {
+		p->data[0] |= 0x80;
+		ns->stats.badlength++;
+	}
+	if (netsim_chance (ns, ns->cfg.garbage)) {
+		size_t len = netsim_random (ns) % (NETSIM_GARBAGE_MAX + 1);
+		struct netsim_packet *g = netsim_alloc (p->arg, len);
+		size_t i;
+
+		for (i = 0; i < len; i++)
+			g->data[i] = netsim_random (ns);
+		ns->stats.garbage++;
+		netsim_link (ns, g, now);
+	}
+	if (netsim_chance (ns, ns->cfg.corrupt) && p->len) {
+		p->data[netsim_random (ns) % p->len] ^= 1 << (netsim_random (ns) % 8);
+		ns->stats.corrupted++;
+	}
+	if (netsim_chance (ns, ns->cfg.truncate) && p->len) {
+		p->len--;
+		ns->stats.truncated++;
+	}
+	netsim_link (ns, p, now);
+}
+
+static void
+netsim_duplicate (struct netsim *ns, struct netsim_packet *p, uint64_t now)
+{
+	if (netsim_chance (ns, ns->cfg.duplicate)) {
+		ns->stats.duplicated++;
+		netsim_impair (ns, netsim_copy (p->arg, p->data, p->len), now);
+	}
+	netsim_impair (ns, p, now);
+}
+
+void
+netsim_submit (struct netsim *ns, void *arg, const void *buf, size_t len)
+{
+	struct netsim_packet *p;
+	uint64_t now = clock_now_us ();
+
+	ns->stats.packets++;
+	if (netsim_chance (ns, ns->cfg.loss)) {
+		ns->stats.lost++;
+		return;
+	}
+	p = netsim_copy (arg, buf, len);
+	if (ns->held) {
+		struct netsim_packet *held = ns->held;
+		ns->held = NULL;
+		netsim_duplicate (ns, p, now);
+		netsim_duplicate (ns, held, now);
+	}
+	else if (netsim_chance (ns, ns->cfg.reorder)) {
+		ns->stats.reordered++;
+		ns->held = p;
+		ns->held_until = now + NETSIM_REORDER_HOLD_US;
+	}
+	else
+		netsim_duplicate (ns, p, now);
+}
+
+void
+netsim_run (struct netsim *ns, uint64_t now_us)
+{
+	if (ns->held && ns->held_until <= now_us) {
+		struct netsim_packet *held = ns->held;
+		ns->held = NULL;
+		netsim_duplicate (ns, held, now_us);
+	}
+	while (ns->npackets && ns->heap[0]->due_us <= now_us) {
+		struct netsim_packet *p = netsim_pop (ns);
+		ns->stats.delivered++;
+		ns->deliver (p->arg, p->data, p->len);
+		free (p);
+	}
+}
+
+uint64_t
+netsim_next (struct netsim *ns)
+{
+	uint64_t due = UINT64_MAX;
+
+	if (!ns)
+		return due;
+	if (ns->npackets)
+		due = ns->heap[0]->due_us;
+	if (ns->held && ns->held_until < due)
+		due = ns->held_until;
+	return due;
+}
+
+int
+netsim_timeout (struct netsim *ns, uint64_t now_us, int timeout_ms)
+{
+	uint64_t due = netsim_next (ns);
+	int ms;
+
+	if (due == UINT64_MAX)
+		return timeout_ms;
+	ms = due <= now_us ? 0 : (int) ((due - now_us + 999) / 1000);
+	return timeout_ms < 0 || ms < timeout_ms ? ms : timeout_ms;
+}
+
+int
+netsim_pending (struct netsim *ns, void *arg)
+{
+	int i, n = 0;
+
+	if (!ns)
+		return 0;
+	for (i = 0; i < ns->npackets; i++)
+		n += ns->heap[i]->arg == arg;
+	return n + (ns->held && ns->held->arg == arg);
+}
+
+void
+netsim_forget (struct netsim *ns, void *arg)
+{
+	int i, kept = 0;
+
+	if (!ns)
+		return;
+	for (i = 0; i < ns->npackets; i++) {
+		if (ns->heap[i]->arg == arg)
+			free (ns->heap[i]);
+		else
+			ns->heap[kept++] = ns->heap[i];
+	}
+	ns->npackets = kept;
+	for (i = kept / 2 - 1; i >= 0; i--)
+		netsim_sift_down (ns, i);
+	if (ns->held && ns->held->arg == arg) {
+		free (ns->held);
+		ns->held = NULL;
+	}
+}
+
+struct netsim *
+netsim_create (const struct netsim_config *cfg, uint64_t seed,
+		const char *name, netsim_deliver_fn *deliver)
+{
+	struct netsim *ns = calloc (1, sizeof (*ns));
+
+	if (!ns) {
+		perror ("netsim");
+		exit (1);
+	}
+	ns->cfg = *cfg;
+	ns->name = name;
+	ns->deliver = deliver;
+	/* xorshift must not start at 0; mix the seed so nearby seeds differ */
+	ns->rng = (seed + 1) * 0x9e3779b97f4a7c15ULL;
+	if (!ns->rng)
+		ns->rng = 1;
+	if (cfg->rate_kbps && cfg->queue) {
+		ns->backlog = malloc (cfg->queue * sizeof (*ns->backlog));
+		if (!ns->backlog) {
+			perror ("netsim");
+			exit (1);
+		}
+	}
+	return ns;
+}
+
+void
+netsim_destroy (struct netsim *ns)
+{
+	if (!ns)
+		return;
+	fprintf (stderr, "Netsim %s: %llu packets, %llu delivered, %llu lost, "
+			"%llu queue drops, %llu reordered, %llu duplicated, "
+			"%llu bad length, %llu garbage, %llu corrupted, %llu truncated\n",
+			ns->name,
+			(unsigned long long) ns->stats.packets,
+			(unsigned long long) ns->stats.delivered,
+			(unsigned long long) ns->stats.lost,
+			(unsigned long long) ns->stats.queue_drops,
+			(unsigned long long) ns->stats.reordered,
+			(unsigned long long) ns->stats.duplicated,
+			(unsigned long long) ns->stats.badlength,
+			(unsigned long long) ns->stats.garbage,
+			(unsigned long long) ns->stats.corrupted,
+			(unsigned long long) ns->stats.truncated);
+	while (ns->npackets)
+		free (netsim_pop (ns));
+	free (ns->held);
+	free (ns->heap);
+	free (ns->backlog);
+	free (ns);
+}
+
+static int
+netsim_probability (const char *key, const char *value, double *p)
+{
+	char *end;
+
+	*p = strtod (value, &end);
+	if (*end || end == value || *p < 0 || *p > 1) {
+		fprintf (stderr, "netsim: %s must be a probability, not \"%s\"\n",
+				key, value);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+netsim_number (const char *key, const char *value, double *d)
+{
+	char *end;
+
+	*d = strtod (value, &end);
+	if (*end || end == value || *d < 0) {
+		fprintf (stderr, "netsim: bad %s \"%s\"\n", key, value);
+		return -1;
+	}
+	return 0;
+}
+
+/* The spec is a comma separated list of key=value:
+ *
+ *   seed=N          seed for the random choices (default 1)
+ *   dir=out|in|both which packets to emulate (default out)
+ *   loss, reorder, dup, badlength, garbage, corrupt, truncate
+ *                   probability of each impairment (default 0)
+ *   rate=KBPS       link rate in kb/s (default no limit)
+ *   delay=MS        propagation delay in ms
+ *   jitter=MS       extra random delay, up to this many ms
+ *   queue=N         packets waiting for the link (default no limit)
+ */
+int
+netsim_parse (const char *spec, struct netsim_config *cfg)
+{
+	char *copy = strdup (spec), *save = NULL, *item;
+	int ret = 0;
+
+	memset (cfg, 0, sizeof (*cfg));
+	cfg->seed = 1;
+	cfg->directions = NETSIM_OUT;
+	for (item = strtok_r (copy, ",", &save); item && !ret;
+			item = strtok_r (NULL, ",", &save)) {
+		char *value = strchr (item, '=');
+		double d;
+
+		if (!value) {
+			fprintf (stderr, "netsim: expected key=value, not \"%s\"\n", item);
+			ret = -1;
+			break;
+		}
+		*value++ = '\0';
+		if (!strcmp (item, "seed"))
+			cfg->seed = strtoull (value, NULL, 0);
+		else if (!strcmp (item, "dir")) {
+			if (!strcmp (value, "out"))
+				cfg->directions = NETSIM_OUT;
+			else if (!strcmp (value, "in"))
+				cfg->directions = NETSIM_IN;
+			else if (!strcmp (value, "both"))
+				cfg->directions = NETSIM_OUT | NETSIM_IN;
+			else {
+				fprintf (stderr, "netsim: dir must be out, in or both\n");
+				ret = -1;
+			}
+		}
+		else if (!strcmp (item, "loss"))
+			ret = netsim_probability (item, value, &cfg->loss);
+		else if (!strcmp (item, "reorder"))
+			ret = netsim_probability (item, value, &cfg->reorder);
+		else if (!strcmp (item, "dup"))
+			ret = netsim_probability (item, value, &cfg->duplicate);
+		else if (!strcmp (item, "badlength"))
+			ret = netsim_probability (item, value, &cfg->badlength);
+		else if (!strcmp (item, "garbage"))
+			ret = netsim_probability (item, value, &cfg->garbage);
+		else if (!strcmp (item, "corrupt"))
+			ret = netsim_probability (item, value, &cfg->corrupt);
+		else if (!strcmp (item, "truncate"))
+			ret = netsim_probability (item, value, &cfg->truncate);
+		else if (!strcmp (item, "rate")) {
+			ret = netsim_number (item, value, &d);
+			cfg->rate_kbps = d;
+		}
+		else if (!strcmp (item, "delay"))
+			ret = netsim_number (item, value, &cfg->delay_ms);
+		else if (!strcmp (item, "jitter"))
+			ret = netsim_number (item, value, &cfg->jitter_ms);
+		else if (!strcmp (item, "queue")) {
+			ret = netsim_number (item, value, &d);
+			cfg->queue = d;
+		}
+		else {
+			fprintf (stderr, "netsim: unknown setting \"%s\"\n", item);
+			ret = -1;
+		}
+	}
+	free (copy);
+	return ret;
+}
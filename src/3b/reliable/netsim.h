@@ -0,0 +1,72 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   In-process network emulator.
+
+   A netsim stands between the protocol and the socket in one direction.
+   Every packet goes through the impairments of the tester's NetSim, in
+   its order: drop, reorder, duplicate, bad length, garbage, corrupt and
+   truncate, each with its own probability.  Then it waits for a link of
+   the given rate, in a queue of the given length (drop-tail), and comes
+   out after the propagation delay plus up to jitter more.  All random
+   choices come from a generator seeded from the config, so a run with
+   the same seed and the same timing makes the same choices; under the
+   virtual clock (see clock.h) the timing is the same too.
+
+   rlib sets one up with -N; see netsim_parse for the spec.  With -S it
+   sets up one each way between the two ends it simulates.
+
+   ----------------------------------------------------------------------- */
+
+#define NETSIM_OUT 0x1		/* packets we send */
+#define NETSIM_IN 0x2		/* packets we receive */
+
+struct netsim_config {
+	uint64_t seed;
+	int directions;			/* NETSIM_OUT and/or NETSIM_IN */
+	double loss;			/* probabilities, 0 to 1 */
+	double reorder;
+	double duplicate;
+	double badlength;
+	double garbage;
+	double corrupt;
+	double truncate;
+	uint64_t rate_kbps;		/* link rate, 0 for no limit */
+	double delay_ms;		/* propagation delay */
+	double jitter_ms;		/* extra delay, uniform in [0, jitter) */
+	int queue;			/* packets waiting for the link, 0 for no limit */
+};
+
+/* Called for each packet that makes it through; buf is the emulator's
+ * copy, which the callee may change */
+typedef void netsim_deliver_fn (void *arg, void *buf, size_t len);
+
+struct netsim;
+
+/* Parse a spec like "loss=0.05,delay=50,rate=10000,seed=7" into cfg.
+ * Returns -1, after saying why, if the spec is bad. */
+int netsim_parse (const char *spec, struct netsim_config *cfg);
+struct netsim *netsim_create (const struct netsim_config *cfg, uint64_t seed,
+		const char *name, netsim_deliver_fn *deliver);
+/* Print what happened to the packets and free the emulator */
+void netsim_destroy (struct netsim *ns);
+
+/* Take in a packet on behalf of arg, which deliver gets back */
+void netsim_submit (struct netsim *ns, void *arg, const void *buf, size_t len);
+/* Deliver every packet due by now */
+void netsim_run (struct netsim *ns, uint64_t now_us);
+/* When the next packet is due, UINT64_MAX if none is on its way */
+uint64_t netsim_next (struct netsim *ns);
+/* Shorten a poll timeout so it ends when the next packet is due */
+int netsim_timeout (struct netsim *ns, uint64_t now_us, int timeout_ms);
+/* Packets of arg still on their way */
+int netsim_pending (struct netsim *ns, void *arg);
+/* Drop the packets of arg, which is going away */
+void netsim_forget (struct netsim *ns, void *arg);
+
+#endif /* NETSIM_H */
@@ -19,8 +19,67 @@ typedef struct packet_list {
 	 * The malloc'd location of the packet
 	 */
 	packet_t *packet;
+	/**
+	 * Non-zero once the payload has been handed to its stream; only used
+	 * when the connection multiplexes streams
+	 */
+	int delivered;
+	/**
+	 * When the packet was first sent, in microseconds, and whether it has
+	 * been sent again since; used to time round trips
+	 */
+	uint64_t sent_us;
+	int retransmitted;
+	/**
+	 * When the packet went into the receive buffer, in microseconds; used
+	 * to time how long it waits there
+	 */
+	uint64_t received_us;
 } packet_list;
 
+/**
+ * Serial number arithmetic on 32 bit seqnos (RFC 1982): a is before b if
+ * it is less than 2^31 behind it, so the order survives the counter
+ * wrapping around
+ */
+int seqno_lt(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) < 0;
+}
+
+int seqno_le(uint32_t a, uint32_t b) {
+	return (int32_t) (a - b) <= 0;
+}
+
+/**
+ * A 64 bit seqno that no packet has
+ */
+#define SEQNO_NONE UINT64_MAX
+
+/**
+ * Connections count seqnos in 64 bits and put the low 32 bits on the
+ * wire.  Wire seqno 0 is never used for data, so the count skips every
+ * value whose low 32 bits are 0.
+ */
+uint64_t seqno_next(uint64_t seqno) {
+	seqno++;
+	if (!(uint32_t) seqno) {
+		seqno++;
+	}
+	return seqno;
+}
+
+/**
+ * The 64 bit seqno nearest to reference that has these low 32 bits, or
+ * 0 if that would be below the start of the sequence space
+ */
+uint64_t seqno_extend(uint64_t reference, uint32_t seqno) {
+	int32_t delta = (int32_t) (seqno - (uint32_t) reference);
+	if (delta < 0 && (uint64_t) -(int64_t) delta > reference) {
+		return 0;
+	}
+	return reference + delta;
+}
+
 /**
  * Create a new, unlinked packet node
  */
@@ -29,6 +88,10 @@ packet_list* new_packet() {
 	new->next = NULL;
 	new->prev = NULL;
 	new->packet = (packet_t*) malloc(MAX_PACKET_SIZE);
+	new->delivered = 0;
+	new->sent_us = 0;
+	new->retransmitted = 0;
+	new->received_us = 0;
 	return new;
 }
 
@@ -110,6 +173,9 @@ int insert_packet_after_seqno(
 
 /**
  * Insert a packet into the list, preserving sequence number order
+ *
+ * Return 1 if it was inserted, 0 if the list has its seqno already, -1
+ * on error
  */
 int insert_packet_in_order(packet_list** list, packet_list* packet) {
 	if (!list || !packet || !(packet->packet)) {
@@ -117,7 +183,7 @@ int insert_packet_in_order(packet_list** list, packet_list* packet) {
 	}
 	if (!(*list)) {
 		*list = packet;
-		return 0;
+		return 1;
 	}
 	if (get_packet_by_seqno(*list, ntohl(packet->packet->seqno))) {
 		return 0;
@@ -131,7 +197,7 @@ int insert_packet_in_order(packet_list** list, packet_list* packet) {
 		if (!iter->packet) {
 			return -1;
 		}
-		if (ntohl(packet->packet->seqno) < ntohl(iter->packet->seqno)) {
+		if (seqno_lt(ntohl(packet->packet->seqno), ntohl(iter->packet->seqno))) {
 			break;
 		}
 		if (!iter->next) {
@@ -156,7 +222,7 @@ int insert_packet_in_order(packet_list** list, packet_list* packet) {
 			*list = packet;
 		}
 	}
-	return 0;
+	return 1;
 }
 
 /**
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+#include "packet_list.c"
+
+void test_seqno_order() {
+	// serial number order holds across the wrap
+	assert(seqno_lt(0xfffffffe, 0xffffffff));
+	assert(seqno_lt(0xffffffff, 1));
+	assert(seqno_lt(0xfffffff0, 0x10));
+	assert(!seqno_lt(1, 0xffffffff));
+	assert(!seqno_lt(5, 5));
+	assert(seqno_le(5, 5));
+	assert(seqno_le(0xffffffff, 0));
+	assert(!seqno_le(0, 0xffffffff));
+}
+
+void test_seqno_count() {
+	// the 64 bit count skips every wire seqno 0
+	assert(seqno_next(1) == 2);
+	assert(seqno_next(0xfffffffeULL) == 0xffffffffULL);
+	assert(seqno_next(0xffffffffULL) == 0x100000001ULL);
+	assert(seqno_next(0x1ffffffffULL) == 0x200000001ULL);
+	assert((uint32_t) seqno_next(0xffffffffULL) == 1);
+}
+
+void test_seqno_extend() {
+	// wire seqnos are extended to the nearest 64 bit seqno
+	assert(seqno_extend(1, 3) == 3);
+	assert(seqno_extend(0xfffffff0ULL, 0xffffffff) == 0xffffffffULL);
+	assert(seqno_extend(0xfffffff0ULL, 2) == 0x100000002ULL);
+	assert(seqno_extend(0x100000001ULL, 0xffffffff) == 0xffffffffULL);
+	assert(seqno_extend(0x100000001ULL, 1) == 0x100000001ULL);
+	assert(seqno_extend(0x200000005ULL, 0xfffffffe) == 0x1fffffffeULL);
+	// but never below the start of the sequence space
+	assert(seqno_extend(1, 0xfffffff0) == 0);
+}
+
+void test_insert_across_wrap() {
+	packet_list* packet_a = new_packet();
+	packet_a->packet->seqno = htonl(0xfffffffe);
+	packet_list* packet_b = new_packet();
+	packet_b->packet->seqno = htonl(0xffffffff);
+	packet_list* packet_c = new_packet();
+	packet_c->packet->seqno = htonl(1);
+	packet_list* packet_d = new_packet();
+	packet_d->packet->seqno = htonl(2);
+	packet_list* duplicate = new_packet();
+	duplicate->packet->seqno = htonl(0xffffffff);
+
+	packet_list* list = NULL;
+	assert(insert_packet_in_order(&list, packet_c) == 1);
+	assert(insert_packet_in_order(&list, packet_a) == 1);
+	assert(insert_packet_in_order(&list, packet_d) == 1);
+	assert(insert_packet_in_order(&list, packet_b) == 1);
+	assert(insert_packet_in_order(&list, duplicate) == 0);
+	assert(packet_list_size(list) == 4);
+	assert(list->packet->seqno == htonl(0xfffffffe));
+	assert(list->next->packet->seqno == htonl(0xffffffff));
+	assert(list->next->next->packet->seqno == htonl(1));
+	assert(list->next->next->next->packet->seqno == htonl(2));
+
+	remove_head_packet(&duplicate);
+	while (list) {
+		remove_head_packet(&list);
+	}
+}
+
+int main() {
+	test_seqno_order();
+	test_seqno_count();
+	test_seqno_extend();
+	test_insert_across_wrap();
+	printf("All tests passed\n");
+	return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pmu.h"
+
+int pmu_enabled;
+volatile sig_atomic_t pmu_report_requested;
+
+static const char *stage_names[PMU_STAGES] = {
+	"rel_recvpkt", "rel_read", "handle_ack", "rel_output", "cksum",
+	"conn_poll", "conn_drain", "aead"
+};
+
+static const char *counter_names[PMU_COUNTERS] = {
+	"task ns", "cycles", "instructions", "cache miss", "branch miss"
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} counter_events[PMU_COUNTERS] = {
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int group_fd = -1;
+/* Position in the group of each counter, or -1 if it did not open */
+static int slot[PMU_COUNTERS];
+static int nslots;
+
+static uint64_t calls[PMU_STAGES];
+static uint64_t totals[PMU_STAGES][PMU_COUNTERS];
+/* What an empty pmu_enter and pmu_leave count */
+static uint64_t overhead[PMU_COUNTERS];
+
+static void
+pmu_signal (int sig)
+{
+	pmu_report_requested = 1;
+}
+
+static int
+open_counter (int i, int group)
+{
+	struct perf_event_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.size = sizeof (attr);
+	attr.type = counter_events[i].type;
+	attr.config = counter_events[i].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall (SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void
+read_counters (uint64_t *v)
+{
+	uint64_t buf[1 + PMU_COUNTERS];
+	int i;
+
+	if (read (group_fd, buf, sizeof (buf)) < (ssize_t) sizeof (uint64_t)) {
+		memset (v, 0, PMU_COUNTERS * sizeof (*v));
+		return;
+	}
+	for (i = 0; i < PMU_COUNTERS; i++)
+		v[i] = slot[i] >= 0 && slot[i] < (int) buf[0] ? buf[1 + slot[i]] : 0;
+}
+
+int
+pmu_open (void)
+{
+	struct sigaction sa;
+	struct pmu_scope s;
+	uint64_t end[PMU_COUNTERS];
+	int i, j;
+
+	group_fd = open_counter (PMU_TASK_NS, -1);
+	if (group_fd < 0) {
+		perror ("perf_event_open");
+		return -1;
+	}
+	slot[PMU_TASK_NS] = nslots++;
+	for (i = 1; i < PMU_COUNTERS; i++)
+		slot[i] = open_counter (i, group_fd) >= 0 ? nslots++ : -1;
+	if (slot[PMU_CYCLES] < 0)
+		fprintf (stderr, "[no hardware counters; timing stages only]\n");
+
+	/* The least an empty stage ever counted */
+	memset (overhead, 0xff, sizeof (overhead));
+	for (j = 0; j < 1000; j++) {
+		read_counters (s.start);
+		read_counters (end);
+		for (i = 0; i < PMU_COUNTERS; i++)
+			if (end[i] - s.start[i] < overhead[i])
+				overhead[i] = end[i] - s.start[i];
+	}
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = pmu_signal;
+	sigaction (SIGUSR2, &sa, NULL);
+	pmu_enabled = 1;
+	return 0;
+}
+
+void
+pmu_enter (struct pmu_scope *s, int stage)
+{
+	s->stage = stage;
+	read_counters (s->start);
+}
+
+void
+pmu_account (struct pmu_scope *s)
+{
+	uint64_t end[PMU_COUNTERS];
+	int i;
+
+	read_counters (end);
+	calls[s->stage]++;
+	for (i = 0; i < PMU_COUNTERS; i++) {
+		uint64_t d = end[i] - s->start[i];
+		totals[s->stage][i] += d > overhead[i] ? d - overhead[i] : 0;
+	}
+}
+
+void
+pmu_report (void)
+{
+	int i, j;
+
+	pmu_report_requested = 0;
+	if (!pmu_enabled)
+		return;
+	fprintf (stderr, "Counters: \tper call, including the stages called\n");
+	fprintf (stderr, "  %-12s %10s", "stage", "calls");
+	for (j = 0; j < PMU_COUNTERS; j++)
+		if (slot[j] >= 0)
+			fprintf (stderr, " %12s", counter_names[j]);
+	fprintf (stderr, "\n");
+	for (i = 0; i < PMU_STAGES; i++) {
+		if (!calls[i])
+			continue;
+		fprintf (stderr, "  %-12s %10llu", stage_names[i],
+				(unsigned long long) calls[i]);
+		for (j = 0; j < PMU_COUNTERS; j++)
+			if (slot[j] >= 0)
+				fprintf (stderr, " %12.1f",
+						(double) totals[i][j] / calls[i]);
+		fprintf (stderr, "\n");
+	}
+}
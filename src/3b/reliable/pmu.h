@@ -0,0 +1,78 @@
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdint.h>
+#include <signal.h>
+
+/* -----------------------------------------------------------------------
+
+   Performance counters per protocol stage.
+
+   With -P, reliable opens one perf_event_open group on itself: task
+   clock, and where the machine has a PMU, cycles, instructions, cache
+   misses and branch misses, user space only.  Each stage below reads
+   the group when it starts and again when it ends, and adds the
+   difference to the stage's totals.  Stages nest, so the numbers are
+   inclusive: rel_recvpkt counts the handle_ack, rel_output and cksum it
+   calls.  A read costs a system call; the cost of an empty start and
+   end, measured when the group is opened, is taken off every call.
+
+   The totals are printed to stderr per call at rel_destroy and on
+   SIGUSR2.  Without -P, a stage costs a test of pmu_enabled.
+
+   ----------------------------------------------------------------------- */
+
+enum pmu_stage {
+	PMU_RECVPKT,		/* rel_recvpkt */
+	PMU_READ,		/* rel_read */
+	PMU_ACK,		/* handle_ack */
+	PMU_OUTPUT,		/* rel_output */
+	PMU_CKSUM,		/* cksum */
+	PMU_POLL,		/* conn_poll, handling the fds poll returned */
+	PMU_DRAIN,		/* conn_drain */
+	PMU_AEAD,		/* sealing and opening packets, with -K */
+	PMU_STAGES
+};
+
+/* The counters, in the order of the group */
+enum pmu_counter {
+	PMU_TASK_NS,
+	PMU_CYCLES,
+	PMU_INSTRUCTIONS,
+	PMU_CACHE_MISSES,
+	PMU_BRANCH_MISSES,
+	PMU_COUNTERS
+};
+
+struct pmu_scope {
+	int stage;			/* -1 when not counting */
+	uint64_t start[PMU_COUNTERS];
+};
+
+extern int pmu_enabled;
+/* Set by SIGUSR2; conn_poll then calls pmu_report */
+extern volatile sig_atomic_t pmu_report_requested;
+
+/* Open the counters; returns -1 if not even the task clock opens */
+int pmu_open (void);
+void pmu_enter (struct pmu_scope *s, int stage);
+void pmu_account (struct pmu_scope *s);
+/* Print the totals so far */
+void pmu_report (void);
+
+static inline void
+pmu_leave (struct pmu_scope *s)
+{
+	if (s->stage >= 0)
+		pmu_account (s);
+}
+
+/* Count the rest of the enclosing block as stage st, whichever way it
+ * is left */
+#define PMU_SCOPE(st)						\
+	struct pmu_scope pmu_scope_ __attribute__ ((cleanup (pmu_leave))); \
+	pmu_scope_.stage = -1;						\
+	if (pmu_enabled)						\
+		pmu_enter (&pmu_scope_, (st))
+
+#endif /* PMU_H */
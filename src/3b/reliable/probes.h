@@ -0,0 +1,98 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Static probes.
+
+   PROBEn (name, args...) marks a point in the code where a tracer can
+   attach: it compiles to one nop, plus an entry in the ELF note section
+   .note.stapsdt saying where the nop is and where each argument lives
+   at that point, in the format of SystemTap's <sys/sdt.h>.  With no
+   tracer attached the nop is all that runs, besides working out the
+   arguments; attaching rewrites the nop to a breakpoint in the live
+   process, so nothing needs rebuilding.  readelf -n reliable lists the
+   probes, and bpftrace reaches them as usdt:./reliable:reliable:name
+   (see the scripts in probes/).
+
+   The provider is "reliable".  Every argument is passed as a signed
+   64 bit integer, pointers included:
+
+     send (conn, seqno, ackno, len, rwnd)	conn_sendpkt, every packet
+     recv (fd, seqno, ackno, len, rwnd)	debug_recv, every datagram
+     ack (rel, ackno, acked, cwnd, peer rwnd, rtt us)
+					handle_ack; rtt is 0 without a sample
+     retransmit (rel, seqno, len, cwnd, ssthresh)
+					resend_packets, every packet
+     output (rel, seqno, len)		rel_output, every conn_output
+     destroy (rel, packets sent, retransmitted, us since the start)
+					rel_destroy
+
+   seqno is 0 for packets too short to carry one.  On machines other
+   than x86-64 and AArch64 the probes are empty.
+
+   ----------------------------------------------------------------------- */
+
+#if (defined (__x86_64__) || defined (__aarch64__)) && !defined (NO_PROBES)
+
+#define PROBE_ARG_(n) " -8@%[a" #n "]"
+#define PROBE_OP_(n, x) [a##n] "nor" ((int64_t) (x))
+
+#define PROBE_(name, args, ...)						\
+	__asm__ __volatile__ (						\
+		"990:\tnop\n"						\
+		"\t.pushsection .note.stapsdt,\"?\",\"note\"\n"		\
+		"\t.balign 4\n"						\
+		"\t.4byte 992f-991f, 994f-993f, 3\n"			\
+		"991:\t.asciz \"stapsdt\"\n"				\
+		"992:\t.balign 4\n"					\
+		"993:\t.8byte 990b\n"					\
+		"\t.8byte _.stapsdt.base\n"				\
+		"\t.8byte 0\n"						\
+		"\t.asciz \"reliable\"\n"				\
+		"\t.asciz \"" #name "\"\n"				\
+		"\t.asciz \"" args "\"\n"				\
+		"994:\t.balign 4\n"					\
+		"\t.popsection\n"					\
+		"\t.ifndef _.stapsdt.base\n"				\
+		"\t.pushsection .stapsdt.base,\"aG\",\"progbits\","	\
+			".stapsdt.base,comdat\n"			\
+		"\t.weak _.stapsdt.base\n"				\
+		"\t.hidden _.stapsdt.base\n"				\
+		"_.stapsdt.base:\t.space 1\n"				\
+		"\t.size _.stapsdt.base, 1\n"				\
+		"\t.popsection\n"					\
+		"\t.endif\n"						\
+		: : __VA_ARGS__)
+
+#define PROBE3(name, x1, x2, x3)					\
+	PROBE_ (name, PROBE_ARG_ (1) PROBE_ARG_ (2) PROBE_ARG_ (3),	\
+		PROBE_OP_ (1, x1), PROBE_OP_ (2, x2), PROBE_OP_ (3, x3))
+#define PROBE4(name, x1, x2, x3, x4)					\
+	PROBE_ (name, PROBE_ARG_ (1) PROBE_ARG_ (2) PROBE_ARG_ (3)	\
+		PROBE_ARG_ (4),						\
+		PROBE_OP_ (1, x1), PROBE_OP_ (2, x2), PROBE_OP_ (3, x3),	\
+		PROBE_OP_ (4, x4))
+#define PROBE5(name, x1, x2, x3, x4, x5)				\
+	PROBE_ (name, PROBE_ARG_ (1) PROBE_ARG_ (2) PROBE_ARG_ (3)	\
+		PROBE_ARG_ (4) PROBE_ARG_ (5),				\
+		PROBE_OP_ (1, x1), PROBE_OP_ (2, x2), PROBE_OP_ (3, x3),	\
+		PROBE_OP_ (4, x4), PROBE_OP_ (5, x5))
+#define PROBE6(name, x1, x2, x3, x4, x5, x6)				\
+	PROBE_ (name, PROBE_ARG_ (1) PROBE_ARG_ (2) PROBE_ARG_ (3)	\
+		PROBE_ARG_ (4) PROBE_ARG_ (5) PROBE_ARG_ (6),		\
+		PROBE_OP_ (1, x1), PROBE_OP_ (2, x2), PROBE_OP_ (3, x3),	\
+		PROBE_OP_ (4, x4), PROBE_OP_ (5, x5), PROBE_OP_ (6, x6))
+
+#else
+
+#define PROBE3(name, x1, x2, x3) do { } while (0)
+#define PROBE4(name, x1, x2, x3, x4) do { } while (0)
+#define PROBE5(name, x1, x2, x3, x4, x5) do { } while (0)
+#define PROBE6(name, x1, x2, x3, x4, x5, x6) do { } while (0)
+
+#endif
+
+#endif /* PROBES_H */
@@ -16,11 +16,45 @@
 #include <limits.h>
 
 #include "rlib.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "clock.h"
+#include "latency.h"
+#include "pmu.h"
+#include "probes.h"
 #include "packet_list.c"
+#include "aead.c"
+#include "handshake.c"
+#include "checksum.c"
+#include "fec.c"
+#include "compress.c"
 #include "constants.h"
 
 #undef DEBUG
 
+/**
+ * Protocol state of one stream of a multiplexed connection
+ */
+typedef struct stream_state {
+	/**
+	 * The library end of the stream, used for conn_input/conn_output
+	 */
+	conn_t *c;
+	uint16_t id;
+	/**
+	 * Bytes of this stream packetized so far, i.e. the offset of the next
+	 * payload we send
+	 */
+	uint32_t send_offset;
+	/**
+	 * Bytes of this stream handed to conn_output so far, modulo 2^32
+	 */
+	uint32_t recv_offset;
+	uint8_t fin_sent;
+	uint8_t fin_received;
+	struct stream_state *next;
+} stream_state;
+
 struct reliable_state {
 
 	conn_t *c;			/* This is the connection object */
@@ -35,10 +69,18 @@ struct reliable_state {
 	 */
 	packet_list* send_buffer;
 	/**
-	 * The next sequence number to send with a packet
+	 * Packets in the send buffer, kept as it changes
+	 */
+	int send_buffer_size;
+	/**
+	 * The next sequence number to send with a packet.  Seqnos are counted
+	 * in 64 bits; packets carry the low 32 bits (see seqno_extend).
+	 */
+	uint64_t next_seqno_to_send;
+	/**
+	 * The seqno of our EOF packet, SEQNO_NONE until we have sent it
 	 */
-	unsigned int next_seqno_to_send;
-	unsigned int final_seqno;
+	uint64_t final_seqno;
 
 	/**
 	 * This consists of the data that has not been read by the application yet.
@@ -51,11 +93,15 @@ struct reliable_state {
 	 * and the second half consists of data that is not yet contiguous
 	 */
 	packet_list* receive_buffer;
+	/**
+	 * Packets in the receive buffer, kept as it changes
+	 */
+	int receive_buffer_size;
 	/**
 	 * The sequence number of the lowest packet that could be received next in
 	 * the receive buffer
 	 */
-	unsigned int next_seqno_expected;
+	uint64_t next_seqno_expected;
 	size_t receive_buffer_data_offset;
 
 	/**
@@ -72,12 +118,104 @@ struct reliable_state {
 	unsigned int ssthresh;
 	unsigned int congestion_window;
 	unsigned int receive_window;
+	/**
+	 * Sender: the receive window of the peer, our own -w until its reply
+	 * says otherwise; bounds the packets in flight
+	 */
+	unsigned int peer_window;
 
 	unsigned int consec_acks;
-	unsigned int last_ack_recvd;
-	
-	struct timeval start;
-	struct timeval finish;
+	uint64_t last_ack_recvd;
+
+	/**
+	 * Whether data packets carry a stream header, as agreed on in the
+	 * handshake before any data; only with opt_mux
+	 */
+	bool multiplexed;
+	/**
+	 * The streams of this connection, ordered by id; NULL unless
+	 * multiplexed.  All streams share the send buffer and the congestion
+	 * window above.
+	 */
+	stream_state* streams;
+	/**
+	 * Receiver: whether packets of a stream beyond opt_mux were dropped
+	 */
+	bool streams_dropped;
+	/**
+	 * The stream rel_read packetizes from next, so streams take turns
+	 */
+	stream_state* next_stream_to_read;
+
+	/**
+	 * Forward error correction state; NULL unless the user asked for FEC
+	 */
+	fec_state* fec;
+	/**
+	 * The most payload a data packet may carry, after room is made for
+	 * FEC parity
+	 */
+	int max_payload;
+
+	/**
+	 * Payload compression state; NULL unless the user asked for it
+	 */
+	compress_state* compress;
+
+	/**
+	 * Handshake state, and the features agreed on in it
+	 */
+	handshake_state* handshake;
+	uint32_t capabilities;
+
+	/**
+	 * Checksum put on data packets and ACKs, and the one the peer may
+	 * switch to; the Internet sum is accepted too until it has
+	 */
+	int checksum;
+	int checksum_accepted;
+	bool checksum_switched;
+
+	/**
+	 * Encryption keys, set up in the handshake; NULL unless both ends
+	 * have a -K secret, or until then
+	 */
+	aead_state* aead;
+	/**
+	 * Receiver: input ended before the keys were there to seal the EOF
+	 */
+	bool eof_waits_for_keys;
+
+	/**
+	 * Smoothed round trip time, 0 until the first sample
+	 */
+	uint64_t srtt_us;
+
+	/**
+	 * The windows as last put in the event trace
+	 */
+	unsigned int traced_cwnd;
+	unsigned int traced_ssthresh;
+	uint32_t peer_rwnd;
+
+	/**
+	 * Data packets sent for the first time and sent again, for the stats
+	 * at the end
+	 */
+	uint64_t packets_sent;
+	uint64_t packets_retransmitted;
+
+	/**
+	 * Whether the transfer has started, and when, on the library clock
+	 */
+	bool started;
+	uint64_t start_us;
+
+	/**
+	 * The other connections of this process, for rel_timer
+	 */
+	rel_t* next;
+	rel_t** prev;
 };
 rel_t *rel_list;
 
@@ -95,11 +233,14 @@ void print_rel_state(rel_t* rel, int indent_level) {
 		indents[0] = 0;
 	}
 	fprintf(stderr, "%sPID: %d\n", indents, getpid());
-	fprintf(stderr, "%sNext seqno to send: %d\n", indents, rel->next_seqno_to_send);
-	fprintf(stderr, "%sFinal seqno: %d\n", indents, rel->final_seqno);
+	fprintf(stderr, "%sNext seqno to send: %llu\n", indents,
+			(unsigned long long) rel->next_seqno_to_send);
+	fprintf(stderr, "%sFinal seqno: %llu\n", indents,
+			(unsigned long long) rel->final_seqno);
 	fprintf(stderr, "%sSend buffer:\n", indents);
 	print_packet_list(rel->send_buffer, 2);
-	fprintf(stderr, "%sNext seqno expected: %d\n", indents, rel->next_seqno_expected);
+	fprintf(stderr, "%sNext seqno expected: %llu\n", indents,
+			(unsigned long long) rel->next_seqno_expected);
 	fprintf(stderr, "%sReceive buffer:\n", indents);
 	print_packet_list(rel->receive_buffer, 2);
 	fprintf(stderr, "%sEOF flags: %d, %d, %d, %d\n", indents,
@@ -114,6 +255,124 @@ bool is_slow_start(rel_t* rel){
 	return rel->congestion_window < rel->ssthresh;
 }
 
+/**
+ * Note the start of the transfer, at the first packet read or received
+ */
+void mark_start(rel_t* r) {
+	if (!r->started) {
+		r->started = true;
+		r->start_us = clock_now_us();
+	}
+}
+
+/**
+ * Whether anything reads the times packets are sent and received: rtop,
+ * the event trace or the latency histograms
+ */
+bool timing_wanted(rel_t* r) {
+	return r->c->telemetry || r->c->trace || r->c->latency;
+}
+
+/**
+ * Send a packet of the send buffer for the first time
+ */
+void send_new_packet(rel_t* s, packet_list* packet_node, int packet_length) {
+	// 0 means no RTT sample, as for a retransmission
+	packet_node->sent_us = timing_wanted(s) ? clock_now_us() : 0;
+	s->packets_sent++;
+	trace_record(s->c->trace, TRACE_SEND, seqno_extend(s->next_seqno_to_send,
+			ntohl(packet_node->packet->seqno)), 0, packet_length);
+	conn_sendpkt(s->c, packet_node->packet, packet_length);
+}
+
+/**
+ * Put the congestion window in the event trace if it changed
+ */
+void trace_windows(rel_t* r) {
+	if (r->congestion_window != r->traced_cwnd
+			|| r->ssthresh != r->traced_ssthresh) {
+		r->traced_cwnd = r->congestion_window;
+		r->traced_ssthresh = r->ssthresh;
+		trace_record(r->c->trace, TRACE_CWND, r->ssthresh, r->congestion_window, 0);
+	}
+}
+
+/**
+ * Publish the windows and queues of a connection for rtop
+ */
+void update_telemetry(rel_t* r) {
+	struct telemetry_conn* t = r->c->telemetry;
+	if (!t) {
+		return;
+	}
+	TELEMETRY_SET(t, cwnd, r->congestion_window);
+	TELEMETRY_SET(t, ssthresh, r->ssthresh);
+	TELEMETRY_SET(t, rwnd, r->receive_window);
+	TELEMETRY_SET(t, srtt_us, r->srtt_us);
+	TELEMETRY_SET(t, send_queue, r->send_buffer_size);
+	TELEMETRY_SET(t, receive_queue, r->receive_buffer_size);
+}
+
+/**
+ * Return the state of a stream, creating it (and asking the library for
+ * its conn_t) the first time the stream is seen; NULL if the library
+ * cannot open the stream
+ */
+stream_state* get_stream(rel_t* rel, uint16_t id) {
+	stream_state** iter = &rel->streams;
+	while (*iter && (*iter)->id < id) {
+		iter = &(*iter)->next;
+	}
+	if (*iter && (*iter)->id == id) {
+		return *iter;
+	}
+	conn_t* c = conn_stream(rel->c, id);
+	if (!c) {
+		return NULL;
+	}
+	stream_state* stream = xmalloc(sizeof(stream_state));
+	memset(stream, 0, sizeof(stream_state));
+	stream->c = c;
+	stream->id = id;
+	stream->next = *iter;
+	*iter = stream;
+	return stream;
+}
+
+void send_hello(rel_t* r) {
+	if (!r->handshake->started) {
+		r->handshake->started = true;
+		r->handshake->started_us = clock_now_us();
+	}
+	handshake_send(r->c, HANDSHAKE_HELLO, r->handshake->wanted,
+			r->handshake->max_payload, r->handshake->window,
+			r->handshake->initial_window, r->handshake->salt, r->next_seqno_expected,
+			r->receive_window - r->receive_buffer_size);
+}
+
+/**
+ * Turn on the features agreed on in the handshake.  The sender calls
+ * this as it sends the settings packet, the receiver as it writes it
+ * out, so both switch at the same seqno.
+ */
+void enable_features(rel_t* r, uint32_t capabilities) {
+	r->capabilities = capabilities;
+	r->checksum = checksum_agreed(capabilities);
+	if (r->fec) {
+		r->fec->checksum = r->checksum;
+	}
+	if (r->c->sender_receiver == SENDER) {
+		if ((capabilities & CAPABILITY_FEC) && !r->fec) {
+			r->fec = fec_create(r->config->fec_group);
+			r->fec->checksum = r->checksum;
+			r->max_payload -= FEC_OVERHEAD;
+		}
+	}
+	if ((capabilities & CAPABILITY_COMPRESS) && !r->compress) {
+		r->compress = compress_create();
+	}
+}
+
 /* Creates a new reliable protocol session, returns NULL on failure.
  * Exactly one of c and ss should be NULL.  (ss is NULL when called
  * from rlib.c, while c is NULL when this function is called from
@@ -136,13 +395,20 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 	}
 
 	r->c = c;
+	r->prev = &rel_list;
+	r->next = rel_list;
+	if (rel_list) {
+		rel_list->prev = &r->next;
+	}
 	rel_list = r;
 
 	/* Do any other initialization you need here */
 	r->send_buffer = NULL;
+	r->send_buffer_size = 0;
 	r->next_seqno_to_send = 1;
-	r->final_seqno = -1;
+	r->final_seqno = SEQNO_NONE;
 	r->receive_buffer = NULL;
+	r->receive_buffer_size = 0;
 	r->next_seqno_expected = 1;
 	r->receive_buffer_data_offset = 0;
 	r->config = cc;
@@ -154,14 +420,57 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 	r->ssthresh = INT_MAX;
 	r->congestion_window = INITIAL_SEND_WINDOW;
 	r->receive_window = r->config->window;
+	r->peer_window = r->config->window;
 
 	r->consec_acks = 0;
 	r->last_ack_recvd = 0;
-	
-	r->start.tv_sec = 0;
-	r->start.tv_usec = 0;
-	r->finish.tv_sec = 0;
-	r->finish.tv_usec = 0;
+
+	r->multiplexed = false;
+	r->streams = NULL;
+	r->next_stream_to_read = NULL;
+	r->streams_dropped = false;
+
+	// features are turned on once the handshake has agreed on them
+	r->fec = NULL;
+	r->compress = NULL;
+	r->max_payload = MAX_PACKET_DATA_SIZE;
+	r->capabilities = 0;
+	r->checksum = CHECKSUM_SUM;
+	r->checksum_accepted = CHECKSUM_SUM;
+	r->checksum_switched = false;
+	if (cc->sender_receiver == SENDER) {
+		uint32_t wanted = 0;
+		if (cc->fec_group > 0) {
+			wanted |= CAPABILITY_FEC;
+		}
+		// streams are packed by read_streams, which does not compress
+		if (cc->compress && !opt_mux) {
+			wanted |= CAPABILITY_COMPRESS;
+		}
+		if (cc->checksum == CHECKSUM_CRC32C) {
+			wanted |= CAPABILITY_CRC32C;
+		}
+		else if (cc->checksum == CHECKSUM_NONE) {
+			wanted |= CAPABILITY_NO_CHECKSUM;
+		}
+		if (cc->key) {
+			wanted |= CAPABILITY_AEAD;
+		}
+		if (opt_mux) {
+			wanted |= CAPABILITY_STREAMS;
+		}
+		r->handshake = handshake_create(wanted, MAX_PACKET_DATA_SIZE,
+				r->receive_window, cc->initial_window > 0
+						? cc->initial_window : INITIAL_SEND_WINDOW);
+		send_hello(r);
+	}
+	else {
+		r->handshake = handshake_create(0, MAX_PACKET_DATA_SIZE,
+				r->receive_window, r->receive_window);
+	}
+
+	r->started = false;
+	r->start_us = 0;
 
 	return r;
 }
@@ -170,6 +479,13 @@ void
 rel_destroy (rel_t *r)
 {
 	conn_destroy (r->c);
+	if (r->prev) {
+		if (r->next) {
+			r->next->prev = r->prev;
+		}
+		*r->prev = r->next;
+		r->prev = NULL;
+	}
 
 	/* Free any other allocated memory here */
 	while (r->send_buffer) {
@@ -178,13 +494,44 @@ rel_destroy (rel_t *r)
 	while (r->receive_buffer) {
 		remove_head_packet(&(r->receive_buffer));
 	}
-	gettimeofday(&r->finish, NULL);
-	long int milliseconds_start = (r->start.tv_sec * 1000)
-			+ (r->start.tv_usec / 1000);
-	long int milliseconds_finish = (r->finish.tv_sec * 1000)
-			+ (r->finish.tv_usec / 1000);
+	r->send_buffer_size = 0;
+	r->receive_buffer_size = 0;
+	while (r->streams) {
+		stream_state* next = r->streams->next;
+		free(r->streams);
+		r->streams = next;
+	}
+	fec_destroy(r->fec);
+	r->fec = NULL;
+	if (r->aead) {
+		fprintf(stderr, "Encryption: \t%llu packets sealed, %llu opened, %llu rejected, "
+				"%llu ACKs sealed\n",
+				(unsigned long long) r->aead->sealed,
+				(unsigned long long) r->aead->opened,
+				(unsigned long long) r->aead->rejected,
+				(unsigned long long) r->aead->acks_sealed);
+		aead_destroy(r->aead);
+		r->aead = NULL;
+	}
+	handshake_destroy(r->handshake);
+	r->handshake = NULL;
+	if (r->compress) {
+		fprintf(stderr, "Compression: \t%llu bytes of data in %llu bytes of payload\n",
+				(unsigned long long) r->compress->bytes_in,
+				(unsigned long long) r->compress->bytes_out);
+		compress_destroy(r->compress);
+		r->compress = NULL;
+	}
+	uint64_t elapsed_us = r->started ? clock_now_us() - r->start_us : 0;
+	long int milliseconds = elapsed_us / 1000;
+
+	PROBE4(destroy, r, r->packets_sent, r->packets_retransmitted, elapsed_us);
 
-	fprintf(stderr, "Total time: \t%ld ms\n", milliseconds_finish - milliseconds_start);
+	fprintf(stderr, "Packets: \t%llu sent, %llu retransmitted\n",
+			(unsigned long long) r->packets_sent,
+			(unsigned long long) r->packets_retransmitted);
+	fprintf(stderr, "Total time: \t%ld ms\n", milliseconds);
+	pmu_report();
 	return;
 
 }
@@ -208,9 +555,11 @@ void enforce_destroy(rel_t* rel) {
 	}
 }
 
-bool handle_duplicate_acks(rel_t* rel, int ackno) {
+bool handle_duplicate_acks(rel_t* rel, uint64_t ackno) {
 	if (ackno == rel->last_ack_recvd) {
 		rel->consec_acks++;
+		TELEMETRY_COUNT(rel->c->telemetry, dup_acks, 1);
+		trace_record(rel->c->trace, TRACE_DUP_ACK, ackno, rel->consec_acks, 0);
 		if (rel->consec_acks >= 4) {
 			rel->ssthresh = rel->congestion_window / 2;
 			rel->congestion_window = rel->ssthresh;
@@ -224,17 +573,25 @@ bool handle_duplicate_acks(rel_t* rel, int ackno) {
 }
 
 int handle_ack(rel_t* rel, struct ack_packet* ack_packet) {
+	PMU_SCOPE(PMU_ACK);
 	if (!rel) {
 		return -1;
 	}
 	int destroy = 0;
-	int ackno = (int) ntohl(ack_packet->ackno);
+	uint64_t ackno = seqno_extend(rel->next_seqno_to_send, ntohl(ack_packet->ackno));
 	bool duplicate_acks = handle_duplicate_acks(rel, ackno);
+	handshake_state* h = rel->handshake;
+	// an old receiver ACKs the first flight and never replies
+	if (h && h->progress == HANDSHAKE_PENDING && rel->c->sender_receiver == SENDER
+			&& !rel->config->key && ackno > 1) {
+		fprintf(stderr, "%d: Peer has no handshake, using no features\n", getpid());
+		h->progress = HANDSHAKE_DONE;
+	}
 
 #ifdef DEBUG
 	fprintf(stderr, "RECEIVE ACK %d\n", ntohl(ack_packet->ackno));
 #endif
-	if (ntohl(ack_packet->ackno) > rel->final_seqno) {
+	if (ackno > rel->final_seqno) {
 		rel->eof_all_acked = 1;
 		destroy = 1;
 #ifdef DEBUG
@@ -242,9 +599,20 @@ int handle_ack(rel_t* rel, struct ack_packet* ack_packet) {
 #endif
 	}
 	bool updated = false;
+	int acked = 0;
+	uint64_t sent_us = 0;
 	while (rel->send_buffer
-			&& ntohl(rel->send_buffer->packet->seqno) < ntohl(ack_packet->ackno)) {
+			&& seqno_lt(ntohl(rel->send_buffer->packet->seqno), (uint32_t) ackno)) {
+		// Karn: a retransmitted packet gives no sample
+		if (!rel->send_buffer->retransmitted) {
+			sent_us = rel->send_buffer->sent_us;
+		}
+		if (rel->send_buffer->sent_us) {
+			LATENCY_RECORD(rel->c, ack, clock_now_us() - rel->send_buffer->sent_us);
+		}
 		remove_head_packet(&rel->send_buffer);
+		rel->send_buffer_size--;
+		acked++;
 		if (!duplicate_acks && is_slow_start(rel)) {
 			(rel->congestion_window)++;
 		}
@@ -253,6 +621,17 @@ int handle_ack(rel_t* rel, struct ack_packet* ack_packet) {
 	if (!duplicate_acks && updated && !is_slow_start(rel)) {
 		(rel->congestion_window)++;
 	}
+	if (!duplicate_acks && (acked || ntohs(ack_packet->len) == ACK_PACKET_LENGTH)) {
+		trace_record(rel->c->trace, TRACE_ACK, ackno, acked, 0);
+	}
+	uint64_t sample = 0;
+	if (sent_us) {
+		sample = clock_now_us() - sent_us;
+		rel->srtt_us = rel->srtt_us ? (7 * rel->srtt_us + sample) / 8 : sample;
+		trace_record(rel->c->trace, TRACE_RTT, rel->srtt_us, sample, 0);
+	}
+	PROBE6(ack, rel, (uint32_t) ackno, acked, rel->congestion_window,
+			ntohl(ack_packet->rwnd), sample);
 	if (destroy) {
 /*		struct timeval tv;
 		gettimeofday(&tv, NULL);
@@ -268,13 +647,25 @@ void send_ack(rel_t *r, uint32_t ackno) {
 #ifdef DEBUG
 	fprintf(stderr, "SEND ACK %d\n", ackno);
 #endif
+	uint32_t rwnd = r->receive_window - r->receive_buffer_size;
+	if (r->config->key) {
+		packet_t sealed;
+		int length;
+		if (!r->aead) {
+			return;
+		}
+		length = aead_seal_ack(r->aead, &sealed, ackno, rwnd);
+		sealed.cksum = packet_checksum(r->checksum, &sealed, length);
+		conn_sendpkt(r->c, &sealed, length);
+		return;
+	}
 	size_t ack_packet_size = sizeof(struct ack_packet);
 	struct ack_packet* ack = (struct ack_packet*) malloc(ack_packet_size);
 	memset(ack, 0, ack_packet_size);
 	ack->len = htons(ack_packet_size);
 	ack->ackno = htonl(ackno);
-	ack->rwnd = htonl(r->receive_window - packet_list_size(r->receive_buffer));
-	ack->cksum = cksum((void *)ack, ack_packet_size);
+	ack->rwnd = htonl(rwnd);
+	ack->cksum = packet_checksum(r->checksum, (packet_t *)ack, ack_packet_size);
 	conn_sendpkt(r->c, (packet_t *)ack, ack_packet_size);
 	free(ack);
 	return;
@@ -291,7 +682,8 @@ bool recvpkt_validity_checks(rel_t* r, packet_t* pkt, size_t n) {
 		return false;
 	}
 	if (ntohl(pkt->ackno) < 1
-			|| ntohl(pkt->ackno) > r->next_seqno_to_send) {
+			|| seqno_extend(r->next_seqno_to_send, ntohl(pkt->ackno))
+					> r->next_seqno_to_send) {
 		fprintf(stderr, "%d: Ackno %d doesn't make sense\n", getpid(), ntohl(pkt->ackno));
 		return false;
 	}
@@ -307,10 +699,11 @@ bool recvpkt_validity_checks(rel_t* r, packet_t* pkt, size_t n) {
 bool recvpkt_checksum(rel_t* r, packet_t* pkt, int len) {
 	uint16_t stored_checksum = pkt->cksum;
 	pkt->cksum = 0;
-	uint16_t computed_checksum = cksum(pkt, len);
-	if (computed_checksum != stored_checksum) {
+	if (!packet_checksum_ok(r->checksum_accepted, &r->checksum_switched,
+			stored_checksum, pkt, len)) {
 		fprintf(stderr, "%d: Checksum failed for packet of length %d, ackno %d, seqno %d\n",
 				getpid(), len, ntohl(pkt->ackno), ntohl(pkt->seqno));
+		TELEMETRY_COUNT(r->c->telemetry, checksum_failures, 1);
 		return false;
 	}
 	//if(ntohs(pkt->len) != (uint16_t) n)	return;
@@ -318,9 +711,136 @@ bool recvpkt_checksum(rel_t* r, packet_t* pkt, int len) {
 	return true;
 }
 
+/**
+ * Close a connection that is to be encrypted but cannot be
+ */
+void refuse_connection(rel_t* r, const char* why) {
+	bool single = r->config->single_connection;
+	fprintf(stderr, "%d: %s; closing the connection\n", getpid(), why);
+	rel_destroy(r);
+	if (single) {
+		exit(1);
+	}
+}
+
+/**
+ * Handle a control packet, i.e. a data packet with seqno 0: FEC parity
+ * from the sender or a loss report from the receiver.  Control packets
+ * are not acknowledged, and are dropped when FEC is off.
+ */
+void handle_control_packet(rel_t* r, packet_t* pkt, int len) {
+	handshake_state* h = r->handshake;
+	if (pkt->data[0] == HANDSHAKE_HELLO && r->c->sender_receiver == RECEIVER) {
+		// data came first, so the sender is taken to be an old one
+		if (h->progress == HANDSHAKE_DONE || !handshake_receive(h, pkt, len)) {
+			return;
+		}
+		// keep a history from the start, for the first parity to use
+		if ((h->wanted & CAPABILITY_FEC) && !r->fec) {
+			r->fec = fec_create(FEC_MAX_GROUP);
+		}
+		uint32_t supported = CAPABILITIES_SUPPORTED;
+		if (r->config->checksum == CHECKSUM_NONE) {
+			supported |= CAPABILITY_NO_CHECKSUM;
+		}
+		if (opt_mux) {
+			supported |= CAPABILITY_STREAMS;
+		}
+		if (r->config->key) {
+			if (!(h->wanted & CAPABILITY_AEAD) || !h->have_peer_salt) {
+				refuse_connection(r, "Peer does not encrypt");
+				return;
+			}
+			supported |= CAPABILITY_AEAD;
+			if (!r->aead) {
+				r->aead = aead_create(r->config->key, r->config->key_length,
+						h->peer_salt, h->salt, false);
+				if (!r->aead) {
+					refuse_connection(r, "No keys");
+					return;
+				}
+			}
+		}
+		// the sender may switch as soon as it has this reply
+		r->checksum_accepted = checksum_agreed(h->wanted & supported);
+		handshake_send(r->c, HANDSHAKE_REPLY, supported,
+				MAX_PACKET_DATA_SIZE, r->receive_window, h->initial_window,
+				h->salt, r->next_seqno_expected,
+				r->receive_window - r->receive_buffer_size);
+		h->progress = HANDSHAKE_REPLIED;
+		// the sender frames its data from the first packet once it has this
+		r->multiplexed = (h->wanted & supported & CAPABILITY_STREAMS) != 0;
+		if (r->eof_waits_for_keys) {
+			rel_read(r);
+		}
+		return;
+	}
+	if (pkt->data[0] == HANDSHAKE_REPLY && r->c->sender_receiver == SENDER) {
+		if (h->progress != HANDSHAKE_PENDING || !handshake_receive(h, pkt, len)) {
+			return;
+		}
+		h->progress = HANDSHAKE_REPLIED;
+		r->checksum_accepted = checksum_agreed(h->wanted & h->capabilities);
+		r->max_payload = h->max_payload;
+		if (r->config->key) {
+			if (!(h->capabilities & CAPABILITY_AEAD) || !h->have_peer_salt) {
+				refuse_connection(r, "Peer does not decrypt");
+				return;
+			}
+			r->aead = aead_create(r->config->key, r->config->key_length,
+					h->salt, h->peer_salt, true);
+			if (!r->aead) {
+				refuse_connection(r, "No keys");
+				return;
+			}
+			r->max_payload -= AEAD_TAG_LENGTH;
+		}
+		r->multiplexed = (h->wanted & h->capabilities & CAPABILITY_STREAMS) != 0;
+		r->peer_window = h->window;
+		if (r->congestion_window < h->initial_window) {
+			r->congestion_window = h->initial_window;
+		}
+		rel_read(r);
+		return;
+	}
+	if (pkt->data[0] == AEAD_ACK) {
+		struct ack_packet ack;
+		if (!r->aead || !aead_open_ack(r->aead, pkt, len)) {
+			fprintf(stderr, "%d: ACK %d does not authenticate\n", getpid(),
+					ntohl(pkt->ackno));
+			return;
+		}
+		ack.len = htons(ACK_PACKET_LENGTH);
+		ack.ackno = pkt->ackno;
+		ack.rwnd = pkt->rwnd;
+		handle_ack(r, &ack);
+		rel_read(r);
+		return;
+	}
+	if (!r->fec) {
+		return;
+	}
+	if (pkt->data[0] == FEC_REPORT) {
+		fec_report(r->fec, pkt, len);
+	}
+	else if (pkt->data[0] == FEC_PARITY) {
+		int recovered = fec_recover(r->fec, pkt, len, r->next_seqno_expected);
+		int i;
+		for (i = 0; i < recovered && !r->c->delete_me; i++) {
+			packet_t* packet = &r->fec->recovered[i];
+			// checked as a packet of the peer's would be at this point
+			packet->cksum = 0;
+			packet->cksum = packet_checksum(r->checksum_switched
+					? r->checksum_accepted : CHECKSUM_SUM, packet, ntohs(packet->len));
+			rel_recvpkt(r, packet, ntohs(packet->len));
+		}
+	}
+}
+
 void
 rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
+	PMU_SCOPE(PMU_RECVPKT);
 #ifdef DEBUG
 	fprintf(stderr, "\n");
 	fprintf(stderr, "--- Start recvpkt -----------------------------\n");
@@ -335,22 +855,45 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 	if (!recvpkt_checksum(r, pkt, packet_length)) {
 		return;
 	}
+	if (ntohl(pkt->rwnd) != r->peer_rwnd) {
+		r->peer_rwnd = ntohl(pkt->rwnd);
+		trace_record(r->c->trace, TRACE_RWND, 0, r->peer_rwnd, 0);
+	}
 
-	// Ack packet
-	if(packet_length == ACK_PACKET_LENGTH){
+	// Control packet
+	if (packet_length > DATA_PACKET_METADATA_LENGTH && ntohl(pkt->seqno) == 0) {
+		handle_control_packet(r, pkt, packet_length);
+		return;
+	}
+	if (r->fec && packet_length >= DATA_PACKET_METADATA_LENGTH
+			&& fec_remember(r->fec, pkt, packet_length)) {
+		fec_send_report(r->fec, r->c, r->next_seqno_expected,
+				r->receive_window - r->receive_buffer_size);
+	}
+
+	if (packet_length >= DATA_PACKET_METADATA_LENGTH) {
+		trace_record(r->c->trace, TRACE_RECV,
+				seqno_extend(r->next_seqno_expected, ntohl(pkt->seqno)), 0,
+				packet_length);
+	}
+
+	// Ack packet; when encrypting, only sealed ones count
+	if(packet_length == ACK_PACKET_LENGTH && r->config->key){
+		fprintf(stderr, "%d: ACK %d is not sealed\n", getpid(), ntohl(pkt->ackno));
+	}
+	else if(packet_length == ACK_PACKET_LENGTH){
 		handle_ack(r, (struct ack_packet*) pkt);
 		rel_read(r);
 	}
 	// Data packet
 	else if (packet_length >= DATA_PACKET_METADATA_LENGTH
 			&& packet_length <= MAX_PACKET_SIZE
-			&& ntohl(pkt->seqno) >= r->next_seqno_expected
-			&& packet_list_size(r->receive_buffer) < r->receive_window){
+			&& seqno_extend(r->next_seqno_expected, ntohl(pkt->seqno))
+					>= r->next_seqno_expected
+			&& r->receive_buffer_size < r->receive_window){
 		//if (ntohs(pkt->len)-12 != check_pkt_data_len(pkt->data))	return;
 		
-		if (!r->start.tv_sec && !r->start.tv_usec) {
-			gettimeofday(&r->start, NULL);
-		}
+		mark_start(r);
 #ifdef DEBUG
 		fprintf(stderr, "INSERTING %d\n", ntohl(pkt->seqno));
 #endif
@@ -358,13 +901,33 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 			fprintf(stderr, "%d: Seqno %d doesn't make sense\n", getpid(), ntohl(pkt->seqno));
 			return;
 		}
+		if (r->c->sender_receiver == RECEIVER && !r->config->key
+				&& r->handshake->progress == HANDSHAKE_PENDING) {
+			r->handshake->progress = HANDSHAKE_DONE;
+		}
+		if (r->config->key) {
+			uint64_t seqno = seqno_extend(r->next_seqno_expected, ntohl(pkt->seqno));
+			if (!r->aead
+					|| (packet_length = aead_open(r->aead, pkt, packet_length, seqno)) < 0) {
+				fprintf(stderr, "%d: Packet %d does not authenticate\n", getpid(),
+						ntohl(pkt->seqno));
+				return;
+			}
+		}
 		packet_list* to_insert = new_packet();
 		memcpy(to_insert->packet, pkt, packet_length);
+		to_insert->received_us = r->c->latency ? clock_now_us() : 0;
 
-		insert_packet_in_order(&(r->receive_buffer), to_insert);
+		if (insert_packet_in_order(&(r->receive_buffer), to_insert) > 0) {
+			r->receive_buffer_size++;
+		}
+		else {
+			remove_head_packet(&to_insert);
+		}
 
-		if (ntohl(pkt->seqno) == r->next_seqno_expected) {
-			r->next_seqno_expected++;
+		// packets past a hole may already be buffered
+		while (get_packet_by_seqno(r->receive_buffer, r->next_seqno_expected)) {
+			r->next_seqno_expected = seqno_next(r->next_seqno_expected);
 		}
 
 		send_ack(r, r->next_seqno_expected);
@@ -381,6 +944,8 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 	else {
 		send_ack(r, r->next_seqno_expected);
 	}
+	trace_windows(r);
+	update_telemetry(r);
 	//enforce_destroy(r);
 #ifdef DEBUG
 	fprintf(stderr, "--- End recvpkt -------------------------------\n");
@@ -391,33 +956,144 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 	return;
 }
 
+/**
+ * Fill the payload of a data packet from the next stream, taking the
+ * streams in turn.  Returns the payload length (stream header included),
+ * 0 if no stream has input right now, or -1 once every stream has sent
+ * its FIN and the connection EOF is due
+ */
+int read_streams(rel_t* s, packet_t* packet) {
+	conn_t* c;
+	// pick up streams the library opened since the last call
+	for (c = s->c; c; c = c->next_stream) {
+		get_stream(s, c->stream);
+	}
+	struct stream_header* header = (struct stream_header*) packet->data;
+	stream_state* start = s->next_stream_to_read ? s->next_stream_to_read : s->streams;
+	stream_state* stream = start;
+	bool all_finished = true;
+	do {
+		stream_state* next = stream->next ? stream->next : s->streams;
+		if (!stream->fin_sent) {
+			all_finished = false;
+			int bytes_read = conn_input(stream->c, packet->data + sizeof(*header),
+					s->max_payload - sizeof(*header));
+			if (bytes_read != 0) {
+				header->stream = htons(stream->id);
+				header->flags = 0;
+				header->offset = htonl(stream->send_offset);
+				if (bytes_read < 0) {
+					header->flags = htons(STREAM_FIN);
+					stream->fin_sent = 1;
+					bytes_read = 0;
+				}
+				stream->send_offset += bytes_read;
+				s->next_stream_to_read = next;
+				return sizeof(*header) + bytes_read;
+			}
+		}
+		stream = next;
+	} while (stream != start);
+	return all_finished ? -1 : 0;
+}
+
+/**
+ * Sender: seal a burst of new data packets when encrypting, then
+ * checksum and send them.  They are in the send buffer already.
+ */
+void send_burst(rel_t* s, packet_list** burst, const uint64_t* seqnos, int n) {
+	int i;
+	if (s->aead && n) {
+		aead_seal_batch(s->aead, burst, seqnos, n);
+	}
+	for (i = 0; i < n; i++) {
+		packet_t* packet = burst[i]->packet;
+		int packet_length = ntohs(packet->len);
+		packet->cksum = packet_checksum(s->checksum, packet, packet_length);
+		send_new_packet(s, burst[i], packet_length);
+		if (s->fec && fec_add(s->fec, packet)) {
+			fec_flush(s->fec, s->c, s->next_seqno_expected,
+					s->receive_window - s->receive_buffer_size);
+		}
+	}
+}
+
+/**
+ * Called by the sender when it gets to HANDSHAKE_SEQNO.  Sends the
+ * settings packet if the peer replied; returns false if it has to keep
+ * waiting for the reply.
+ */
+bool finish_handshake(rel_t* s) {
+	handshake_state* h = s->handshake;
+	if (h->progress == HANDSHAKE_PENDING) {
+		if (h->retries < HANDSHAKE_RETRIES) {
+			return false;
+		}
+		fprintf(stderr, "%d: No handshake reply, using no features\n", getpid());
+		h->progress = HANDSHAKE_DONE;
+		return true;
+	}
+	h->progress = HANDSHAKE_DONE;
+	uint32_t capabilities = h->wanted & h->capabilities;
+	if (!capabilities) {
+		return true;
+	}
+	packet_list* packet_node = new_packet();
+	int packet_length = DATA_PACKET_METADATA_LENGTH + handshake_settings_length();
+	handshake_write_settings(packet_node->packet->data, capabilities);
+	packet_node->packet->cksum = 0;
+	packet_node->packet->len = htons(packet_length);
+	packet_node->packet->ackno = htonl(s->next_seqno_expected);
+	packet_node->packet->seqno = htonl(s->next_seqno_to_send);
+	packet_node->packet->rwnd = htonl(s->receive_window - s->receive_buffer_size);
+	if (s->aead) {
+		aead_seal_batch(s->aead, &packet_node, &s->next_seqno_to_send, 1);
+		packet_length = ntohs(packet_node->packet->len);
+	}
+	packet_node->packet->cksum = cksum(packet_node->packet, packet_length);
+	s->next_seqno_to_send = seqno_next(s->next_seqno_to_send);
+	send_new_packet(s, packet_node, packet_length);
+	append_packet(&(s->send_buffer), packet_node);
+	s->send_buffer_size++;
+	enable_features(s, capabilities);
+	return true;
+}
+
 void
 rel_read (rel_t *s)
 {
-	if (!s->start.tv_sec && !s->start.tv_usec) {
-		gettimeofday(&s->start, NULL);
-	}
+	PMU_SCOPE(PMU_READ);
+	mark_start(s);
 	if(s->c->sender_receiver == RECEIVER)
 	{
 		if (s->eof_conn_input) {
 			return;
+		} else if (s->config->key && !s->aead) {
+			s->eof_waits_for_keys = true;
+			return;
 		} else {
+			s->eof_waits_for_keys = false;
 			s->eof_conn_input = 1;
 			s->final_seqno = s->next_seqno_to_send;
 			packet_list *eof = new_packet();
-			memset(eof, 0, sizeof(packet_list));
+			memset(eof->packet, 0, MAX_PACKET_SIZE);
 			
 			int packet_length = DATA_PACKET_METADATA_LENGTH;
 			eof->packet->len = htons(packet_length);
 			eof->packet->ackno = htonl(s->next_seqno_expected);
 			eof->packet->seqno = htonl(s->next_seqno_to_send);
-			eof->packet->rwnd = htonl(s->receive_window - packet_list_size(s->receive_buffer));
-			uint16_t checksum = cksum(eof->packet, packet_length);
+			eof->packet->rwnd = htonl(s->receive_window - s->receive_buffer_size);
+			if (s->aead) {
+				aead_seal_batch(s->aead, &eof, &s->next_seqno_to_send, 1);
+				packet_length = ntohs(eof->packet->len);
+			}
+			uint16_t checksum = packet_checksum(s->checksum, eof->packet, packet_length);
 			eof->packet->cksum = checksum;
-			s->next_seqno_to_send++;
+			s->next_seqno_to_send = seqno_next(s->next_seqno_to_send);
 
-			conn_sendpkt(s->c, eof->packet, packet_length);
+			send_new_packet(s, eof, packet_length);
 			append_packet(&(s->send_buffer), eof);
+			s->send_buffer_size++;
 			return;
 		}
 	}
@@ -431,21 +1107,59 @@ rel_read (rel_t *s)
 		fprintf(stderr, "\n");
 #endif
 		if (!s
-				|| s->eof_conn_input) {
+				|| s->eof_conn_input
+				|| s->c->delete_me) {
+			return;
+		}
+		// nothing goes out in the clear when it is to be encrypted
+		if (s->config->key && !s->aead) {
+			return;
+		}
+		// nor unframed before the peer has said whether it takes streams
+		if (opt_mux && s->handshake->progress == HANDSHAKE_PENDING) {
+			return;
+		}
+		if (!s->multiplexed && s->c->next_stream) {
+			refuse_connection(s, "Peer does not multiplex streams");
 			return;
 		}
-//		int window_size = s->config->window;
-		int compare = s->receive_window - packet_list_size(s->receive_buffer);
+		int compare = s->peer_window;
 		int min = s->congestion_window < compare ? s->congestion_window : compare;
-		while (packet_list_size(s->send_buffer) < min) {
+		bool input_idle = false;
+		packet_list* burst[AEAD_BATCH];
+		uint64_t burst_seqnos[AEAD_BATCH];
+		int nburst = 0;
+		while (s->send_buffer_size < min) {
+			if (s->next_seqno_to_send == HANDSHAKE_SEQNO
+					&& s->handshake->progress != HANDSHAKE_DONE) {
+				send_burst(s, burst, burst_seqnos, nburst);
+				nburst = 0;
+				if (!finish_handshake(s)) {
+					break;
+				}
+				continue;
+			}
 			int should_break = 0;
 			packet_list* packet_node = new_packet();
-			int bytes_read = conn_input(s->c, packet_node->packet->data, MAX_PACKET_DATA_SIZE);
+			int bytes_read;
+			if (s->multiplexed) {
+				bytes_read = read_streams(s, packet_node->packet);
+			}
+			else if (s->compress) {
+				bytes_read = compress_input(s->compress, s->c,
+						packet_node->packet->data, s->max_payload);
+			}
+			else {
+				bytes_read = conn_input(s->c, packet_node->packet->data, s->max_payload);
+			}
 			if (bytes_read == 0) {
+				remove_head_packet(&packet_node);
+				input_idle = true;
 				break;
 			}
 			if(bytes_read < 0){
 				should_break = 1; //need to send eof
+				input_idle = true;
 				s->eof_conn_input = 1;
 				s->final_seqno = s->next_seqno_to_send;
 				bytes_read = 0;
@@ -455,17 +1169,27 @@ rel_read (rel_t *s)
 			packet_node->packet->len = htons(packet_length);
 			packet_node->packet->ackno = htonl(s->next_seqno_expected);
 			packet_node->packet->seqno = htonl(s->next_seqno_to_send);
-			packet_node->packet->rwnd = htonl(s->receive_window - packet_list_size(s->receive_buffer));
-			uint16_t checksum = cksum(packet_node->packet, packet_length);
-			packet_node->packet->cksum = checksum;
-			s->next_seqno_to_send++;
-
-			conn_sendpkt(s->c, packet_node->packet, packet_length);
+			packet_node->packet->rwnd = htonl(s->receive_window - s->receive_buffer_size);
+			burst[nburst] = packet_node;
+			burst_seqnos[nburst++] = s->next_seqno_to_send;
+			s->next_seqno_to_send = seqno_next(s->next_seqno_to_send);
 			append_packet(&(s->send_buffer), packet_node);
+			s->send_buffer_size++;
+			// unencrypted packets go out one by one, as they always did
+			if (!s->aead || nburst == AEAD_BATCH) {
+				send_burst(s, burst, burst_seqnos, nburst);
+				nburst = 0;
+			}
 			if (should_break) {
 				break;
 			}
 		}
+		send_burst(s, burst, burst_seqnos, nburst);
+		// no more data is coming for now, so don't hold the parity back
+		if (s->fec && input_idle) {
+			fec_flush(s->fec, s->c, s->next_seqno_expected,
+					s->receive_window - s->receive_buffer_size);
+		}
 		//enforce_destroy(s);
 #ifdef DEBUG
 		fprintf(stderr, "--- End read ----------------------------------\n");
@@ -493,8 +1217,13 @@ bool handle_eof_packet(rel_t* rel) {
 			|| !(rel->receive_buffer->packet)) {
 		return false;
 	}
-	if (is_eof_packet(rel->receive_buffer->packet)) {
-		conn_output(rel->c, NULL, 0);
+	// an EOF that overtook lost data must wait for it
+	if (is_eof_packet(rel->receive_buffer->packet)
+			&& seqno_lt(ntohl(rel->receive_buffer->packet->seqno), rel->next_seqno_expected)) {
+		// with streams, stream 0 may already be closed by its own FIN
+		if (!rel->c->write_eof) {
+			conn_output(rel->c, NULL, 0);
+		}
 		rel->eof_conn_output = 1;
 		if (rel->c->sender_receiver == RECEIVER) {
 			rel_destroy(rel);
@@ -506,9 +1235,104 @@ bool handle_eof_packet(rel_t* rel) {
 	return false;
 }
 
+/**
+ * Receiver: whether a packet being written out is the settings packet,
+ * and if so turn on its features.  Only the first packet with seqno
+ * HANDSHAKE_SEQNO after a reply can be one; once the wire seqno has
+ * wrapped around it is just data.
+ */
+bool read_settings(rel_t* r, packet_t* packet) {
+	uint32_t capabilities;
+	if (r->handshake->progress != HANDSHAKE_REPLIED
+			|| ntohl(packet->seqno) != HANDSHAKE_SEQNO) {
+		return false;
+	}
+	r->handshake->progress = HANDSHAKE_DONE;
+	if (!handshake_read_settings(packet, &capabilities)) {
+		return false;
+	}
+	enable_features(r, capabilities);
+	return true;
+}
+
+/**
+ * Hand buffered packets to their streams.  A stream is written as soon
+ * as its own next bytes are here, even while earlier packets of other
+ * streams are still missing, so a loss only holds up the stream it hit.
+ * Packets stay in the receive buffer, marked delivered, until the
+ * cumulative ACK has passed them.
+ */
+void output_streams(rel_t* r) {
+	packet_list* iter;
+	for (iter = r->receive_buffer; iter; iter = iter->next) {
+		if (iter->delivered || is_eof_packet(iter->packet)) {
+			continue;
+		}
+		if (read_settings(r, iter->packet)) {
+			iter->delivered = 1;
+			continue;
+		}
+		struct stream_header* header = (struct stream_header*) iter->packet->data;
+		stream_state* stream = get_stream(r, ntohs(header->stream));
+		if (!stream) {
+			if (!r->streams_dropped) {
+				fprintf(stderr, "%d: Dropping stream %d, beyond -m %d or not writable\n",
+						getpid(), ntohs(header->stream), opt_mux);
+				r->streams_dropped = true;
+			}
+			iter->delivered = 1;
+			continue;
+		}
+		uint32_t offset = ntohl(header->offset);
+		int length = ntohs(iter->packet->len) - DATA_PACKET_METADATA_LENGTH
+				- sizeof(*header);
+		// offsets wrap after 4 GiB, so compare them as seqnos are
+		if (seqno_lt(stream->recv_offset, offset)) {
+			continue;
+		}
+		int32_t already_written = (int32_t) (stream->recv_offset - offset);
+		if (already_written < 0) {
+			continue;
+		}
+		if (already_written < length) {
+			int to_write = length - already_written;
+			int bufspace = conn_bufspace(stream->c);
+			if (to_write > bufspace) {
+				to_write = bufspace;
+			}
+			if (to_write > 0) {
+				conn_output(stream->c, iter->packet->data + sizeof(*header)
+						+ already_written, to_write);
+				PROBE3(output, r, ntohl(iter->packet->seqno), to_write);
+				stream->recv_offset += to_write;
+			}
+			if (already_written + to_write < length) {
+				continue;
+			}
+		}
+		if ((ntohs(header->flags) & STREAM_FIN) && !stream->fin_received) {
+			conn_output(stream->c, NULL, 0);
+			stream->fin_received = 1;
+		}
+		LATENCY_RECORD(r->c, reorder, clock_now_us() - iter->received_us);
+		iter->delivered = 1;
+	}
+	while (r->receive_buffer
+			&& r->receive_buffer->delivered
+			&& seqno_lt(ntohl(r->receive_buffer->packet->seqno), r->next_seqno_expected)) {
+		remove_head_packet(&r->receive_buffer);
+		r->receive_buffer_size--;
+	}
+	if (r->receive_buffer
+			&& seqno_lt(ntohl(r->receive_buffer->packet->seqno), r->next_seqno_expected)) {
+		handle_eof_packet(r);
+	}
+}
+
 void
 rel_output (rel_t *r)
 {
+	PMU_SCOPE(PMU_OUTPUT);
 #ifdef DEBUG
 	fprintf(stderr, "\n");
 	fprintf(stderr, "--- Start output ------------------------------\n");
@@ -519,34 +1343,60 @@ rel_output (rel_t *r)
 	if (r->eof_conn_output) {
 		return;
 	}
-	int bufspace = conn_bufspace(r->c);
-	int data_written = 0;
-	while (data_written < bufspace
+	if (r->multiplexed) {
+		output_streams(r);
+		return;
+	}
+	// a file takes everything we write, so ask again after every write
+	int bufspace;
+	while ((bufspace = conn_bufspace(r->c)) > 0
 			&& r->receive_buffer
 			&& r->receive_buffer->packet
 			&& !(handle_eof_packet(r))
 			&& r->receive_buffer->packet->data
-			&& ntohl(r->receive_buffer->packet->seqno) < r->next_seqno_expected) {
-		int to_write = ntohs(r->receive_buffer->packet->len)
-				- DATA_PACKET_METADATA_LENGTH
-				- r->receive_buffer_data_offset;
+			&& seqno_lt(ntohl(r->receive_buffer->packet->seqno), r->next_seqno_expected)) {
+		if (read_settings(r, r->receive_buffer->packet)) {
+			remove_head_packet(&r->receive_buffer);
+			r->receive_buffer_size--;
+			continue;
+		}
+		char* data = r->receive_buffer->packet->data;
+		int length = ntohs(r->receive_buffer->packet->len)
+				- DATA_PACKET_METADATA_LENGTH;
+		if (r->compress) {
+			data = r->compress->expanded;
+			length = decompress_packet(r->compress, r->receive_buffer->packet);
+			if (length < 0) {
+				fprintf(stderr, "%d: Cannot expand packet %d\n", getpid(),
+						ntohl(r->receive_buffer->packet->seqno));
+				length = 0;
+			}
+		}
+		int to_write = length - r->receive_buffer_data_offset;
 		if (to_write <= 0) {
-			break;
+			remove_head_packet(&r->receive_buffer);
+			r->receive_buffer_size--;
+			r->receive_buffer_data_offset = 0;
+			continue;
 		}
 		bool truncated = false;
-		if (data_written + to_write > bufspace) {
-			to_write = bufspace - data_written;
+		if (to_write > bufspace) {
+			to_write = bufspace;
 			truncated = true;
 		}
-		char* start_of_data = r->receive_buffer->packet->data + r->receive_buffer_data_offset;
+		char* start_of_data = data + r->receive_buffer_data_offset;
 		conn_output(r->c, start_of_data, to_write);
+		PROBE3(output, r, ntohl(r->receive_buffer->packet->seqno), to_write);
 		if (truncated) {
 			r->receive_buffer_data_offset += to_write;
 		}
 		else {
+			LATENCY_RECORD(r->c, reorder,
+					clock_now_us() - r->receive_buffer->received_us);
 			remove_head_packet(&r->receive_buffer);
+			r->receive_buffer_size--;
+			r->receive_buffer_data_offset = 0;
 		}
-		data_written += to_write;
 	}
 #ifdef DEBUG
 	fprintf(stderr, "--- End output --------------------------------\n");
@@ -565,38 +1415,66 @@ void resend_packets(rel_t *rel) {
 	}
 
 	while (packets_iter && packets_iter->packet) {
+		packet_t* packet = packets_iter->packet;
+		// what went out under the Internet sum before the switch goes
+		// under the agreed checksum now, the only one the peer takes then
+		if (rel->checksum != CHECKSUM_SUM
+				&& seqno_extend(rel->next_seqno_to_send, ntohl(packet->seqno))
+						<= HANDSHAKE_SEQNO) {
+			packet->cksum = 0;
+			packet->cksum = packet_checksum(rel->checksum, packet, ntohs(packet->len));
+		}
 		conn_sendpkt(rel->c, packets_iter->packet, ntohs(packets_iter->packet->len));
+		packets_iter->retransmitted = 1;
+		rel->packets_retransmitted++;
+		TELEMETRY_COUNT(rel->c->telemetry, retransmits, 1);
+		PROBE5(retransmit, rel, ntohl(packets_iter->packet->seqno),
+				ntohs(packets_iter->packet->len), rel->congestion_window,
+				rel->ssthresh);
+		trace_record(rel->c->trace, TRACE_RETRANSMIT,
+				seqno_extend(rel->next_seqno_to_send, ntohl(packets_iter->packet->seqno)),
+				0, ntohs(packets_iter->packet->len));
 		packets_iter = packets_iter->next;
 	}
+	handshake_state* h = rel->handshake;
+	if (h && h->progress == HANDSHAKE_PENDING && (rel->config->key || opt_mux)
+			&& rel->c->sender_receiver == SENDER && !rel->c->delete_me && h->started
+			&& clock_now_us() - h->started_us > HANDSHAKE_TIMEOUT_MS * 1000) {
+		refuse_connection(rel, rel->config->key ? "No encrypted handshake with the peer"
+				: "No handshake with the peer, which -m needs");
+		return;
+	}
+	if (h && h->progress == HANDSHAKE_PENDING
+			&& rel->c->sender_receiver == SENDER && !rel->eof_conn_input
+			&& !rel->c->delete_me) {
+		// count the hellos that went unanswered after the first flight
+		if (rel->next_seqno_to_send > 1 && !rel->send_buffer) {
+			h->retries++;
+		}
+		if (h->retries < HANDSHAKE_RETRIES) {
+			send_hello(rel);
+		}
+		else {
+			rel_read(rel);
+		}
+	}
+	// close a group the window has kept open
+	if (rel->fec && !rel->c->delete_me) {
+		fec_flush(rel->fec, rel->c, rel->next_seqno_expected,
+				rel->receive_window - rel->receive_buffer_size);
+	}
+	trace_windows(rel);
+	update_telemetry(rel);
 }
 
 void
 rel_timer ()
 {
 	/* Retransmit any packets that need to be retransmitted */
-	/* Retransmit any packets that need to be retransmitted */
-	if (rel_list) {
-		resend_packets(rel_list);
-		/*
-		rel_list->window_timer += rel_list->config->timer;
-		if (rel_list->window_timer >= rel_list->config->timeout) {
-			slow_start_check(rel_list);
-			rel_list->window_timer = 0;
-			rel_list->num_packets_sent = 0;
-			rel_list->num_packets_recvd = 0;
-		}
-		*/
-	}
-	/*
-	rel_t *rel_list_fwd = rel_list;
-	while (rel_list_fwd->next) {
-		rel_list_fwd = rel_list_fwd->next;
-		resend_packets(rel_list_fwd);
-	}
-	rel_t *rel_list_bwd = rel_list;
-	while (rel_list_bwd->prev && *(rel_list_bwd->prev)) {
-		rel_list_bwd = *(rel_list_bwd->prev);
-		resend_packets(rel_list_bwd);
-	}
-	*/
+	rel_t* r;
+	rel_t* next;
+	for (r = rel_list; r; r = next) {
+		next = r->next;
+		resend_packets(r);
+	}
 }
@@ -11,17 +11,37 @@
 #include <getopt.h>
 #include <assert.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <signal.h>
 #include <sys/stat.h>
 
 #include "rlib.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "netsim.h"
+#include "clock.h"
+#include "latency.h"
+#include "pmu.h"
+#include "probes.h"
+#include "synth.h"
+
+/* Limits for one UDP_SEGMENT send: the kernel accepts at most 64
+ * segments, and the whole super-segment must fit in one IP datagram. */
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_BYTES 65000
+
+/* Receive buffer large enough for a full GRO super-segment. */
+#define GRO_BUF_SIZE 65536
 
 char *progname;
 int opt_debug;
+int opt_gso;
+int opt_mux;
 int log_in = -1;
 int log_out = -1;
 
@@ -30,6 +50,10 @@ int infile = 0;
 int outfile = 0;
 /************************/
 
+/* Output file name; stream n > 0 of a multiplexed connection is
+ * written to "<output>.n". */
+static char *stream_output;
+
 struct config_client {
 	struct config_common c;
 	int listen_socket; 		/* Accept TCP connections on this socket */
@@ -47,8 +71,8 @@ struct config_server {
 static struct config_server *serverconf;
 
 static void conn_mkevents (void);
-static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-		struct sockaddr_storage *from);
+static int debug_recv (int s, void *buf, size_t len, int flags,
+		struct sockaddr_storage *from, int *segsize);
 
 int cevents_generation;
 static struct pollfd *cevents;
@@ -58,7 +82,17 @@ static conn_t **evwriters;
 
 
 static conn_t *conn_list;
-struct timespec last_timeout;
+uint64_t last_timeout;
+
+/* With -N, the emulated network in each direction */
+static struct netsim_config netsim_config;
+static struct netsim *netsim_out, *netsim_in;
+
+/* With -S, both ends run here on virtual time: netsim_out carries what
+ * the sender sends and netsim_in what the receiver sends.  sim_limit
+ * is the most virtual time the transfer may take, in seconds. */
+static int simulating;
+static double sim_limit;
 
 #if !DMALLOC
 void *
@@ -119,31 +153,170 @@ print_pkt (const packet_t *buf, const char *op, int n)
 	errno = saved_errno;
 }
 
+static int
+conn_sendto (conn_t *c, const void *buf, size_t len)
+{
+	if (c->server)
+		return sendto (c->nfd, buf, len, 0,
+				(const struct sockaddr *) &c->peer, addrsize (&c->peer));
+	return send (c->nfd, buf, len, 0);
+}
+
+/* Hand everything queued by conn_sendpkt to the kernel.  Several
+ * queued packets go out as one UDP_SEGMENT send, which the kernel (or
+ * the NIC) splits back into datagrams of gso_size bytes. */
+static void
+conn_flush (conn_t *c)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE (sizeof (uint16_t))];
+	size_t off;
+	int n;
+
+	if (!c->gso_len)
+		return;
+
+	if (c->gso_len > c->gso_size && opt_gso) {
+		memset (&msg, 0, sizeof (msg));
+		memset (control, 0, sizeof (control));
+		iov.iov_base = c->gso_buf;
+		iov.iov_len = c->gso_len;
+		if (c->server) {
+			msg.msg_name = &c->peer;
+			msg.msg_namelen = addrsize (&c->peer);
+		}
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+		cm = CMSG_FIRSTHDR (&msg);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+		*(uint16_t *) CMSG_DATA (cm) = c->gso_size;
+
+		n = sendmsg (c->nfd, &msg, 0);
+		if (n >= 0 || (errno != EIO && errno != EINVAL
+						&& errno != ENOPROTOOPT)) {
+			c->gso_len = 0;
+			return;
+		}
+		/* No GSO on this path (old kernel, or no checksum offload on
+		 * the outgoing device); fall back to one send per packet. */
+		fprintf (stderr, "%s: UDP GSO unavailable (%s), disabling\n",
+				progname, strerror (errno));
+		opt_gso = 0;
+	}
+
+	for (off = 0; off < c->gso_len; off += c->gso_size)
+		conn_sendto (c, c->gso_buf + off, c->gso_len - off < c->gso_size
+				? c->gso_len - off : c->gso_size);
+	c->gso_len = 0;
+}
+
+static void
+conn_flushall (void)
+{
+	conn_t *c;
+	for (c = conn_list; c; c = c->next)
+		conn_flush (c);
+}
+
+static void
+netsim_send (void *arg, void *buf, size_t len)
+{
+	conn_sendto (arg, buf, len);
+}
+
+static void
+netsim_receive (void *arg, void *buf, size_t len)
+{
+	conn_t *c = arg;
+	if (!c->delete_me)
+		rel_recvpkt (c->rel, buf, len);
+}
+
+static void
+sim_deliver (void *arg, void *buf, size_t len)
+{
+	conn_t *c = ((conn_t *) arg)->sim_peer;
+	if (c && !c->delete_me) {
+		TELEMETRY_COUNT (c->telemetry, packets_received, 1);
+		TELEMETRY_COUNT (c->telemetry, bytes_received, len);
+		rel_recvpkt (c->rel, buf, len);
+	}
+}
+
+static void
+netsim_cleanup (void)
+{
+	netsim_destroy (netsim_out);
+	netsim_destroy (netsim_in);
+}
+
 int
 conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 {
 	int n;
 	assert (!c->delete_me);
-	if (c->server)
-		n = sendto (c->nfd, pkt, len, 0,
-				(const struct sockaddr *) &c->peer, addrsize (&c->peer));
-	else
-		n = send (c->nfd, pkt, len, 0);
+	PROBE5 (send, c, len >= offsetof (packet_t, data) ? ntohl (pkt->seqno) : 0,
+			ntohl (pkt->ackno), len, ntohl (pkt->rwnd));
+	if (simulating) {
+		netsim_submit (c->sender_receiver == SENDER ? netsim_out : netsim_in,
+				c, pkt, len);
+		n = len;
+	}
+	else if (netsim_out) {
+		/* The emulator sends each packet when its time comes */
+		netsim_submit (netsim_out, c, pkt, len);
+		n = len;
+	}
+	else if (!opt_gso)
+		n = conn_sendto (c, pkt, len);
+	else {
+		/* All segments but the last must be gso_size bytes, so a
+		 * packet of a different size, or anything after a short
+		 * packet, starts a new super-segment. */
+		if (c->gso_len && (len > c->gso_size
+						|| c->gso_len % c->gso_size
+						|| c->gso_len + len > GSO_MAX_BYTES
+						|| c->gso_len / c->gso_size >= GSO_MAX_SEGS))
+			conn_flush (c);
+		if (!c->gso_buf)
+			c->gso_buf = xmalloc (GSO_MAX_BYTES);
+		if (!c->gso_len)
+			c->gso_size = len;
+		memcpy (c->gso_buf + c->gso_len, pkt, len);
+		c->gso_len += len;
+		n = len;
+	}
+	TELEMETRY_COUNT (c->telemetry, packets_sent, 1);
+	TELEMETRY_COUNT (c->telemetry, bytes_sent, len);
 	if (opt_debug)
 		print_pkt (pkt, "send", n);
 	return n;
 }
 
-size_t
-conn_bufspace (conn_t *c)
+/* Bytes waiting in the output queue */
+static size_t
+conn_queued (conn_t *c)
 {
 	chunk_t *ch;
 	size_t used = 0;
-	const size_t bufsize = 8192;
-
 
 	for (ch = c->outq; ch; ch = ch->next)
 		used += (ch->size - ch->used);
+	return used;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+	size_t used = conn_queued (c);
+	const size_t bufsize = 8192;
+
 	return used > bufsize ? 0 : bufsize - used;
 }
 
@@ -159,7 +332,8 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 		c->write_eof = 1;
 		if (!c->outq)
 		{
-			close(outfile);
+			if (c->wfd == outfile)
+				close(outfile);
 			shutdown (c->wfd, SHUT_WR);
 		}
 		return 0;
@@ -179,7 +353,8 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 		write (log_out, buf, n);
 
 	if (!c->outq) {
-		int r = write (c->wfd, buf, n);
+		int r = c->synth ? synth_write (c->synth, buf, n)
+			: write (c->wfd, buf, n);
 		if (r < 0) {
 			if (errno != EAGAIN) {
 				perror ("write");
@@ -190,6 +365,9 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 		else {
 			buf += r;
 			n -= r;
+			trace_record (c->trace, TRACE_OUTPUT, n, r, 0);
+			if (n == 0)
+				LATENCY_RECORD (c, output, 0);
 		}
 	}
 
@@ -198,9 +376,11 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 		ch->next = NULL;
 		ch->size = n;
 		ch->used = 0;
+		ch->queued_us = c->latency ? clock_now_us () : 0;
 		memcpy (ch->buf, buf, n);
 		*c->outqtail = ch;
 		c->outqtail = &ch->next;
+		TELEMETRY_SET (c->telemetry, output_queue, conn_queued (c));
 	}
 
 	if (c->wpoll && c->outq)
@@ -216,7 +396,7 @@ conn_input (conn_t *c, void *buf, size_t n)
 
 	if (c->read_eof)
 		return -1;
-	r = read (c->rfd, buf, n);
+	r = c->synth ? synth_read (c->synth, buf, n) : read (c->rfd, buf, n);
 	if (r == 0 || (r < 0 && errno != EAGAIN)) {
 		if (r == 0)
 			errno = EIO;
@@ -284,6 +464,7 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
 	c->nfd = serverconf->udp_socket;
 	c->rfd = c->wfd = n;
 	c->server = 1;
+	c->latency = latency_attach ();
 
 	return c;
 }
@@ -297,6 +478,15 @@ conn_free (conn_t *c)
 		nch = ch->next;
 		free (ch);
 	}
+	free (c->gso_buf);
+	netsim_forget (netsim_out, c);
+	netsim_forget (netsim_in, c);
+	if (c->sim_peer)
+		c->sim_peer->sim_peer = NULL;
+	telemetry_detach (c->telemetry);
+	trace_detach (c->trace);
+	latency_detach (c->latency, c->sender_receiver);
+	synth_close (c->synth);
 
 	if (c->next)
 		c->next->prev = c->prev;
@@ -305,7 +495,7 @@ conn_free (conn_t *c)
 	close (c->rfd);
 	if (c->wfd != c->rfd)
 		close (c->wfd);
-	if (!c->server)
+	if (!c->server && !c->mux)
 		close (c->nfd);
 	close(infile);
 	close(outfile);
@@ -319,7 +509,118 @@ conn_free (conn_t *c)
 void
 conn_destroy (conn_t *c)
 {
-	c->delete_me = 1;
+	for (; c; c = c->next_stream)
+		c->delete_me = 1;
+}
+
+/* Open the input -s names: the file, or for a synth: spec /dev/zero,
+ * which is always readable, with *synth set to the generator that
+ * conn_input reads instead.  Returns -1 on failure. */
+static int
+open_input (const char *name, struct synth **synth)
+{
+	struct synth spec;
+	int fd;
+
+	*synth = NULL;
+	switch (synth_parse (name, 0, &spec)) {
+	case -1:
+		return -1;
+	case 1:
+		*synth = synth_create (&spec);
+		fd = open ("/dev/zero", O_RDONLY);
+		break;
+	default:
+		fd = open (name, O_RDONLY);
+	}
+	if (fd < 0)
+		perror (name);
+	return fd;
+}
+
+/* Open the output for -r spec: the file name, created with the extra
+ * flags, or for a synth: spec /dev/null, with *synth set to the checker
+ * that conn_output writes to instead. */
+static int
+open_output (const char *spec, const char *name, int flags,
+		struct synth **synth)
+{
+	struct synth s;
+	int fd;
+
+	*synth = NULL;
+	switch (synth_parse (spec, 1, &s)) {
+	case -1:
+		return -1;
+	case 1:
+		*synth = synth_create (&s);
+		fd = open ("/dev/null", O_WRONLY);
+		break;
+	default:
+		fd = open (name, O_RDWR|O_CREAT|flags, S_IWRITE|S_IREAD);
+	}
+	if (fd < 0)
+		perror (name);
+	return fd;
+}
+
+/* Add stream id to connection c, keeping its streams in order; id < 0
+ * takes the one after the last. */
+static conn_t *
+conn_stream_add (conn_t *c, int id, int rfd, int wfd)
+{
+	conn_t *s, **sp;
+
+	if (id < 0) {
+		for (s = c; s->next_stream; s = s->next_stream)
+			;
+		id = s->stream + 1;
+	}
+	for (sp = &c->next_stream; *sp && (*sp)->stream < id;
+	     sp = &(*sp)->next_stream)
+		;
+	s = conn_alloc ();
+	s->next_stream = *sp;
+	s->rel = c->rel;
+	s->mux = c;
+	s->stream = id;
+	s->rfd = rfd;
+	s->wfd = wfd;
+	s->nfd = -1;
+	s->server = c->server;
+	s->sender_receiver = c->sender_receiver;
+	s->peer = c->peer;
+	if (rfd < 0)
+		s->read_eof = 1;
+	if (wfd < 0)
+		s->write_err = 1;
+	*sp = s;
+	return s;
+}
+
+conn_t *
+conn_stream (conn_t *c, int id)
+{
+	conn_t *s;
+	char name[PATH_MAX];
+	struct synth *synth;
+	int fd;
+
+	for (s = c; s; s = s->next_stream)
+		if (s->stream == id)
+			return s;
+	if (!stream_output || c->delete_me || id >= opt_mux)
+		return NULL;
+
+	/* The peer opened a new stream; give it its own output file */
+	snprintf (name, sizeof (name), "%s.%d", stream_output, id);
+	fd = open_output (stream_output, name, O_TRUNC, &synth);
+	if (fd < 0)
+		return NULL;
+	make_async (fd);
+	s = conn_stream_add (c, id, -1, fd);
+	s->synth = synth;
+	return s;
 }
 
 void
@@ -327,6 +628,8 @@ conn_drain (conn_t *c)
 {
 	chunk_t *ch;
 	int didsome = 0;
+	int drained = 0;
+	PMU_SCOPE (PMU_DRAIN);
 
 	if (c->wpoll)
 		cevents[c->wpoll].events &= ~POLLOUT;
@@ -343,6 +646,7 @@ conn_drain (conn_t *c)
 			break;
 		}
 		didsome = 1;
+		drained += n;
 		ch->used += n;
 		if (ch->used < ch->size) {
 			if (c->wpoll)
@@ -352,8 +656,12 @@ conn_drain (conn_t *c)
 		c->outq = ch->next;
 		if (!c->outq)
 			c->outqtail = &c->outq;
+		LATENCY_RECORD (c, output, clock_now_us () - ch->queued_us);
 		free (ch);
 	}
+	TELEMETRY_SET (c->telemetry, output_queue, conn_queued (c));
+	if (drained)
+		trace_record (c->trace, TRACE_OUTPUT, conn_queued (c), drained, 0);
 	if (c->write_eof && !c->write_err && !c->outq) {
 		c->write_err = 1;
 		shutdown (c->wfd, SHUT_WR);
@@ -386,11 +694,11 @@ conn_mkevents (void)
 				c->wpoll = c->rpoll;
 			else
 				c->wpoll = n++;
-			if (c->server)
-				c->npoll = 0;
-			else
-				c->npoll = n++;
 		}
+		if (c->server || c->mux)
+			c->npoll = 0;
+		else
+			c->npoll = n++;
 	}
 
 	e = xmalloc (n * sizeof (*e));
@@ -443,14 +751,20 @@ conn_mkevents (void)
 static void
 conn_demux (const struct config_server *cs)
 {
-	packet_t pkt;
+	static union {
+		packet_t pkt;
+		char buf[GRO_BUF_SIZE];
+	} u;
 	struct sockaddr_storage ss;
-	int n;
+	int n, off, seg;
 
 	memset (&ss, 0, sizeof (ss));
-	while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
-		rel_demux (&cs->c, &ss, &pkt, n);
-		memset (&pkt, 0xc7, n);	     /* to help debugging */
+	while ((n = debug_recv (cs->udp_socket, u.buf, sizeof (u.buf), 0, &ss,
+							&seg)) >= 0) {
+		for (off = 0; off < n; off += seg)
+			rel_demux (&cs->c, &ss, (packet_t *) (u.buf + off),
+					n - off < seg ? n - off : seg);
+		memset (u.buf, 0xc7, n);	     /* to help debugging */
 		memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
 	}
 	if (errno != EAGAIN)
@@ -458,27 +772,22 @@ conn_demux (const struct config_server *cs)
 }
 
 long
-need_timer_in (const struct timespec *last, long timer)
+need_timer_in (uint64_t last, long timer)
 {
-	long to;
-	struct timespec ts;
+	uint64_t to = (clock_now_us () - last) / 1000;
 
-	clock_gettime (CLOCK_MONOTONIC, &ts);
-	to = ts.tv_sec - last->tv_sec;
-	if (to > timer / 1000)
-		return 0;
-	to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-	if (to >= timer)
+	if (to >= (uint64_t) timer)
 		return 0;
-	return
-			timer - to;
+	return timer - to;
 }
 
 void
 conn_poll (const struct config_common *cc)
 {
 	int n, i;
+	long timeout;
 	conn_t *c, *nc;
+	struct pmu_scope dispatch;
 	static int last_cg;
 
 	if (last_cg != cevents_generation) {
@@ -486,14 +795,31 @@ conn_poll (const struct config_common *cc)
 		cevents_generation = last_cg;
 	}
 
+	timeout = need_timer_in (last_timeout, cc->timer);
+	if (netsim_out || netsim_in) {
+		uint64_t now = clock_now_us ();
+		timeout = netsim_timeout (netsim_out, now, timeout);
+		timeout = netsim_timeout (netsim_in, now, timeout);
+	}
 	if (cevents[0].fd >= 0)
-		n = poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+		n = poll (cevents, ncevents, timeout);
 	else
-		n = poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-	if (n < 0) {
+		n = poll (cevents+1, ncevents-1, timeout);
+	if (n < 0 && errno != EINTR) {
 		fprintf(stderr, "Poll error\n");
 	}
-
+	if (netsim_out)
+		netsim_run (netsim_out, clock_now_us ());
+	if (netsim_in)
+		netsim_run (netsim_in, clock_now_us ());
+	if (trace_dump_requested)
+		trace_dump_all ();
+	if (pmu_report_requested)
+		pmu_report ();
+
+	dispatch.stage = -1;
+	if (pmu_enabled)
+		pmu_enter (&dispatch, PMU_POLL);
 	for (i = 1; i < ncevents; i++) {
 		if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
 			if ((c = evreaders[i]) && !c->delete_me) {
@@ -516,15 +842,30 @@ conn_poll (const struct config_common *cc)
 					rel_destroy (c->rel);
 				}
 				else if (cevents[i].fd == c->nfd && !c->server) {
-					packet_t pkt;
-					int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
+					static union {
+						packet_t pkt;
+						char buf[GRO_BUF_SIZE];
+					} u;
+					int seg, off;
+					int len = debug_recv (c->nfd, u.buf, sizeof (u.buf), 0, NULL,
+							&seg);
 					if (len < 0) {
 						if (errno != EAGAIN)
 							perror ("recv");
 					}
 					else {
-						rel_recvpkt (c->rel, &pkt, len);
-						memset (&pkt, 0xc9, len); /* for debugging */
+						/* With UDP_GRO, len may cover several datagrams of
+						 * seg bytes each; hand them over one at a time. */
+						for (off = 0; off < len && !c->delete_me; off += seg) {
+							int n = len - off < seg ? len - off : seg;
+							TELEMETRY_COUNT (c->telemetry, packets_received, 1);
+							TELEMETRY_COUNT (c->telemetry, bytes_received, n);
+							if (netsim_in)
+								netsim_submit (netsim_in, c, u.buf + off, n);
+							else
+								rel_recvpkt (c->rel, (packet_t *) (u.buf + off), n);
+						}
+						memset (u.buf, 0xc9, len); /* for debugging */
 					}
 				}
 			}
@@ -545,24 +886,168 @@ conn_poll (const struct config_common *cc)
 		}
 		cevents[i].revents = 0;
 	}
+	pmu_leave (&dispatch);
 
-	if (need_timer_in (&last_timeout, cc->timer) == 0) {
+	if (need_timer_in (last_timeout, cc->timer) == 0) {
 		rel_timer ();
-		clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+		last_timeout = clock_now_us ();
 	}
 
+	conn_flushall ();
+
 	for (c = conn_list; c; c = nc) {
 		nc = c->next;
-		if (c->delete_me && (c->write_err || !c->outq))
+		/* Let what the emulator still holds for c go out first */
+		if (c->delete_me && (c->write_err || !c->outq)
+				&& !netsim_pending (netsim_out, c))
 			conn_free (c);
 	}
 }
 
+/* The event loop of -S.  Files are always ready, so at each moment
+ * everything the protocol can read is read and everything queued is
+ * written; then virtual time jumps to the next event, which is a packet
+ * coming out of a link or rel_timer, and that event runs. */
+static void
+sim_run (const struct config_common *cc)
+{
+	uint64_t now = 0, next, due;
+	uint64_t next_timer = cc->timer * 1000;
+	uint64_t limit = sim_limit * 1000000;
+	uint64_t events = 0;
+	struct timespec start, end;
+	conn_t *c, *nc;
+	int last_cg = -1;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	while (conn_list) {
+		if (last_cg != cevents_generation) {
+			conn_mkevents ();
+			last_cg = cevents_generation;
+		}
+		for (c = conn_list; c; c = c->next) {
+			if (c->delete_me)
+				continue;
+			if (c->outq)
+				conn_drain (c);
+			if (c->rfd >= 0 && !c->read_eof && !c->xoff && !c->delete_me) {
+				c->xoff = 1;
+				rel_read (c->rel);
+			}
+		}
+
+		for (c = conn_list; c; c = nc) {
+			nc = c->next;
+			if (c->delete_me && (c->write_err || !c->outq)
+					&& !netsim_pending (c->sender_receiver == SENDER
+							? netsim_out : netsim_in, c))
+				conn_free (c);
+		}
+		if (!conn_list)
+			break;
+
+		next = next_timer;
+		if ((due = netsim_next (netsim_out)) < next)
+			next = due;
+		if ((due = netsim_next (netsim_in)) < next)
+			next = due;
+		if (next > limit) {
+			fprintf (stderr, "%s: transfer not done after %g s of"
+					" simulated time\n", progname, sim_limit);
+			exit (1);
+		}
+		now = next;
+		clock_advance (now);
+		netsim_run (netsim_out, now);
+		netsim_run (netsim_in, now);
+		if (now >= next_timer) {
+			rel_timer ();
+			next_timer = now + cc->timer * 1000;
+		}
+		events++;
+	}
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	fprintf (stderr, "Simulated: \t%.3f s in %llu events, %.3f s real time\n",
+			now / 1e6, (unsigned long long) events,
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+/* Set up -S: the sender reads inputs and the receiver writes output,
+ * each with its own copy of the configuration, and the links between
+ * them are emulated with the -N spec in the directions it names and
+ * perfect the other way. */
+static void
+sim_setup (const struct config_common *cc, char **inputs, int ninputs,
+		char *output, int have_netsim)
+{
+	static struct config_common sc, rc;
+	struct netsim_config perfect;
+	conn_t *snd, *rcv;
+	struct synth *synth;
+	int i;
+
+	memset (&perfect, 0, sizeof (perfect));
+	if (!have_netsim)
+		netsim_config = perfect;
+	netsim_out = netsim_create (netsim_config.directions & NETSIM_OUT
+			? &netsim_config : &perfect, netsim_config.seed, "out", sim_deliver);
+	netsim_in = netsim_create (netsim_config.directions & NETSIM_IN
+			? &netsim_config : &perfect, netsim_config.seed + 1, "in",
+			sim_deliver);
+	atexit (netsim_cleanup);
+	clock_set_virtual (0);
+	simulating = 1;
+
+	sc = rc = *cc;
+	sc.sender_receiver = SENDER;
+	rc.sender_receiver = RECEIVER;
+
+	snd = conn_alloc ();
+	rcv = conn_alloc ();
+	infile = open_input (inputs[0], &snd->synth);
+	outfile = open_output (output, output, O_TRUNC, &rcv->synth);
+	if (infile < 0 || outfile < 0)
+		exit (1);
+	snd->rfd = infile;
+	snd->wfd = open ("/dev/null", O_WRONLY);
+	/* Like a receiver on a terminal, the receiver has nothing to send
+	 * and does not end its side first */
+	rcv->rfd = -1;
+	rcv->wfd = outfile;
+	if (opt_mux)
+		stream_output = output;
+	snd->nfd = rcv->nfd = -1;
+	snd->sender_receiver = SENDER;
+	rcv->sender_receiver = RECEIVER;
+	snd->sim_peer = rcv;
+	rcv->sim_peer = snd;
+	if (telemetry) {
+		snd->telemetry = telemetry_attach (SENDER, "simulated receiver");
+		rcv->telemetry = telemetry_attach (RECEIVER, "simulated sender");
+	}
+	snd->trace = trace_attach ();
+	rcv->trace = trace_attach ();
+	snd->latency = latency_attach ();
+	rcv->latency = latency_attach ();
+	snd->rel = rel_create (snd, NULL, &sc);
+	rcv->rel = rel_create (rcv, NULL, &rc);
+
+	for (i = 1; i < ninputs; i++) {
+		int fd = open_input (inputs[i], &synth);
+		if (fd < 0)
+			exit (1);
+		conn_stream_add (snd, -1, fd, -1)->synth = synth;
+	}
+
+	sim_run (&rc);
+}
+
 uint16_t
 cksum (const void *_data, int len)
 {
 	const uint8_t *data = _data;
 	uint32_t sum;
+	PMU_SCOPE (PMU_CKSUM);
 
 	for (sum = 0;len >= 2; data += 2, len -= 2)
 		sum += data[0] << 8 | data[1];
@@ -805,22 +1290,62 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
 	return s;
 }
 
+/* Turn on UDP_GRO so that the kernel may coalesce a burst of
+ * datagrams from the peer into one receive. */
+static void
+set_gro (int s)
+{
+	int on = 1;
+	if (setsockopt (s, SOL_UDP, UDP_GRO, &on, sizeof (on)) < 0)
+		perror ("setsockopt UDP_GRO");
+}
+
 static int
-debug_recv (int s, packet_t *buf, size_t len, int flags,
-		struct sockaddr_storage *from)
+debug_recv (int s, void *buf, size_t len, int flags,
+		struct sockaddr_storage *from, int *segsize)
 {
-	socklen_t socklen = sizeof (*from);
-	int n;
-	if (from)
-		n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
-	else
-		n = recv (s, buf, len, flags);
-	if (opt_debug)
-		print_pkt (buf, "recv", n);
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char control[CMSG_SPACE (sizeof (int))];
+	int n, off;
+
+	memset (&msg, 0, sizeof (msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (from) {
+		msg.msg_name = from;
+		msg.msg_namelen = sizeof (*from);
+	}
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	n = recvmsg (s, &msg, flags);
+	*segsize = n;
+	if (n > 0)
+		for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+			if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+				*segsize = *(int *) CMSG_DATA (cm);
+	for (off = 0; off < n; off += *segsize) {
+		const packet_t *p = (const packet_t *) ((char *) buf + off);
+		int plen = n - off < *segsize ? n - off : *segsize;
+		if (plen < offsetof (packet_t, seqno))
+			break;
+		PROBE5 (recv, s, plen >= offsetof (packet_t, data) ? ntohl (p->seqno) : 0,
+				ntohl (p->ackno), plen, ntohl (p->rwnd));
+	}
+	if (opt_debug) {
+		if (n <= 0)
+			print_pkt (buf, "recv", n);
+		for (off = 0; off < n; off += *segsize)
+			print_pkt ((const packet_t *) ((char *) buf + off), "recv",
+					n - off < *segsize ? n - off : *segsize);
+	}
 	return n;
 }
 
-
 void
 do_client (struct config_client *cc)
 {
@@ -842,7 +1367,26 @@ do_client (struct config_client *cc)
 			if (s < 0)
 				continue;
 			make_async (s);
+			/* With opt_mux every further TCP connection becomes one
+			 * more stream of the connection already up, so it shares
+			 * its socket and congestion state instead of starting over,
+			 * until that has opt_mux streams. */
+			if (opt_mux) {
+				conn_t *last;
+				for (c = conn_list; c; c = c->next)
+					if (!c->mux && !c->delete_me)
+						break;
+				for (last = c; last && last->next_stream;
+				     last = last->next_stream)
+					;
+				if (c && last->stream + 1 < opt_mux) {
+					conn_stream_add (c, -1, s, s);
+					continue;
+				}
+			}
 			if ((u = connect_to (1, &cc->server)) >= 0) {
+				if (opt_gso)
+					set_gro (u);
 				c = conn_alloc ();
 				c->rfd = s;
 				c->wfd = s;
@@ -863,6 +1407,8 @@ do_server (struct config_server *cs)
 	serverconf = cs;
 	conn_mkevents ();
 	make_async (cs->udp_socket);
+	if (opt_gso)
+		set_gro (cs->udp_socket);
 	cevents[0].fd = cs->udp_socket;
 	cevents[0].events = POLLIN;
 	for (;;) {
@@ -872,14 +1418,73 @@ do_server (struct config_server *cs)
 	}
 }
 
+/* Read the shared secret of -K, up to KEY_MAX bytes of it, into c */
+#define KEY_MAX 4096
+static void
+read_key (const char *path, struct config_common *c)
+{
+	char *key = xmalloc (KEY_MAX);
+	int fd = open (path, O_RDONLY), n = 0, got = 1;
+
+	if (fd < 0) {
+		perror (path);
+		exit (1);
+	}
+	while (n < KEY_MAX && (got = read (fd, key + n, KEY_MAX - n)) > 0)
+		n += got;
+	if (got < 0) {
+		perror (path);
+		exit (1);
+	}
+	close (fd);
+	if (n < 16) {
+		fprintf (stderr, "%s: a key needs at least 16 bytes\n", path);
+		exit (1);
+	}
+	c->key = key;
+	c->key_length = n;
+}
+
 static void
 usage (void)
 {
 	fprintf (stderr,
 			"usage: %s -s inputfile udp-port [relayer:]udp-port\n"
 			"       %s -r outputfile udp-port [relayer:]udp-port\n"
+			"       inputfile may be synth:size=N[,seed=S], N bytes of made-up\n"
+			"       data, and outputfile synth[:size=N][,seed=S], which checks that\n"
+			"       data arrives intact instead of storing it (see synth.h)\n"
 			"       -w: RECEIVER's maximum receiving window size, in number of packets\n"
-			,progname, progname);
+			"       -g: batch sends with UDP GSO and receives with UDP GRO\n"
+			"       -f: SENDER's parity packets for every group of up to N data packets (FEC)\n"
+			"       -z: SENDER compresses payloads (not with -m)\n"
+			"       -c: packet checksum, sum (the default), crc32c or none; SENDER\n"
+			"           asks for it, RECEIVER grants none only with -c none\n"
+			"       -K: encrypt data packets with AES-256-GCM, with keys derived from\n"
+			"           the secret in this file; both ends need the same one.  Data\n"
+			"           packets with their whole header and ACKs are authenticated;\n"
+			"           the handshake and FEC control packets are not\n"
+			"       -i: SENDER's congestion window after the handshake, in packets\n"
+			"       -m: multiplex up to N streams per connection; each -s input is\n"
+			"           sent as its own stream and stream n > 0 is written to\n"
+			"           outputfile.n.  Both ends need it: the SENDER sends no data\n"
+			"           until the RECEIVER has agreed, and the RECEIVER drops\n"
+			"           streams N and up\n"
+			"       -T: publish live counters in shared memory segment /name (see rtop)\n"
+			"       -t: record protocol events, written to file on SIGUSR1 and at exit\n"
+			"           (see rtrace)\n"
+			"       -L: append latency percentiles to file, as CSV, as each\n"
+			"           connection closes\n"
+			"       -P: count cycles, instructions, cache and branch misses per\n"
+			"           protocol stage, printed at the end and on SIGUSR2\n"
+			"       -N: emulate the network in-process, e.g. -N loss=0.05,delay=20,rate=10000\n"
+			"           (keys: seed dir loss reorder dup badlength garbage corrupt\n"
+			"           truncate rate delay jitter queue; see netsim.c)\n"
+			"       %s -S seconds [-N spec] -s inputfile -r outputfile\n"
+			"       -S: simulate sender, link and receiver in this process on virtual\n"
+			"           time, giving up after this many seconds of it; with the same\n"
+			"           inputs and seed every run is the same\n"
+			,progname, progname, progname);
 	exit (1);
 }
 
@@ -888,6 +1493,19 @@ main (int argc, char **argv)
 {
 	struct option o[] = {
 			{ "debug", no_argument, NULL, 'd' },
+			{ "gso", no_argument, NULL, 'g' },
+			{ "mux", required_argument, NULL, 'm' },
+			{ "fec", required_argument, NULL, 'f' },
+			{ "compress", no_argument, NULL, 'z' },
+			{ "checksum", required_argument, NULL, 'c' },
+			{ "key", required_argument, NULL, 'K' },
+			{ "initial-window", required_argument, NULL, 'i' },
+			{ "telemetry", required_argument, NULL, 'T' },
+			{ "trace", required_argument, NULL, 't' },
+			{ "latency", required_argument, NULL, 'L' },
+			{ "netsim", required_argument, NULL, 'N' },
+			{ "perf", no_argument, NULL, 'P' },
+			{ "simulate", required_argument, NULL, 'S' },
 			{ "window", required_argument, NULL, 'w' },
 			{ "sender", required_argument, NULL, 's'},
 			{ "receiver", required_argument, NULL, 'r'},
@@ -896,10 +1514,13 @@ main (int argc, char **argv)
 	int opt;
 	char *local = NULL;
 	char *remote = NULL;
-	char *input = NULL;
+	char **inputs = xmalloc (argc * sizeof (*inputs));
+	int ninputs = 0;
 	char *output = NULL;
 	struct config_common c;
 	struct sigaction sa;
+	int have_netsim = 0;
+	int i;
 
 	/* Ignore SIGPIPE, since we may get a lot of these */
 	memset (&sa, 0, sizeof (sa));
@@ -917,14 +1538,71 @@ main (int argc, char **argv)
 		progname = argv[0];
 
 
-	while ((opt = getopt_long (argc, argv, "ds:r:w:", o, NULL)) != -1)
+	while ((opt = getopt_long (argc, argv, "c:df:gi:K:L:m:s:N:Pr:S:T:t:w:z", o, NULL)) != -1)
 		switch (opt) {
 		case 'd':
 			opt_debug = 1;
 			break;
+		case 'g':
+			opt_gso = 1;
+			break;
+		case 'f':
+			c.fec_group = atoi (optarg);
+			break;
+		case 'i':
+			c.initial_window = atoi (optarg);
+			break;
+		case 'm':
+			opt_mux = atoi (optarg);
+			if (opt_mux < 1 || opt_mux > 65536)
+				usage ();
+			break;
+		case 'z':
+			c.compress = 1;
+			break;
+		case 'c':
+			if (!strcmp (optarg, "sum"))
+				c.checksum = CHECKSUM_SUM;
+			else if (!strcmp (optarg, "crc32c"))
+				c.checksum = CHECKSUM_CRC32C;
+			else if (!strcmp (optarg, "none"))
+				c.checksum = CHECKSUM_NONE;
+			else
+				usage ();
+			break;
+		case 'K':
+			read_key (optarg, &c);
+			break;
+		case 'T':
+			if (telemetry_open (optarg) < 0)
+				exit (1);
+			break;
+		case 't':
+			if (trace_open (optarg) < 0)
+				exit (1);
+			break;
+		case 'L':
+			if (latency_open (optarg) < 0)
+				exit (1);
+			break;
+		case 'N':
+			if (netsim_parse (optarg, &netsim_config) < 0)
+				exit (1);
+			have_netsim = 1;
+			break;
+		case 'P':
+			if (pmu_open () < 0)
+				exit (1);
+			break;
+		case 'S':
+			sim_limit = atof (optarg);
+			simulating = sim_limit > 0;
+			if (!simulating)
+				usage ();
+			break;
 		case 's':
 			c.sender_receiver = SENDER;
-			input = optarg;
+			inputs[ninputs++] = optarg;
 			break;
 		case 'r':
 			c.sender_receiver = RECEIVER;
@@ -939,10 +1617,28 @@ main (int argc, char **argv)
 		}
 
 
-	if(optind + 2 != argc || c.window < 1)
+	if(c.window < 1 || c.fec_group < 0 || ninputs > (opt_mux ? opt_mux : 1))
 		usage ();
-
 	c.timer = 10; //wake up rel_timer every 10ms
+
+	if (simulating) {
+		if (optind != argc || !ninputs || !output)
+			usage ();
+		sim_setup (&c, inputs, ninputs, output, have_netsim);
+		free (inputs);
+		return synth_failed;
+	}
+	if (optind + 2 != argc)
+		usage ();
+	if (have_netsim) {
+		if (netsim_config.directions & NETSIM_OUT)
+			netsim_out = netsim_create (&netsim_config, netsim_config.seed,
+					"out", netsim_send);
+		if (netsim_config.directions & NETSIM_IN)
+			netsim_in = netsim_create (&netsim_config,
+					netsim_config.seed + 1, "in", netsim_receive);
+		atexit (netsim_cleanup);
+	}
 	local = argv[optind];
 	remote = argv[optind+1];
 
@@ -953,25 +1649,21 @@ main (int argc, char **argv)
 
 	if(c.sender_receiver == SENDER)
 	{
-		infile = open(input, O_RDONLY);
+		infile = open_input (inputs[0], &cn->synth);
 		if(infile < 0)
-		{
-			fprintf(stderr, "input file open error\n");
 			exit (1);
-		}
 		cn->rfd = infile;
 		cn->wfd = STDOUT_FILENO;
 	}
 	else if(c.sender_receiver == RECEIVER)
 	{
 		cn->rfd = STDIN_FILENO;
-		outfile = open(output, O_RDWR|O_CREAT, S_IWRITE|S_IREAD);
+		outfile = open_output (output, output, 0, &cn->synth);
 		if(outfile < 0)
-		{
-			fprintf(stderr, "output file open error\n");
 			exit (1);
-		}
 		cn->wfd = outfile;
+		if (opt_mux)
+			stream_output = output;
 	}
 
 
@@ -990,10 +1682,34 @@ main (int argc, char **argv)
 	make_async (cn->rfd);
 	make_async (cn->wfd);
 	make_async (cn->nfd);
+	if (opt_gso)
+		set_gro (cn->nfd);
+	if (telemetry) {
+		char addr[NI_MAXHOST] = "unknown";
+		char port[NI_MAXSERV] = "unknown";
+		char peer[NI_MAXHOST + NI_MAXSERV + 1];
+		getnameinfo ((const struct sockaddr *) &cn->peer, sizeof (cn->peer),
+				addr, sizeof (addr), port, sizeof (port),
+				NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+		snprintf (peer, sizeof (peer), "%s:%s", addr, port);
+		cn->telemetry = telemetry_attach (c.sender_receiver, peer);
+	}
+	cn->trace = trace_attach ();
+	cn->latency = latency_attach ();
 	cn->rel = rel_create (cn, NULL, &c);
 
+	for (i = 1; i < ninputs; i++) {
+		struct synth *synth;
+		int fd = open_input (inputs[i], &synth);
+		if (fd < 0)
+			exit (1);
+		make_async (fd);
+		conn_stream_add (cn, -1, fd, -1)->synth = synth;
+	}
+	free (inputs);
+
 	conn_mkevents ();
 	while (conn_list)
 		conn_poll (&c);
-	return 0;
+	return synth_failed;
 }
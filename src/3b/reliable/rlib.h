@@ -87,6 +87,20 @@ struct packet {
 };
 typedef struct packet packet_t;
 
+/* When a connection multiplexes several streams (opt_mux, once both ends
+   have agreed on it in the handshake), the data of every Data packet
+   starts with a stream header.  offset is the byte
+   offset of the payload within its stream, so each stream can be put
+   back in order on its own.  A packet with STREAM_FIN set and no
+   payload ends its stream; the connection still ends with an ordinary
+   EOF packet once every stream has finished. */
+struct stream_header {
+	uint16_t stream;
+	uint16_t flags;
+	uint32_t offset;
+};
+#define STREAM_FIN 0x1
+
 /* -----------------------------------------------------------------------
 
    Important notes about the library:
@@ -193,12 +207,26 @@ struct config_common {
 	int timeout;			/* Retransmission timeout in milliseconds */
 	int single_connection;        /* Exit after first connection failure */
 	int sender_receiver;          /* sender or receiver*/
+	int fec_group;		/* Most data packets per FEC group, 0 for no FEC */
+	int compress;		/* Compress payloads */
+	int initial_window;	/* Congestion window after the handshake, 0 for default */
+	int checksum;		/* CHECKSUM_*: sender asks for it, receiver grants none */
+	const char *key;		/* Secret for encrypting packets, NULL for none */
+	int key_length;
 };
 
+/* Packet checksums a connection can agree on (-c) */
+#define CHECKSUM_SUM 0		/* Internet checksum, what cksum computes */
+#define CHECKSUM_CRC32C 1	/* CRC32C folded to 16 bits */
+#define CHECKSUM_NONE 2		/* none, for trusted paths */
+
 typedef struct reliable_state rel_t;
 
 extern char *progname;		/* Set to name of program by main */
 extern int opt_debug;		/* When != 0, print packets */
+extern int opt_gso;		/* When != 0, batch sends with UDP GSO */
+extern int opt_mux;		/* When != 0, connections carry up to this
+				   many streams */
 
 
 #if !DMALLOC
@@ -230,11 +258,16 @@ struct chunk {
 	struct chunk *next;
 	size_t size;
 	size_t used;
+	uint64_t queued_us;		/* when conn_output queued it */
 	char buf[1];
 };
 typedef struct chunk chunk_t;
 
 
+struct telemetry_conn;
+struct trace_ring;
+struct latency;
+struct synth;
 struct conn {
 	rel_t *rel;			/* Data from reliable */
 
@@ -257,6 +290,21 @@ struct conn {
 	chunk_t *outq;		/* chunks not yet written */
 	chunk_t **outqtail;
 
+	char *gso_buf;		/* packets queued for one UDP_SEGMENT send */
+	size_t gso_len;		/* bytes queued in gso_buf */
+	size_t gso_size;		/* segment size of the queued packets */
+
+	int stream;			/* stream id within the connection */
+	struct conn *mux;		/* connection this stream belongs to */
+	struct conn *next_stream;	/* next stream of the same connection */
+
+	struct telemetry_conn *telemetry;	/* live counters, NULL without -T */
+	struct trace_ring *trace;	/* event trace, NULL without -t */
+	struct latency *latency;	/* latency histograms, NULL for streams */
+	struct synth *synth;		/* made-up input or checked output, for
+					   -s/-r synth; NULL for files */
+	struct conn *sim_peer;	/* the other end, when simulating (-S) */
+
 	struct conn *next;		/* Linked list of connections */
 	struct conn **prev;
 };
@@ -266,7 +314,10 @@ typedef struct conn conn_t;
  * NULL conn_t. */
 conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 
-/* Call this function to send a UDP packet to the other side. */
+/* Call this function to send a UDP packet to the other side.  With
+ * opt_gso the packet is only queued; the library hands everything
+ * queued during one event to the kernel as a single GSO super-segment
+ * before going back to poll. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
 /* This function tells you how many bytes of output buffering are free
@@ -296,6 +347,15 @@ int conn_input (conn_t *c, void *buf, size_t len);
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
+/* With opt_mux, every stream of a connection is a conn_t of its own
+ * that works with conn_input, conn_output and conn_bufspace.  The
+ * connection's conn_t is stream 0, and the others hang off it through
+ * next_stream.  Only the connection's conn_t sends packets.  This
+ * function returns stream id of connection c, creating it if the peer
+ * has just opened it, or NULL if it cannot be created or id is not
+ * below opt_mux. */
+conn_t *conn_stream (conn_t *c, int id);
+
 /* Functions you must provide (in reliable.c). */
 
 rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
@@ -0,0 +1,311 @@
+/*
+ * rtop: watch the live counters a reliable process publishes with -T.
+ *
+ *   rtop [-c | -j] [-i ms] [-n count] name
+ *
+ * Without -c or -j, rtop redraws a table of the connections every
+ * interval.  -c prints CSV and -j JSON lines instead, one record per
+ * connection per interval, for plotting or for feeding another tool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+#define FORMAT_TABLE 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+
+/* A copy of one connection's numbers, taken at some moment */
+struct snapshot {
+	uint32_t state;
+	int32_t sender_receiver;
+	char peer[64];
+	uint64_t started_us;
+	struct telemetry_counters counters;
+	uint64_t cwnd, ssthresh, rwnd, srtt_us;
+	uint64_t send_queue, receive_queue, output_queue;
+};
+
+static char *progname;
+
+static void
+usage (void)
+{
+	fprintf (stderr,
+			"usage: %s [-c | -j] [-i ms] [-n count] name\n"
+			"       -c: print CSV\n"
+			"       -j: print JSON lines\n"
+			"       -i: interval between samples, in ms (default 1000)\n"
+			"       -n: stop after count samples\n"
+			, progname);
+	exit (1);
+}
+
+static uint64_t
+now_us (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const struct telemetry_segment *
+attach (const char *name)
+{
+	char path[256];
+	const struct telemetry_segment *seg;
+	struct stat sb;
+	int fd;
+
+	snprintf (path, sizeof (path), "%s%s", name[0] == '/' ? "" : "/", name);
+	fd = shm_open (path, O_RDONLY, 0);
+	if (fd < 0) {
+		perror (path);
+		return NULL;
+	}
+	if (fstat (fd, &sb) < 0 || sb.st_size < (off_t) sizeof (*seg)) {
+		fprintf (stderr, "%s: not a telemetry segment\n", path);
+		close (fd);
+		return NULL;
+	}
+	seg = mmap (NULL, sizeof (*seg), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED) {
+		perror ("mmap");
+		return NULL;
+	}
+	if (__atomic_load_n (&seg->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC
+			|| seg->version != TELEMETRY_VERSION
+			|| seg->max_conns != TELEMETRY_MAX_CONNS) {
+		fprintf (stderr, "%s: not a telemetry segment of version %d\n",
+				path, TELEMETRY_VERSION);
+		munmap ((void *) seg, sizeof (*seg));
+		return NULL;
+	}
+	return seg;
+}
+
+static void
+take (const struct telemetry_conn *t, struct snapshot *s)
+{
+	s->state = __atomic_load_n (&t->state, __ATOMIC_ACQUIRE);
+	s->sender_receiver = t->sender_receiver;
+	memcpy (s->peer, t->peer, sizeof (s->peer));
+	s->peer[sizeof (s->peer) - 1] = '\0';
+	s->started_us = t->started_us;
+	s->counters.packets_sent = TELEMETRY_GET (t->counters.packets_sent);
+	s->counters.bytes_sent = TELEMETRY_GET (t->counters.bytes_sent);
+	s->counters.packets_received = TELEMETRY_GET (t->counters.packets_received);
+	s->counters.bytes_received = TELEMETRY_GET (t->counters.bytes_received);
+	s->counters.retransmits = TELEMETRY_GET (t->counters.retransmits);
+	s->counters.dup_acks = TELEMETRY_GET (t->counters.dup_acks);
+	s->counters.checksum_failures = TELEMETRY_GET (t->counters.checksum_failures);
+	s->cwnd = TELEMETRY_GET (t->cwnd);
+	s->ssthresh = TELEMETRY_GET (t->ssthresh);
+	s->rwnd = TELEMETRY_GET (t->rwnd);
+	s->srtt_us = TELEMETRY_GET (t->srtt_us);
+	s->send_queue = TELEMETRY_GET (t->send_queue);
+	s->receive_queue = TELEMETRY_GET (t->receive_queue);
+	s->output_queue = TELEMETRY_GET (t->output_queue);
+}
+
+/* Per second rate of a counter between two samples */
+static double
+rate (uint64_t now, uint64_t before, uint64_t elapsed_us)
+{
+	if (!elapsed_us || now < before)
+		return 0;
+	return (now - before) * 1e6 / elapsed_us;
+}
+
+static const char *
+state_name (uint32_t state)
+{
+	return state == TELEMETRY_LIVE ? "live" : "closed";
+}
+
+static void
+print_header (int format)
+{
+	if (format == FORMAT_CSV)
+		printf ("time_us,slot,state,role,peer,packets_sent,bytes_sent,"
+				"packets_received,bytes_received,retransmits,dup_acks,"
+				"checksum_failures,send_bps,receive_bps,cwnd,ssthresh,rwnd,"
+				"srtt_us,send_queue,receive_queue,output_queue\n");
+}
+
+static void
+print_conn (int format, uint64_t time_us, int slot, const struct snapshot *s,
+		double send_bps, double receive_bps)
+{
+	const char *role = s->sender_receiver == 1 ? "sender" : "receiver";
+	const struct telemetry_counters *k = &s->counters;
+
+	switch (format) {
+	case FORMAT_CSV:
+		printf ("%llu,%d,%s,%s,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,"
+				"%.0f,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+				(unsigned long long) time_us, slot, state_name (s->state),
+				role, s->peer,
+				(unsigned long long) k->packets_sent,
+				(unsigned long long) k->bytes_sent,
+				(unsigned long long) k->packets_received,
+				(unsigned long long) k->bytes_received,
+				(unsigned long long) k->retransmits,
+				(unsigned long long) k->dup_acks,
+				(unsigned long long) k->checksum_failures,
+				send_bps, receive_bps,
+				(unsigned long long) s->cwnd,
+				(unsigned long long) s->ssthresh,
+				(unsigned long long) s->rwnd,
+				(unsigned long long) s->srtt_us,
+				(unsigned long long) s->send_queue,
+				(unsigned long long) s->receive_queue,
+				(unsigned long long) s->output_queue);
+		break;
+	case FORMAT_JSON:
+		printf ("{\"time_us\":%llu,\"slot\":%d,\"state\":\"%s\","
+				"\"role\":\"%s\",\"peer\":\"%s\",\"packets_sent\":%llu,"
+				"\"bytes_sent\":%llu,\"packets_received\":%llu,"
+				"\"bytes_received\":%llu,\"retransmits\":%llu,"
+				"\"dup_acks\":%llu,\"checksum_failures\":%llu,"
+				"\"send_bps\":%.0f,\"receive_bps\":%.0f,\"cwnd\":%llu,"
+				"\"ssthresh\":%llu,\"rwnd\":%llu,\"srtt_us\":%llu,"
+				"\"send_queue\":%llu,\"receive_queue\":%llu,"
+				"\"output_queue\":%llu}\n",
+				(unsigned long long) time_us, slot, state_name (s->state),
+				role, s->peer,
+				(unsigned long long) k->packets_sent,
+				(unsigned long long) k->bytes_sent,
+				(unsigned long long) k->packets_received,
+				(unsigned long long) k->bytes_received,
+				(unsigned long long) k->retransmits,
+				(unsigned long long) k->dup_acks,
+				(unsigned long long) k->checksum_failures,
+				send_bps, receive_bps,
+				(unsigned long long) s->cwnd,
+				(unsigned long long) s->ssthresh,
+				(unsigned long long) s->rwnd,
+				(unsigned long long) s->srtt_us,
+				(unsigned long long) s->send_queue,
+				(unsigned long long) s->receive_queue,
+				(unsigned long long) s->output_queue);
+		break;
+	default:
+		printf ("%4d %-6s %-8s %-21.21s %10.1f %10.1f %8llu %7llu %5llu "
+				"%6llu %9.1f %6llu %6llu %8llu\n",
+				slot, state_name (s->state), role, s->peer,
+				send_bps / 1e3, receive_bps / 1e3,
+				(unsigned long long) k->retransmits,
+				(unsigned long long) k->dup_acks,
+				(unsigned long long) k->checksum_failures,
+				(unsigned long long) s->cwnd,
+				s->srtt_us / 1e3,
+				(unsigned long long) s->send_queue,
+				(unsigned long long) s->receive_queue,
+				(unsigned long long) s->output_queue);
+		break;
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	const struct telemetry_segment *seg;
+	static struct snapshot prev[TELEMETRY_MAX_CONNS], cur;
+	uint64_t prev_us[TELEMETRY_MAX_CONNS];
+	int format = FORMAT_TABLE;
+	int interval = 1000;
+	long count = -1;
+	long sample;
+	int opt, i;
+
+	progname = strrchr (argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+
+	while ((opt = getopt (argc, argv, "cji:n:")) != -1)
+		switch (opt) {
+		case 'c':
+			format = FORMAT_CSV;
+			break;
+		case 'j':
+			format = FORMAT_JSON;
+			break;
+		case 'i':
+			interval = atoi (optarg);
+			break;
+		case 'n':
+			count = atol (optarg);
+			break;
+		default:
+			usage ();
+		}
+	if (optind + 1 != argc || interval < 1)
+		usage ();
+
+	seg = attach (argv[optind]);
+	if (!seg)
+		exit (1);
+
+	memset (prev, 0, sizeof (prev));
+	memset (prev_us, 0, sizeof (prev_us));
+	print_header (format);
+	for (sample = 0; count < 0 || sample < count; sample++) {
+		uint64_t t = now_us ();
+		int alive = kill (seg->pid, 0) == 0 || errno != ESRCH;
+
+		if (format == FORMAT_TABLE) {
+			printf ("\033[H\033[2J");
+			printf ("reliable pid %d%s, up %.1f s\n\n", (int) seg->pid,
+					alive ? "" : " (exited)", (t - seg->started_us) / 1e6);
+			printf ("slot state  role     peer                  "
+					"send KB/s  recv KB/s  retrans dupacks cksum "
+					"  cwnd  srtt ms  sendq  recvq  outq B\n");
+		}
+		for (i = 0; i < TELEMETRY_MAX_CONNS; i++) {
+			const struct telemetry_conn *tc = &seg->conns[i];
+			double send_bps, receive_bps;
+
+			if (__atomic_load_n (&tc->state, __ATOMIC_ACQUIRE) == TELEMETRY_FREE) {
+				prev_us[i] = 0;
+				continue;
+			}
+			take (tc, &cur);
+			/* A slot reused by a new connection starts over */
+			if (prev_us[i] && cur.started_us == prev[i].started_us) {
+				send_bps = rate (cur.counters.bytes_sent,
+						prev[i].counters.bytes_sent, t - prev_us[i]);
+				receive_bps = rate (cur.counters.bytes_received,
+						prev[i].counters.bytes_received, t - prev_us[i]);
+			}
+			else {
+				uint64_t since = cur.started_us < t ? t - cur.started_us : 0;
+				send_bps = rate (cur.counters.bytes_sent, 0, since);
+				receive_bps = rate (cur.counters.bytes_received, 0, since);
+			}
+			print_conn (format, t, i, &cur, send_bps, receive_bps);
+			prev[i] = cur;
+			prev_us[i] = t;
+		}
+		fflush (stdout);
+		if (!alive && format != FORMAT_TABLE) {
+			fprintf (stderr, "%s: reliable pid %d has exited\n", progname,
+					(int) seg->pid);
+			break;
+		}
+		if (count < 0 || sample + 1 < count)
+			usleep (interval * 1000);
+	}
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * rtrace: convert an event trace written by reliable -t.
+ *
+ *   rtrace [-c] file
+ *   rtrace -p prefix file
+ *
+ * By default rtrace prints one line per event.  -c prints CSV instead.
+ * -p writes the congestion window to prefix-cwnd.dat, the RTT samples to
+ * prefix-rtt.dat and a gnuplot script prefix.gp that plots both against
+ * time into prefix.png.  Times are in seconds since the first event.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+static char *progname;
+
+static const char *event_names[] = {
+	[TRACE_SEND] = "send",
+	[TRACE_RECV] = "recv",
+	[TRACE_ACK] = "ack",
+	[TRACE_DUP_ACK] = "dup-ack",
+	[TRACE_RETRANSMIT] = "retransmit",
+	[TRACE_CWND] = "cwnd",
+	[TRACE_RWND] = "rwnd",
+	[TRACE_OUTPUT] = "output",
+	[TRACE_RTT] = "rtt",
+};
+
+static void
+usage (void)
+{
+	fprintf (stderr,
+			"usage: %s [-c] file\n"
+			"       %s -p prefix file\n"
+			"       -c: print CSV\n"
+			"       -p: write cwnd and RTT time series and a gnuplot script\n"
+			, progname, progname);
+	exit (1);
+}
+
+static const char *
+event_name (int type)
+{
+	if (type > 0 && type < (int) (sizeof (event_names) / sizeof (*event_names))
+			&& event_names[type])
+		return event_names[type];
+	return "unknown";
+}
+
+static FILE *
+xfopen (const char *prefix, const char *suffix)
+{
+	char path[1024];
+	FILE *f;
+
+	snprintf (path, sizeof (path), "%s%s", prefix, suffix);
+	f = fopen (path, "w");
+	if (!f) {
+		perror (path);
+		exit (1);
+	}
+	return f;
+}
+
+static void
+write_script (const char *prefix)
+{
+	FILE *gp = xfopen (prefix, ".gp");
+
+	fprintf (gp,
+			"set terminal png size 1200,800\n"
+			"set output '%s.png'\n"
+			"set multiplot layout 2,1\n"
+			"set xlabel 'time (s)'\n"
+			"set ylabel 'packets'\n"
+			"set title 'congestion window'\n"
+			"plot '%s-cwnd.dat' using 1:3 with steps title 'cwnd', \\\n"
+			"     '' using 1:4 with steps title 'ssthresh'\n"
+			"set ylabel 'ms'\n"
+			"set title 'round trip time'\n"
+			"plot '%s-rtt.dat' using 1:3 with points pt 7 ps 0.3 title 'sample', \\\n"
+			"     '' using 1:4 with lines title 'smoothed'\n"
+			"unset multiplot\n",
+			prefix, prefix, prefix);
+	fclose (gp);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct trace_header h;
+	struct trace_event e;
+	const char *prefix = NULL;
+	FILE *in, *cwnd = NULL, *rtt = NULL;
+	uint64_t base = 0, dropped = 0;
+	int csv = 0, based = 0;
+	int opt;
+
+	progname = strrchr (argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+
+	while ((opt = getopt (argc, argv, "cp:")) != -1)
+		switch (opt) {
+		case 'c':
+			csv = 1;
+			break;
+		case 'p':
+			prefix = optarg;
+			break;
+		default:
+			usage ();
+		}
+	if (optind + 1 != argc || (csv && prefix))
+		usage ();
+
+	in = fopen (argv[optind], "rb");
+	if (!in) {
+		perror (argv[optind]);
+		exit (1);
+	}
+	if (prefix) {
+		cwnd = xfopen (prefix, "-cwnd.dat");
+		rtt = xfopen (prefix, "-rtt.dat");
+		fprintf (cwnd, "# time conn cwnd ssthresh\n");
+		fprintf (rtt, "# time conn sample_ms smoothed_ms\n");
+	}
+	else if (csv)
+		printf ("time,conn,event,seqno,value,length\n");
+
+	while (fread (&h, sizeof (h), 1, in) == 1) {
+		uint64_t i;
+
+		if (memcmp (h.magic, TRACE_MAGIC, sizeof (h.magic))
+				|| h.version != TRACE_VERSION) {
+			fprintf (stderr, "%s: not a trace of version %d\n", argv[optind],
+					TRACE_VERSION);
+			exit (1);
+		}
+		dropped += h.dropped;
+		if (h.dropped && !prefix)
+			fprintf (stderr, "%s: conn %u lost %llu events\n", progname,
+					h.conn, (unsigned long long) h.dropped);
+		for (i = 0; i < h.count; i++) {
+			double t;
+
+			if (fread (&e, sizeof (e), 1, in) != 1) {
+				fprintf (stderr, "%s: trace is truncated\n", argv[optind]);
+				exit (1);
+			}
+			if (!based) {
+				base = e.time_us;
+				based = 1;
+			}
+			t = ((double) e.time_us - base) / 1e6;
+			if (prefix) {
+				if (e.type == TRACE_CWND)
+					fprintf (cwnd, "%.6f %u %u %llu\n", t, h.conn, e.value,
+							(unsigned long long) e.seqno);
+				else if (e.type == TRACE_RTT)
+					fprintf (rtt, "%.6f %u %.3f %.3f\n", t, h.conn,
+							e.value / 1e3, e.seqno / 1e3);
+			}
+			else if (csv)
+				printf ("%.6f,%u,%s,%llu,%u,%u\n", t, h.conn,
+						event_name (e.type), (unsigned long long) e.seqno,
+						e.value, e.length);
+			else
+				printf ("%12.6f conn %-3u %-10s seqno %-10llu value %-8u len %u\n",
+						t, h.conn, event_name (e.type),
+						(unsigned long long) e.seqno, e.value, e.length);
+		}
+	}
+	if (prefix) {
+		fclose (cwnd);
+		fclose (rtt);
+		write_script (prefix);
+		if (dropped)
+			fprintf (stderr, "%s: %llu events were lost\n", progname,
+					(unsigned long long) dropped);
+		fprintf (stderr, "wrote %s-cwnd.dat, %s-rtt.dat and %s.gp; "
+				"run gnuplot %s.gp for %s.png\n",
+				prefix, prefix, prefix, prefix, prefix);
+	}
+	fclose (in);
+	return 0;
+}
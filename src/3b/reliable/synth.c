@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include "synth.h"
+
+/* Bytes a sink checks at a time */
+#define SYNTH_BLOCK 4096
+
+int synth_failed;
+
+/* Word i of the stream: splitmix64, run from the seed */
+static inline uint64_t
+synth_word (uint64_t seed, uint64_t i)
+{
+	uint64_t z = seed + (i + 1) * 0x9e3779b97f4a7c15ULL;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return htole64 (z ^ (z >> 31));
+}
+
+/* The n bytes of the stream from offset off */
+static void
+synth_fill (uint64_t seed, uint64_t off, uint8_t *buf, size_t n)
+{
+	size_t k = off & 7;
+	uint64_t w;
+
+	if (k && n) {
+		size_t take = 8 - k < n ? 8 - k : n;
+		w = synth_word (seed, off >> 3);
+		memcpy (buf, (uint8_t *) &w + k, take);
+		buf += take;
+		off += take;
+		n -= take;
+	}
+	for (; n >= 8; buf += 8, off += 8, n -= 8) {
+		w = synth_word (seed, off >> 3);
+		memcpy (buf, &w, 8);
+	}
+	if (n) {
+		w = synth_word (seed, off >> 3);
+		memcpy (buf, &w, n);
+	}
+}
+
+static int
+parse_size (const char *value, uint64_t *size)
+{
+	char *end;
+	double v = strtod (value, &end);
+
+	if (*end == 'k' || *end == 'K')
+		v *= 1024, end++;
+	else if (*end == 'm' || *end == 'M')
+		v *= 1024 * 1024, end++;
+	else if (*end == 'g' || *end == 'G')
+		v *= 1024.0 * 1024 * 1024, end++;
+	if (*end || end == value || v < 0 || v >= 1e19)
+		return -1;
+	*size = v;
+	return 0;
+}
+
+int
+synth_parse (const char *name, int sink, struct synth *spec)
+{
+	char *copy, *save = NULL, *item;
+	int r = 1;
+
+	if (strncmp (name, "synth", 5) || (name[5] && name[5] != ':'))
+		return 0;
+	memset (spec, 0, sizeof (*spec));
+	spec->seed = 1;
+	spec->length = SYNTH_NONE;
+	spec->sink = sink;
+	spec->first_bad = SYNTH_NONE;
+
+	copy = strdup (name[5] ? name + 6 : "");
+	for (item = strtok_r (copy, ",", &save); item && r > 0;
+			item = strtok_r (NULL, ",", &save)) {
+		char *value = strchr (item, '=');
+		char *end;
+		if (!value) {
+			fprintf (stderr, "synth: expected key=value, not \"%s\"\n", item);
+			r = -1;
+			break;
+		}
+		*value++ = 0;
+		if (!strcmp (item, "size")) {
+			if (parse_size (value, &spec->length) < 0) {
+				fprintf (stderr, "synth: bad size \"%s\"\n", value);
+				r = -1;
+			}
+		}
+		else if (!strcmp (item, "seed")) {
+			spec->seed = strtoull (value, &end, 0);
+			if (*end || end == value) {
+				fprintf (stderr, "synth: bad seed \"%s\"\n", value);
+				r = -1;
+			}
+		}
+		else {
+			fprintf (stderr, "synth: unknown key \"%s\"\n", item);
+			r = -1;
+		}
+	}
+	free (copy);
+	if (r > 0 && !sink && spec->length == SYNTH_NONE) {
+		fprintf (stderr, "synth: a source needs a size\n");
+		r = -1;
+	}
+	return r;
+}
+
+struct synth *
+synth_create (const struct synth *spec)
+{
+	struct synth *s = malloc (sizeof (*s));
+
+	if (!s) {
+		perror ("malloc");
+		exit (1);
+	}
+	*s = *spec;
+	s->offset = 0;
+	s->first_bad = SYNTH_NONE;
+	s->bad = 0;
+	return s;
+}
+
+size_t
+synth_read (struct synth *s, void *buf, size_t n)
+{
+	if (n > s->length - s->offset)
+		n = s->length - s->offset;
+	synth_fill (s->seed, s->offset, buf, n);
+	s->offset += n;
+	return n;
+}
+
+/* Note that the n bytes from off, of which buf has what arrived and
+ * want what should have, differ somewhere */
+static void
+synth_mismatch (struct synth *s, uint64_t off, const uint8_t *buf,
+		const uint8_t *want, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (buf[i] != want[i]) {
+			if (s->first_bad == SYNTH_NONE)
+				s->first_bad = off + i;
+			s->bad++;
+		}
+}
+
+size_t
+synth_write (struct synth *s, const void *_buf, size_t n)
+{
+	const uint8_t *buf = _buf;
+	uint8_t want[SYNTH_BLOCK];
+	size_t done = 0, valid = n;
+
+	if (s->length != SYNTH_NONE && s->offset + n > s->length)
+		valid = s->offset < s->length ? s->length - s->offset : 0;
+	while (done < valid) {
+		size_t k = valid - done < SYNTH_BLOCK ? valid - done : SYNTH_BLOCK;
+		synth_fill (s->seed, s->offset + done, want, k);
+		if (memcmp (buf + done, want, k))
+			synth_mismatch (s, s->offset + done, buf + done, want, k);
+		done += k;
+	}
+	/* Nothing is right past the end, which comes after any bad byte
+	 * above */
+	if (valid < n) {
+		if (s->first_bad == SYNTH_NONE || s->first_bad > s->offset + valid)
+			s->first_bad = s->offset + valid;
+		s->bad += n - valid;
+	}
+	s->offset += n;
+	return n;
+}
+
+void
+synth_close (struct synth *s)
+{
+	if (!s)
+		return;
+	if (s->sink) {
+		uint64_t short_by = s->length != SYNTH_NONE && s->offset < s->length
+			? s->length - s->offset : 0;
+		fprintf (stderr, "Verified: \t%llu bytes, seed %llu",
+				(unsigned long long) s->offset, (unsigned long long) s->seed);
+		if (s->first_bad != SYNTH_NONE)
+			fprintf (stderr, ", CORRUPT from offset %llu, %llu bytes wrong",
+					(unsigned long long) s->first_bad,
+					(unsigned long long) s->bad);
+		if (short_by)
+			fprintf (stderr, ", SHORT by %llu bytes",
+					(unsigned long long) short_by);
+		if (s->first_bad == SYNTH_NONE && !short_by)
+			fprintf (stderr, ", intact");
+		fprintf (stderr, "\n");
+		if (s->first_bad != SYNTH_NONE || short_by)
+			synth_failed = 1;
+	}
+	free (s);
+}
@@ -0,0 +1,56 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Synthetic data.
+
+   -s synth:size=N[,seed=S] sends N bytes of pseudo-random data made on
+   the fly instead of reading a file, and -r synth[:size=N][,seed=S]
+   checks what arrives against the same stream instead of writing it,
+   so that a transfer measures the protocol and the network without
+   the disk.  Sizes take k, m and g suffixes; the seed defaults to 1,
+   and both ends must use the same one.  With -m, every stream past
+   the first that -r synth receives is checked against that seed as
+   well.
+
+   Byte i of the stream is byte i % 8, little endian, of splitmix64 of
+   word i / 8: no word depends on another, so the stream can start at
+   any offset and the compiler is free to vectorise the loop.  The
+   receiver compares what conn_output gets a block at a time and keeps
+   the offset of the first byte that differs and how many do; bytes
+   past size count as wrong, and so does stopping short of it.  At the
+   end it prints what it found, and a corrupt or short stream makes
+   reliable exit with status 1.
+
+   ----------------------------------------------------------------------- */
+
+#define SYNTH_NONE UINT64_MAX
+
+struct synth {
+	uint64_t seed;
+	uint64_t length;		/* SYNTH_NONE: no end; a sink not told */
+	int sink;			/* checks data instead of making it */
+	uint64_t offset;		/* bytes made or checked */
+	uint64_t first_bad;		/* SYNTH_NONE while every byte matched */
+	uint64_t bad;			/* bytes that did not */
+};
+
+/* Set by synth_close when a sink found the stream corrupt or short */
+extern int synth_failed;
+
+/* Parse name as a synth: spec into *spec, for a sink or not; returns 1
+ * if it is one, 0 if name is a file name and -1 if the spec is bad */
+int synth_parse (const char *name, int sink, struct synth *spec);
+struct synth *synth_create (const struct synth *spec);
+/* Make up to n more bytes of the stream; 0 at its end */
+size_t synth_read (struct synth *s, void *buf, size_t n);
+/* Check the next n bytes of the stream; returns n */
+size_t synth_write (struct synth *s, const void *buf, size_t n);
+/* Report what a sink found, and free s */
+void synth_close (struct synth *s);
+
+#endif /* SYNTH_H */
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+struct telemetry_segment *telemetry;
+static char telemetry_name[256];
+
+static uint64_t
+telemetry_now (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+telemetry_close (void)
+{
+	if (telemetry) {
+		munmap (telemetry, sizeof (*telemetry));
+		telemetry = NULL;
+		shm_unlink (telemetry_name);
+	}
+}
+
+int
+telemetry_open (const char *name)
+{
+	int fd;
+
+	snprintf (telemetry_name, sizeof (telemetry_name), "%s%s",
+			name[0] == '/' ? "" : "/", name);
+	fd = shm_open (telemetry_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror (telemetry_name);
+		return -1;
+	}
+	if (ftruncate (fd, sizeof (*telemetry)) < 0) {
+		perror ("ftruncate");
+		close (fd);
+		shm_unlink (telemetry_name);
+		return -1;
+	}
+	telemetry = mmap (NULL, sizeof (*telemetry), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close (fd);
+	if (telemetry == MAP_FAILED) {
+		perror ("mmap");
+		telemetry = NULL;
+		shm_unlink (telemetry_name);
+		return -1;
+	}
+	telemetry->version = TELEMETRY_VERSION;
+	telemetry->pid = getpid ();
+	telemetry->max_conns = TELEMETRY_MAX_CONNS;
+	telemetry->started_us = telemetry_now ();
+	/* Readers check the magic last */
+	__atomic_store_n (&telemetry->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+	atexit (telemetry_close);
+	return 0;
+}
+
+struct telemetry_conn *
+telemetry_attach (int sender_receiver, const char *peer)
+{
+	struct telemetry_conn *t, *closed = NULL;
+	int i;
+
+	if (!telemetry)
+		return NULL;
+	for (i = 0; i < TELEMETRY_MAX_CONNS; i++) {
+		t = &telemetry->conns[i];
+		if (t->state == TELEMETRY_FREE)
+			break;
+		if (t->state == TELEMETRY_CLOSED && !closed)
+			closed = t;
+	}
+	if (i == TELEMETRY_MAX_CONNS) {
+		if (!closed)
+			return NULL;
+		t = closed;
+	}
+	__atomic_store_n (&t->state, TELEMETRY_FREE, __ATOMIC_RELAXED);
+	memset (&t->counters, 0, sizeof (*t) - offsetof (struct telemetry_conn,
+					counters));
+	t->sender_receiver = sender_receiver;
+	snprintf (t->peer, sizeof (t->peer), "%s", peer);
+	t->started_us = telemetry_now ();
+	__atomic_store_n (&t->state, TELEMETRY_LIVE, __ATOMIC_RELEASE);
+	return t;
+}
+
+void
+telemetry_detach (struct telemetry_conn *t)
+{
+	if (t)
+		__atomic_store_n (&t->state, TELEMETRY_CLOSED, __ATOMIC_RELEASE);
+}
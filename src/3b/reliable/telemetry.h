@@ -0,0 +1,101 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+/* -----------------------------------------------------------------------
+
+   Live telemetry.
+
+   With -T name, reliable publishes its counters in the POSIX shared
+   memory segment /name, and rtop reads them from there while the
+   transfer runs.  The segment holds the totals for the process and one
+   slot per connection.  Writers update it with relaxed atomics and take
+   no locks, so a reader may see counters from slightly different
+   moments, but never a torn value.
+
+   The segment is removed when reliable exits.
+
+   ----------------------------------------------------------------------- */
+
+#define TELEMETRY_MAGIC 0x4d544c52	/* "RLTM" */
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_MAX_CONNS 64
+
+struct telemetry_counters {
+	uint64_t packets_sent;
+	uint64_t bytes_sent;
+	uint64_t packets_received;
+	uint64_t bytes_received;
+	uint64_t retransmits;
+	uint64_t dup_acks;
+	uint64_t checksum_failures;
+};
+
+/* Slot states */
+#define TELEMETRY_FREE 0
+#define TELEMETRY_LIVE 1
+#define TELEMETRY_CLOSED 2
+
+struct telemetry_conn {
+	uint32_t state;
+	int32_t sender_receiver;	/* SENDER 1 or RECEIVER 2, as in rlib.h */
+	char peer[64];			/* "address:port" */
+	uint64_t started_us;		/* CLOCK_REALTIME */
+	struct telemetry_counters counters;
+
+	/* Gauges, set as they change */
+	uint64_t cwnd;			/* congestion window, packets */
+	uint64_t ssthresh;
+	uint64_t rwnd;			/* receive window, packets */
+	uint64_t srtt_us;		/* smoothed round trip time */
+	uint64_t send_queue;		/* packets sent but not ACKed */
+	uint64_t receive_queue;		/* packets received but not written */
+	uint64_t output_queue;		/* bytes waiting for the output fd */
+};
+
+struct telemetry_segment {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t max_conns;
+	uint64_t started_us;
+	struct telemetry_counters total;
+	struct telemetry_conn conns[TELEMETRY_MAX_CONNS];
+};
+
+extern struct telemetry_segment *telemetry;
+
+/* Create the segment; returns -1 on failure. */
+int telemetry_open (const char *name);
+/* Take a slot for a new connection, or NULL if there is no segment or
+ * no free slot. */
+struct telemetry_conn *telemetry_attach (int sender_receiver,
+		const char *peer);
+/* Mark the slot closed; it keeps its numbers until it is reused. */
+void telemetry_detach (struct telemetry_conn *t);
+
+/* Add n to a counter of connection t and to the process total.  t may
+ * be NULL, when telemetry is off. */
+#define TELEMETRY_COUNT(t, field, n)					\
+	do {								\
+		struct telemetry_conn *t_ = (t);			\
+		if (t_) {						\
+			__atomic_fetch_add (&t_->counters.field, (n),	\
+					__ATOMIC_RELAXED);		\
+			__atomic_fetch_add (&telemetry->total.field, (n), \
+					__ATOMIC_RELAXED);		\
+		}							\
+	} while (0)
+
+/* Set a gauge of connection t */
+#define TELEMETRY_SET(t, field, v)					\
+	do {								\
+		struct telemetry_conn *t_ = (t);			\
+		if (t_)							\
+			__atomic_store_n (&t_->field, (v), __ATOMIC_RELAXED); \
+	} while (0)
+
+#define TELEMETRY_GET(p) __atomic_load_n (&(p), __ATOMIC_RELAXED)
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "trace.h"
+
+volatile sig_atomic_t trace_dump_requested;
+
+static int trace_fd = -1;
+static struct trace_ring *trace_rings;
+static uint32_t trace_conns;
+
+static void
+trace_signal (int sig)
+{
+	trace_dump_requested = 1;
+}
+
+static void
+trace_write (struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t n = writev (trace_fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror ("trace");
+			return;
+		}
+		while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+static void
+trace_dump (struct trace_ring *t)
+{
+	struct trace_header h;
+	struct iovec iov[3];
+	uint64_t first = t->dumped;
+	size_t start, count, tail;
+	int iovcnt = 1;
+
+	if (t->head - first > TRACE_EVENTS)
+		first = t->head - TRACE_EVENTS;
+	if (trace_fd < 0 || t->head == t->dumped)
+		return;
+
+	memset (&h, 0, sizeof (h));
+	memcpy (h.magic, TRACE_MAGIC, sizeof (h.magic));
+	h.version = TRACE_VERSION;
+	h.conn = t->conn;
+	h.dropped = first - t->dumped;
+	h.count = t->head - first;
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof (h);
+
+	/* The events may wrap around the end of the ring */
+	start = first & (TRACE_EVENTS - 1);
+	count = h.count;
+	tail = TRACE_EVENTS - start < count ? TRACE_EVENTS - start : count;
+	iov[iovcnt].iov_base = &t->events[start];
+	iov[iovcnt++].iov_len = tail * sizeof (struct trace_event);
+	if (tail < count) {
+		iov[iovcnt].iov_base = &t->events[0];
+		iov[iovcnt++].iov_len = (count - tail) * sizeof (struct trace_event);
+	}
+	trace_write (iov, iovcnt);
+	t->dumped = t->head;
+}
+
+void
+trace_dump_all (void)
+{
+	struct trace_ring *t;
+
+	trace_dump_requested = 0;
+	for (t = trace_rings; t; t = t->next)
+		trace_dump (t);
+}
+
+int
+trace_open (const char *path)
+{
+	struct sigaction sa;
+
+	trace_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0) {
+		perror (path);
+		return -1;
+	}
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = trace_signal;
+	sigaction (SIGUSR1, &sa, NULL);
+	atexit (trace_dump_all);
+	return 0;
+}
+
+struct trace_ring *
+trace_attach (void)
+{
+	struct trace_ring *t;
+
+	if (trace_fd < 0)
+		return NULL;
+	t = malloc (sizeof (*t));
+	if (!t) {
+		perror ("trace");
+		return NULL;
+	}
+	t->conn = ++trace_conns;
+	t->head = t->dumped = 0;
+	t->next = trace_rings;
+	trace_rings = t;
+	return t;
+}
+
+void
+trace_detach (struct trace_ring *t)
+{
+	struct trace_ring **tp;
+
+	if (!t)
+		return;
+	trace_dump (t);
+	for (tp = &trace_rings; *tp; tp = &(*tp)->next)
+		if (*tp == t) {
+			*tp = t->next;
+			break;
+		}
+	free (t);
+}
@@ -0,0 +1,92 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+#include "clock.h"
+
+/* -----------------------------------------------------------------------
+
+   Binary event trace.
+
+   With -t file, every connection records its protocol events in a ring
+   of TRACE_EVENTS fixed size records in memory; recording one costs a
+   clock read and a few stores.  The rings are written to the file on
+   SIGUSR1, when a connection closes and when reliable exits.  Each dump
+   of a ring is a struct trace_header followed by its events, oldest
+   first, and only covers events not dumped before; if the ring wrapped
+   in between, the header counts the events lost.
+
+   rtrace turns the file into text, CSV or cwnd and RTT plots.
+
+   ----------------------------------------------------------------------- */
+
+#define TRACE_MAGIC "RLTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_EVENTS 65536		/* per connection, a power of 2 */
+
+/* Event types, and what seqno and value hold for each */
+#define TRACE_SEND 1		/* data packet sent first time: seqno */
+#define TRACE_RECV 2		/* data packet received: seqno */
+#define TRACE_ACK 3		/* ACK: ackno, value packets it acked */
+#define TRACE_DUP_ACK 4		/* duplicate ACK: ackno, value how many */
+#define TRACE_RETRANSMIT 5	/* data packet sent again: seqno */
+#define TRACE_CWND 6		/* congestion window: seqno ssthresh, value cwnd */
+#define TRACE_RWND 7		/* window the peer advertised: value */
+#define TRACE_OUTPUT 8		/* output drained: value bytes, seqno bytes left */
+#define TRACE_RTT 9		/* RTT sample: value us, seqno smoothed RTT us */
+
+struct trace_event {
+	uint64_t time_us;		/* clock_now_us */
+	uint64_t seqno;
+	uint32_t value;
+	uint16_t type;
+	uint16_t length;		/* packet length, for packet events */
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t conn;			/* connection number, from 1 */
+	uint64_t dropped;		/* events overwritten before this dump */
+	uint64_t count;			/* events following */
+};
+
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t conn;
+	uint64_t head;			/* events recorded */
+	uint64_t dumped;		/* events written out or dropped */
+	struct trace_event events[TRACE_EVENTS];
+};
+
+/* Set by SIGUSR1; conn_poll then calls trace_dump_all */
+extern volatile sig_atomic_t trace_dump_requested;
+
+/* Open the trace file; returns -1 on failure. */
+int trace_open (const char *path);
+/* A ring for a new connection, or NULL when tracing is off */
+struct trace_ring *trace_attach (void);
+/* Dump what is left in the ring and free it */
+void trace_detach (struct trace_ring *t);
+void trace_dump_all (void);
+
+static inline void
+trace_record (struct trace_ring *t, int type, uint64_t seqno,
+		uint32_t value, int length)
+{
+	struct trace_event *e;
+
+	if (!t)
+		return;
+	e = &t->events[t->head++ & (TRACE_EVENTS - 1)];
+	e->time_us = clock_now_us ();
+	e->seqno = seqno;
+	e->value = value;
+	e->type = type;
+	e->length = length;
+}
+
+#endif /* TRACE_H */